@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <flyweight.hpp>
+
+// Benchmarks for the common flyweight workloads.
+// Each scenario prints the average time per operation, so results are comparable across scenarios, maps and commits.
+// Pass a number as the first argument to scale the number of iterations, e.g. `flyweight_bench 0.1` for a quick run.
+
+namespace {
+
+using bench_clock = std::chrono::steady_clock;
+
+double iteration_scale = 1.0;
+
+size_t scaled(size_t iterations) {
+	return std::max<size_t>(1, static_cast<size_t>(iterations * iteration_scale));
+}
+
+/// Volatile pointer written by `do_not_optimize`, so that stores to it are never dropped.
+const void *volatile sink;
+
+/// Keeps the compiler from optimizing away the computation of `value`.
+template<typename T>
+void do_not_optimize(const T& value) {
+	sink = &value;
+}
+
+void report(const char *scenario, const char *map, size_t threads, size_t operations, bench_clock::duration elapsed) {
+	double nanoseconds = std::chrono::duration<double, std::nano>(elapsed).count();
+	std::printf("%-36s %-16s %8zu %12.1f\n", scenario, map, threads, nanoseconds / operations);
+}
+
+/// Runs `body(thread_index)` on `threads` threads started at the same time, returning the wall time until all of them finish.
+template<typename Body>
+bench_clock::duration run_threads(size_t threads, Body body) {
+	std::atomic<size_t> ready { 0 };
+	std::atomic<bool> start { false };
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < threads; i++) {
+		workers.emplace_back([&, i]() {
+			ready++;
+			while (!start.load(std::memory_order_acquire)) {
+				std::this_thread::yield();
+			}
+			body(i);
+		});
+	}
+	while (ready.load() < threads) {
+		std::this_thread::yield();
+	}
+	auto begin = bench_clock::now();
+	start.store(true, std::memory_order_release);
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	return bench_clock::now() - begin;
+}
+
+std::vector<std::string> make_strings(size_t count, const char *prefix) {
+	std::vector<std::string> strings;
+	strings.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		strings.push_back(prefix + std::to_string(i * 2654435761u % 1000003));
+	}
+	return strings;
+}
+
+/// Words following a Zipf-like distribution, as found in source code or text being interned.
+std::vector<std::string> make_corpus(size_t words, size_t distinct) {
+	std::vector<std::string> vocabulary = make_strings(distinct, "identifier_");
+	std::vector<std::string> corpus;
+	corpus.reserve(words);
+	uint64_t state = 88172645463325252ull;
+	for (size_t i = 0; i < words; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		// squaring a uniform number skews picks towards the first words of the vocabulary
+		double uniform = static_cast<double>(state % 1000000) / 1000000.0;
+		corpus.push_back(vocabulary[static_cast<size_t>(uniform * uniform * distinct)]);
+	}
+	return corpus;
+}
+
+/// Creator that is as cheap as it gets.
+struct cheap_creator {
+	template<typename Key>
+	std::string operator()(const Key& key) const {
+		return std::string(key);
+	}
+};
+
+/// Creator standing in for decoding or loading a resource.
+struct expensive_creator {
+	template<typename Key>
+	std::string operator()(const Key& key) const {
+		std::string value(4096, '\0');
+		uint32_t state = 2166136261u;
+		for (char c : key) {
+			state = (state ^ static_cast<unsigned char>(c)) * 16777619u;
+		}
+		for (char& c : value) {
+			state = state * 1664525u + 1013904223u;
+			c = static_cast<char>(state >> 24);
+		}
+		return value;
+	}
+};
+
+// Map types each scenario is run with.
+// `Mapped` is the value type stored by the flyweight, `T` for `flyweight` and `detail::refcounted_value<T>` for `flyweight_refcounted`.
+template<typename Key, typename Mapped>
+using flat_map = flyweight::flat_map<Key, Mapped>;
+template<typename Key, typename Mapped>
+using flat_map_inline = flyweight::flat_map_inline<Key, Mapped>;
+template<typename Key, typename Mapped>
+using unordered_map = std::unordered_map<Key, Mapped, flyweight::hash<Key>, flyweight::equal_to<Key>>;
+template<typename Key, typename Mapped>
+using ordered_map = std::map<Key, Mapped, std::less<>>;
+
+template<template<typename, typename> class MapOf>
+struct map_name;
+template<> struct map_name<flat_map> { static constexpr const char *value = "flat_map"; };
+template<> struct map_name<flat_map_inline> { static constexpr const char *value = "flat_map_inline"; };
+template<> struct map_name<unordered_map> { static constexpr const char *value = "unordered_map"; };
+template<> struct map_name<ordered_map> { static constexpr const char *value = "map"; };
+
+template<template<typename, typename> class MapOf>
+void bench_hits() {
+	const char *name = map_name<MapOf>::value;
+	const size_t iterations = scaled(4000000);
+	for (size_t size : { 64, 65536 }) {
+		std::vector<std::string> keys = make_strings(size, "asset/");
+		flyweight::flyweight<std::string, std::string, MapOf<std::string, std::string>, flyweight::detail::dummy_mutex, flyweight::detail::dummy_lock, flyweight::detail::dummy_lock, cheap_creator> strings;
+		for (auto& key : keys) {
+			strings.get(key);
+		}
+		auto begin = bench_clock::now();
+		for (size_t i = 0; i < iterations; i++) {
+			do_not_optimize(strings.get(keys[i % size]));
+		}
+		report(size == 64 ? "hit, 64 keys" : "hit, 64K keys", name, 1, iterations, bench_clock::now() - begin);
+
+		std::vector<size_t> hashes;
+		for (auto& key : keys) {
+			hashes.push_back(strings.hash_key(key));
+		}
+		begin = bench_clock::now();
+		for (size_t i = 0; i < iterations; i++) {
+			do_not_optimize(strings.get_hashed(keys[i % size], hashes[i % size]));
+		}
+		report(size == 64 ? "hit hashed, 64 keys" : "hit hashed, 64K keys", name, 1, iterations, bench_clock::now() - begin);
+	}
+}
+
+template<template<typename, typename> class MapOf, typename Creator>
+void bench_misses(const char *scenario, size_t iterations) {
+	std::vector<std::string> keys = make_strings(iterations, "asset/");
+	flyweight::flyweight<std::string, std::string, MapOf<std::string, std::string>, flyweight::detail::dummy_mutex, flyweight::detail::dummy_lock, flyweight::detail::dummy_lock, Creator> strings;
+	auto begin = bench_clock::now();
+	for (auto& key : keys) {
+		do_not_optimize(strings.get(key));
+	}
+	report(scenario, map_name<MapOf>::value, 1, iterations, bench_clock::now() - begin);
+}
+
+template<template<typename, typename> class MapOf>
+void bench_misses() {
+	bench_misses<MapOf, cheap_creator>("miss, cheap creator", scaled(1000000));
+	bench_misses<MapOf, expensive_creator>("miss, expensive creator", scaled(100000));
+}
+
+/// Threads getting hot keys, as in an asset cache shared by worker threads.
+/// `flyweight_refcounted_threadsafe` releases every value it gets, keeping one reference to each so that they are never deleted.
+template<template<typename, typename> class MapOf>
+void bench_contention() {
+	const char *name = map_name<MapOf>::value;
+	const size_t iterations = scaled(1000000);
+	std::vector<std::string> keys = make_strings(256, "asset/");
+	size_t max_threads = std::max(2u, std::thread::hardware_concurrency());
+	for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+		flyweight::flyweight_threadsafe<std::string, std::string, MapOf<std::string, std::string>> strings;
+		for (auto& key : keys) {
+			strings.get(key);
+		}
+		auto elapsed = run_threads(threads, [&](size_t thread) {
+			for (size_t i = 0; i < iterations; i++) {
+				do_not_optimize(strings.get(keys[(i + thread * 7) % keys.size()]));
+			}
+		});
+		report("contended get, threadsafe", name, threads, iterations * threads, elapsed);
+
+		// front caches keep pointers to values, which maps without stable references move
+		if constexpr (flyweight::detail::has_stable_references<MapOf<std::string, std::string>>::value) {
+			flyweight::thread_cached<flyweight::flyweight_threadsafe<std::string, std::string, MapOf<std::string, std::string>>, 1024> front_cached;
+			for (auto& key : keys) {
+				front_cached.get(key);
+			}
+			elapsed = run_threads(threads, [&](size_t thread) {
+				for (size_t i = 0; i < iterations; i++) {
+					do_not_optimize(front_cached.get(keys[(i + thread * 7) % keys.size()]));
+				}
+			});
+			report("contended get, thread_cached", name, threads, iterations * threads, elapsed);
+		}
+
+		flyweight::flyweight_refcounted_threadsafe<std::string, std::string, MapOf<std::string, flyweight::detail::refcounted_value<std::string>>> refcounted;
+		for (auto& key : keys) {
+			refcounted.get(key);
+		}
+		elapsed = run_threads(threads, [&](size_t thread) {
+			for (size_t i = 0; i < iterations; i++) {
+				const std::string& key = keys[(i + thread * 7) % keys.size()];
+				do_not_optimize(refcounted.get(key));
+				refcounted.release(key);
+			}
+		});
+		report("contended get+release, refcounted", name, threads, iterations * threads, elapsed);
+	}
+}
+
+/// Scoped gets through `autorelease_value`, for values that are kept loaded by another reference and values that are created and deleted every time.
+template<template<typename, typename> class MapOf>
+void bench_autorelease() {
+	const char *name = map_name<MapOf>::value;
+	const size_t iterations = scaled(2000000);
+	std::vector<std::string> keys = make_strings(256, "asset/");
+	flyweight::flyweight_refcounted<std::string, std::string, MapOf<std::string, flyweight::detail::refcounted_value<std::string>>, flyweight::detail::dummy_mutex, flyweight::detail::dummy_lock, flyweight::detail::dummy_lock, cheap_creator> strings;
+	for (auto& key : keys) {
+		strings.get(key);
+	}
+	auto begin = bench_clock::now();
+	for (size_t i = 0; i < iterations; i++) {
+		auto value = strings.get_autorelease(keys[i % keys.size()]);
+		do_not_optimize(value.value);
+	}
+	report("autorelease, held elsewhere", name, 1, iterations, bench_clock::now() - begin);
+
+	strings.clear();
+	begin = bench_clock::now();
+	for (size_t i = 0; i < iterations; i++) {
+		auto value = strings.get_autorelease(keys[i % keys.size()]);
+		do_not_optimize(value.value);
+	}
+	report("autorelease churn", name, 1, iterations, bench_clock::now() - begin);
+}
+
+template<template<typename, typename> class MapOf>
+void bench_string_interning(const std::vector<std::string>& corpus) {
+	flyweight::flyweight<std::string, std::string, MapOf<std::string, std::string>, flyweight::detail::dummy_mutex, flyweight::detail::dummy_lock, flyweight::detail::dummy_lock, cheap_creator> strings;
+	auto begin = bench_clock::now();
+	for (auto& word : corpus) {
+		do_not_optimize(strings.get(std::string_view(word)));
+	}
+	report("string interning", map_name<MapOf>::value, 1, corpus.size(), bench_clock::now() - begin);
+}
+
+void bench_interner(const std::vector<std::string>& corpus) {
+	flyweight::interner strings;
+	auto begin = bench_clock::now();
+	for (auto& word : corpus) {
+		do_not_optimize(strings.intern(word));
+	}
+	report("string interning", "interner", 1, corpus.size(), bench_clock::now() - begin);
+
+	flyweight::interner bulk_strings;
+	std::vector<flyweight::interner::symbol_type> symbols(corpus.size());
+	begin = bench_clock::now();
+	bulk_strings.intern(corpus.begin(), corpus.end(), symbols.begin());
+	do_not_optimize(symbols.back());
+	report("string interning, bulk", "interner", 1, corpus.size(), bench_clock::now() - begin);
+}
+
+template<template<typename, typename> class... MapOfs>
+struct map_types {
+	static void run_all() {
+		int expand[] = { (bench_hits<MapOfs>(), 0)... };
+		int expand_misses[] = { (bench_misses<MapOfs>(), 0)... };
+		int expand_contention[] = { (bench_contention<MapOfs>(), 0)... };
+		int expand_autorelease[] = { (bench_autorelease<MapOfs>(), 0)... };
+		std::vector<std::string> corpus = make_corpus(scaled(2000000), 50000);
+		int expand_interning[] = { (bench_string_interning<MapOfs>(corpus), 0)... };
+		bench_interner(corpus);
+		(void) expand, (void) expand_misses, (void) expand_contention, (void) expand_autorelease, (void) expand_interning;
+	}
+};
+
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1) {
+		iteration_scale = std::atof(argv[1]);
+	}
+	std::printf("%-36s %-16s %8s %12s\n", "scenario", "map", "threads", "ns/op");
+	map_types<flat_map, flat_map_inline, unordered_map, ordered_map>::run_all();
+	return 0;
+}
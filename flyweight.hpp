@@ -78,25 +78,121 @@
 #ifndef __FLYWEIGHT_HPP__
 #define __FLYWEIGHT_HPP__
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <tuple>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
+
+#if __cplusplus >= 201402L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201402L)
+	#define FLYWEIGHT_HAS_CXX14 1
+#endif
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+	#define FLYWEIGHT_HAS_CXX17 1
+	#include <optional>
+	#include <shared_mutex>
+	#include <string_view>
+#endif
+
+#ifdef FLYWEIGHT_HAS_CXX17
+	#define FLYWEIGHT_CXX17_CONSTEXPR constexpr
+#else
+	#define FLYWEIGHT_CXX17_CONSTEXPR
+#endif
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+	#define FLYWEIGHT_HAS_COROUTINES 1
+	#include <coroutine>
+#endif
+
+#if !defined(FLYWEIGHT_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+	#define FLYWEIGHT_HAS_MMAP 1
+	#include <cerrno>
+	#include <cstdio>
+	#include <system_error>
+	#include <fcntl.h>
+	#include <pthread.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#if defined(__cpp_lib_generic_unordered_lookup) && __cpp_lib_generic_unordered_lookup >= 201811L
+	#define FLYWEIGHT_HAS_GENERIC_UNORDERED_LOOKUP 1
+#else
+	#define FLYWEIGHT_HAS_GENERIC_UNORDERED_LOOKUP 0
+#endif
+
+#if !defined(FLYWEIGHT_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define FLYWEIGHT_HAS_SSE2 1
+	#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+	#define FLYWEIGHT_PREFETCH(address) __builtin_prefetch(address)
+#elif defined(FLYWEIGHT_HAS_SSE2)
+	#define FLYWEIGHT_PREFETCH(address) _mm_prefetch(reinterpret_cast<const char *>(address), _MM_HINT_T0)
+#else
+	#define FLYWEIGHT_PREFETCH(address) ((void) (address))
+#endif
+
+#ifndef FLYWEIGHT_CACHE_LINE_SIZE
+/// Cache line size used for padding data accessed by different threads, avoiding false sharing.
+#define FLYWEIGHT_CACHE_LINE_SIZE 64
+#endif
 
 namespace flyweight {
 
 namespace detail {
+	/// Converts to the value of type `T` created by calling `creator(key)`.
+	/// Constructing a value from it calls the creator right where the value is stored,
+	/// and since C++17 the created value is initialized in place, without being moved.
+	template<typename T, typename Creator, typename Key>
+	struct deferred_value {
+		Creator& creator;
+		const Key& key;
+
+		operator T() const {
+			return creator(key);
+		}
+	};
+
 	/// Reference counted value, used for flyweight_refcounted
-	template<typename T>
+	/// @tparam T  Value type.
+	/// @tparam Count  Type used for the reference count.
+	///                Use `std::atomic<long long>` if references are taken while the map is locked in shared mode.
+	template<typename T, typename Count = long long>
 	struct refcounted_value {
 		T value;
-		long long refcount = 0;
+		Count refcount { 0 };
 
 		/// Construct a value with an initial reference count of 0.
 		/// `reference` should be called right after constructing this.
-		refcounted_value(T&& value) : value(value) {}
+		refcounted_value(T&& value) : value(std::move(value)) {}
+		/// Construct a value in place, calling the creator.
+		template<typename Creator, typename Key>
+		refcounted_value(deferred_value<T, Creator, Key> create) : value(create) {}
 
 		operator T&() {
 			return value;
@@ -105,414 +201,8481 @@ namespace detail {
 			return value;
 		}
 
-		/// Increment the reference count.
-		refcounted_value& reference() {
-			refcount++;
+		/// Increment the reference count by `count`.
+		refcounted_value& reference(long long count = 1) {
+			refcount += count;
 			return *this;
 		}
 
 		/// Decrement the reference count.
 		/// @return `true` in case the count reached zero, `false` otherwise.
 		bool dereference() {
-			--refcount;
-			return refcount <= 0;
+			return --refcount <= 0;
 		}
 	};
 
-	struct dummy_mutex {};
-	struct dummy_lock {
-		template<typename T> dummy_lock(T) {}
+	/// Reference counted value that stays cached when no longer referenced, used for flyweight_cached.
+	/// @tparam Key  Key type, pointed to by the value so that evicting it doesn't need to look it up.
+	/// @tparam T  Value type.
+	/// @tparam Eviction  Eviction policy, whose `hook` holds the data it needs in each value.
+	template<typename Key, typename T, typename Eviction>
+	struct cached_value {
+		using key_type = Key;
+
+		T value;
+		long long refcount { 0 };
+		const Key *key = nullptr;
+		/// Hash of the key, computed with the map's hash functor, so that eviction policies can track keys without hashing them again.
+		size_t key_hash = 0;
+		/// Size measured by the flyweight's `Sizer` when the value was created.
+		size_t size = 0;
+		typename Eviction::template hook<cached_value> hook;
+
+		/// Construct a value with an initial reference count of 0.
+		cached_value(T&& value) : value(std::move(value)) {}
+		/// Construct a value in place, calling the creator.
+		template<typename Creator, typename K>
+		cached_value(deferred_value<T, Creator, K> create) : value(create) {}
+
+		operator T&() {
+			return value;
+		}
+		operator const T&() const {
+			return value;
+		}
 	};
-}
 
+	/// Value allocated together with intrusive strong and weak reference counts, used for flyweight_shared.
+	/// The value is destroyed when the last strong reference is dropped, and the node is freed when the last weak reference is dropped.
+	/// Strong references, as a whole, hold one weak reference, and so does the map while the node is attached to it.
+	template<typename T>
+	struct shared_node {
+		std::atomic<size_t> strong { 1 };
+		std::atomic<size_t> weak { 2 };
+		alignas(T) unsigned char storage[sizeof(T)];
 
-/// The default Creator functor used by flyweight.
-/// Constructs the value `T` from arguments of type `Args`.
-/// @tparam T  Type that will be created.
-/// @tparam Args...  Arguments used to construct the value.
-template<typename T, typename... Args>
-struct default_creator {
-	/// Default creator implementation, just call the value constructor forwarding the passed arguments.
-	T operator()(Args&&... args) {
-		return T { std::forward<Args>(args)... };
+		/// Construct the value in place, calling the creator, with a single strong reference.
+		/// The node is freed if the creator throws.
+		template<typename Creator, typename Key>
+		static shared_node *create(Creator& creator, const Key& key) {
+			shared_node *node = new shared_node();
+			try {
+				new (node->storage) T(deferred_value<T, Creator, Key> { creator, key });
+			}
+			catch (...) {
+				delete node;
+				throw;
+			}
+			return node;
+		}
+
+		T& value() {
+			return *reinterpret_cast<T *>(storage);
+		}
+
+		bool alive() const {
+			return strong.load(std::memory_order_acquire) > 0;
+		}
+
+		/// Takes a strong reference, which requires holding one already.
+		void reference() {
+			strong.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		/// Takes a strong reference unless the value was already destroyed, which only requires holding a weak reference.
+		bool try_reference() {
+			size_t count = strong.load(std::memory_order_relaxed);
+			while (count > 0) {
+				if (strong.compare_exchange_weak(count, count + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		/// Drops a strong reference, destroying the value if it was the last one.
+		void dereference() {
+			if (strong.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				value().~T();
+				dereference_weak();
+			}
+		}
+
+		void reference_weak() {
+			weak.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		/// Drops a weak reference, freeing the node if it was the last one.
+		void dereference_weak() {
+			if (weak.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				delete this;
+			}
+		}
+	};
+
+	/// Intrusive doubly linked list of nodes with `hook.prev` and `hook.next` pointers.
+	/// Eviction policies push recently used nodes to the front, so that the back is the least recently used one.
+	template<typename Node>
+	struct lru_list {
+		Node *front = nullptr;
+		Node *back = nullptr;
+		size_t size = 0;
+
+		void push_front(Node& node) {
+			insert_before(front, node);
+		}
+
+		/// Insert `node` before `position`, or at the back if `position` is `nullptr`.
+		void insert_before(Node *position, Node& node) {
+			node.hook.next = position;
+			node.hook.prev = position ? position->hook.prev : back;
+			if (node.hook.prev) {
+				node.hook.prev->hook.next = &node;
+			}
+			else {
+				front = &node;
+			}
+			if (position) {
+				position->hook.prev = &node;
+			}
+			else {
+				back = &node;
+			}
+			size++;
+		}
+
+		void erase(Node& node) {
+			if (node.hook.prev) {
+				node.hook.prev->hook.next = node.hook.next;
+			}
+			else {
+				front = node.hook.next;
+			}
+			if (node.hook.next) {
+				node.hook.next->hook.prev = node.hook.prev;
+			}
+			else {
+				back = node.hook.prev;
+			}
+			node.hook.prev = node.hook.next = nullptr;
+			size--;
+		}
+
+		void clear() {
+			front = back = nullptr;
+			size = 0;
+		}
+	};
+
+	/// Count-min sketch of 4 bit counters estimating how often each hash was seen recently.
+	/// Counters are halved after `10 * Counters` increments, so that old popularity fades away.
+	/// @tparam Counters  Number of counters. Must be a power of two.
+	template<size_t Counters>
+	class frequency_sketch {
+		static_assert(Counters > 0 && (Counters & (Counters - 1)) == 0, "Counter count must be a power of two");
+
+	public:
+		frequency_sketch() : counters(Counters) {}
+
+		void increment(size_t hash) {
+			for (int i = 0; i < depth; i++) {
+				uint8_t& counter = counters[index(hash, i)];
+				if (counter < max_count) {
+					counter++;
+				}
+			}
+			if (++samples >= 10 * Counters) {
+				for (auto& counter : counters) {
+					counter >>= 1;
+				}
+				samples /= 2;
+			}
+		}
+
+		unsigned estimate(size_t hash) const {
+			unsigned count = max_count;
+			for (int i = 0; i < depth; i++) {
+				unsigned counter = counters[index(hash, i)];
+				if (counter < count) {
+					count = counter;
+				}
+			}
+			return count;
+		}
+
+	private:
+		static constexpr int depth = 4;
+		static constexpr unsigned max_count = 15;
+
+		/// Index of the counter for `hash` in row `row`, each row using a different multiplier on the mixed hash.
+		static size_t index(size_t hash, int row) {
+			static const uint64_t seeds[depth] = { 0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL };
+			uint64_t h = static_cast<uint64_t>(hash) * seeds[row];
+			return static_cast<size_t>(h >> 32) & (Counters - 1);
+		}
+
+		std::vector<uint8_t> counters;
+		size_t samples = 0;
+	};
+
+	template<typename T>
+	struct is_atomic : std::false_type {};
+	template<typename T>
+	struct is_atomic<std::atomic<T>> : std::true_type {};
+
+	template<typename...>
+	struct make_void {
+		using type = void;
+	};
+
+	/// Compile-time sequence of indices, like C++14's `std::index_sequence`.
+	template<size_t... I>
+	struct index_sequence {};
+	template<size_t N, size_t... I>
+	struct make_index_sequence : make_index_sequence<N - 1, N - 1, I...> {};
+	template<size_t... I>
+	struct make_index_sequence<0, I...> : index_sequence<I...> {};
+
+	/// Lookup key made of references to the arguments passed to the multi-argument overloads of `get`.
+	template<typename... Args>
+	using argument_key = std::tuple<const Args&...>;
+
+	/// Enabled if more than one argument is passed, so that multi-argument overloads never hide the single key ones.
+	template<typename... Args>
+	using enable_if_arguments = typename std::enable_if<(sizeof...(Args) > 1)>::type;
+
+	template<typename T, typename = void>
+	struct is_transparent : std::false_type {};
+	template<typename T>
+	struct is_transparent<T, typename make_void<typename T::is_transparent>::type> : std::true_type {};
+
+	template<typename Map>
+	struct is_std_unordered_map : std::false_type {};
+	template<typename Key, typename T, typename Hash, typename KeyEqual, typename Allocator>
+	struct is_std_unordered_map<std::unordered_map<Key, T, Hash, KeyEqual, Allocator>> : std::true_type {};
+
+	/// Whether `Hash` and `KeyEqual` are transparent and `Hash` accepts keys of type `K`.
+	template<typename Hash, typename KeyEqual, typename K, typename = void>
+	struct is_transparent_lookup : std::false_type {};
+	template<typename Hash, typename KeyEqual, typename K>
+	struct is_transparent_lookup<Hash, KeyEqual, K, typename make_void<decltype(std::declval<const Hash&>()(std::declval<const K&>()))>::type>
+		: std::integral_constant<bool, is_transparent<Hash>::value && is_transparent<KeyEqual>::value> {};
+
+	/// Whether the hash map `Map` finds keys of type `K` without converting them to `Map::key_type`.
+	/// `std::unordered_map` only supports it from C++20 on.
+	template<typename Map, typename K, typename = void>
+	struct has_hashed_lookup : std::false_type {};
+	template<typename Map, typename K>
+	struct has_hashed_lookup<Map, K, typename make_void<typename Map::hasher, typename Map::key_equal>::type>
+		: std::integral_constant<bool, is_transparent_lookup<typename Map::hasher, typename Map::key_equal, K>::value && (FLYWEIGHT_HAS_GENERIC_UNORDERED_LOOKUP || !is_std_unordered_map<Map>::value)> {};
+
+	/// Whether the ordered map `Map` finds keys of type `K` without converting them to `Map::key_type`.
+	/// `std::map` only supports it from C++14 on.
+	template<typename Map, typename K, typename = void>
+	struct has_ordered_lookup : std::false_type {};
+	template<typename Map, typename K>
+	struct has_ordered_lookup<Map, K, typename make_void<decltype(std::declval<const typename Map::key_compare&>()(std::declval<const typename Map::key_type&>(), std::declval<const K&>()))>::type>
+#ifdef FLYWEIGHT_HAS_CXX14
+		: is_transparent<typename Map::key_compare> {};
+#else
+		: std::false_type {};
+#endif
+
+	/// Enabled if keys of type `K` can be used for looking up values in `Map` without constructing a `Key`.
+	template<typename Map, typename Key, typename K>
+	using enable_if_lookup_key = typename std::enable_if<
+		std::is_same<K, Key>::value || has_hashed_lookup<Map, K>::value || has_ordered_lookup<Map, K>::value
+	>::type;
+
+	/// Number of keys hashed, prefetched and looked up together by batched operations like `flyweight::get_many`.
+	constexpr size_t batch_size = 16;
+
+	/// Looks up keys with precomputed hashes, used by batched operations and the hashed overloads like `flyweight::get_hashed`.
+	/// Maps without `prefetch`, like `std::unordered_map`, are looked up normally, ignoring hashes, and hash every key to 0.
+	template<typename Map, typename = void>
+	struct hashed_lookup {
+		template<typename K>
+		static size_t hash(const Map&, const K&) {
+			return 0;
+		}
+		static void prefetch(const Map&, size_t) {}
+		template<typename K>
+		static auto find(Map& map, const K& key, size_t) -> decltype(map.find(key)) {
+			return map.find(key);
+		}
+	};
+	template<typename Map>
+	struct hashed_lookup<Map, typename make_void<decltype(std::declval<const Map&>().prefetch(size_t()))>::type> {
+		template<typename K>
+		static size_t hash(const Map& map, const K& key) {
+			return map.hash(key);
+		}
+		static void prefetch(const Map& map, size_t hash) {
+			map.prefetch(hash);
+		}
+		template<typename K>
+		static auto find(Map& map, const K& key, size_t hash) -> decltype(map.find(key)) {
+			return map.find(key, hash);
+		}
+	};
+
+	/// Future that is already ready with `value`.
+	template<typename T>
+	std::shared_future<T> make_ready_future(T value) {
+		std::promise<T> promise;
+		promise.set_value(value);
+		return promise.get_future().share();
 	}
-};
 
-/// The default Deleter functor used by flyweight.
-/// Doesn't do anything, as the value's destructor will be called when released from the flyweight.
-/// @tparam T  Type that will be deleted.
-template<typename T>
-struct default_deleter {
-	/// Default deleter implementation, a no-op.
-	void operator()(T&) {
-		// no-op
+	/// Inserts the value created by calling `creator(key)` into `map`, constructing it right in the map's storage.
+	/// The entry is constructed before the map looks the key up, so creators may get other values from the same map,
+	/// like recursive memoized functions do. Standard maps don't support that from `try_emplace`.
+	/// @return Iterator to the entry.
+	template<typename T, typename Map, typename Key, typename Creator>
+	typename Map::iterator emplace_created(Map& map, const Key& key, Creator& creator) {
+		return map.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(deferred_value<T, Creator, Key> { creator, key })).first;
 	}
-};
 
-/// Value wrapper that releases it back to the owning flyweight upon destruction.
-template<typename Key, typename T, typename Flyweight>
-struct autorelease_value {
-	T& value;
+	/// Calls `creator` for every key in `keys` on up to `parallelism` threads, including the calling thread.
+	/// Keys are claimed one at a time, so that threads that got quick values keep taking new keys.
+	/// If the creator throws, the first exception is stored in `exception` and the remaining keys are skipped.
+	/// @return Values created by each thread, paired with the index of their key.
+	template<typename T, typename Key, typename Creator>
+	std::vector<std::vector<std::pair<size_t, T>>> parallel_create(Creator& creator, const std::vector<Key>& keys, size_t parallelism, std::exception_ptr& exception) {
+		size_t thread_count = std::max<size_t>(1, std::min(parallelism, keys.size()));
+		std::vector<std::vector<std::pair<size_t, T>>> created(thread_count);
+		std::atomic<size_t> next { 0 };
+		std::mutex exception_mutex;
+		auto work = [&](std::vector<std::pair<size_t, T>>& values) {
+			try {
+				for (size_t i = next++; i < keys.size(); i = next++) {
+					values.emplace_back(i, creator(keys[i]));
+				}
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock { exception_mutex };
+				if (!exception) {
+					exception = std::current_exception();
+				}
+				next = keys.size();
+			}
+		};
 
-	/// Constructor.
-	autorelease_value(Flyweight& flyweight, const Key& key)
-		: value(flyweight.get(key))
-		, flyweight(flyweight)
-		, key(key)
-	{
+		std::vector<std::thread> threads;
+		try {
+			threads.reserve(thread_count - 1);
+			for (size_t i = 1; i < thread_count; i++) {
+				threads.emplace_back(work, std::ref(created[i]));
+			}
+		}
+		catch (...) {
+			// Keys not taken by other threads are created by the calling thread
+		}
+		work(created[0]);
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		return created;
 	}
 
-	/// Copy constructor.
-	autorelease_value(const autorelease_value& other) : autorelease_value(other.flyweight, other.key) {}
+#ifdef FLYWEIGHT_HAS_COROUTINES
+	/// Coroutine that starts suspended and destroys itself when it finishes, used for loading values in coroutine flyweights.
+	/// The coroutine body must not let exceptions escape.
+	struct detached_coroutine {
+		struct promise_type {
+			detached_coroutine get_return_object() {
+				return { std::coroutine_handle<promise_type>::from_promise(*this) };
+			}
+			std::suspend_always initial_suspend() noexcept {
+				return {};
+			}
+			std::suspend_never final_suspend() noexcept {
+				return {};
+			}
+			void return_void() noexcept {}
+			void unhandled_exception() noexcept {
+				std::terminate();
+			}
+		};
 
-	/// Copy assignment.
-	/// Releases the previously referenced value and calls `flyweight.get` to make sure reference counting is correct.
-	autorelease_value& operator=(const autorelease_value& other)
-	{
-		// release previous value
-		flyweight.release(key);
-		// re-get the value to make sure reference counting is correct
-		value = other.flyweight.get(other.key);
-		flyweight = other.flyweight;
-		key = other.key;
+		std::coroutine_handle<promise_type> handle;
+	};
+#endif
+
+	/// Hashes up to `batch_size` keys from `first` for `hashed_lookup`, advancing `first` past them.
+	/// @return Number of hashed keys.
+	template<typename Key, typename Map, typename ForwardIt>
+	size_t hash_batch(const Map& map, ForwardIt& first, ForwardIt last, size_t *hashes) {
+		size_t count = 0;
+		for (; count < batch_size && first != last; ++first, count++) {
+			hashes[count] = hashed_lookup<Map>::hash(map, static_cast<const Key&>(*first));
+		}
+		return count;
 	}
 
-	/// Returns the wrapped value.
-	T& operator*() {
-		return value;
+	/// Output iterator that counts the values written to it and discards them.
+	/// Used by batched gets on maps without stable references, which only take pointers to values once all of them are loaded.
+	class counting_iterator {
+	public:
+		using iterator_category = std::output_iterator_tag;
+		using value_type = void;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = void;
+
+		explicit counting_iterator(size_t& count) : count(&count) {}
+
+		counting_iterator& operator*() {
+			return *this;
+		}
+		counting_iterator& operator++() {
+			return *this;
+		}
+		counting_iterator operator++(int) {
+			return *this;
+		}
+		template<typename T>
+		counting_iterator& operator=(T *) {
+			++*count;
+			return *this;
+		}
+
+	private:
+		size_t *count;
+	};
+
+	/// Prefetches the slots of `count` hashed keys.
+	template<typename Map>
+	void prefetch_batch(const Map& map, const size_t *hashes, size_t count) {
+		for (size_t i = 0; i < count; i++) {
+			hashed_lookup<Map>::prefetch(map, hashes[i]);
+		}
 	}
-	const T& operator*() const {
-		return value;
+
+	/// Forward iterator over an array of iterators, dereferencing to what they point to.
+	/// Used for passing keys regrouped by batched operations to another batched operation.
+	template<typename It>
+	class indirect_iterator {
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using reference = decltype(*std::declval<const It&>());
+		using value_type = typename std::remove_cv<typename std::remove_reference<reference>::type>::type;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+
+		indirect_iterator() {}
+		explicit indirect_iterator(const It *it) : it(it) {}
+
+		reference operator*() const {
+			return **it;
+		}
+		indirect_iterator& operator++() {
+			++it;
+			return *this;
+		}
+		indirect_iterator operator++(int) {
+			indirect_iterator previous = *this;
+			++it;
+			return previous;
+		}
+		bool operator==(const indirect_iterator& other) const {
+			return it == other.it;
+		}
+		bool operator!=(const indirect_iterator& other) const {
+			return it != other.it;
+		}
+
+	private:
+		const It *it = nullptr;
+	};
+
+	/// Whether the flyweight type `F` maps keys with a map that hashes them with `Hash`,
+	/// so that hashes computed with `Hash` may be passed to its hashed alternatives like `flyweight::get_hashed`.
+	template<typename F, typename Hash, typename = void>
+	struct hashes_with : std::false_type {};
+	template<typename F, typename Hash>
+	struct hashes_with<F, Hash, typename make_void<typename F::map_type::hasher>::type> : std::is_same<typename F::map_type::hasher, Hash> {};
+
+	/// Whether the flyweight type `F` employs reference counting.
+	template<typename F, typename = void>
+	struct has_reference_count : std::false_type {};
+	template<typename F>
+	struct has_reference_count<F, typename make_void<decltype(std::declval<F&>().reference_count(std::declval<const typename F::key_type&>()))>::type> : std::true_type {};
+
+	/// Whether references to the entries of `Map` stay valid when other entries are inserted or erased.
+	/// Maps declare it with a `stable_references` constant, like `flat_map` does.
+	/// Maps that don't are assumed to be node based, like `std::unordered_map` and `std::map`.
+	template<typename Map, typename = void>
+	struct has_stable_references : std::true_type {};
+	template<typename Map>
+	struct has_stable_references<Map, typename make_void<decltype(Map::stable_references)>::type> : std::integral_constant<bool, Map::stable_references> {};
+
+	/// Whether values of the flyweight type `F` stay at the same address while other values are created, that is, whether its `map_type` has stable references.
+	/// Flyweights without a `map_type`, like `flyweight_refcounted_lockfree`, allocate their values separately.
+	template<typename F, typename = void>
+	struct has_stable_values : std::true_type {};
+	template<typename F>
+	struct has_stable_values<F, typename make_void<typename F::map_type>::type> : has_stable_references<typename F::map_type> {};
+
+	/// Returns `key` itself if it's already a `Key`, otherwise constructs a `Key` from it.
+	template<typename Key, typename K>
+	using key_reference = typename std::conditional<std::is_same<K, Key>::value, const Key&, Key>::type;
+	template<typename Key, typename K>
+	key_reference<Key, K> make_key(const K& key) {
+		return static_cast<key_reference<Key, K>>(key);
 	}
-	/// Returns the wrapped value.
-	T& operator->() {
-		return value;
+
+	/// Whether `F` can be stored as an empty base class.
+	template<typename F>
+	struct is_empty_base : std::integral_constant<bool, std::is_empty<F>::value
+#ifdef FLYWEIGHT_HAS_CXX14
+		&& !std::is_final<F>::value
+#endif
+	> {};
+
+	/// Storage for a functor of type `F`, which takes no space when `F` is stateless by using empty base optimization.
+	/// @tparam Tag  Distinguishes storages for different functors in the same class.
+	template<typename F, typename Tag, bool = is_empty_base<F>::value>
+	class functor_storage {
+	public:
+		functor_storage() {}
+		template<typename Arg>
+		explicit functor_storage(Arg&& arg) : functor(std::forward<Arg>(arg)) {}
+
+		F& get() {
+			return functor;
+		}
+		const F& get() const {
+			return functor;
+		}
+
+	private:
+		F functor;
+	};
+	template<typename F, typename Tag>
+	class functor_storage<F, Tag, true> : private F {
+	public:
+		functor_storage() {}
+		template<typename Arg>
+		explicit functor_storage(Arg&& arg) : F(std::forward<Arg>(arg)) {}
+
+		F& get() {
+			return *this;
+		}
+		const F& get() const {
+			return *this;
+		}
+	};
+
+	struct creator_tag {};
+	struct deleter_tag {};
+	struct sizer_tag {};
+	struct hash_tag {};
+	struct key_equal_tag {};
+	struct stats_tag {};
+
+	/// Whether `T` is a container with contiguous storage reported by `capacity()`, like `std::vector` and `std::basic_string`.
+	template<typename T, typename = void>
+	struct has_capacity : std::false_type {};
+	template<typename T>
+	struct has_capacity<T, typename make_void<typename T::value_type, decltype(std::declval<const T&>().capacity())>::type> : std::true_type {};
+
+	/// Whether the deleter functor `D` deletes a whole batch of values, taking a `std::vector<T>&`.
+	template<typename D, typename T, typename = void>
+	struct is_batch_deleter : std::false_type {};
+	template<typename D, typename T>
+	struct is_batch_deleter<D, T, typename make_void<decltype(std::declval<D&>()(std::declval<std::vector<T>&>()))>::type> : std::true_type {};
+
+	/// Constructs a functor of type `F` from a `Default` functor if possible, otherwise default constructs it.
+	template<typename F, typename Default>
+	F make_default_functor(std::true_type) {
+		return F(Default{});
 	}
-	const T& operator->() const {
-		return value;
+	template<typename F, typename Default>
+	F make_default_functor(std::false_type) {
+		return F();
 	}
-	/// Returns the wrapped value.
-	operator T&() {
-		return value;
+	template<typename F, typename Default>
+	F make_default_functor() {
+		return make_default_functor<F, Default>(std::is_constructible<F, Default>{});
 	}
-	operator const T&() const {
-		return value;
+
+	/// Enabled if a constructor argument of type `Arg` is not the class `Class` itself, so that copies don't pick the forwarding constructor.
+	template<typename Class, typename Arg>
+	using enable_if_not_self = typename std::enable_if<!std::is_base_of<Class, typename std::decay<Arg>::type>::value>::type;
+
+#ifdef FLYWEIGHT_HAS_CXX17
+	/// Argument and result types of a non-generic callable of type `F`, used by deduction guides.
+	template<typename F>
+	struct callable_traits : callable_traits<decltype(&F::operator())> {};
+	template<typename R, typename Arg>
+	struct callable_traits<R(*)(Arg)> {
+		using argument_type = std::decay_t<Arg>;
+		using result_type = R;
+	};
+	template<typename C, typename R, typename Arg>
+	struct callable_traits<R(C::*)(Arg)> : callable_traits<R(*)(Arg)> {};
+	template<typename C, typename R, typename Arg>
+	struct callable_traits<R(C::*)(Arg) const> : callable_traits<R(*)(Arg)> {};
+	template<typename R, typename Arg>
+	struct callable_traits<R(*)(Arg) noexcept> : callable_traits<R(*)(Arg)> {};
+	template<typename C, typename R, typename Arg>
+	struct callable_traits<R(C::*)(Arg) noexcept> : callable_traits<R(*)(Arg)> {};
+	template<typename C, typename R, typename Arg>
+	struct callable_traits<R(C::*)(Arg) const noexcept> : callable_traits<R(*)(Arg)> {};
+#endif
+
+	constexpr uint64_t xor_shift_33(uint64_t hash) {
+		return hash ^ (hash >> 33);
 	}
 
-	/// Release the value back to the owning flyweight.
-	~autorelease_value() {
-		flyweight.release(key);
+	/// Mixes the bits of `hash` with the MurmurHash3 finalizer, so that hashes that only differ in a few bits,
+	/// like the identity hashes of consecutive integers, still spread over all bits.
+	constexpr uint64_t mix_hash(uint64_t hash) {
+		return xor_shift_33(xor_shift_33(xor_shift_33(hash) * 0xff51afd7ed558ccdULL) * 0xc4ceb9fe1a85ec53ULL);
 	}
 
-private:
-	Flyweight& flyweight;
-	Key key;
-};
+	/// Combines the hash of a tuple element into the hash of the preceding elements.
+	inline size_t hash_combine(size_t seed, size_t hash) {
+		return seed ^ (hash + static_cast<size_t>(0x9e3779b97f4a7c15ULL) + (seed << 6) + (seed >> 2));
+	}
+
+	/// Number of buckets of the minimal perfect hash of `size` keys, about 4 keys per bucket.
+	constexpr size_t perfect_hash_bucket_count(size_t size) {
+		return size / 4 + 1;
+	}
+
+	/// Bucket of the minimal perfect hash for a key with mixed hash `mixed`.
+	constexpr size_t perfect_hash_bucket(uint64_t mixed, size_t bucket_count) {
+		return static_cast<size_t>(((mixed >> 32) * bucket_count) >> 32);
+	}
+
+	/// Slot of the minimal perfect hash of `size` keys for a key with mixed hash `mixed`, displaced by the `seed` of its bucket.
+	constexpr size_t perfect_hash_slot(uint64_t mixed, uint32_t seed, size_t size) {
+		return static_cast<size_t>(((mix_hash(mixed ^ seed) & 0xffffffffULL) * size) >> 32);
+	}
+
+	/// Builds a minimal perfect hash for `size` keys with mixed hashes `mixed`, using hash and displace.
+	/// Keys are grouped in buckets, then starting from the largest bucket, seeds are tried until all keys of the bucket land in free slots.
+	/// Arrays are indexable containers, so that tables of a known size may be built in constant expressions.
+	/// @param seeds  Output seed for each of the `perfect_hash_bucket_count(size)` buckets.
+	/// @param slots  Output slot for each key.
+	/// @param order  Scratch array of `size` elements.
+	/// @param taken  Scratch array of `size` elements.
+	/// @param bucket_starts  Scratch array of `perfect_hash_bucket_count(size) + 1` elements.
+	/// @throw std::invalid_argument if two keys have the same mixed hash, for example when a key is repeated.
+	template<typename Hashes, typename Seeds, typename Slots, typename Order, typename Taken, typename Starts>
+	FLYWEIGHT_CXX17_CONSTEXPR void build_perfect_hash(const Hashes& mixed, size_t size, Seeds& seeds, Slots& slots, Order& order, Taken& taken, Starts& bucket_starts) {
+		size_t bucket_count = perfect_hash_bucket_count(size);
+		for (size_t bucket = 0; bucket <= bucket_count; bucket++) {
+			bucket_starts[bucket] = 0;
+		}
+		for (size_t i = 0; i < size; i++) {
+			bucket_starts[perfect_hash_bucket(mixed[i], bucket_count) + 1]++;
+		}
+		size_t largest = 0;
+		for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+			largest = bucket_starts[bucket + 1] > largest ? bucket_starts[bucket + 1] : largest;
+			bucket_starts[bucket + 1] += bucket_starts[bucket];
+			// seeds are used as insertion cursors while grouping keys by bucket
+			seeds[bucket] = static_cast<uint32_t>(bucket_starts[bucket]);
+		}
+		for (size_t i = 0; i < size; i++) {
+			order[seeds[perfect_hash_bucket(mixed[i], bucket_count)]++] = i;
+			taken[i] = false;
+		}
+
+		for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+			seeds[bucket] = 0;
+			for (size_t i = bucket_starts[bucket]; i < bucket_starts[bucket + 1]; i++) {
+				for (size_t j = i + 1; j < bucket_starts[bucket + 1]; j++) {
+					if (mixed[order[i]] == mixed[order[j]]) {
+						throw std::invalid_argument("flyweight::build_perfect_hash: repeated keys or hash collision");
+					}
+				}
+			}
+		}
+		for (size_t bucket_size = largest; bucket_size > 0; bucket_size--) {
+			for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+				size_t start = bucket_starts[bucket];
+				size_t end = bucket_starts[bucket + 1];
+				if (end - start != bucket_size) {
+					continue;
+				}
+				for (uint32_t seed = 0;; seed++) {
+					size_t placed = start;
+					for (; placed < end; placed++) {
+						size_t slot = perfect_hash_slot(mixed[order[placed]], seed, size);
+						if (taken[slot]) {
+							break;
+						}
+						taken[slot] = true;
+						slots[order[placed]] = slot;
+					}
+					if (placed == end) {
+						seeds[bucket] = seed;
+						break;
+					}
+					for (size_t i = start; i < placed; i++) {
+						taken[slots[order[i]]] = false;
+					}
+				}
+			}
+		}
+	}
+
+	/// Index of the lowest set bit of a non-zero `mask`.
+	inline int count_trailing_zeros(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctz(mask);
+#else
+		int count = 0;
+		for (; !(mask & 1); mask >>= 1) {
+			count++;
+		}
+		return count;
+#endif
+	}
+
+	/// Group of control bytes probed at once by flat_map, using SSE2 when available.
+	/// Full slots have a control byte with the 7 bit tag of their hash, empty slots have `empty`.
+	class control_group {
+	public:
+		static constexpr size_t width = 16;
+		static constexpr int8_t empty = -128;
+
+		explicit control_group(const int8_t *ctrl) {
+#ifdef FLYWEIGHT_HAS_SSE2
+			bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl));
+#else
+			std::memcpy(bytes, ctrl, width);
+#endif
+		}
+
+		/// Bit mask of the bytes in the group that are equal to `tag`.
+		uint32_t match(int8_t tag) const {
+#ifdef FLYWEIGHT_HAS_SSE2
+			return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(tag))));
+#else
+			uint32_t mask = 0;
+			for (size_t i = 0; i < width; i++) {
+				mask |= uint32_t(bytes[i] == tag) << i;
+			}
+			return mask;
+#endif
+		}
+
+		/// Bit mask of the empty slots in the group.
+		uint32_t match_empty() const {
+			return match(empty);
+		}
+
+	private:
+#ifdef FLYWEIGHT_HAS_SSE2
+		__m128i bytes;
+#else
+		int8_t bytes[width];
+#endif
+	};
+
+	/// Pool of objects of type `Node`, carved from slabs allocated with `Allocator`.
+	/// Allocating pops a free list or bumps a pointer in the current slab, and deallocating pushes to the free list,
+	/// so inserting and erasing don't touch the heap nor fragment it.
+	/// Slabs double in size, from 8 objects up to about 64KB, and are only freed all at once.
+	/// The allocator is passed to every call that may need it, so that containers keep a single copy of it.
+	template<typename Node, typename Allocator>
+	class slab_pool {
+		union slot {
+			slot *next_free;
+			alignas(Node) unsigned char storage[sizeof(Node)];
+		};
+		struct slab {
+			slab *next;
+			size_t capacity;
+		};
+		/// Slots at the start of each slab that hold its header.
+		static constexpr size_t header_slots = (sizeof(slab) + sizeof(slot) - 1) / sizeof(slot);
+		static constexpr size_t min_slab_capacity = 8;
+		static constexpr size_t max_slab_capacity = sizeof(slot) >= 65536 / min_slab_capacity ? min_slab_capacity : 65536 / sizeof(slot);
+
+		using slot_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<slot>;
+
+	public:
+		slab_pool() {}
+		slab_pool(const slab_pool&) = delete;
+		slab_pool& operator=(const slab_pool&) = delete;
+
+		/// Allocate uninitialized storage for a `Node`.
+		void *allocate(const Allocator& allocator) {
+			if (free_list) {
+				slot *result = free_list;
+				free_list = result->next_free;
+				return result;
+			}
+			if (!current || used == current->capacity) {
+				next_slab(allocator);
+			}
+			return &slots(current)[used++];
+		}
+
+		/// Return storage of a destroyed `Node` to the pool.
+		void deallocate(void *pointer) {
+			slot *freed = static_cast<slot *>(pointer);
+			freed->next_free = free_list;
+			free_list = freed;
+		}
+
+		/// Make all storage available again, after every `Node` was destroyed. Slabs are kept for reuse.
+		void reset() {
+			free_list = nullptr;
+			current = nullptr;
+			used = 0;
+		}
+
+		/// Free all slabs, after every `Node` was destroyed.
+		void release(const Allocator& allocator) {
+			slot_allocator slabs { allocator };
+			while (head) {
+				slab *next = head->next;
+				std::allocator_traits<slot_allocator>::deallocate(slabs, reinterpret_cast<slot *>(head), header_slots + head->capacity);
+				head = next;
+			}
+			reset();
+		}
+
+		/// Takes all slabs from `other`, leaving it empty.
+		void steal(slab_pool& other) {
+			head = other.head;
+			current = other.current;
+			free_list = other.free_list;
+			used = other.used;
+			other.head = nullptr;
+			other.reset();
+		}
+
+	private:
+		static slot *slots(slab *s) {
+			return reinterpret_cast<slot *>(s) + header_slots;
+		}
+
+		/// Move to the slab after the current one, allocating it if this is the last one.
+		void next_slab(const Allocator& allocator) {
+			slab *next = current ? current->next : head;
+			if (!next) {
+				size_t capacity = current ? current->capacity * 2 : min_slab_capacity;
+				if (capacity > max_slab_capacity) {
+					capacity = max_slab_capacity;
+				}
+				slot_allocator slabs { allocator };
+				next = new (std::allocator_traits<slot_allocator>::allocate(slabs, header_slots + capacity)) slab { nullptr, capacity };
+				if (current) {
+					current->next = next;
+				}
+				else {
+					head = next;
+				}
+			}
+			current = next;
+			used = 0;
+		}
+
+		slab *head = nullptr;
+		slab *current = nullptr;
+		slot *free_list = nullptr;
+		size_t used = 0;
+	};
+
+	/// Bump allocator for strings, carved from chunks allocated with `Allocator` and only freed all at once.
+	/// Strings too long to share a chunk get a chunk of their own, so the rest of the current chunk isn't wasted.
+	template<typename CharT, typename Allocator>
+	class string_arena {
+		using char_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<CharT>;
+		struct chunk {
+			CharT *data;
+			size_t size;
+		};
+		using chunk_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<chunk>;
+		static constexpr size_t chunk_size = 65536 / sizeof(CharT);
+
+	public:
+		explicit string_arena(const Allocator& allocator) : allocator(allocator), chunks(chunk_allocator(allocator)) {}
+		string_arena(const string_arena&) = delete;
+		string_arena& operator=(const string_arena&) = delete;
+
+		~string_arena() {
+			clear();
+		}
+
+		/// Copies `size` characters of `str` followed by a null terminator, returning the stable copy.
+		const CharT *store(const CharT *str, size_t size) {
+			size_t needed = size + 1;
+			CharT *result;
+			if (needed > left) {
+				if (needed > chunk_size / 4) {
+					result = allocate_chunk(needed);
+				}
+				else {
+					result = current = allocate_chunk(chunk_size);
+					current += needed;
+					left = chunk_size - needed;
+				}
+			}
+			else {
+				result = current;
+				current += needed;
+				left -= needed;
+			}
+			std::memcpy(result, str, size * sizeof(CharT));
+			result[size] = CharT();
+			return result;
+		}
+
+		/// Frees all chunks.
+		void clear() {
+			for (chunk& c : chunks) {
+				std::allocator_traits<char_allocator>::deallocate(allocator, c.data, c.size);
+			}
+			chunks.clear();
+			current = nullptr;
+			left = 0;
+			allocated = 0;
+		}
+
+		/// Total size of the allocated chunks, in characters.
+		size_t capacity() const {
+			return allocated;
+		}
+
+	private:
+		CharT *allocate_chunk(size_t size) {
+			chunks.reserve(chunks.size() + 1);
+			CharT *data = std::allocator_traits<char_allocator>::allocate(allocator, size);
+			chunks.push_back({ data, size });
+			allocated += size;
+			return data;
+		}
+
+		char_allocator allocator;
+		std::vector<chunk, chunk_allocator> chunks;
+		CharT *current = nullptr;
+		size_t left = 0;
+		size_t allocated = 0;
+	};
+
+	/// 64-bit MurmurHash2 over `size` bytes in `data`.
+	inline uint64_t hash_bytes(const void *data, size_t size) {
+		const uint64_t m = 0xc6a4a7935bd1e995ULL;
+		const int r = 47;
+		uint64_t h = 0xc70f6907ULL ^ (size * m);
+
+		const unsigned char *bytes = static_cast<const unsigned char *>(data);
+		const unsigned char *end = bytes + (size & ~size_t(7));
+		for (; bytes != end; bytes += 8) {
+			uint64_t k;
+			std::memcpy(&k, bytes, sizeof(k));
+			k *= m;
+			k ^= k >> r;
+			k *= m;
+			h ^= k;
+			h *= m;
+		}
+		if (size & 7) {
+			uint64_t tail = 0;
+			std::memcpy(&tail, bytes, size & 7);
+			h ^= tail;
+			h *= m;
+		}
+
+		h ^= h >> r;
+		h *= m;
+		h ^= h >> r;
+		return h;
+	}
+
+	/// Transparent hash for strings, accepting any character sequence without constructing a string.
+	template<typename CharT, typename Traits>
+	struct string_hash {
+		using is_transparent = void;
+
+		template<typename Allocator>
+		size_t operator()(const std::basic_string<CharT, Traits, Allocator>& str) const {
+			return static_cast<size_t>(hash_bytes(str.data(), str.size() * sizeof(CharT)));
+		}
+		size_t operator()(const CharT *str) const {
+			return static_cast<size_t>(hash_bytes(str, Traits::length(str) * sizeof(CharT)));
+		}
+#ifdef FLYWEIGHT_HAS_CXX17
+		size_t operator()(std::basic_string_view<CharT, Traits> str) const {
+			return static_cast<size_t>(hash_bytes(str.data(), str.size() * sizeof(CharT)));
+		}
+#endif
+	};
+
+	/// Transparent equality, comparing any pair of types with `operator==`.
+	struct transparent_equal_to {
+		using is_transparent = void;
+
+		template<typename A, typename B>
+		bool operator()(const A& a, const B& b) const {
+			return a == b;
+		}
+	};
+
+	struct dummy_mutex {};
+	struct dummy_lock {
+		template<typename T> dummy_lock(T) {}
+	};
+
+	/// Measures the time since its construction for a `Stats` policy, reading the clock only if the policy is enabled.
+	template<typename Stats, bool = Stats::enabled>
+	struct stats_timer {
+		uint64_t elapsed() const {
+			return 0;
+		}
+	};
+	template<typename Stats>
+	struct stats_timer<Stats, true> {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		uint64_t elapsed() const {
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		}
+	};
+
+	/// Lock of type `Lock` that reports the time spent waiting for the mutex to a `Stats` policy, if it's enabled.
+	template<typename Lock, typename Stats, bool = Stats::enabled>
+	struct stats_lock : Lock {
+		template<typename Mutex>
+		stats_lock(Mutex& mutex, Stats&) : Lock(mutex) {}
+	};
+	template<typename Lock, typename Stats>
+	struct stats_lock<Lock, Stats, true> : private stats_timer<Stats>, Lock {
+		template<typename Mutex>
+		stats_lock(Mutex& mutex, Stats& stats) : stats_timer<Stats>(), Lock(mutex) {
+			stats.lock(this->elapsed());
+		}
+	};
+
+	/// Index of the calling thread's stripe in striped counters, assigned round-robin to threads.
+	inline size_t thread_stripe() {
+		static std::atomic<size_t> next_stripe { 0 };
+		thread_local size_t stripe = next_stripe.fetch_add(1, std::memory_order_relaxed);
+		return stripe;
+	}
+
+	/// Hazard pointer record, owned by a single thread at a time.
+	/// Pointers published in a record must not be freed by other threads.
+	struct hazard_record {
+		static constexpr size_t pointer_count = 2;
+
+		std::atomic<void *> pointers[pointer_count];
+		std::atomic<bool> active;
+		hazard_record *next;
+	};
+
+	/// List of hazard pointer records shared by all `flyweight_refcounted_lockfree` instances.
+	/// Records are never freed, they are reused by new threads after their owner threads exit.
+	class hazard_domain {
+	public:
+		static hazard_domain& instance() {
+			static hazard_domain domain;
+			return domain;
+		}
+
+		/// Acquire a record for the current thread, reusing an inactive one if possible.
+		hazard_record *acquire() {
+			for (hazard_record *record = head.load(); record; record = record->next) {
+				bool expected = false;
+				if (!record->active.load(std::memory_order_relaxed) && record->active.compare_exchange_strong(expected, true)) {
+					return record;
+				}
+			}
+
+			hazard_record *record = new hazard_record;
+			for (auto& pointer : record->pointers) {
+				pointer.store(nullptr, std::memory_order_relaxed);
+			}
+			record->active.store(true, std::memory_order_relaxed);
+			record->next = head.load();
+			while (!head.compare_exchange_weak(record->next, record)) {}
+			return record;
+		}
+
+		/// Release a record, so that it may be reused by other threads.
+		void release(hazard_record *record) {
+			for (auto& pointer : record->pointers) {
+				pointer.store(nullptr);
+			}
+			record->active.store(false);
+		}
+
+		/// Collect all currently published hazard pointers into `hazards`.
+		void collect(std::vector<void *>& hazards) {
+			for (hazard_record *record = head.load(); record; record = record->next) {
+				for (auto& pointer : record->pointers) {
+					if (void *hazard = pointer.load()) {
+						hazards.push_back(hazard);
+					}
+				}
+			}
+		}
+
+	private:
+		std::atomic<hazard_record *> head { nullptr };
+	};
+
+	/// Hazard pointer record owned by the current thread.
+	inline hazard_record& current_hazard_record() {
+		struct owner {
+			hazard_record *record = hazard_domain::instance().acquire();
+			~owner() {
+				hazard_domain::instance().release(record);
+			}
+		};
+		static thread_local owner current;
+		return *current.record;
+	}
+
+	/// RAII guard over the current thread's hazard pointers, clearing them upon destruction.
+	class hazard_guard {
+	public:
+		hazard_guard() : record(current_hazard_record()) {}
+		~hazard_guard() {
+			clear();
+		}
+
+		/// Load a pointer from `source` and protect it in slot `index`.
+		/// Loops until the value in `source` is stable, so that the returned pointer is safe to dereference.
+		template<typename P>
+		P *protect(size_t index, const std::atomic<P *>& source) {
+			P *pointer = source.load();
+			for (;;) {
+				record.pointers[index].store(pointer);
+				P *again = source.load();
+				if (again == pointer) {
+					return pointer;
+				}
+				pointer = again;
+			}
+		}
+
+		/// Publish `pointer` in slot `index`.
+		/// The caller must validate that `pointer` is still reachable before dereferencing it.
+		void set(size_t index, void *pointer) {
+			record.pointers[index].store(pointer);
+		}
+
+		void clear() {
+			for (auto& pointer : record.pointers) {
+				pointer.store(nullptr, std::memory_order_release);
+			}
+		}
+
+	private:
+		hazard_record& record;
+	};
+}
+
+
+/// The default Creator functor used by flyweight.
+/// Constructs the value `T` from arguments of type `Args`.
+/// @tparam T  Type that will be created.
+/// @tparam Args...  Arguments used to construct the value.
+template<typename T, typename... Args>
+struct default_creator {
+	/// Default creator implementation, just call the value constructor forwarding the passed arguments.
+	T operator()(const Args&... args) const {
+		return T { args... };
+	}
+};
+
+/// Default creator for tuple keys, constructing the value from the tuple elements, unless `T` is constructible from the tuple itself.
+/// This lets multi-argument keys, like `flyweight::get(a, b, c)`, construct values the same way as `T { a, b, c }`.
+template<typename T, typename... Args>
+struct default_creator<T, std::tuple<Args...>> {
+	T operator()(const std::tuple<Args...>& key) const {
+		return create(key, std::is_constructible<T, const std::tuple<Args...>&>{}, detail::make_index_sequence<sizeof...(Args)>{});
+	}
+
+private:
+	template<size_t... I>
+	static T create(const std::tuple<Args...>& key, std::true_type, detail::index_sequence<I...>) {
+		return T { key };
+	}
+	template<size_t... I>
+	static T create(const std::tuple<Args...>& key, std::false_type, detail::index_sequence<I...>) {
+		return T { std::get<I>(key)... };
+	}
+};
+
+/// Creator adapter for tuple keys, calling the function `F` with the tuple elements as separate arguments.
+/// Used for memoizing functions of several arguments with flyweights keyed by `std::tuple`, see `unpack_creator`.
+/// @tparam F  Function called with the tuple elements.
+template<typename F>
+struct unpacked_creator {
+	F function;
+
+	template<typename... Args>
+	auto operator()(const std::tuple<Args...>& key) const -> decltype(std::declval<const F&>()(std::declval<const Args&>()...)) {
+		return call(key, detail::make_index_sequence<sizeof...(Args)>{});
+	}
+
+private:
+	template<typename Tuple, size_t... I>
+	auto call(const Tuple& key, detail::index_sequence<I...>) const -> decltype(function(std::get<I>(key)...)) {
+		return function(std::get<I>(key)...);
+	}
+};
+
+/// Wraps `function` in an `unpacked_creator`, so that a flyweight keyed by `std::tuple<Args...>` memoizes `function(args...)`.
+/// @code
+/// flyweight::flyweight<std::tuple<std::string, int>, double> prices {
+///     flyweight::unpack_creator([](const std::string& symbol, int quantity) {
+///         return price(symbol, quantity);
+///     }),
+/// };
+/// double total = prices.get("ACME", 100);
+/// @endcode
+template<typename F>
+unpacked_creator<typename std::decay<F>::type> unpack_creator(F&& function) {
+	return { std::forward<F>(function) };
+}
+
+/// The default Deleter functor used by flyweight.
+/// Doesn't do anything, as the value's destructor will be called when released from the flyweight.
+/// @tparam T  Type that will be deleted.
+template<typename T>
+struct default_deleter {
+	/// Default deleter implementation, a no-op.
+	void operator()(T&) const {
+		// no-op
+	}
+};
+
+/// The default Sizer functor used by flyweight_cached.
+/// Measures `sizeof(T)`, plus the allocated storage of containers with a `capacity()`, like `std::vector` and `std::string`.
+/// Memory owned by other types, like pixel data referenced by handles, is not accounted for; pass a custom Sizer for them.
+/// @tparam T  Type that will be measured.
+template<typename T>
+struct default_sizer {
+	size_t operator()(const T& value) const {
+		return measure(value, detail::has_capacity<T>{});
+	}
+
+private:
+	static size_t measure(const T&, std::false_type) {
+		return sizeof(T);
+	}
+	static size_t measure(const T& value, std::true_type) {
+		return sizeof(T) + value.capacity() * sizeof(typename T::value_type);
+	}
+};
+
+/**
+ * Queue of released values waiting to be deleted, so that flyweights never call expensive deleters while releasing values.
+ *
+ * Pass `deletion_queue::deleter` as the deleter functor of a flyweight: releasing, evicting or clearing values moves them into the queue,
+ * without calling `Deleter` while the flyweight is locked nor on the releasing thread's latency path.
+ * Queued values are deleted in batches, calling `Deleter` on them and destroying them, either explicitly with `deletion_queue::collect`,
+ * for example at frame boundaries, or by a background thread started with `deletion_queue::start_background_collection`.
+ * If `Deleter` takes a `std::vector<T>&`, it is called once per batch with all collected values,
+ * so that teardown of many values can be coalesced, like unloading a batch of textures with a single call.
+ *
+ * Values must be move constructible.
+ * Values are deleted in the order they were released, but possibly after a value for the same key was created again.
+ * The queue must outlive the flyweights using its deleter, since destroying them queues their remaining values.
+ * Values still queued when the queue is destroyed are collected by its destructor.
+ *
+ * @tparam T  Value type.
+ * @tparam Deleter  Deleter functor type, called with a reference to each value or with a `std::vector<T>&` of values.
+ *                  Defaults to `std::function<void(T&)>`, which type erases any deleter functor.
+ */
+template<typename T, typename Deleter = std::function<void(T&)>>
+class deletion_queue
+	: private detail::functor_storage<Deleter, detail::deleter_tag>
+{
+	using deleter_storage = detail::functor_storage<Deleter, detail::deleter_tag>;
+
+public:
+	using value_type = T;
+
+	/// Deleter functor to pass to flyweights, which moves released values into the queue.
+	class deferred_deleter {
+	public:
+		void operator()(T& value) const {
+			queue->push(std::move(value));
+		}
+
+	private:
+		friend class deletion_queue;
+
+		explicit deferred_deleter(deletion_queue *queue) : queue(queue) {}
+
+		deletion_queue *queue;
+	};
+
+	/// Default constructor.
+	/// Uses `default_deleter`, or default constructs `Deleter` if it can't be constructed from it, so values are only destroyed.
+	deletion_queue()
+		: deleter_storage(detail::make_default_functor<Deleter, default_deleter<T>>())
+	{
+	}
+
+	/// Constructor with custom deleter functor.
+	/// @param deleter  Deleter functor that will be called when collecting queued values.
+	template<typename D, typename = detail::enable_if_not_self<deletion_queue, D>>
+	explicit deletion_queue(D&& deleter)
+		: deleter_storage(std::forward<D>(deleter))
+	{
+	}
+
+	deletion_queue(const deletion_queue&) = delete;
+	deletion_queue& operator=(const deletion_queue&) = delete;
+
+	/// Stops background collection, if started, and collects the remaining values.
+	~deletion_queue() {
+		stop_background_collection();
+		collect();
+	}
+
+	/// Deleter functor that queues values, to be passed to flyweights.
+	deferred_deleter deleter() {
+		return deferred_deleter(this);
+	}
+
+	/// Queues `value` to be deleted by the next collection.
+	/// Wakes the background collector up if the number of queued values reaches its batch size.
+	void push(T&& value) {
+		bool wake;
+		{
+			std::lock_guard<std::mutex> lock { mutex };
+			pending.push_back(std::move(value));
+			wake = pending.size() >= wake_size;
+		}
+		if (wake) {
+			condition.notify_one();
+		}
+	}
+
+	/// Deletes every queued value, calling the deleter functor without holding the queue locked, so values may be queued meanwhile.
+	/// Concurrent collections are serialized.
+	/// @return Number of deleted values.
+	size_t collect() {
+		std::lock_guard<std::mutex> collect_lock { collect_mutex };
+		{
+			std::lock_guard<std::mutex> lock { mutex };
+			collecting.swap(pending);
+		}
+		size_t count = collecting.size();
+		try {
+			if (count) {
+				delete_values(detail::is_batch_deleter<Deleter, T>{});
+			}
+		}
+		catch (...) {
+			// values are destroyed anyway, so that the next collection doesn't pass them to the deleter again
+			collecting.clear();
+			throw;
+		}
+		// keep the storage, so that the next values queued reuse it after swapping again
+		collecting.clear();
+		return count;
+	}
+
+	/// Number of values waiting to be deleted.
+	size_t size() const {
+		std::lock_guard<std::mutex> lock { mutex };
+		return pending.size();
+	}
+
+	/// Starts a background thread that collects queued values every `period`,
+	/// or as soon as `batch_size` values are queued.
+	/// The deleter functor is then called on the background thread, so it must be thread-safe and must not throw.
+	/// Restarts the background thread if it was already started.
+	void start_background_collection(std::chrono::milliseconds period, size_t batch_size = SIZE_MAX) {
+		stop_background_collection();
+		{
+			std::lock_guard<std::mutex> lock { mutex };
+			stopping = false;
+			wake_size = batch_size;
+		}
+		collector = std::thread([this, period]() {
+			std::unique_lock<std::mutex> lock { mutex };
+			while (!stopping) {
+				condition.wait_for(lock, period, [this]() { return stopping || pending.size() >= wake_size; });
+				lock.unlock();
+				collect();
+				lock.lock();
+			}
+		});
+	}
+
+	/// Stops the background thread started by `deletion_queue::start_background_collection`, after it collects queued values one last time.
+	void stop_background_collection() {
+		if (collector.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock { mutex };
+				stopping = true;
+				wake_size = SIZE_MAX;
+			}
+			condition.notify_one();
+			collector.join();
+		}
+	}
+
+protected:
+	void delete_values(std::true_type) {
+		deleter_storage::get()(collecting);
+	}
+	void delete_values(std::false_type) {
+		for (T& value : collecting) {
+			deleter_storage::get()(value);
+		}
+	}
+
+	/// Values queued since the last collection.
+	std::vector<T> pending;
+	/// Values being deleted by the current collection.
+	std::vector<T> collecting;
+	size_t wake_size = SIZE_MAX;
+	bool stopping = false;
+	mutable std::mutex mutex;
+	std::mutex collect_mutex;
+	std::condition_variable condition;
+	std::thread collector;
+};
+
+/**
+ * Second-level tier behind a flyweight's creator functor, shared by several flyweights, processes or hosts.
+ *
+ * Pass `tiered_store::creator` as the creator functor of a flyweight: a miss in the flyweight first loads the value from `Store`,
+ * and only calls `Creator` if the store doesn't have it either.
+ * Created values are written back to the store asynchronously by a background thread,
+ * so that other flyweights using the same store find them instead of creating them again.
+ *
+ * `Store` is the pluggable shared tier, like a client of a remote cache or a shared memory segment, and must have these members:
+ * - `bool load(const Key& key, T& value)`, which assigns the stored value of `key` to `value` and returns `true` if the store has it.
+ * - `void store(const Key& key, const T& value)`, which stores `value` as the value of `key`.
+ * Both may be called concurrently, from the threads getting values and from the write-back thread.
+ * Errors reaching the store are not fatal: exceptions thrown by `load` are treated as a miss, and failed write-backs are dropped.
+ *
+ * Values must be default constructible, to be loaded into, and copy constructible, to be written back while the flyweight uses them.
+ * The tiered store must outlive the flyweights using its creator.
+ * Values waiting to be written back when it's destroyed are written by its destructor.
+ *
+ * @tparam Key  Key type.
+ * @tparam T  Value type.
+ * @tparam Store  Shared tier type. May be a reference type to use a store owned elsewhere, for example shared by several tiered stores.
+ * @tparam Creator  Creator functor type, called when both tiers miss. Defaults to `std::function<T(const Key&)>`, which type erases any creator functor.
+ */
+template<typename Key, typename T, typename Store, typename Creator = std::function<T(const Key&)>>
+class tiered_store
+	: private detail::functor_storage<Creator, detail::creator_tag>
+{
+	using creator_storage = detail::functor_storage<Creator, detail::creator_tag>;
+
+public:
+	using key_type = Key;
+	using value_type = T;
+	using store_type = Store;
+
+	/// Creator functor to pass to flyweights, which loads values from the store before creating them.
+	class tiered_creator {
+	public:
+		T operator()(const Key& key) const {
+			return tier->load_or_create(key);
+		}
+
+	private:
+		friend class tiered_store;
+
+		explicit tiered_creator(tiered_store *tier) : tier(tier) {}
+
+		tiered_store *tier;
+	};
+
+	/// Constructor with the shared tier and the creator functor called when it misses.
+	/// @param store  Shared tier, moved or copied into the tiered store.
+	/// @param creator  Creator functor that will be called when neither the flyweight nor the store have a value.
+	template<typename S, typename C>
+	tiered_store(S&& store, C&& creator)
+		: creator_storage(std::forward<C>(creator))
+		, shared_store(std::forward<S>(store))
+		, writer([this]() { write_back(); })
+	{
+	}
+
+	tiered_store(const tiered_store&) = delete;
+	tiered_store& operator=(const tiered_store&) = delete;
+
+	/// Writes back the remaining created values and stops the write-back thread.
+	~tiered_store() {
+		{
+			std::lock_guard<std::mutex> lock { mutex };
+			stopping = true;
+		}
+		pending_condition.notify_one();
+		writer.join();
+	}
+
+	/// Creator functor that loads values from the store before creating them, to be passed to flyweights.
+	tiered_creator creator() {
+		return tiered_creator(this);
+	}
+
+	/// Loads the value of `key` from the store, or creates it and queues it to be written back if the store doesn't have it.
+	T load_or_create(const Key& key) {
+		T value;
+		bool found;
+		try {
+			found = shared_store.load(key, value);
+		}
+		catch (...) {
+			found = false;
+		}
+		if (found) {
+			hit_count.fetch_add(1, std::memory_order_relaxed);
+			return value;
+		}
+		miss_count.fetch_add(1, std::memory_order_relaxed);
+		value = creator_storage::get()(key);
+		{
+			std::lock_guard<std::mutex> lock { mutex };
+			pending.emplace_back(key, value);
+		}
+		pending_condition.notify_one();
+		return value;
+	}
+
+	/// Blocks until every value created so far was written back to the store.
+	void flush() {
+		std::unique_lock<std::mutex> lock { mutex };
+		idle_condition.wait(lock, [this]() { return pending.empty() && !writing; });
+	}
+
+	/// Number of values loaded from the store.
+	size_t hits() const {
+		return hit_count.load(std::memory_order_relaxed);
+	}
+	/// Number of values that the store didn't have, and were created.
+	size_t misses() const {
+		return miss_count.load(std::memory_order_relaxed);
+	}
+
+	/// Get the shared tier.
+	Store& store() {
+		return shared_store;
+	}
+
+protected:
+	/// Write-back thread loop, storing created values until the tiered store is destroyed and no values are left.
+	void write_back() {
+		std::unique_lock<std::mutex> lock { mutex };
+		while (true) {
+			pending_condition.wait(lock, [this]() { return stopping || !pending.empty(); });
+			if (pending.empty()) {
+				return;
+			}
+			std::deque<std::pair<Key, T>> batch;
+			batch.swap(pending);
+			writing = true;
+			lock.unlock();
+			for (auto& value : batch) {
+				try {
+					shared_store.store(value.first, value.second);
+				}
+				catch (...) {
+					// the value was created anyway, the store may have it next time
+				}
+			}
+			lock.lock();
+			writing = false;
+			idle_condition.notify_all();
+		}
+	}
+
+	Store shared_store;
+	/// Created values waiting to be written back.
+	std::deque<std::pair<Key, T>> pending;
+	bool writing = false;
+	bool stopping = false;
+	std::atomic<size_t> hit_count { 0 };
+	std::atomic<size_t> miss_count { 0 };
+	std::mutex mutex;
+	std::condition_variable pending_condition;
+	std::condition_variable idle_condition;
+	std::thread writer;
+};
+
+/// Statistics of a flyweight, as returned by `flyweight::stats`.
+/// Durations are in nanoseconds.
+struct stats_snapshot {
+	/// Number of gets that found a loaded value.
+	uint64_t hits = 0;
+	/// Number of gets that created the value.
+	uint64_t misses = 0;
+	/// Total time spent in the creator functor.
+	uint64_t create_nanoseconds = 0;
+	/// Number of values passed to the deleter functor.
+	uint64_t deletions = 0;
+	/// Total time spent in the deleter functor.
+	uint64_t delete_nanoseconds = 0;
+	/// Number of unreferenced values evicted by `flyweight_cached`.
+	uint64_t evictions = 0;
+	/// Number of times the mutex was locked by gets and releases.
+	uint64_t locks = 0;
+	/// Total time spent waiting for the mutex by gets and releases.
+	uint64_t lock_wait_nanoseconds = 0;
+	/// Number of loaded values when the snapshot was taken.
+	size_t size = 0;
+
+	/// Fraction of gets that found a loaded value, or 0 if there were no gets.
+	double hit_ratio() const {
+		uint64_t gets = hits + misses;
+		return gets ? static_cast<double>(hits) / static_cast<double>(gets) : 0.0;
+	}
+
+	/// Accumulates the statistics of `other`, used for summing the statistics of the shards of a `sharded` flyweight.
+	stats_snapshot& operator+=(const stats_snapshot& other) {
+		hits += other.hits;
+		misses += other.misses;
+		create_nanoseconds += other.create_nanoseconds;
+		deletions += other.deletions;
+		delete_nanoseconds += other.delete_nanoseconds;
+		evictions += other.evictions;
+		locks += other.locks;
+		lock_wait_nanoseconds += other.lock_wait_nanoseconds;
+		size += other.size;
+		return *this;
+	}
+};
+
+/// The default Stats policy, that records nothing.
+/// Its hooks are empty and it takes no space, so flyweights without statistics compile to the same code as before,
+/// and the clock is never read.
+/// Custom Stats policies must have the same members, with `enabled` set to `true`.
+struct no_stats {
+	/// Whether the flyweight should measure durations and lock waits.
+	static constexpr bool enabled = false;
+
+	/// Called when a get finds a loaded value.
+	void hit() {}
+	/// Called when a get creates a value, with the time spent in the creator functor.
+	void miss(uint64_t) {}
+	/// Called when a value is passed to the deleter functor, with the time spent in it.
+	void deletion(uint64_t) {}
+	/// Called when `flyweight_cached` evicts an unreferenced value.
+	void eviction() {}
+	/// Called when a get or release locks the mutex, with the time spent waiting for it.
+	void lock(uint64_t) {}
+	/// Current statistics.
+	stats_snapshot snapshot() const {
+		return {};
+	}
+};
+
+/**
+ * Stats policy that counts with relaxed atomic counters.
+ *
+ * Counters are striped: each thread updates the counters of one of `Stripes` cache line aligned stripes,
+ * so that threads getting values concurrently don't contend for the same counter.
+ * Snapshots sum all stripes, so they are not atomic in regards to concurrent updates.
+ *
+ * @tparam Stripes  Number of counter stripes.
+ */
+template<size_t Stripes = 8>
+class atomic_stats {
+public:
+	static constexpr bool enabled = true;
+
+	void hit() {
+		add(&stripe::hits, 1);
+	}
+	void miss(uint64_t nanoseconds) {
+		add(&stripe::misses, 1);
+		add(&stripe::create_nanoseconds, nanoseconds);
+	}
+	void deletion(uint64_t nanoseconds) {
+		add(&stripe::deletions, 1);
+		add(&stripe::delete_nanoseconds, nanoseconds);
+	}
+	void eviction() {
+		add(&stripe::evictions, 1);
+	}
+	void lock(uint64_t nanoseconds) {
+		add(&stripe::locks, 1);
+		add(&stripe::lock_wait_nanoseconds, nanoseconds);
+	}
+
+	stats_snapshot snapshot() const {
+		stats_snapshot snapshot;
+		for (const stripe& s : stripes) {
+			snapshot.hits += s.hits.load(std::memory_order_relaxed);
+			snapshot.misses += s.misses.load(std::memory_order_relaxed);
+			snapshot.create_nanoseconds += s.create_nanoseconds.load(std::memory_order_relaxed);
+			snapshot.deletions += s.deletions.load(std::memory_order_relaxed);
+			snapshot.delete_nanoseconds += s.delete_nanoseconds.load(std::memory_order_relaxed);
+			snapshot.evictions += s.evictions.load(std::memory_order_relaxed);
+			snapshot.locks += s.locks.load(std::memory_order_relaxed);
+			snapshot.lock_wait_nanoseconds += s.lock_wait_nanoseconds.load(std::memory_order_relaxed);
+		}
+		return snapshot;
+	}
+
+private:
+	struct alignas(FLYWEIGHT_CACHE_LINE_SIZE) stripe {
+		std::atomic<uint64_t> hits { 0 };
+		std::atomic<uint64_t> misses { 0 };
+		std::atomic<uint64_t> create_nanoseconds { 0 };
+		std::atomic<uint64_t> deletions { 0 };
+		std::atomic<uint64_t> delete_nanoseconds { 0 };
+		std::atomic<uint64_t> evictions { 0 };
+		std::atomic<uint64_t> locks { 0 };
+		std::atomic<uint64_t> lock_wait_nanoseconds { 0 };
+	};
+
+	void add(std::atomic<uint64_t> stripe::*counter, uint64_t amount) {
+		(stripes[detail::thread_stripe() % Stripes].*counter).fetch_add(amount, std::memory_order_relaxed);
+	}
+
+	stripe stripes[Stripes];
+};
+
+/// The default hash functor used for keys.
+/// Same as `std::hash<Key>`, except for strings, which are hashed transparently.
+/// Together with `equal_to`, this lets maps that support heterogeneous lookup find string keys from string literals and views without allocating a temporary string.
+/// @tparam Key  Type that will be hashed.
+template<typename Key>
+struct hash : std::hash<Key> {};
+template<typename CharT, typename Traits, typename Allocator>
+struct hash<std::basic_string<CharT, Traits, Allocator>> : detail::string_hash<CharT, Traits> {};
+#ifdef FLYWEIGHT_HAS_CXX17
+template<typename CharT, typename Traits>
+struct hash<std::basic_string_view<CharT, Traits>> : detail::string_hash<CharT, Traits> {};
+#endif
+/// Tuples are hashed element by element with `flyweight::hash`, transparently accepting any tuple of the same size whose elements are accepted by the element hashes.
+/// This is what lets `flyweight::get(args...)` look values up with a tuple of references to the arguments, without constructing a `Key`.
+template<typename... Ts>
+struct hash<std::tuple<Ts...>> {
+private:
+	template<typename Tuple, size_t... I>
+	static auto hash_elements(const Tuple& key, detail::index_sequence<I...>)
+		-> typename std::conditional<true, size_t, typename detail::make_void<decltype(hash<Ts>()(std::get<I>(key)))...>::type>::type
+	{
+		size_t seed = 0;
+		using expand = int[];
+		(void) expand { 0, (seed = detail::hash_combine(seed, hash<Ts>()(std::get<I>(key))), 0)... };
+		return seed;
+	}
+
+public:
+	using is_transparent = void;
+
+	template<typename Tuple, typename = typename std::enable_if<std::tuple_size<Tuple>::value == sizeof...(Ts)>::type>
+	auto operator()(const Tuple& key) const -> decltype(hash_elements(key, detail::make_index_sequence<sizeof...(Ts)>{})) {
+		return hash_elements(key, detail::make_index_sequence<sizeof...(Ts)>{});
+	}
+};
+
+/// The default equality functor used for keys.
+/// Same as `std::equal_to<Key>`, except for strings, which are compared transparently.
+/// @tparam Key  Type that will be compared.
+template<typename Key>
+struct equal_to : std::equal_to<Key> {};
+template<typename CharT, typename Traits, typename Allocator>
+struct equal_to<std::basic_string<CharT, Traits, Allocator>> : detail::transparent_equal_to {};
+#ifdef FLYWEIGHT_HAS_CXX17
+template<typename CharT, typename Traits>
+struct equal_to<std::basic_string_view<CharT, Traits>> : detail::transparent_equal_to {};
+#endif
+/// Tuples are compared element by element with `flyweight::equal_to`, transparently accepting any tuple of the same size.
+template<typename... Ts>
+struct equal_to<std::tuple<Ts...>> {
+	using is_transparent = void;
+
+	template<typename A, typename B, typename = typename std::enable_if<std::tuple_size<A>::value == sizeof...(Ts) && std::tuple_size<B>::value == sizeof...(Ts)>::type>
+	bool operator()(const A& a, const B& b) const {
+		return equal_elements(a, b, detail::make_index_sequence<sizeof...(Ts)>{});
+	}
+
+private:
+	template<typename A, typename B, size_t... I>
+	static bool equal_elements(const A& a, const B& b, detail::index_sequence<I...>) {
+		bool equal = true;
+		using expand = int[];
+		(void) expand { 0, (equal = equal && equal_to<Ts>()(std::get<I>(a), std::get<I>(b)), 0)... };
+		return equal;
+	}
+};
+
+namespace detail {
+	/// Set of keys that hashes and compares them like `Map` does.
+	/// Hash maps, like `flat_map` and `std::unordered_map`, use copies of their hash and equality functors,
+	/// ordered maps, like `std::map`, use a copy of their comparison and other maps use `flyweight::hash` and `flyweight::equal_to`.
+	template<typename Map, typename Key, typename = void, typename = void>
+	struct key_set {
+		using type = std::unordered_set<Key, hash<Key>, equal_to<Key>>;
+		static type make(const Map&) {
+			return type();
+		}
+	};
+	template<typename Map, typename Key, typename Unused>
+	struct key_set<Map, Key, typename make_void<decltype(std::declval<const Map&>().hash_function()), decltype(std::declval<const Map&>().key_eq())>::type, Unused> {
+		using type = std::unordered_set<Key, typename Map::hasher, typename Map::key_equal>;
+		static type make(const Map& map) {
+			return type(0, map.hash_function(), map.key_eq());
+		}
+	};
+	template<typename Map, typename Key>
+	struct key_set<Map, Key, void, typename make_void<decltype(std::declval<const Map&>().key_comp())>::type> {
+		using type = std::set<Key, typename Map::key_compare>;
+		static type make(const Map& map) {
+			return type(map.key_comp());
+		}
+	};
+
+	/// Hash and equality functors of `Map`, for containers that look keys up like it does.
+	/// Maps without `hasher` and `key_equal` types, like `std::map`, fall back to `flyweight::hash` and `flyweight::equal_to`.
+	template<typename Map, typename Key, typename = void>
+	struct map_hashing {
+		using hasher = hash<Key>;
+		using key_equal = equal_to<Key>;
+	};
+	template<typename Map, typename Key>
+	struct map_hashing<Map, Key, typename make_void<typename Map::hasher, typename Map::key_equal>::type> {
+		using hasher = typename Map::hasher;
+		using key_equal = typename Map::key_equal;
+	};
+
+	/// Hashes keys with the hash functor of `Map`, or with `flyweight::hash` for maps without one, like `std::map`.
+	template<typename Map, typename Key, typename = void>
+	struct key_hasher {
+		static size_t hash(const Map&, const Key& key) {
+			return flyweight::hash<Key>()(key);
+		}
+	};
+	template<typename Map, typename Key>
+	struct key_hasher<Map, Key, typename make_void<decltype(std::declval<const Map&>().hash_function())>::type> {
+		static size_t hash(const Map& map, const Key& key) {
+			return map.hash_function()(key);
+		}
+	};
+
+	/// Copies the keys in [`first`, `last`) that are not loaded in `map` to `keys`,
+	/// skipping keys that `map` considers equal to previous ones.
+	template<typename Map, typename Key, typename ForwardIt>
+	void missing_keys(Map& map, ForwardIt first, ForwardIt last, std::vector<Key>& keys) {
+		typename key_set<Map, Key>::type seen = key_set<Map, Key>::make(map);
+		for (; first != last; ++first) {
+			const Key& key = *first;
+			if (map.find(key) == map.end() && seen.insert(key).second) {
+				keys.push_back(key);
+			}
+		}
+	}
+}
+
+/**
+ * Open addressing hash map, used by default for mapping keys to values in flyweights.
+ *
+ * Control bytes holding a 7 bit tag of each key's hash are kept in a separate array and probed 16 at a time, using SSE2 when available,
+ * so that most lookups only touch one cache line of control bytes and the matching entry.
+ * Probing is linear and erasing an entry shifts the following ones back into place instead of leaving a tombstone,
+ * so maps that frequently release values don't degrade over time.
+ *
+ * In stable mode, the default, entries are allocated separately and the table only stores pointers to them,
+ * so references to entries stay valid until they are erased, like with `std::unordered_map`.
+ * Entries are carved from slabs owned by the map and recycled through a free list, so churning entries doesn't touch the heap
+ * and `clear()` doesn't free them one by one.
+ * Entries also cache their key's hash, so growing the table and erasing entries never hash keys again.
+ * Otherwise entries are stored inline in the table, which saves an indirection per entry,
+ * but growing the table moves them, invalidating references.
+ *
+ * Iterators and references to entries are invalidated by any insertion or erasure, except references in stable mode.
+ *
+ * @tparam Key  Key type.
+ * @tparam T  Mapped type.
+ * @tparam Hash  Hash functor. Heterogeneous lookup is supported if both `Hash` and `KeyEqual` are transparent.
+ * @tparam KeyEqual  Key equality functor.
+ * @tparam Stable  Whether references to entries stay valid when other entries are inserted or erased.
+ * @tparam Allocator  Allocator used for the table and, in stable mode, for entries.
+ */
+template<typename Key, typename T, typename Hash = hash<Key>, typename KeyEqual = equal_to<Key>, bool Stable = true, typename Allocator = std::allocator<std::pair<const Key, T>>>
+class flat_map
+	: private detail::functor_storage<Hash, detail::hash_tag>
+	, private detail::functor_storage<KeyEqual, detail::key_equal_tag>
+{
+	using hash_storage = detail::functor_storage<Hash, detail::hash_tag>;
+	using key_equal_storage = detail::functor_storage<KeyEqual, detail::key_equal_tag>;
+	using group = detail::control_group;
+	using is_stable = std::integral_constant<bool, Stable>;
+
+	/// Enabled if keys of type `K` can be looked up without constructing a `Key`.
+	template<typename K>
+	using enable_if_lookup_key = typename std::enable_if<
+		!std::is_same<K, Key>::value && detail::is_transparent_lookup<Hash, KeyEqual, K>::value
+	>::type;
+
+public:
+	using key_type = Key;
+	using mapped_type = T;
+	using value_type = std::pair<const Key, T>;
+	using size_type = size_t;
+	using hasher = Hash;
+	using key_equal = KeyEqual;
+	using allocator_type = Allocator;
+
+	/// Whether references to entries stay valid when other entries are inserted or erased, see `detail::has_stable_references`.
+	static constexpr bool stable_references = Stable;
+
+private:
+	/// Entry allocated separately in stable mode, caching its key's hash.
+	struct node {
+		template<typename... Args>
+		explicit node(Args&&... args) : value(std::forward<Args>(args)...) {}
+
+		value_type value;
+		size_t hash = 0;
+	};
+	/// Storage for an entry stored inline in the table.
+	struct inline_slot {
+		alignas(value_type) unsigned char storage[sizeof(value_type)];
+	};
+	using slot_type = typename std::conditional<Stable, node *, inline_slot>::type;
+
+	using allocator_traits = std::allocator_traits<Allocator>;
+	using node_allocator = typename allocator_traits::template rebind_alloc<node>;
+	using slot_allocator = typename allocator_traits::template rebind_alloc<slot_type>;
+	using ctrl_allocator = typename allocator_traits::template rebind_alloc<int8_t>;
+
+	template<bool Const>
+	class basic_iterator {
+		using map_pointer = typename std::conditional<Const, const flat_map *, flat_map *>::type;
+
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = typename flat_map::value_type;
+		using difference_type = std::ptrdiff_t;
+		using pointer = typename std::conditional<Const, const value_type *, value_type *>::type;
+		using reference = typename std::conditional<Const, const value_type&, value_type&>::type;
+
+		basic_iterator() {}
+
+		/// Conversion from `iterator` to `const_iterator`.
+		template<bool OtherConst, typename = typename std::enable_if<Const && !OtherConst>::type>
+		basic_iterator(const basic_iterator<OtherConst>& other) : map(other.map), index(other.index) {}
+
+		reference operator*() const {
+			return map->value_at(index);
+		}
+		pointer operator->() const {
+			return &map->value_at(index);
+		}
+
+		basic_iterator& operator++() {
+			index = map->next_full(index + 1);
+			return *this;
+		}
+		basic_iterator operator++(int) {
+			basic_iterator previous = *this;
+			++*this;
+			return previous;
+		}
+
+		bool operator==(const basic_iterator& other) const {
+			return index == other.index;
+		}
+		bool operator!=(const basic_iterator& other) const {
+			return index != other.index;
+		}
+
+	private:
+		friend class flat_map;
+		template<bool>
+		friend class basic_iterator;
+
+		basic_iterator(map_pointer map, size_t index) : map(map), index(index) {}
+
+		map_pointer map = nullptr;
+		size_t index = 0;
+	};
+
+public:
+	using iterator = basic_iterator<false>;
+	using const_iterator = basic_iterator<true>;
+
+	flat_map() : hash_storage(Hash()), key_equal_storage(KeyEqual()) {}
+
+	explicit flat_map(size_t capacity, const Hash& hash = Hash(), const KeyEqual& equal = KeyEqual(), const Allocator& allocator = Allocator())
+		: hash_storage(hash)
+		, key_equal_storage(equal)
+		, allocator(allocator)
+	{
+		reserve(capacity);
+	}
+
+	flat_map(const flat_map& other)
+		: hash_storage(other.hash_function())
+		, key_equal_storage(other.key_eq())
+		, allocator(allocator_traits::select_on_container_copy_construction(other.allocator))
+	{
+		reserve(other.size());
+		for (const auto& value : other) {
+			emplace(value);
+		}
+	}
+
+	flat_map(flat_map&& other) noexcept
+		: hash_storage(other.hash_function())
+		, key_equal_storage(other.key_eq())
+		, allocator(std::move(other.allocator))
+	{
+		steal(other);
+	}
+
+	flat_map& operator=(const flat_map& other) {
+		if (this != &other) {
+			flat_map copy { other };
+			*this = std::move(copy);
+		}
+		return *this;
+	}
+
+	flat_map& operator=(flat_map&& other) noexcept {
+		if (this != &other) {
+			destroy();
+			hash_storage::get() = other.hash_function();
+			key_equal_storage::get() = other.key_eq();
+			allocator = std::move(other.allocator);
+			steal(other);
+		}
+		return *this;
+	}
+
+	~flat_map() {
+		destroy();
+	}
+
+	iterator begin() {
+		return { this, next_full(0) };
+	}
+	const_iterator begin() const {
+		return { this, next_full(0) };
+	}
+	iterator end() {
+		return { this, capacity };
+	}
+	const_iterator end() const {
+		return { this, capacity };
+	}
+
+	size_t size() const {
+		return entry_count;
+	}
+	bool empty() const {
+		return entry_count == 0;
+	}
+
+	hasher hash_function() const {
+		return hash_storage::get();
+	}
+	key_equal key_eq() const {
+		return key_equal_storage::get();
+	}
+
+	/// Finds the entry with the passed key, returning `end()` if there is none.
+	iterator find(const Key& key) {
+		return { this, find_index(key, hash_key(key)) };
+	}
+	const_iterator find(const Key& key) const {
+		return { this, find_index(key, hash_key(key)) };
+	}
+
+	/// Alternative to `flat_map::find` that looks up keys of type `K` without constructing a `Key`.
+	/// Only available if `Hash` and `KeyEqual` are transparent.
+	template<typename K, typename = enable_if_lookup_key<K>>
+	iterator find(const K& key) {
+		return { this, find_index(key, hash_key(key)) };
+	}
+	template<typename K, typename = enable_if_lookup_key<K>>
+	const_iterator find(const K& key) const {
+		return { this, find_index(key, hash_key(key)) };
+	}
+
+	/// Hash of `key`, to be passed to `flat_map::prefetch` and the hashed overloads of `flat_map::find`.
+	/// Only uses the hash functor, so it may be called concurrently with modifications of the map.
+	template<typename K>
+	size_t hash(const K& key) const {
+		return hash_key(key);
+	}
+
+	/// Prefetches the control bytes and slots where looking up a key with hash `hash` starts.
+	/// Prefetching the keys of a batch before looking them up overlaps their cache misses.
+	void prefetch(size_t hash) const {
+		if (capacity) {
+			size_t index = home(detail::mix_hash(hash));
+			FLYWEIGHT_PREFETCH(ctrl + index);
+			FLYWEIGHT_PREFETCH(slots + index);
+		}
+	}
+
+	/// Alternative to `flat_map::find` that takes the key's hash, as returned by `flat_map::hash`, instead of hashing it again.
+	iterator find(const Key& key, size_t hash) {
+		return { this, find_index(key, hash) };
+	}
+	const_iterator find(const Key& key, size_t hash) const {
+		return { this, find_index(key, hash) };
+	}
+	template<typename K, typename = enable_if_lookup_key<K>>
+	iterator find(const K& key, size_t hash) {
+		return { this, find_index(key, hash) };
+	}
+	template<typename K, typename = enable_if_lookup_key<K>>
+	const_iterator find(const K& key, size_t hash) const {
+		return { this, find_index(key, hash) };
+	}
+
+	/// Number of entries with the passed key, either 0 or 1.
+	size_t count(const Key& key) const {
+		return find(key) != end();
+	}
+
+	/// Inserts an entry constructed from `args`, unless there is already an entry with the same key.
+	/// @return Iterator to the inserted or existing entry, and whether the entry was inserted.
+	template<typename... Args>
+	std::pair<iterator, bool> emplace(Args&&... args) {
+		return emplace_entry(is_stable(), std::forward<Args>(args)...);
+	}
+
+	/// Inserts an entry with `key` and a value constructed from `args`, unless there is already an entry with the same key.
+	/// Unlike `flat_map::emplace`, the key is looked up before constructing anything, so nothing is constructed if the key is already present.
+	/// Constructing the value may insert other entries into this map, like recursive flyweight creators do,
+	/// since the slot is only claimed after the value is constructed.
+	/// @return Iterator to the inserted or existing entry, and whether the entry was inserted.
+	template<typename... Args>
+	std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args) {
+		size_t hash = hash_key(key);
+		size_t index = find_index(key, hash);
+		if (index != capacity) {
+			return { { this, index }, false };
+		}
+		return emplace_hashed(is_stable(), hash, std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+	}
+
+	/// Erase the entry pointed to by `it`.
+	void erase(const_iterator it) {
+		erase_index(it.index);
+	}
+
+	/// Erase the entry with the passed key, if there is one.
+	/// @return Number of erased entries.
+	size_t erase(const Key& key) {
+		size_t index = find_index(key, hash_key(key));
+		if (index != capacity) {
+			erase_index(index);
+			return 1;
+		}
+		return 0;
+	}
+
+	/// Erase all entries, keeping the table allocated.
+	/// In stable mode, entry storage is kept for reuse and freed in bulk, without keeping track of individual entries.
+	void clear() {
+		if (!std::is_trivially_destructible<value_type>::value) {
+			for (size_t i = 0; i < capacity; i++) {
+				if (ctrl[i] >= 0) {
+					destroy_value(slots[i]);
+				}
+			}
+		}
+		node_pool.reset();
+		if (capacity) {
+			std::memset(ctrl, group::empty, capacity + group::width - 1);
+		}
+		entry_count = 0;
+		growth_left = max_load(capacity);
+	}
+
+	/// Grow the table so that `size` entries fit without growing it again.
+	void reserve(size_t size) {
+		if (size > max_load(capacity)) {
+			size_t new_capacity = group::width;
+			while (size > max_load(new_capacity)) {
+				new_capacity *= 2;
+			}
+			rehash(new_capacity);
+		}
+	}
+
+	void swap(flat_map& other) noexcept {
+		flat_map temporary { std::move(other) };
+		other = std::move(*this);
+		*this = std::move(temporary);
+	}
+
+private:
+	/// Maximum number of entries in a table with `capacity` slots, for a load factor of 7/8.
+	static size_t max_load(size_t capacity) {
+		return capacity - capacity / 8;
+	}
+
+	template<typename K>
+	size_t hash_key(const K& key) const {
+		return hash_storage::get()(key);
+	}
+
+	/// Slot where probing for `hash` starts.
+	size_t home(uint64_t mixed) const {
+		return static_cast<size_t>(mixed) & (capacity - 1);
+	}
+	/// Tag stored in the control byte, taken from bits not used for selecting the home slot.
+	static int8_t tag(uint64_t mixed) {
+		return static_cast<int8_t>(mixed >> 57);
+	}
+
+	/// Sets the control byte of slot `index`, also updating its copy after the end of the table, which lets groups be loaded past the end.
+	void set_ctrl(size_t index, int8_t value) {
+		ctrl[index] = value;
+		if (index < group::width - 1) {
+			ctrl[capacity + index] = value;
+		}
+	}
+
+	template<typename K>
+	size_t find_index(const K& key, size_t hash) const {
+		if (entry_count == 0) {
+			return capacity;
+		}
+		uint64_t mixed = detail::mix_hash(hash);
+		int8_t key_tag = tag(mixed);
+		size_t position = home(mixed);
+		for (size_t probed = 0; probed < capacity; probed += group::width) {
+			group g { ctrl + position };
+			for (uint32_t mask = g.match(key_tag); mask; mask &= mask - 1) {
+				size_t index = (position + detail::count_trailing_zeros(mask)) & (capacity - 1);
+				if (slot_matches(slots[index], key, hash)) {
+					return index;
+				}
+			}
+			if (g.match_empty()) {
+				break;
+			}
+			position = (position + group::width) & (capacity - 1);
+		}
+		return capacity;
+	}
+
+	/// First empty slot at or after the home slot for `mixed`, which always exists since the table is never full.
+	size_t find_empty(uint64_t mixed) const {
+		size_t position = home(mixed);
+		for (;;) {
+			uint32_t mask = group { ctrl + position }.match_empty();
+			if (mask) {
+				return (position + detail::count_trailing_zeros(mask)) & (capacity - 1);
+			}
+			position = (position + group::width) & (capacity - 1);
+		}
+	}
+
+	/// Claims an empty slot for an entry with `hash`, growing the table if necessary.
+	size_t prepare_insert(size_t hash) {
+		if (growth_left == 0) {
+			rehash(capacity ? capacity * 2 : group::width);
+		}
+		uint64_t mixed = detail::mix_hash(hash);
+		size_t index = find_empty(mixed);
+		set_ctrl(index, tag(mixed));
+		growth_left--;
+		entry_count++;
+		return index;
+	}
+
+	template<typename... Args>
+	std::pair<iterator, bool> emplace_entry(std::true_type, Args&&... args) {
+		node *entry = construct_node(std::forward<Args>(args)...);
+		return insert_node(entry, hash_key(entry->value.first));
+	}
+
+	/// Alternative to `emplace_entry` for entries whose key has the passed hash.
+	template<typename... Args>
+	std::pair<iterator, bool> emplace_hashed(std::true_type, size_t hash, Args&&... args) {
+		return insert_node(construct_node(std::forward<Args>(args)...), hash);
+	}
+	template<typename... Args>
+	std::pair<iterator, bool> emplace_hashed(std::false_type, size_t, Args&&... args) {
+		return emplace_entry(std::false_type(), std::forward<Args>(args)...);
+	}
+
+	template<typename... Args>
+	node *construct_node(Args&&... args) {
+		node_allocator nodes { allocator };
+		node *entry = static_cast<node *>(node_pool.allocate(allocator));
+		try {
+			std::allocator_traits<node_allocator>::construct(nodes, entry, std::forward<Args>(args)...);
+		}
+		catch (...) {
+			node_pool.deallocate(entry);
+			throw;
+		}
+		return entry;
+	}
+
+	/// Inserts the constructed `entry` with `hash`, unless there is already an entry with the same key, in which case `entry` is destroyed.
+	std::pair<iterator, bool> insert_node(node *entry, size_t hash) {
+		size_t index = find_index(entry->value.first, hash);
+		if (index == capacity) {
+			try {
+				index = prepare_insert(hash);
+			}
+			catch (...) {
+				destroy_node(entry);
+				throw;
+			}
+			entry->hash = hash;
+			slots[index] = entry;
+			return { { this, index }, true };
+		}
+		destroy_node(entry);
+		return { { this, index }, false };
+	}
+
+	template<typename... Args>
+	std::pair<iterator, bool> emplace_entry(std::false_type, Args&&... args) {
+		value_type value(std::forward<Args>(args)...);
+		size_t hash = hash_key(value.first);
+		size_t index = find_index(value.first, hash);
+		if (index == capacity) {
+			index = prepare_insert(hash);
+			try {
+				new (&slots[index].storage) value_type(std::move(value));
+			}
+			catch (...) {
+				entry_count--;
+				growth_left++;
+				set_ctrl(index, group::empty);
+				throw;
+			}
+			return { { this, index }, true };
+		}
+		return { { this, index }, false };
+	}
+
+	/// Erases the entry in slot `index`, then shifts back the entries probed after it,
+	/// so that every entry is still reachable from its home slot without crossing an empty slot.
+	void erase_index(size_t index) {
+		destroy_slot(slots[index]);
+		entry_count--;
+		growth_left++;
+		size_t mask = capacity - 1;
+		size_t hole = index;
+		for (size_t next = (index + 1) & mask; ctrl[next] != group::empty; next = (next + 1) & mask) {
+			size_t next_home = home(detail::mix_hash(slot_hash(slots[next])));
+			// the entry can move to the hole if the hole is between its home slot and its current slot
+			if (((next - next_home) & mask) >= ((next - hole) & mask)) {
+				set_ctrl(hole, ctrl[next]);
+				move_slot(slots[hole], slots[next]);
+				hole = next;
+			}
+		}
+		set_ctrl(hole, group::empty);
+	}
+
+	void rehash(size_t new_capacity) {
+		int8_t *old_ctrl = ctrl;
+		slot_type *old_slots = slots;
+		size_t old_capacity = capacity;
+
+		ctrl_allocator ctrls { allocator };
+		slot_allocator slot_array { allocator };
+		int8_t *new_ctrl = std::allocator_traits<ctrl_allocator>::allocate(ctrls, new_capacity + group::width - 1);
+		try {
+			slots = std::allocator_traits<slot_allocator>::allocate(slot_array, new_capacity);
+		}
+		catch (...) {
+			std::allocator_traits<ctrl_allocator>::deallocate(ctrls, new_ctrl, new_capacity + group::width - 1);
+			throw;
+		}
+		ctrl = new_ctrl;
+		capacity = new_capacity;
+		std::memset(ctrl, group::empty, capacity + group::width - 1);
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (old_ctrl[i] >= 0) {
+				uint64_t mixed = detail::mix_hash(slot_hash(old_slots[i]));
+				size_t index = find_empty(mixed);
+				set_ctrl(index, tag(mixed));
+				move_slot(slots[index], old_slots[i]);
+			}
+		}
+		growth_left = max_load(capacity) - entry_count;
+
+		if (old_capacity) {
+			std::allocator_traits<ctrl_allocator>::deallocate(ctrls, old_ctrl, old_capacity + group::width - 1);
+			std::allocator_traits<slot_allocator>::deallocate(slot_array, old_slots, old_capacity);
+		}
+	}
+
+	/// Destroys all entries and frees the table.
+	void destroy() {
+		if (capacity) {
+			clear();
+			ctrl_allocator ctrls { allocator };
+			slot_allocator slot_array { allocator };
+			std::allocator_traits<ctrl_allocator>::deallocate(ctrls, ctrl, capacity + group::width - 1);
+			std::allocator_traits<slot_allocator>::deallocate(slot_array, slots, capacity);
+			ctrl = nullptr;
+			slots = nullptr;
+			capacity = 0;
+			growth_left = 0;
+		}
+		node_pool.release(allocator);
+	}
+
+	/// Takes the table from `other`, leaving it empty.
+	void steal(flat_map& other) {
+		ctrl = other.ctrl;
+		slots = other.slots;
+		capacity = other.capacity;
+		entry_count = other.entry_count;
+		growth_left = other.growth_left;
+		node_pool.steal(other.node_pool);
+		other.ctrl = nullptr;
+		other.slots = nullptr;
+		other.capacity = 0;
+		other.entry_count = 0;
+		other.growth_left = 0;
+	}
+
+	/// Index of the first full slot at or after `index`, or `capacity` if there is none.
+	size_t next_full(size_t index) const {
+		while (index < capacity && ctrl[index] < 0) {
+			index++;
+		}
+		return index;
+	}
+
+	value_type& value_at(size_t index) {
+		return slot_value(slots[index]);
+	}
+	const value_type& value_at(size_t index) const {
+		return slot_value(const_cast<slot_type&>(slots[index]));
+	}
+
+	// Stable mode slot operations
+	static value_type& slot_value(node *slot) {
+		return slot->value;
+	}
+	size_t slot_hash(node *slot) const {
+		return slot->hash;
+	}
+	template<typename K>
+	bool slot_matches(node *slot, const K& key, size_t hash) const {
+		return slot->hash == hash && key_equal_storage::get()(slot->value.first, key);
+	}
+	static void move_slot(node *& to, node *& from) {
+		to = from;
+	}
+	void destroy_slot(node *slot) {
+		destroy_node(slot);
+	}
+	void destroy_value(node *slot) {
+		node_allocator nodes { allocator };
+		std::allocator_traits<node_allocator>::destroy(nodes, slot);
+	}
+	void destroy_node(node *entry) {
+		destroy_value(entry);
+		node_pool.deallocate(entry);
+	}
+
+	// Inline mode slot operations
+	static value_type& slot_value(inline_slot& slot) {
+		return *reinterpret_cast<value_type *>(&slot.storage);
+	}
+	size_t slot_hash(inline_slot& slot) const {
+		return hash_key(slot_value(slot).first);
+	}
+	template<typename K>
+	bool slot_matches(const inline_slot& slot, const K& key, size_t) const {
+		return key_equal_storage::get()(slot_value(const_cast<inline_slot&>(slot)).first, key);
+	}
+	static void move_slot(inline_slot& to, inline_slot& from) {
+		new (&to.storage) value_type(std::move(slot_value(from)));
+		slot_value(from).~value_type();
+	}
+	static void destroy_slot(inline_slot& slot) {
+		slot_value(slot).~value_type();
+	}
+	static void destroy_value(inline_slot& slot) {
+		destroy_slot(slot);
+	}
+
+	int8_t *ctrl = nullptr;
+	slot_type *slots = nullptr;
+	size_t capacity = 0;
+	size_t entry_count = 0;
+	size_t growth_left = 0;
+	Allocator allocator;
+	/// Storage for entries in stable mode, unused otherwise.
+	detail::slab_pool<node, Allocator> node_pool;
+};
+
+template<typename Key, typename T, typename Hash, typename KeyEqual, bool Stable, typename Allocator>
+void swap(flat_map<Key, T, Hash, KeyEqual, Stable, Allocator>& a, flat_map<Key, T, Hash, KeyEqual, Stable, Allocator>& b) noexcept {
+	a.swap(b);
+}
+
+/// Alternative to `flat_map` that stores entries inline, for value types that are cheap to move.
+template<typename Key, typename T, typename Hash = hash<Key>, typename KeyEqual = equal_to<Key>, typename Allocator = std::allocator<std::pair<const Key, T>>>
+using flat_map_inline = flat_map<Key, T, Hash, KeyEqual, false, Allocator>;
+
+/// Value wrapper that releases it back to the owning flyweight upon destruction.
+template<typename Key, typename T, typename Flyweight>
+struct autorelease_value {
+	T& value;
+
+	/// Constructor.
+	autorelease_value(Flyweight& flyweight, const Key& key)
+		: value(flyweight.get(key))
+		, flyweight(flyweight)
+		, key(key)
+	{
+	}
+
+	/// Copy constructor.
+	autorelease_value(const autorelease_value& other) : autorelease_value(other.flyweight, other.key) {}
+
+	/// Copy assignment.
+	/// Releases the previously referenced value and calls `flyweight.get` to make sure reference counting is correct.
+	autorelease_value& operator=(const autorelease_value& other)
+	{
+		// release previous value
+		flyweight.release(key);
+		// re-get the value to make sure reference counting is correct
+		value = other.flyweight.get(other.key);
+		flyweight = other.flyweight;
+		key = other.key;
+	}
+
+	/// Returns the wrapped value.
+	T& operator*() {
+		return value;
+	}
+	const T& operator*() const {
+		return value;
+	}
+	/// Returns the wrapped value.
+	T& operator->() {
+		return value;
+	}
+	const T& operator->() const {
+		return value;
+	}
+	/// Returns the wrapped value.
+	operator T&() {
+		return value;
+	}
+	operator const T&() const {
+		return value;
+	}
+
+	/// Release the value back to the owning flyweight.
+	~autorelease_value() {
+		flyweight.release(key);
+	}
+
+private:
+	Flyweight& flyweight;
+	Key key;
+};
+
+/**
+ * Immutable map of keys to values, looked up with a minimal perfect hash, usually created by freezing a flyweight with `flyweight::freeze`.
+ *
+ * Values are stored contiguously, each key having its own slot, so a lookup is a hash, a seed read, a slot read and a single key comparison.
+ * Since it's never modified, a frozen flyweight is safe to read from any number of threads without locking.
+ *
+ * @tparam Key  Key mapped to values.
+ * @tparam T  Value type.
+ * @tparam Hash  Hash functor for keys. Defaults to `flyweight::hash<Key>`.
+ * @tparam KeyEqual  Equality functor for keys. Defaults to `flyweight::equal_to<Key>`.
+ */
+template<typename Key, typename T, typename Hash = hash<Key>, typename KeyEqual = equal_to<Key>>
+class frozen_flyweight {
+public:
+	using key_type = Key;
+	using value_type = T;
+
+	/// Construct an empty frozen flyweight, which finds no values.
+	frozen_flyweight() {}
+
+	/// Copies the keys and values in [`first`, `last`) and builds their perfect hash.
+	/// Elements must have `first` and `second` members, like map entries, with `second` convertible to `T`.
+	/// @throw std::invalid_argument if a key is repeated.
+	template<typename ForwardIt>
+	frozen_flyweight(ForwardIt first, ForwardIt last) {
+		for (; first != last; ++first) {
+			entries.emplace_back(first->first, first->second);
+		}
+		size_t size = entries.size();
+		size_t bucket_count = detail::perfect_hash_bucket_count(size);
+		std::vector<uint64_t> mixed(size);
+		for (size_t i = 0; i < size; i++) {
+			mixed[i] = detail::mix_hash(Hash{}(entries[i].first));
+		}
+		std::vector<size_t> slots(size), order(size), bucket_starts(bucket_count + 1);
+		std::vector<bool> taken(size);
+		seeds.resize(bucket_count);
+		detail::build_perfect_hash(mixed, size, seeds, slots, order, taken, bucket_starts);
+
+		// move each entry to its slot, following permutation cycles
+		for (size_t i = 0; i < size; i++) {
+			while (slots[i] != i) {
+				std::swap(entries[i], entries[slots[i]]);
+				std::swap(slots[i], slots[slots[i]]);
+			}
+		}
+	}
+
+	/// Gets the value associated to the passed key.
+	/// @throw std::out_of_range if the key is not in the frozen flyweight.
+	const T& get(const Key& key) const {
+		if (const T *value = peek(key)) {
+			return *value;
+		}
+		throw std::out_of_range("flyweight::frozen_flyweight: key not found");
+	}
+
+	/// Alternative to `frozen_flyweight::get` that takes the key's hash, as computed by `Hash`, instead of hashing the key again.
+	/// @throw std::out_of_range if the key is not in the frozen flyweight.
+	const T& get_hashed(const Key& key, size_t hash) const {
+		if (const T *value = peek_hashed(key, hash)) {
+			return *value;
+		}
+		throw std::out_of_range("flyweight::frozen_flyweight: key not found");
+	}
+
+	/// Gets the value associated to the passed key.
+	/// @return Pointer to the value, or `nullptr` if the key is not in the frozen flyweight.
+	const T *peek(const Key& key) const {
+		return peek_hashed(key, Hash{}(key));
+	}
+
+	/// Alternative to `frozen_flyweight::peek` that takes the key's hash, as computed by `Hash`, instead of hashing the key again.
+	/// @see peek
+	const T *peek_hashed(const Key& key, size_t hash) const {
+		if (entries.empty()) {
+			return nullptr;
+		}
+		uint64_t mixed = detail::mix_hash(hash);
+		uint32_t seed = seeds[detail::perfect_hash_bucket(mixed, seeds.size())];
+		const std::pair<Key, T>& entry = entries[detail::perfect_hash_slot(mixed, seed, entries.size())];
+		return KeyEqual{}(entry.first, key) ? &entry.second : nullptr;
+	}
+
+	/// Check whether the passed key is in the frozen flyweight.
+	bool is_loaded(const Key& key) const {
+		return peek(key) != nullptr;
+	}
+
+	/// Number of values.
+	size_t size() const {
+		return entries.size();
+	}
+
+private:
+	/// Entries in the slot of their keys.
+	std::vector<std::pair<Key, T>> entries;
+	/// Seed of each bucket, which displaces its keys to their slots.
+	std::vector<uint32_t> seeds;
+};
+
+#ifdef FLYWEIGHT_HAS_CXX17
+/**
+ * Hash functor usable in constant expressions, for integers, enums and string views.
+ * Used by `static_frozen_flyweight`, whose perfect hash may be built at compile time.
+ */
+template<typename Key, typename = void>
+struct constexpr_hash;
+template<typename Key>
+struct constexpr_hash<Key, typename std::enable_if<std::is_integral<Key>::value || std::is_enum<Key>::value>::type> {
+	constexpr uint64_t operator()(Key key) const {
+		return static_cast<uint64_t>(key);
+	}
+};
+template<typename CharT, typename Traits>
+struct constexpr_hash<std::basic_string_view<CharT, Traits>> {
+	/// 64-bit FNV-1a over the characters of `str`.
+	constexpr uint64_t operator()(std::basic_string_view<CharT, Traits> str) const {
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		for (CharT c : str) {
+			hash = (hash ^ static_cast<uint64_t>(c)) * 0x100000001b3ULL;
+		}
+		return hash;
+	}
+};
+
+/**
+ * Alternative to `frozen_flyweight` with a fixed number of values, that may be constructed in constant expressions.
+ * When the keys are known at compile time, declare it `constexpr` and its perfect hash is built by the compiler.
+ * @see make_frozen_flyweight
+ *
+ * @tparam Key  Key mapped to values. Must be a literal type.
+ * @tparam T  Value type. Must be a default constructible literal type.
+ * @tparam N  Number of values.
+ * @tparam Hash  Hash functor for keys. Defaults to `constexpr_hash<Key>`.
+ * @tparam KeyEqual  Equality functor for keys. Defaults to `std::equal_to<Key>`.
+ */
+template<typename Key, typename T, size_t N, typename Hash = constexpr_hash<Key>, typename KeyEqual = std::equal_to<Key>>
+class static_frozen_flyweight {
+	static constexpr size_t bucket_count = detail::perfect_hash_bucket_count(N);
+
+public:
+	using key_type = Key;
+	using value_type = T;
+
+	/// Builds the perfect hash of the passed keys and values.
+	/// @param values  Array of `N` elements with `first` and `second` members, like `std::array<std::pair<Key, T>, N>`.
+	/// @throw std::invalid_argument if a key is repeated, which fails compilation in constant expressions.
+	template<typename Values>
+	constexpr explicit static_frozen_flyweight(const Values& values) {
+		std::array<uint64_t, N> mixed {};
+		for (size_t i = 0; i < N; i++) {
+			mixed[i] = detail::mix_hash(Hash{}(values[i].first));
+		}
+		std::array<size_t, N> slots {}, order {};
+		std::array<bool, N> taken {};
+		std::array<size_t, bucket_count + 1> bucket_starts {};
+		detail::build_perfect_hash(mixed, N, seeds, slots, order, taken, bucket_starts);
+		for (size_t i = 0; i < N; i++) {
+			entries[slots[i]].first = values[i].first;
+			entries[slots[i]].second = values[i].second;
+		}
+	}
+
+	/// Gets the value associated to the passed key.
+	/// @throw std::out_of_range if the key is not in the frozen flyweight.
+	constexpr const T& get(const Key& key) const {
+		if (const T *value = peek(key)) {
+			return *value;
+		}
+		throw std::out_of_range("flyweight::static_frozen_flyweight: key not found");
+	}
+
+	/// Gets the value associated to the passed key.
+	/// @return Pointer to the value, or `nullptr` if the key is not in the frozen flyweight.
+	constexpr const T *peek(const Key& key) const {
+		if (N == 0) {
+			return nullptr;
+		}
+		uint64_t mixed = detail::mix_hash(Hash{}(key));
+		const entry& found = entries[detail::perfect_hash_slot(mixed, seeds[detail::perfect_hash_bucket(mixed, bucket_count)], N)];
+		return KeyEqual{}(found.first, key) ? &found.second : nullptr;
+	}
+
+	/// Check whether the passed key is in the frozen flyweight.
+	constexpr bool is_loaded(const Key& key) const {
+		return peek(key) != nullptr;
+	}
+
+	/// Number of values.
+	constexpr size_t size() const {
+		return N;
+	}
+
+private:
+	struct entry {
+		Key first {};
+		T second {};
+	};
+
+	/// Entries in the slot of their keys.
+	std::array<entry, N> entries {};
+	/// Seed of each bucket, which displaces its keys to their slots.
+	std::array<uint32_t, bucket_count> seeds {};
+};
+
+/**
+ * Creates a `static_frozen_flyweight` from an array of keys and values, deducing its size.
+ * ```cpp
+ * constexpr auto opcodes = flyweight::make_frozen_flyweight<std::string_view, int>({ {"add", 1}, {"sub", 2} });
+ * static_assert(opcodes.get("sub") == 2);
+ * ```
+ */
+template<typename Key, typename T, size_t N>
+constexpr static_frozen_flyweight<Key, T, N> make_frozen_flyweight(const std::pair<Key, T> (&values)[N]) {
+	return static_frozen_flyweight<Key, T, N> { values };
+}
+
+/**
+ * Flyweight for a set of keys known at compile time, like enum values, that stores each value in its own slot instead of a map.
+ *
+ * `static_flyweight::get<Key>()` resolves the slot of `Key` at compile time, so getting a loaded value is an array index, an atomic load and a branch.
+ * Keys only known at runtime are mapped to their slots by a `static_frozen_flyweight` built at compile time.
+ * Values are still created by the creator functor the first time they are gotten, exactly once even when gotten concurrently.
+ * A mutex is only locked for creating and releasing values.
+ *
+ * Use the `static_flyweight` alias, which type erases the creator and deleter functors,
+ * or `make_static_flyweight` to store them with their own types.
+ *
+ * @tparam T  Value type.
+ * @tparam Creator  Creator functor type.
+ * @tparam Deleter  Deleter functor type.
+ * @tparam Keys  Keys mapped to values, all of the same integral or enum type. Repeated keys fail compilation.
+ */
+template<typename T, typename Creator, typename Deleter, auto... Keys>
+class basic_static_flyweight
+	: protected detail::functor_storage<Creator, detail::creator_tag>
+	, protected detail::functor_storage<Deleter, detail::deleter_tag>
+{
+	static_assert(sizeof...(Keys) > 0, "static_flyweight needs at least one key");
+
+	using creator_storage = detail::functor_storage<Creator, detail::creator_tag>;
+	using deleter_storage = detail::functor_storage<Deleter, detail::deleter_tag>;
+
+public:
+	using key_type = typename std::common_type<decltype(Keys)...>::type;
+	using value_type = T;
+	using creator_type = Creator;
+	using deleter_type = Deleter;
+	using autorelease_value_type = autorelease_value<key_type, T, basic_static_flyweight>;
+
+	static_assert((std::is_same<decltype(Keys), key_type>::value && ...), "static_flyweight keys must all have the same type");
+
+	/// Number of keys, which is also the maximum number of loaded values.
+	static constexpr size_t key_count = sizeof...(Keys);
+
+	/// Default constructor.
+	/// Uses `default_creator` as the value creator and `default_deleter` as the value deleter,
+	/// or default constructs `Creator` and `Deleter` if they can't be constructed from those.
+	basic_static_flyweight()
+		: creator_storage(detail::make_default_functor<Creator, default_creator<T, key_type>>())
+		, deleter_storage(detail::make_default_functor<Deleter, default_deleter<T>>())
+	{
+	}
+
+	/// Constructor with custom value creator functor.
+	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
+	///                 It will be called with a const reference to the key of the value.
+	template<typename C, typename = detail::enable_if_not_self<basic_static_flyweight, C>>
+	basic_static_flyweight(C&& creator)
+		: creator_storage(std::forward<C>(creator))
+		, deleter_storage(detail::make_default_functor<Deleter, default_deleter<T>>())
+	{
+	}
+
+	/// Constructor with custom value creator functor and deleter functor.
+	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
+	///                 It will be called with a const reference to the key of the value.
+	/// @param deleter  Deleter functor that will be called when releasing a mapped value.
+	template<typename C, typename D>
+	basic_static_flyweight(C&& creator, D&& deleter)
+		: creator_storage(std::forward<C>(creator))
+		, deleter_storage(std::forward<D>(deleter))
+	{
+	}
+
+	basic_static_flyweight(const basic_static_flyweight&) = delete;
+	basic_static_flyweight& operator=(const basic_static_flyweight&) = delete;
+
+	/// Calls the deleter functor to all remaining values, to ensure everything is cleaned up properly.
+	~basic_static_flyweight() {
+		clear();
+	}
+
+	/// Gets the value associated to `Key`, whose slot is resolved at compile time.
+	/// If the value was already created, a reference to the existing value is returned.
+	/// Otherwise, the value is created using the creator functor.
+	template<key_type Key>
+	T& get() {
+		constexpr size_t index = indices.get(Key);
+		return get_slot(index, Key);
+	}
+
+	/// Gets the value associated to the passed key.
+	/// @throw std::out_of_range if the key is not one of `Keys`.
+	/// @see get()
+	T& get(const key_type& key) {
+		return get_slot(indices.get(key), key);
+	}
+
+	/// Alternative to `static_flyweight::get` that returns an `autorelease_value`.
+	/// This enables the RAII idiom for automatically releasing values.
+	/// @see get
+	autorelease_value_type get_autorelease(const key_type& key) {
+		return {
+			*this,
+			key,
+		};
+	}
+
+	/// Gets the existing value associated to the passed key.
+	/// @return Pointer to the existing value, or `nullptr` if the value is not loaded or the key is not one of `Keys`.
+	T *peek(const key_type& key) {
+		const size_t *index = indices.peek(key);
+		if (index && slots[*index].loaded.load(std::memory_order_acquire)) {
+			return &slots[*index].value();
+		}
+		return nullptr;
+	}
+
+	/// Check whether the value mapped to the passed key is loaded.
+	bool is_loaded(const key_type& key) {
+		return peek(key) != nullptr;
+	}
+
+	/// Release the value mapped to the passed key.
+	/// Trying to release a value that is not loaded is a no-op.
+	/// @return `true` if a loaded value was released, `false` otherwise.
+	bool release(const key_type& key) {
+		const size_t *index = indices.peek(key);
+		if (!index) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lock { mutex };
+		return release_slot(slots[*index]);
+	}
+
+	/// Release all values, calling the deleter functor on them.
+	void clear() {
+		std::lock_guard<std::mutex> lock { mutex };
+		for (slot& value_slot : slots) {
+			release_slot(value_slot);
+		}
+	}
+
+protected:
+	/// Creator functor passed when constructing the flyweight, if any.
+	Creator& creator() {
+		return creator_storage::get();
+	}
+	/// Deleter functor passed when constructing the flyweight, if any.
+	Deleter& deleter() {
+		return deleter_storage::get();
+	}
+
+	/// Storage for a value that is created on first use.
+	struct slot {
+		std::atomic<bool> loaded { false };
+		alignas(T) unsigned char storage[sizeof(T)];
+
+		T& value() {
+			return *std::launder(reinterpret_cast<T *>(storage));
+		}
+	};
+
+	template<size_t... I>
+	static constexpr static_frozen_flyweight<key_type, size_t, key_count> make_indices(std::index_sequence<I...>) {
+		return static_frozen_flyweight<key_type, size_t, key_count> {
+			std::array<std::pair<key_type, size_t>, key_count> {{ { Keys, I }... }},
+		};
+	}
+
+	T& get_slot(size_t index, const key_type& key) {
+		slot& value_slot = slots[index];
+		if (!value_slot.loaded.load(std::memory_order_acquire)) {
+			std::lock_guard<std::mutex> lock { mutex };
+			if (!value_slot.loaded.load(std::memory_order_relaxed)) {
+				::new (static_cast<void *>(value_slot.storage)) T(creator()(key));
+				value_slot.loaded.store(true, std::memory_order_release);
+			}
+		}
+		return value_slot.value();
+	}
+
+	/// Must be called with the mutex locked.
+	bool release_slot(slot& value_slot) {
+		if (!value_slot.loaded.load(std::memory_order_relaxed)) {
+			return false;
+		}
+		value_slot.loaded.store(false, std::memory_order_relaxed);
+		deleter()(value_slot.value());
+		value_slot.value().~T();
+		return true;
+	}
+
+	/// Slot index of each key, built at compile time.
+	static constexpr static_frozen_flyweight<key_type, size_t, key_count> indices = make_indices(std::make_index_sequence<key_count>{});
+
+	std::array<slot, key_count> slots;
+	std::mutex mutex;
+};
+
+/**
+ * `basic_static_flyweight` that type erases its creator and deleter functors with `std::function`.
+ * @see basic_static_flyweight
+ */
+template<typename T, auto... Keys>
+using static_flyweight = basic_static_flyweight<
+	T,
+	std::function<T(const typename std::common_type<decltype(Keys)...>::type&)>,
+	std::function<void(T&)>,
+	Keys...
+>;
+
+/**
+ * Creates a `basic_static_flyweight` that stores `creator` and `deleter` with their own types, instead of type erasing them with `std::function`.
+ * ```cpp
+ * auto names = flyweight::make_static_flyweight<std::string, color::red, color::green>([](color key) { return to_string(key); });
+ * ```
+ * @see make_flyweight
+ */
+template<typename T, auto... Keys, typename Creator, typename Deleter = default_deleter<T>>
+basic_static_flyweight<T, typename std::decay<Creator>::type, typename std::decay<Deleter>::type, Keys...>
+make_static_flyweight(Creator&& creator, Deleter&& deleter = Deleter{}) {
+	return { std::forward<Creator>(creator), std::forward<Deleter>(deleter) };
+}
+#endif
+
+/**
+ * Factory for flyweight objects of type `T`, created with a key of type `Key`.
+ *
+ * When getting a value, the flyweight first checks for an existing value associated with the passed key, returning a reference to it if found.
+ * Otherwise, a new value is created and cached for future requests.
+ * When no longer needed, an existing value may be released by calling `flyweight::release`.
+ *
+ * Flyweights are useful as a way to load heavy objects only once and sharing them whenever necessary, for example images used as icons in an interactive app.
+ * Flyweights can also be used to implement string interning and function result memoization.
+ *
+ * @tparam Key  Key mapped to loaded values.
+ * @tparam T  Value type.
+ * @tparam Map  Internal type used to map keys to values. Defaults to `flat_map`, using `flyweight::hash` and `flyweight::equal_to`.
+ * @tparam Mutex  Internal type used for a mutex. Defaults to `detail::dummy_mutex`.
+ * @tparam Lock  Internal type used for locking the mutex. Defaults to `detail::dummy_lock`.
+ * @tparam SharedLock  Internal type used for locking the mutex in shared mode, for lookups that don't modify the map.
+ *                     Defaults to `Lock`, which means lookups also lock the mutex exclusively.
+ * @tparam Creator  Creator functor type. Defaults to `std::function<T(const Key&)>`, which type erases any creator functor.
+ *                  Naming the functor type avoids the indirect call; see `make_flyweight`.
+ * @tparam Deleter  Deleter functor type. Defaults to `std::function<void(T&)>`, which type erases any deleter functor.
+ * @tparam Stats  Statistics policy, reported by `flyweight::stats`. Defaults to `no_stats`, which records nothing and takes no space.
+ *                Use `atomic_stats` to count hits, misses, creator and deleter time and lock waits.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, T>, typename Mutex = detail::dummy_mutex, typename Lock = detail::dummy_lock, typename SharedLock = Lock, typename Creator = std::function<T(const Key&)>, typename Deleter = std::function<void(T&)>, typename Stats = no_stats>
+class flyweight
+	: protected detail::functor_storage<Creator, detail::creator_tag>
+	, protected detail::functor_storage<Deleter, detail::deleter_tag>
+	, protected detail::functor_storage<Stats, detail::stats_tag>
+{
+	using creator_storage = detail::functor_storage<Creator, detail::creator_tag>;
+	using deleter_storage = detail::functor_storage<Deleter, detail::deleter_tag>;
+	using stats_storage = detail::functor_storage<Stats, detail::stats_tag>;
+
+public:
+	using key_type = Key;
+	using value_type = T;
+	using creator_type = Creator;
+	using deleter_type = Deleter;
+	using stats_type = Stats;
+	using map_type = Map;
+	using autorelease_value_type = autorelease_value<Key, T, flyweight>;
+
+	/// Default constructor.
+	/// Uses `default_creator` as the value creator and `default_deleter` as the value deleter,
+	/// or default constructs `Creator` and `Deleter` if they can't be constructed from those.
+	flyweight()
+		: creator_storage(detail::make_default_functor<Creator, default_creator<T, Key>>())
+		, deleter_storage(detail::make_default_functor<Deleter, default_deleter<T>>())
+	{
+	}
+
+	/// Constructor with custom value creator functor.
+	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
+	///                 It will be called with a const reference to the key passed to `flyweight::get`.
+	template<typename C, typename = detail::enable_if_not_self<flyweight, C>>
+	flyweight(C&& creator)
+		: creator_storage(std::forward<C>(creator))
+		, deleter_storage(detail::make_default_functor<Deleter, default_deleter<T>>())
+	{
+	}
+
+	/// Constructor with custom value creator functor and deleter functor.
+	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
+	///                 It will be called with a const reference to the key passed to `flyweight::get`.
+	/// @param deleter  Deleter functor that will be called when releasing a mapped value.
+	///                 It will be called by `flyweight::release` with a reference to the value.
+	template<typename C, typename D>
+	flyweight(C&& creator, D&& deleter)
+		: creator_storage(std::forward<C>(creator))
+		, deleter_storage(std::forward<D>(deleter))
+	{
+	}
+
+	/// Calls the deleter functor to all remaining values, to ensure everything is cleaned up properly.
+	~flyweight() {
+		Lock lock { mutex };
+		for (auto& it : map) {
+			deleter()(it.second);
+		}
+	}
+
+	/// Gets the value associated to the passed key.
+	/// If the value was already created, a reference to the existing value is returned.
+	/// Otherwise, the value is created using the creator functor passed on the flyweight's constructor.
+	/// @param key Key that represent a value.
+	///            It will be passed to the creator functor if the value is not loaded yet.
+	/// @return Reference to the value mapped to the passed key.
+	T& get(const Key& key) {
+		return get<Key>(key);
+	}
+
+	/// Alternative to `flyweight::get` that looks up the value without constructing a `Key`.
+	/// A `Key` is only constructed from `key` if the value is not loaded yet.
+	/// Only available if `Map` supports heterogeneous lookup with keys of type `K`.
+	/// @see get
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T& get(const K& key) {
+		return get_hashed(key, hash_key(key));
+	}
+
+	/// Hash of `key`, to be passed to the hashed alternatives like `flyweight::get_hashed` instead of hashing the key again.
+	/// This is the hash computed by `Map`'s hasher, which is `flyweight::hash<Key>` for the default `flat_map`.
+	/// Maps that don't look keys up by hash, like `std::unordered_map`, ignore hashes and get 0.
+	/// Only uses the hash functor, so it doesn't lock the mutex.
+	template<typename K>
+	size_t hash_key(const K& key) const {
+		return detail::hashed_lookup<Map>::hash(map, key);
+	}
+
+	/// Alternative to `flyweight::get` that takes the key's hash, as returned by `flyweight::hash_key`, instead of hashing the key again.
+	/// The hash must have been computed for a key equal to `key`, otherwise the loaded value may not be found.
+	/// @see get
+	T& get_hashed(const Key& key, size_t hash) {
+		return get_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight::get_hashed` that looks up the value without constructing a `Key`.
+	/// @see get_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T& get_hashed(const K& key, size_t hash) {
+		if (has_shared_lock) {
+			stats_lock<SharedLock> lock { mutex, statistics() };
+			auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+			if (it != map.end()) {
+				statistics().hit();
+				return it->second;
+			}
+		}
+		stats_lock<Lock> lock { mutex, statistics() };
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		if (it == map.end()) {
+			auto&& new_key = detail::make_key<Key>(key);
+			it = create_entry(new_key);
+		}
+		else {
+			statistics().hit();
+		}
+		return it->second;
+	}
+
+	/// Alternative to `flyweight::get` for `std::tuple` keys that takes the tuple elements as separate arguments, for memoizing functions of several arguments.
+	/// Arguments are hashed and compared against loaded keys directly, and the `Key` tuple is only constructed from them if the value is not loaded yet.
+	/// Only available if `Map` supports heterogeneous lookup with tuples, like the default `flat_map` with `flyweight::hash` and `flyweight::equal_to`.
+	/// @see get
+	template<typename... Args, typename = detail::enable_if_arguments<Args...>, typename = detail::enable_if_lookup_key<Map, Key, detail::argument_key<Args...>>>
+	T& get(const Args&... args) {
+		return get(detail::argument_key<Args...>(args...));
+	}
+
+	/// Gets the values associated to every key in [`first`, `last`), writing pointers to them to `out`.
+	/// Same as calling `flyweight::get` for each key, but keys are hashed before locking the mutex,
+	/// the mutex is locked once per batch of keys and the map slots of a whole batch are prefetched before probing them.
+	/// With maps whose values move when inserting, like `flat_map_inline`, pointers are written after every value is loaded.
+	/// @return Output iterator past the last written pointer.
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out) {
+		return get_many(first, last, out, detail::has_stable_references<Map>());
+	}
+
+	/// Creates the values of every key in [`first`, `last`) that are not loaded yet, calling the creator functor on up to `parallelism` threads.
+	/// The creator functor is called without holding the lock, so it must be thread-safe, and values are inserted all at once after being created.
+	/// Values that got loaded by other means in the meantime are kept, passing the preloaded duplicates to the deleter functor.
+	/// If the creator functor throws, the remaining keys are skipped, the values created so far are inserted and the first exception is rethrown.
+	/// @return Number of inserted values.
+	template<typename ForwardIt>
+	size_t preload(ForwardIt first, ForwardIt last, size_t parallelism = std::thread::hardware_concurrency()) {
+		std::vector<Key> keys;
+		{
+			SharedLock lock { mutex };
+			detail::missing_keys(map, first, last, keys);
+		}
+		std::exception_ptr exception;
+		auto created = detail::parallel_create<T>(creator(), keys, parallelism, exception);
+		size_t inserted = 0;
+		{
+			Lock lock { mutex };
+			for (auto& values : created) {
+				for (auto& value : values) {
+					const Key& key = keys[value.first];
+					if (map.find(key) == map.end()) {
+						map.emplace(key, std::move(value.second));
+						inserted++;
+					}
+					else {
+						deleter()(value.second);
+					}
+				}
+			}
+		}
+		if (exception) {
+			std::rethrow_exception(exception);
+		}
+		return inserted;
+	}
+
+	/// Alternative to `flyweight::get` that returns an `autorelease_value`.
+	/// This enables the RAII idiom for automatically releasing values.
+	/// @see get
+	autorelease_value_type get_autorelease(const Key& key) {
+		return {
+			*this,
+			key,
+		};
+	}
+
+	/// Gets the existing value associated to the passed key.
+	/// If the value was not created yet, returns `nullptr`.
+	/// @param key Key that represents a value.
+	/// @return Pointer to the existing value, or `nullptr` if the value is not loaded.
+	T *peek(const Key& key) {
+		return peek<Key>(key);
+	}
+
+	/// Alternative to `flyweight::peek` that looks up the value without constructing a `Key`.
+	/// @see peek
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T *peek(const K& key) {
+		return peek_hashed(key, hash_key(key));
+	}
+
+	/// Alternative to `flyweight::peek` that takes the key's hash, as returned by `flyweight::hash_key`.
+	/// @see get_hashed
+	T *peek_hashed(const Key& key, size_t hash) {
+		return peek_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight::peek_hashed` that looks up the value without constructing a `Key`.
+	/// @see peek_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T *peek_hashed(const K& key, size_t hash) {
+		SharedLock lock { mutex };
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		if (it == map.end()) {
+			return nullptr;
+		}
+		else {
+			return &it->second;
+		}
+	}
+
+	/// Check whether the value mapped to the passed key is loaded.
+	bool is_loaded(const Key& key) {
+		return is_loaded<Key>(key);
+	}
+
+	/// Alternative to `flyweight::is_loaded` that looks up the value without constructing a `Key`.
+	/// @see is_loaded
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool is_loaded(const K& key) {
+		return is_loaded_hashed(key, hash_key(key));
+	}
+
+	/// Alternative to `flyweight::is_loaded` that takes the key's hash, as returned by `flyweight::hash_key`.
+	/// @see get_hashed
+	bool is_loaded_hashed(const Key& key, size_t hash) {
+		return is_loaded_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight::is_loaded_hashed` that looks up the value without constructing a `Key`.
+	/// @see is_loaded_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool is_loaded_hashed(const K& key, size_t hash) {
+		SharedLock lock { mutex };
+		return detail::hashed_lookup<Map>::find(map, key, hash) != map.end();
+	}
+
+	/// Release the value mapped to the passed key.
+	/// Trying to release a value that is not loaded is a no-op.
+	/// @return `true` if a loaded value was released, `false` otherwise.
+	bool release(const Key& key) {
+		return release<Key>(key);
+	}
+
+	/// Alternative to `flyweight::release` that looks up the value without constructing a `Key`.
+	/// @see release
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool release(const K& key) {
+		return release_hashed(key, hash_key(key));
+	}
+
+	/// Alternative to `flyweight::release` that takes the key's hash, as returned by `flyweight::hash_key`.
+	/// @see get_hashed
+	bool release_hashed(const Key& key, size_t hash) {
+		return release_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight::release_hashed` that looks up the value without constructing a `Key`.
+	/// @see release_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool release_hashed(const K& key, size_t hash) {
+		stats_lock<Lock> lock { mutex, statistics() };
+		return release_one(key, hash);
+	}
+
+	/// Releases the values mapped to every key in [`first`, `last`).
+	/// Same as calling `flyweight::release` for each key, but the mutex is locked once per batch of keys.
+	/// @return Number of released values.
+	/// @see get_many
+	template<typename ForwardIt>
+	size_t release_many(ForwardIt first, ForwardIt last) {
+		size_t hashes[detail::batch_size];
+		size_t released = 0;
+		while (first != last) {
+			ForwardIt batch = first;
+			size_t count = detail::hash_batch<Key>(map, first, last, hashes);
+			stats_lock<Lock> lock { mutex, statistics() };
+			detail::prefetch_batch(map, hashes, count);
+			for (size_t i = 0; i < count; ++batch, i++) {
+				released += release_one(*batch, hashes[i]);
+			}
+		}
+		return released;
+	}
+
+	/// Copies the loaded values to a `frozen_flyweight`, whose lookups use a minimal perfect hash without locking any mutex.
+	/// The frozen flyweight hashes and compares keys with `Map`'s functors, when it has them.
+	/// Later changes to this flyweight are not reflected in the frozen one.
+	frozen_flyweight<Key, T, typename detail::map_hashing<Map, Key>::hasher, typename detail::map_hashing<Map, Key>::key_equal> freeze() {
+		SharedLock lock { mutex };
+		return { map.begin(), map.end() };
+	}
+
+	/// Release all values, calling the deleter functor on them.
+	void clear() {
+		Lock lock { mutex };
+		for (auto& it : map) {
+			delete_value(it.second);
+		}
+		map.clear();
+	}
+
+	/// Snapshot of the statistics recorded by the `Stats` policy, with the number of loaded values.
+	/// With the default `no_stats` policy, only `size` is filled.
+	stats_snapshot stats() {
+		stats_snapshot snapshot = statistics().snapshot();
+		SharedLock lock { mutex };
+		snapshot.size = map.size();
+		return snapshot;
+	}
+
+protected:
+	/// Creator functor passed when constructing the flyweight, if any.
+	Creator& creator() {
+		return creator_storage::get();
+	}
+	/// Deleter functor passed when constructing the flyweight, if any.
+	Deleter& deleter() {
+		return deleter_storage::get();
+	}
+	/// Statistics policy.
+	Stats& statistics() {
+		return stats_storage::get();
+	}
+
+	/// Lock of type `L` that reports the time spent waiting for the mutex to the statistics policy.
+	template<typename L>
+	using stats_lock = detail::stats_lock<L, Stats>;
+
+	/// Creates the value mapped to `key`, which must not be loaded, recording a miss with the time spent creating it.
+	typename Map::iterator create_entry(const Key& key) {
+		detail::stats_timer<Stats> timer;
+		auto it = detail::emplace_created<T>(map, key, creator());
+		statistics().miss(timer.elapsed());
+		return it;
+	}
+
+	/// Calls the deleter functor on `value`, recording the time spent in it.
+	void delete_value(T& value) {
+		detail::stats_timer<Stats> timer;
+		deleter()(value);
+		statistics().deletion(timer.elapsed());
+	}
+
+	/// Value map.
+	/// Maps the tuple of arguments to an already loaded value of type `T`.
+	Map map;
+	Mutex mutex;
+
+	/// Whether lookups lock the mutex in shared mode before trying to lock it exclusively.
+	static constexpr bool has_shared_lock = !std::is_same<Lock, SharedLock>::value;
+
+private:
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out, std::true_type) {
+		size_t hashes[detail::batch_size];
+		T *values[detail::batch_size];
+		while (first != last) {
+			ForwardIt batch = first;
+			size_t count = detail::hash_batch<Key>(map, first, last, hashes);
+			std::fill(values, values + count, nullptr);
+			size_t missing = count;
+			if (has_shared_lock) {
+				stats_lock<SharedLock> lock { mutex, statistics() };
+				missing = find_batch(batch, count, hashes, values, false);
+			}
+			if (missing) {
+				stats_lock<Lock> lock { mutex, statistics() };
+				find_batch(batch, count, hashes, values, true);
+			}
+			out = std::copy(values, values + count, out);
+		}
+		return out;
+	}
+
+	/// Creating values may move the values loaded before in maps without stable references,
+	/// so pointers are only taken once the values of every key are loaded.
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out, std::false_type) {
+		size_t loaded = 0;
+		get_many(first, last, detail::counting_iterator(loaded), std::true_type());
+		return write_loaded(first, loaded, out);
+	}
+
+	/// Writes pointers to the loaded values of the first `count` keys from `first` to `out`.
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt write_loaded(ForwardIt first, size_t count, OutputIt out) {
+		SharedLock lock { mutex };
+		for (; count > 0; ++first, count--) {
+			*out = &map.find(static_cast<const Key&>(*first))->second;
+			++out;
+		}
+		return out;
+	}
+
+	/// Looks up the keys of a batch whose values weren't found yet, prefetching their slots first.
+	/// Missing values are created if `create` is `true`.
+	/// @return Number of values that are still missing.
+	template<typename ForwardIt>
+	size_t find_batch(ForwardIt it, size_t count, const size_t *hashes, T **values, bool create) {
+		for (size_t i = 0; i < count; i++) {
+			if (!values[i]) {
+				detail::hashed_lookup<Map>::prefetch(map, hashes[i]);
+			}
+		}
+		size_t missing = 0;
+		for (size_t i = 0; i < count; ++it, i++) {
+			if (!values[i] && !find_one(*it, hashes[i], values[i], create)) {
+				missing++;
+			}
+		}
+		return missing;
+	}
+
+	bool find_one(const Key& key, size_t hash, T *& value, bool create) {
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		if (it == map.end()) {
+			if (!create) {
+				return false;
+			}
+			it = create_entry(key);
+		}
+		else {
+			statistics().hit();
+		}
+		value = &it->second;
+		return true;
+	}
+
+	template<typename K>
+	bool release_one(const K& key, size_t hash) {
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		if (it != map.end()) {
+			delete_value(it->second);
+			map.erase(it);
+			return true;
+		}
+		return false;
+	}
+};
+
+#ifdef FLYWEIGHT_HAS_CXX17
+/// Deduces `Key` and `T` from the parameter and return types of a non-generic creator functor, storing it without type erasure.
+template<typename Creator>
+flyweight(Creator) -> flyweight<
+	typename detail::callable_traits<Creator>::argument_type,
+	typename detail::callable_traits<Creator>::result_type,
+	flat_map<typename detail::callable_traits<Creator>::argument_type, typename detail::callable_traits<Creator>::result_type>,
+	detail::dummy_mutex, detail::dummy_lock, detail::dummy_lock,
+	Creator, default_deleter<typename detail::callable_traits<Creator>::result_type>
+>;
+template<typename Creator, typename Deleter>
+flyweight(Creator, Deleter) -> flyweight<
+	typename detail::callable_traits<Creator>::argument_type,
+	typename detail::callable_traits<Creator>::result_type,
+	flat_map<typename detail::callable_traits<Creator>::argument_type, typename detail::callable_traits<Creator>::result_type>,
+	detail::dummy_mutex, detail::dummy_lock, detail::dummy_lock,
+	Creator, Deleter
+>;
+#endif
+
+/**
+ * Creates a `flyweight` that stores `creator` and `deleter` with their own types, instead of type erasing them with `std::function`.
+ * Stateless functors, like lambdas without captures, take no space and calls to them may be inlined.
+ * Before C++17, bind the result to `auto&&` if the flyweight is not movable, for example when `Mutex` is `std::mutex`.
+ * @see flyweight::flyweight(C&&, D&&)
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, T>, typename Mutex = detail::dummy_mutex, typename Lock = detail::dummy_lock, typename SharedLock = Lock, typename Creator, typename Deleter = default_deleter<T>>
+flyweight<Key, T, Map, Mutex, Lock, SharedLock, typename std::decay<Creator>::type, typename std::decay<Deleter>::type>
+make_flyweight(Creator&& creator, Deleter&& deleter = Deleter{}) {
+	return { std::forward<Creator>(creator), std::forward<Deleter>(deleter) };
+}
+
+/**
+ * Alternative to `flyweight` that uses `std::mutex` and `std::lock_guard` for thread safety.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, T>, typename Stats = no_stats>
+using flyweight_threadsafe = flyweight<Key, T, Map, std::mutex, std::lock_guard<std::mutex>, std::lock_guard<std::mutex>, std::function<T(const Key&)>, std::function<void(T&)>, Stats>;
+
+#ifdef FLYWEIGHT_HAS_CXX17
+/**
+ * Alternative to `flyweight` that uses `std::shared_mutex` for thread safety.
+ * Lookups lock the mutex in shared mode, so that concurrent gets of already loaded values don't block each other.
+ * The mutex is only locked exclusively when creating or releasing values.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, T>, typename Stats = no_stats>
+using flyweight_threadsafe_rw = flyweight<Key, T, Map, std::shared_mutex, std::unique_lock<std::shared_mutex>, std::shared_lock<std::shared_mutex>, std::function<T(const Key&)>, std::function<void(T&)>, Stats>;
+#endif
+
+#ifdef FLYWEIGHT_HAS_MMAP
+/**
+ * Read-only table of keys and values of trivially copyable types, stored in a file that is memory-mapped when opened.
+ *
+ * Snapshots are written by `snapshot::write` and opened by constructing a `snapshot` with the file path.
+ * Opening a snapshot only reads its header and index for validating them, pages of entries are loaded by the OS when lookups touch them.
+ * Since snapshots are never modified after being opened, lookups don't lock any mutex.
+ *
+ * The file is mapped privately, so writing to values copies their pages in memory without modifying the file.
+ * Snapshots are not portable across architectures, or across builds where `Key` or `T` change layout.
+ *
+ * @tparam Key  Key type. Must be trivially copyable.
+ * @tparam T  Value type. Must be trivially copyable.
+ * @tparam Hash  Hash functor for keys. Defaults to `flyweight::hash<Key>`.
+ *               Must return the same hashes in the processes writing and opening snapshots, like the identity hash of integers does.
+ * @tparam KeyEqual  Equality functor for keys. Defaults to `flyweight::equal_to<Key>`.
+ */
+template<typename Key, typename T, typename Hash = hash<Key>, typename KeyEqual = equal_to<Key>>
+class snapshot {
+	static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<T>::value,
+		"Snapshot keys and values must be trivially copyable, since they are mapped straight from the file");
+
+public:
+	/// Key and value stored in a snapshot.
+	struct entry {
+		Key first;
+		T second;
+	};
+
+	/// Construct an empty snapshot, which finds no values.
+	snapshot() {}
+
+	/// Maps the snapshot file at `path`.
+	/// @throw std::system_error if the file could not be opened or mapped.
+	/// @throw std::runtime_error if the file is not a snapshot of the same `Key` and `T` types.
+	explicit snapshot(const std::string& path) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::system_error(errno, std::generic_category(), "flyweight::snapshot: could not open " + path);
+		}
+		struct stat info;
+		if (::fstat(fd, &info) < 0) {
+			int error = errno;
+			::close(fd);
+			throw std::system_error(error, std::generic_category(), "flyweight::snapshot: could not stat " + path);
+		}
+		mapped_size = static_cast<size_t>(info.st_size);
+		if (mapped_size < sizeof(header)) {
+			::close(fd);
+			throw std::runtime_error("flyweight::snapshot: invalid snapshot " + path);
+		}
+		void *address = ::mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		int error = errno;
+		::close(fd);
+		if (address == MAP_FAILED) {
+			throw std::system_error(error, std::generic_category(), "flyweight::snapshot: could not map " + path);
+		}
+		mapped = static_cast<char *>(address);
+		if (!validate()) {
+			unmap();
+			throw std::runtime_error("flyweight::snapshot: invalid snapshot " + path);
+		}
+		const header *file_header = reinterpret_cast<const header *>(mapped);
+		entries = reinterpret_cast<entry *>(mapped + entries_offset);
+		count = static_cast<size_t>(file_header->count);
+		index = reinterpret_cast<const uint32_t *>(mapped + file_header->index_offset);
+		capacity = static_cast<size_t>(file_header->capacity);
+	}
+
+	snapshot(snapshot&& other) noexcept {
+		swap(other);
+	}
+
+	snapshot& operator=(snapshot other) noexcept {
+		swap(other);
+		return *this;
+	}
+
+	/// Unmaps the snapshot file.
+	~snapshot() {
+		unmap();
+	}
+
+	void swap(snapshot& other) noexcept {
+		std::swap(mapped, other.mapped);
+		std::swap(mapped_size, other.mapped_size);
+		std::swap(entries, other.entries);
+		std::swap(count, other.count);
+		std::swap(index, other.index);
+		std::swap(capacity, other.capacity);
+	}
+
+	/// Finds the value mapped to the passed key.
+	/// @return Pointer to the mapped value, or `nullptr` if the key is not in the snapshot.
+	T *find(const Key& key) const {
+		if (capacity == 0) {
+			return nullptr;
+		}
+		size_t mask = capacity - 1;
+		size_t position = static_cast<size_t>(detail::mix_hash(Hash{}(key))) & mask;
+		for (size_t probes = 0; probes < capacity && index[position] != 0; probes++, position = (position + 1) & mask) {
+			entry& candidate = entries[index[position] - 1];
+			if (KeyEqual{}(candidate.first, key)) {
+				return &candidate.second;
+			}
+		}
+		return nullptr;
+	}
+
+	/// Number of entries in the snapshot.
+	size_t size() const {
+		return count;
+	}
+
+	entry *begin() const {
+		return entries;
+	}
+	entry *end() const {
+		return entries + count;
+	}
+
+	/// Writes the keys and values in [`first`, `last`) to a snapshot file at `path`.
+	/// Elements must have `first` and `second` members, like the entries of maps and snapshots, and keys must not repeat.
+	/// The file is written to a temporary file next to `path` and then renamed, so that processes never open a partially written snapshot.
+	/// @throw std::system_error if the file could not be written.
+	template<typename ForwardIt>
+	static void write(const std::string& path, ForwardIt first, ForwardIt last) {
+		size_t entry_count = static_cast<size_t>(std::distance(first, last));
+		if (entry_count >= UINT32_MAX) {
+			throw std::length_error("flyweight::snapshot: too many entries");
+		}
+		size_t table_capacity = 2;
+		while (table_capacity < entry_count * 2) {
+			table_capacity *= 2;
+		}
+
+		std::vector<entry> table_entries;
+		table_entries.reserve(entry_count);
+		std::vector<uint32_t> table_index(table_capacity, 0);
+		size_t mask = table_capacity - 1;
+		for (; first != last; ++first) {
+			entry new_entry;
+			std::memset(static_cast<void *>(&new_entry), 0, sizeof(new_entry));
+			new_entry.first = first->first;
+			new_entry.second = first->second;
+			table_entries.push_back(new_entry);
+			size_t position = static_cast<size_t>(detail::mix_hash(Hash{}(new_entry.first))) & mask;
+			while (table_index[position] != 0) {
+				position = (position + 1) & mask;
+			}
+			table_index[position] = static_cast<uint32_t>(table_entries.size());
+		}
+
+		header file_header;
+		std::memset(&file_header, 0, sizeof(file_header));
+		std::memcpy(file_header.magic, magic, sizeof(file_header.magic));
+		file_header.version = version;
+		file_header.key_size = sizeof(Key);
+		file_header.value_size = sizeof(T);
+		file_header.entry_size = sizeof(entry);
+		file_header.count = entry_count;
+		file_header.capacity = table_capacity;
+		file_header.index_offset = index_offset(entry_count);
+
+		std::string temporary_path = path + ".tmp";
+		std::FILE *file = std::fopen(temporary_path.c_str(), "wb");
+		if (!file) {
+			throw std::system_error(errno, std::generic_category(), "flyweight::snapshot: could not create " + temporary_path);
+		}
+		char padding[entries_offset] = {};
+		size_t entries_padding = static_cast<size_t>(file_header.index_offset) - entries_offset - entry_count * sizeof(entry);
+		bool ok = std::fwrite(&file_header, sizeof(file_header), 1, file) == 1
+			&& std::fwrite(padding, 1, entries_offset - sizeof(file_header), file) == entries_offset - sizeof(file_header)
+			&& (entry_count == 0 || std::fwrite(table_entries.data(), sizeof(entry), entry_count, file) == entry_count)
+			&& std::fwrite(padding, 1, entries_padding, file) == entries_padding
+			&& std::fwrite(table_index.data(), sizeof(uint32_t), table_capacity, file) == table_capacity;
+		int error = errno;
+		ok = std::fclose(file) == 0 && ok;
+		if (!ok || std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+			error = ok ? errno : error;
+			std::remove(temporary_path.c_str());
+			throw std::system_error(error, std::generic_category(), "flyweight::snapshot: could not write " + path);
+		}
+	}
+
+private:
+	/// Snapshot file header, followed by the entries at `entries_offset` and the index at `index_offset`.
+	struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t key_size;
+		uint32_t value_size;
+		uint32_t entry_size;
+		uint64_t count;
+		uint64_t capacity;
+		uint64_t index_offset;
+	};
+
+	static constexpr const char *magic = "FLYWSNAP";
+	static constexpr uint32_t version = 1;
+	/// Entries start at a fixed offset that is aligned for any entry, since mappings are page aligned.
+	static constexpr size_t entries_offset = 64;
+	static_assert(alignof(entry) <= entries_offset && sizeof(header) <= entries_offset, "Snapshot entries must fit their alignment after the header");
+
+	static size_t index_offset(size_t entry_count) {
+		size_t offset = entries_offset + entry_count * sizeof(entry);
+		return (offset + alignof(uint32_t) - 1) & ~(alignof(uint32_t) - 1);
+	}
+
+	bool validate() const {
+		// sizes are subtracted from `mapped_size` only after checking they fit, so that they never wrap around
+		if (mapped_size < entries_offset) {
+			return false;
+		}
+		const header *file_header = reinterpret_cast<const header *>(mapped);
+		if (std::memcmp(file_header->magic, magic, sizeof(file_header->magic)) != 0
+			|| file_header->version != version
+			|| file_header->key_size != sizeof(Key)
+			|| file_header->value_size != sizeof(T)
+			|| file_header->entry_size != sizeof(entry)
+			|| file_header->capacity == 0
+			|| (file_header->capacity & (file_header->capacity - 1)) != 0
+			|| file_header->count >= file_header->capacity
+			|| file_header->count > (mapped_size - entries_offset) / sizeof(entry))
+		{
+			return false;
+		}
+		size_t offset = index_offset(static_cast<size_t>(file_header->count));
+		if (file_header->index_offset != offset || offset > mapped_size || file_header->capacity > (mapped_size - offset) / sizeof(uint32_t)) {
+			return false;
+		}
+		// every index entry must point to an entry, and the table must have empty slots to end probes
+		const uint32_t *file_index = reinterpret_cast<const uint32_t *>(mapped + offset);
+		size_t empty_slots = 0;
+		for (size_t i = 0; i < file_header->capacity; i++) {
+			if (file_index[i] > file_header->count) {
+				return false;
+			}
+			empty_slots += file_index[i] == 0;
+		}
+		return empty_slots > 0;
+	}
+
+	void unmap() {
+		if (mapped) {
+			::munmap(mapped, mapped_size);
+			mapped = nullptr;
+		}
+	}
+
+	char *mapped = nullptr;
+	size_t mapped_size = 0;
+	entry *entries = nullptr;
+	size_t count = 0;
+	/// Open addressing table of entry indices plus one, zero meaning an empty slot.
+	const uint32_t *index = nullptr;
+	size_t capacity = 0;
+};
+
+/**
+ * Alternative to `flyweight` that serves values from a memory-mapped `snapshot` before calling the creator functor.
+ *
+ * Getting a key that is in the snapshot returns a reference to its value in the mapped file, without locking the mutex.
+ * Other keys are created and released as usual.
+ * Values in the snapshot are never released, and the deleter functor is not called on them.
+ * Use `flyweight_snapshot::save_snapshot` to write both the snapshot and the created values to a new snapshot file,
+ * so that the next process starts with all of them loaded, without calling the creator functor.
+ *
+ * @tparam Key  Key mapped to loaded values. Must be trivially copyable.
+ * @tparam T  Value type. Must be trivially copyable.
+ * @tparam Map  Internal type used to map keys to values created after opening the snapshot. Defaults to `flat_map`, using `flyweight::hash` and `flyweight::equal_to`.
+ * @tparam Mutex  Internal type used for a mutex. Defaults to `detail::dummy_mutex`.
+ * @tparam Lock  Internal type used for locking the mutex. Defaults to `detail::dummy_lock`.
+ * @tparam SharedLock  Internal type used for locking the mutex in shared mode. Defaults to `Lock`.
+ * @tparam Creator  Creator functor type. Defaults to `std::function<T(const Key&)>`, which type erases any creator functor.
+ * @tparam Deleter  Deleter functor type. Defaults to `std::function<void(T&)>`, which type erases any deleter functor.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, T>, typename Mutex = detail::dummy_mutex, typename Lock = detail::dummy_lock, typename SharedLock = Lock, typename Creator = std::function<T(const Key&)>, typename Deleter = std::function<void(T&)>>
+class flyweight_snapshot : public flyweight<Key, T, Map, Mutex, Lock, SharedLock, Creator, Deleter> {
+	using base = flyweight<Key, T, Map, Mutex, Lock, SharedLock, Creator, Deleter>;
+
+public:
+	using snapshot_type = snapshot<Key, T>;
+	using autorelease_value_type = autorelease_value<Key, T, flyweight_snapshot>;
+
+	/// Constructor with the snapshot to serve values from and the arguments for constructing the `flyweight` that creates the other values.
+	/// @see flyweight::flyweight
+	template<typename... Args>
+	flyweight_snapshot(snapshot_type&& mapped_snapshot, Args&&... args)
+		: base(std::forward<Args>(args)...)
+		, mapped(std::move(mapped_snapshot))
+	{
+	}
+
+	/// Gets the value associated to the passed key.
+	/// If the key is in the snapshot, a reference to its mapped value is returned.
+	/// @see flyweight::get
+	T& get(const Key& key) {
+		if (T *value = mapped.find(key)) {
+			return *value;
+		}
+		return base::get(key);
+	}
+
+	/// Alternative to `flyweight_snapshot::get` that takes the key's hash, as returned by `hash_key`, for values that are not in the snapshot.
+	/// @see get
+	T& get_hashed(const Key& key, size_t hash) {
+		if (T *value = mapped.find(key)) {
+			return *value;
+		}
+		return base::get_hashed(key, hash);
+	}
+
+	/// Gets the values associated to every key in [`first`, `last`), writing pointers to them to `out`.
+	/// @return Output iterator past the last written pointer.
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out) {
+		static_assert(detail::has_stable_references<Map>::value, "Values are gotten one at a time, so Map must have stable references, like flat_map does and flat_map_inline doesn't");
+		for (; first != last; ++first) {
+			*out = &get(*first);
+			++out;
+		}
+		return out;
+	}
+
+	/// Alternative to `flyweight_snapshot::get` that returns an `autorelease_value`.
+	/// @see get
+	autorelease_value_type get_autorelease(const Key& key) {
+		return {
+			*this,
+			key,
+		};
+	}
+
+	/// Creates the values of every key in [`first`, `last`) that are neither in the snapshot nor loaded yet.
+	/// @see flyweight::preload
+	template<typename ForwardIt>
+	size_t preload(ForwardIt first, ForwardIt last, size_t parallelism = std::thread::hardware_concurrency()) {
+		std::vector<Key> keys;
+		for (; first != last; ++first) {
+			const Key& key = *first;
+			if (!mapped.find(key)) {
+				keys.push_back(key);
+			}
+		}
+		return base::preload(keys.begin(), keys.end(), parallelism);
+	}
+
+	/// Gets the existing value associated to the passed key, either from the snapshot or created.
+	/// @see flyweight::peek
+	T *peek(const Key& key) {
+		if (T *value = mapped.find(key)) {
+			return value;
+		}
+		return base::peek(key);
+	}
+
+	/// Check whether the value mapped to the passed key is in the snapshot or loaded.
+	bool is_loaded(const Key& key) {
+		return mapped.find(key) || base::is_loaded(key);
+	}
+
+	/// Alternative to `flyweight_snapshot::peek` that takes the key's hash, as returned by `hash_key`, for values that are not in the snapshot.
+	/// @see peek
+	T *peek_hashed(const Key& key, size_t hash) {
+		if (T *value = mapped.find(key)) {
+			return value;
+		}
+		return base::peek_hashed(key, hash);
+	}
+
+	/// Alternative to `flyweight_snapshot::is_loaded` that takes the key's hash, as returned by `hash_key`, for values that are not in the snapshot.
+	/// @see is_loaded
+	bool is_loaded_hashed(const Key& key, size_t hash) {
+		return mapped.find(key) || base::is_loaded_hashed(key, hash);
+	}
+
+	/// Check whether the value mapped to the passed key is in the snapshot.
+	bool is_mapped(const Key& key) const {
+		return mapped.find(key) != nullptr;
+	}
+
+	/// Writes the values in the snapshot and every created value to a new snapshot file at `path`.
+	/// The snapshot currently in use is not changed, so `path` may be the file it was opened from.
+	/// @see snapshot::write
+	void save_snapshot(const std::string& path) {
+		std::vector<typename snapshot_type::entry> entries(mapped.begin(), mapped.end());
+		{
+			SharedLock lock { this->mutex };
+			for (auto& it : this->map) {
+				entries.push_back({ it.first, it.second });
+			}
+		}
+		snapshot_type::write(path, entries.begin(), entries.end());
+	}
+
+protected:
+	/// Snapshot whose values are served before creating values.
+	snapshot_type mapped;
+};
+
+namespace detail {
+	/// How keys and values of type `T` are stored in a `shared_memory_flyweight` segment.
+	/// Trivially copyable types are stored in their slots as they are.
+	template<typename T>
+	struct shared_memory_traits {
+		static_assert(std::is_trivially_copyable<T>::value,
+			"Shared memory keys and values must be trivially copyable or string views, since every process maps them at a different address");
+
+		using stored_type = T;
+		using reference = const T&;
+		using created_type = T;
+
+		/// Bytes of the segment's string arena needed for storing `value`.
+		static size_t arena_size(const T&) {
+			return 0;
+		}
+		static void store(char *, uint64_t, stored_type& stored, const T& value) {
+			stored = value;
+		}
+		static reference load(const char *, const stored_type& stored) {
+			return stored;
+		}
+	};
+
+#ifdef FLYWEIGHT_HAS_CXX17
+	/// Offset and size of characters in the string arena of a shared memory segment.
+	/// Offsets are relative to the start of the segment, so they stay valid in every process that maps it.
+	struct shared_memory_string {
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	/// String views are stored as copies of their characters in the segment's string arena, and loaded as views of that copy.
+	template<typename CharT, typename Traits>
+	struct shared_memory_traits<std::basic_string_view<CharT, Traits>> {
+		using stored_type = shared_memory_string;
+		using reference = std::basic_string_view<CharT, Traits>;
+		/// Creators return owning strings, which are copied to the arena, instead of views that could dangle.
+		using created_type = std::basic_string<CharT, Traits>;
+
+		static size_t arena_size(reference value) {
+			return (value.size() + 1) * sizeof(CharT);
+		}
+		static void store(char *base, uint64_t offset, stored_type& stored, reference value) {
+			CharT *characters = reinterpret_cast<CharT *>(base + offset);
+			Traits::copy(characters, value.data(), value.size());
+			characters[value.size()] = CharT();
+			stored = { offset, value.size() };
+		}
+		static reference load(const char *base, const stored_type& stored) {
+			return { reinterpret_cast<const CharT *>(base + stored.offset), static_cast<size_t>(stored.size) };
+		}
+	};
+#endif
+}
+
+/**
+ * Flyweight whose values live in a named POSIX shared memory segment, so that every process opening the same name shares a single copy of them.
+ *
+ * The first process constructing a `shared_memory_flyweight` with a name creates the segment, and the others map it.
+ * The segment outlives the processes using it until `shared_memory_flyweight::remove` is called,
+ * so worker processes that are recycled or restarted find the values created by their predecessors, without calling the creator functor again.
+ *
+ * The segment holds a fixed capacity open addressing table of slots that store keys and values in place,
+ * and an arena for the characters of string view keys and values, referenced by offset instead of by pointer.
+ * Lookups of loaded values never lock: slots are published with atomic stores once their key and value are written.
+ * Creating values locks a process-shared mutex in the segment, which is robust on Linux,
+ * so that a process dying while holding it doesn't block the others.
+ *
+ * Values are never released, since other processes may be using them.
+ * Getting a new value when the table or the string arena is full throws `std::length_error`.
+ *
+ * @tparam Key  Key mapped to loaded values. Must be trivially copyable or `std::basic_string_view` (C++17).
+ * @tparam T  Value type. Must be trivially copyable or `std::basic_string_view` (C++17).
+ * @tparam Hash  Hash functor for keys. Defaults to `flyweight::hash<Key>`.
+ *               Must return the same hashes in every process mapping the segment, like the identity hash of integers does.
+ * @tparam KeyEqual  Equality functor for keys. Defaults to `flyweight::equal_to<Key>`.
+ * @tparam Creator  Creator functor type. Defaults to `std::function<T(const Key&)>`, or `std::function<std::basic_string<...>(const Key&)>` for string view values,
+ *                  whose characters are copied to the segment.
+ */
+template<typename Key, typename T, typename Hash = hash<Key>, typename KeyEqual = equal_to<Key>, typename Creator = std::function<typename detail::shared_memory_traits<T>::created_type(const Key&)>>
+class shared_memory_flyweight : detail::functor_storage<Creator, detail::creator_tag> {
+	using creator_storage = detail::functor_storage<Creator, detail::creator_tag>;
+	using key_traits = detail::shared_memory_traits<Key>;
+	using value_traits = detail::shared_memory_traits<T>;
+
+public:
+	using key_type = Key;
+	using value_type = T;
+	/// Type returned by `get`: a const reference to the value in the segment, or a view of its characters for string view values.
+	using reference = typename value_traits::reference;
+
+	/// Opens the shared memory segment called `name`, creating it if no process did.
+	/// @param name  Name of the segment, starting with a slash, like "/my_app_values".
+	/// @param capacity  Maximum number of values. Ignored if the segment already exists.
+	/// @param arena_size  Bytes reserved for the characters of string view keys and values. Ignored if the segment already exists.
+	/// @throw std::system_error if the segment could not be created, opened or mapped.
+	/// @throw std::runtime_error if the segment was not created for the same `Key` and `T` types.
+	explicit shared_memory_flyweight(const std::string& name, size_t capacity, size_t arena_size = 0)
+		: creator_storage(detail::make_default_functor<Creator, default_creator<typename value_traits::created_type, Key>>())
+	{
+		open(name, capacity, arena_size);
+	}
+
+	/// Opens the shared memory segment called `name`, creating it if no process did, with the passed creator functor.
+	/// @see shared_memory_flyweight(const std::string&, size_t, size_t)
+	template<typename C>
+	shared_memory_flyweight(const std::string& name, size_t capacity, size_t arena_size, C&& creator)
+		: creator_storage(std::forward<C>(creator))
+	{
+		open(name, capacity, arena_size);
+	}
+
+	shared_memory_flyweight(const shared_memory_flyweight&) = delete;
+	shared_memory_flyweight& operator=(const shared_memory_flyweight&) = delete;
+
+	/// Unmaps the segment. The segment and its values stay available to other processes.
+	~shared_memory_flyweight() {
+		unmap();
+	}
+
+	/// Gets the value associated to the passed key.
+	/// If no process created it yet, the creator functor is called with the cross-process mutex locked and the value is copied to the segment.
+	/// @throw std::length_error if the value needs to be created but the table or the string arena is full.
+	reference get(const Key& key) {
+		uint32_t hash = hash_bits(key);
+		if (slot *found = find(key, hash)) {
+			return value_traits::load(mapped, found->value);
+		}
+		process_lock lock { segment_header()->mutex };
+		return value_traits::load(mapped, insert(key, hash)->value);
+	}
+
+	/// Check whether the value mapped to the passed key was created by any process.
+	bool is_loaded(const Key& key) const {
+		return find(key, hash_bits(key)) != nullptr;
+	}
+
+	/// Number of values in the segment.
+	size_t size() const {
+		return static_cast<size_t>(segment_header()->count.load(std::memory_order_acquire));
+	}
+
+	/// Maximum number of values in the segment.
+	size_t capacity() const {
+		return static_cast<size_t>(segment_header()->capacity);
+	}
+
+	/// Returns the creator functor.
+	Creator& creator() {
+		return creator_storage::get();
+	}
+
+	/// Removes the shared memory segment called `name`.
+	/// Processes that have it mapped keep using it, and the next `shared_memory_flyweight` with that name creates a new segment.
+	/// @return Whether the segment existed.
+	static bool remove(const std::string& name) {
+		return ::shm_unlink(name.c_str()) == 0;
+	}
+
+private:
+	/// Segment header, followed by the slots at `slots_offset` and the string arena at `arena_offset`.
+	struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t key_size;
+		uint32_t value_size;
+		uint32_t slot_size;
+		uint64_t capacity;
+		uint64_t table_size;
+		uint64_t arena_offset;
+		uint64_t arena_size;
+		/// Set once the creating process finished initializing the header and the mutex.
+		std::atomic<uint32_t> ready;
+		std::atomic<uint64_t> count;
+		uint64_t arena_used;
+		pthread_mutex_t mutex;
+	};
+
+	/// Table slot, published by storing `state` after writing the key and value.
+	struct slot {
+		std::atomic<uint32_t> state;
+		uint32_t hash;
+		typename key_traits::stored_type key;
+		typename value_traits::stored_type value;
+	};
+
+	static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "Shared memory flyweights need address free atomics");
+
+	static constexpr const char *magic = "FLYWSHM1";
+	static constexpr uint32_t version = 1;
+	static constexpr uint32_t empty_slot = 0;
+	static constexpr uint32_t ready_slot = 1;
+	/// Slots start at a cache line boundary after the header, mappings being page aligned.
+	static constexpr size_t slots_offset = (sizeof(header) + 63) & ~size_t(63);
+
+	/// Locks the process-shared mutex in the segment, recovering it if its owner died while holding it.
+	class process_lock {
+	public:
+		explicit process_lock(pthread_mutex_t& mutex) : mutex(mutex) {
+			int result = ::pthread_mutex_lock(&mutex);
+#ifdef __linux__
+			if (result == EOWNERDEAD) {
+				// The slot being written by the dead process was not published, so the table is consistent.
+				result = ::pthread_mutex_consistent(&mutex);
+			}
+#endif
+			if (result != 0) {
+				throw std::system_error(result, std::generic_category(), "flyweight::shared_memory_flyweight: could not lock the segment");
+			}
+		}
+		~process_lock() {
+			::pthread_mutex_unlock(&mutex);
+		}
+
+		process_lock(const process_lock&) = delete;
+		process_lock& operator=(const process_lock&) = delete;
+
+	private:
+		pthread_mutex_t& mutex;
+	};
+
+	static uint32_t hash_bits(const Key& key) {
+		return static_cast<uint32_t>(detail::mix_hash(Hash{}(key)));
+	}
+
+	header *segment_header() const {
+		return reinterpret_cast<header *>(mapped);
+	}
+
+	slot *slots() const {
+		return reinterpret_cast<slot *>(mapped + slots_offset);
+	}
+
+	slot *find(const Key& key, uint32_t hash) const {
+		size_t mask = table_size - 1;
+		for (size_t position = hash & mask; ; position = (position + 1) & mask) {
+			slot& candidate = slots()[position];
+			if (candidate.state.load(std::memory_order_acquire) == empty_slot) {
+				return nullptr;
+			}
+			if (candidate.hash == hash && KeyEqual{}(key_traits::load(mapped, candidate.key), key)) {
+				return &candidate;
+			}
+		}
+	}
+
+	/// Finds or creates the value for `key`, with the segment mutex locked.
+	slot *insert(const Key& key, uint32_t hash) {
+		header *segment = segment_header();
+		size_t mask = table_size - 1;
+		size_t position = hash & mask;
+		for (; slots()[position].state.load(std::memory_order_acquire) != empty_slot; position = (position + 1) & mask) {
+			slot& candidate = slots()[position];
+			if (candidate.hash == hash && KeyEqual{}(key_traits::load(mapped, candidate.key), key)) {
+				return &candidate;
+			}
+		}
+		if (segment->count.load(std::memory_order_relaxed) >= segment->capacity) {
+			throw std::length_error("flyweight::shared_memory_flyweight: segment is full");
+		}
+
+		typename value_traits::created_type value = creator()(key);
+		size_t key_bytes = key_traits::arena_size(key);
+		size_t value_bytes = value_traits::arena_size(value);
+		if (key_bytes + value_bytes > segment->arena_size - segment->arena_used) {
+			throw std::length_error("flyweight::shared_memory_flyweight: string arena is full");
+		}
+		slot& new_slot = slots()[position];
+		uint64_t offset = segment->arena_offset + segment->arena_used;
+		key_traits::store(mapped, offset, new_slot.key, key);
+		value_traits::store(mapped, offset + key_bytes, new_slot.value, value);
+		new_slot.hash = hash;
+		// Arena bytes are reserved before publishing, so a process dying in between only leaks them.
+		segment->arena_used += (key_bytes + value_bytes + 7) & ~size_t(7);
+		new_slot.state.store(ready_slot, std::memory_order_release);
+		segment->count.fetch_add(1, std::memory_order_release);
+		return &new_slot;
+	}
+
+	void open(const std::string& name, size_t capacity, size_t arena_size) {
+		if (capacity == 0) {
+			throw std::invalid_argument("flyweight::shared_memory_flyweight: capacity must not be zero");
+		}
+		int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		bool created = fd >= 0;
+		if (!created && errno == EEXIST) {
+			fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+		}
+		if (fd < 0) {
+			throw std::system_error(errno, std::generic_category(), "flyweight::shared_memory_flyweight: could not open " + name);
+		}
+
+		if (created) {
+			size_t table = 2;
+			while (table < capacity * 2) {
+				table *= 2;
+			}
+			size_t arena_offset = slots_offset + table * sizeof(slot);
+			mapped_size = arena_offset + ((arena_size + 7) & ~size_t(7));
+			if (::ftruncate(fd, static_cast<off_t>(mapped_size)) < 0) {
+				int error = errno;
+				::close(fd);
+				::shm_unlink(name.c_str());
+				throw std::system_error(error, std::generic_category(), "flyweight::shared_memory_flyweight: could not size " + name);
+			}
+			map(fd, name);
+			int result = initialize(capacity, table, arena_offset);
+			if (result != 0) {
+				unmap();
+				::shm_unlink(name.c_str());
+				throw std::system_error(result, std::generic_category(), "flyweight::shared_memory_flyweight: could not initialize the mutex of " + name);
+			}
+		}
+		else {
+			// The creating process sizes the segment right after creating it, then initializes it.
+			struct stat info;
+			for (int attempt = 0; ; attempt++) {
+				if (::fstat(fd, &info) < 0) {
+					int error = errno;
+					::close(fd);
+					throw std::system_error(error, std::generic_category(), "flyweight::shared_memory_flyweight: could not stat " + name);
+				}
+				if (info.st_size > 0 || attempt == open_attempts) {
+					break;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			mapped_size = static_cast<size_t>(info.st_size);
+			if (mapped_size < slots_offset) {
+				::close(fd);
+				throw std::runtime_error("flyweight::shared_memory_flyweight: invalid segment " + name);
+			}
+			map(fd, name);
+			for (int attempt = 0; segment_header()->ready.load(std::memory_order_acquire) == 0; attempt++) {
+				if (attempt == open_attempts) {
+					unmap();
+					throw std::runtime_error("flyweight::shared_memory_flyweight: segment was never initialized " + name);
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			if (!validate()) {
+				unmap();
+				throw std::runtime_error("flyweight::shared_memory_flyweight: invalid segment " + name);
+			}
+		}
+		table_size = static_cast<size_t>(segment_header()->table_size);
+	}
+
+	void map(int fd, const std::string& name) {
+		void *address = ::mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		int error = errno;
+		::close(fd);
+		if (address == MAP_FAILED) {
+			throw std::system_error(error, std::generic_category(), "flyweight::shared_memory_flyweight: could not map " + name);
+		}
+		mapped = static_cast<char *>(address);
+	}
+
+	/// Initializes the header of a newly created segment, whose pages are zero filled, so every slot starts empty.
+	/// @return Zero, or the error initializing the mutex.
+	int initialize(size_t capacity, size_t table, size_t arena_offset) {
+		header *segment = new (mapped) header;
+		std::memcpy(segment->magic, magic, sizeof(segment->magic));
+		segment->version = version;
+		segment->key_size = sizeof(typename key_traits::stored_type);
+		segment->value_size = sizeof(typename value_traits::stored_type);
+		segment->slot_size = sizeof(slot);
+		segment->capacity = capacity;
+		segment->table_size = table;
+		segment->arena_offset = arena_offset;
+		segment->arena_size = mapped_size - arena_offset;
+		segment->arena_used = 0;
+		segment->count.store(0, std::memory_order_relaxed);
+
+		pthread_mutexattr_t attributes;
+		::pthread_mutexattr_init(&attributes);
+		::pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+		::pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+#endif
+		int result = ::pthread_mutex_init(&segment->mutex, &attributes);
+		::pthread_mutexattr_destroy(&attributes);
+		if (result == 0) {
+			segment->ready.store(1, std::memory_order_release);
+		}
+		return result;
+	}
+
+	bool validate() const {
+		const header *segment = segment_header();
+		return std::memcmp(segment->magic, magic, sizeof(segment->magic)) == 0
+			&& segment->version == version
+			&& segment->key_size == sizeof(typename key_traits::stored_type)
+			&& segment->value_size == sizeof(typename value_traits::stored_type)
+			&& segment->slot_size == sizeof(slot)
+			&& segment->capacity != 0
+			&& segment->table_size >= segment->capacity * 2
+			&& (segment->table_size & (segment->table_size - 1)) == 0
+			&& segment->arena_offset == slots_offset + segment->table_size * sizeof(slot)
+			&& segment->arena_offset <= mapped_size
+			&& segment->arena_size == mapped_size - segment->arena_offset;
+	}
+
+	void unmap() {
+		if (mapped) {
+			::munmap(mapped, mapped_size);
+			mapped = nullptr;
+		}
+	}
+
+	/// Number of 1ms waits for another process to finish creating the segment.
+	static constexpr int open_attempts = 5000;
+
+	char *mapped = nullptr;
+	size_t mapped_size = 0;
+	size_t table_size = 0;
+};
+#endif
+
+/**
+ * Factory for flyweight objects of type `T`, created with a key of type `Key`, that employs reference counting.
+ *
+ * The reference count increments for each call to `flyweight_refcounted::get` and decrements for each call to `flyweight_refcounted::release` using the same key.
+ * When calling `flyweight_refcounted::release`, the value is actually deleted from the cache only when the reference count reaches zero.
+ *
+ * This is specially useful for implementing resource management of heavy objects, like images used as icons in an interactive app.
+ *
+ * @tparam Key  Key mapped to loaded values.
+ * @tparam T  Value type.
+ * @tparam Map  Internal type used to map keys to values. Defaults to `flat_map`, using `flyweight::hash` and `flyweight::equal_to`.
+ * @tparam Mutex  Internal type used for a mutex. Defaults to `detail::dummy_mutex`.
+ * @tparam Lock  Internal type used for locking the mutex. Defaults to `detail::dummy_lock`.
+ * @tparam SharedLock  Internal type used for locking the mutex in shared mode, for lookups that don't modify the map.
+ *                     Defaults to `Lock`, which means lookups also lock the mutex exclusively.
+ * @tparam Creator  Creator functor type. Defaults to `std::function<T(const Key&)>`, which type erases any creator functor.
+ *                  Naming the functor type avoids the indirect call; see `make_flyweight_refcounted`.
+ * @tparam Deleter  Deleter functor type. Defaults to `std::function<void(T&)>`, which type erases any deleter functor.
+ * @tparam Stats  Statistics policy, reported by `flyweight_refcounted::stats`. Defaults to `no_stats`, which records nothing and takes no space.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, detail::refcounted_value<T>>, typename Mutex = detail::dummy_mutex, typename Lock = detail::dummy_lock, typename SharedLock = Lock, typename Creator = std::function<T(const Key&)>, typename Deleter = std::function<void(T&)>, typename Stats = no_stats>
+class flyweight_refcounted
+	: protected detail::functor_storage<Creator, detail::creator_tag>
+	, protected detail::functor_storage<Deleter, detail::deleter_tag>
+	, protected detail::functor_storage<Stats, detail::stats_tag>
+{
+	static_assert(std::is_same<Lock, SharedLock>::value || detail::is_atomic<decltype(Map::mapped_type::refcount)>::value,
+		"Reference counts must be atomic when references are taken while locked in shared mode");
+
+	using creator_storage = detail::functor_storage<Creator, detail::creator_tag>;
+	using deleter_storage = detail::functor_storage<Deleter, detail::deleter_tag>;
+	using stats_storage = detail::functor_storage<Stats, detail::stats_tag>;
+
+public:
+	using key_type = Key;
+	using value_type = T;
+	using creator_type = Creator;
+	using deleter_type = Deleter;
+	using stats_type = Stats;
+	using map_type = Map;
+	using autorelease_value_type = autorelease_value<Key, T, flyweight_refcounted>;
+	/// Map entry, containing the key and its reference counted value.
+	using entry_type = typename Map::value_type;
+
+	/// Reference counted handle to a value, pointing directly to its map entry.
+	/// Copying or destroying a handle only touches the reference count, without looking up the key.
+	/// Moving a handle doesn't touch the flyweight at all.
+	/// The key is only looked up again when the last reference is released, to remove the entry from the map.
+	/// Requires `Map` to have stable references to its entries, like `flat_map`, `std::unordered_map` and `std::map` do, which is checked at compile time.
+	class handle {
+	public:
+		/// Construct an empty handle.
+		handle() {}
+
+		/// Copy constructor.
+		/// Increments the reference count.
+		handle(const handle& other) : owner(other.owner), entry(other.entry) {
+			if (entry) {
+				owner->reference_entry(*entry);
+			}
+		}
+
+		/// Move constructor.
+		/// Transfers the reference to this handle, leaving `other` empty.
+		handle(handle&& other) noexcept : owner(other.owner), entry(other.entry) {
+			other.owner = nullptr;
+			other.entry = nullptr;
+		}
+
+		/// Copy and move assignment.
+		/// Releases the previously referenced value.
+		handle& operator=(handle other) noexcept {
+			swap(other);
+			return *this;
+		}
+
+		/// Release the value back to the owning flyweight.
+		~handle() {
+			reset();
+		}
+
+		/// Release the value back to the owning flyweight, leaving this handle empty.
+		void reset() {
+			if (entry) {
+				owner->release_entry(*entry);
+				owner = nullptr;
+				entry = nullptr;
+			}
+		}
+
+		void swap(handle& other) noexcept {
+			std::swap(owner, other.owner);
+			std::swap(entry, other.entry);
+		}
+
+		/// Returns the key mapped to the referenced value.
+		const Key& key() const {
+			return entry->first;
+		}
+
+		/// Returns the referenced value.
+		T& operator*() const {
+			return entry->second.value;
+		}
+		/// Returns the referenced value.
+		T *operator->() const {
+			return &entry->second.value;
+		}
+
+		/// Whether this handle references a value.
+		explicit operator bool() const {
+			return entry != nullptr;
+		}
+
+	private:
+		friend class flyweight_refcounted;
+
+		handle(flyweight_refcounted *owner, entry_type *entry) : owner(owner), entry(entry) {}
+
+		flyweight_refcounted *owner = nullptr;
+		entry_type *entry = nullptr;
+	};
+
+	/// Default constructor.
+	/// Uses `default_creator` as the value creator and `default_deleter` as the value deleter,
+	/// or default constructs `Creator` and `Deleter` if they can't be constructed from those.
+	flyweight_refcounted()
+		: creator_storage(detail::make_default_functor<Creator, default_creator<T, Key>>())
+		, deleter_storage(detail::make_default_functor<Deleter, default_deleter<T>>())
+	{
+	}
+
+	/// Constructor with custom value creator functor.
+	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
+	///                 It will be called with a const reference to the key passed to `flyweight_refcounted::get`.
+	template<typename C, typename = detail::enable_if_not_self<flyweight_refcounted, C>>
+	flyweight_refcounted(C&& creator)
+		: creator_storage(std::forward<C>(creator))
+		, deleter_storage(detail::make_default_functor<Deleter, default_deleter<T>>())
+	{
+	}
+
+	/// Constructor with custom value creator functor and deleter functor.
+	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
+	///                 It will be called with a const reference to the key passed to `flyweight_refcounted::get`.
+	/// @param deleter  Deleter functor that will be called when releasing a mapped value.
+	///                 It will be called by `flyweight_refcounted::release` with a reference to the value.
+	template<typename C, typename D>
+	flyweight_refcounted(C&& creator, D&& deleter)
+		: creator_storage(std::forward<C>(creator))
+		, deleter_storage(std::forward<D>(deleter))
+	{
+	}
+
+	/// Calls the deleter functor to all remaining values, to ensure everything is cleaned up properly.
+	~flyweight_refcounted() {
+		Lock lock { mutex };
+		for (auto& it : map) {
+			deleter()(it.second.value);
+		}
+	}
+
+	/// Gets the value associated to the passed arguments.
+	/// If the value was already created, a reference to the existing value is returned.
+	/// Otherwise, the value is created using the creator functor passed on the flyweight's constructor.
+	/// @param key Key that represent a value.
+	///            It will be passed to the creator functor if the value is not loaded yet.
+	/// @return Reference to the value mapped to the passed arguments.
+	T& get(const Key& key) {
+		return get<Key>(key);
+	}
+
+	/// Alternative to `flyweight_refcounted::get` that looks up the value without constructing a `Key`.
+	/// A `Key` is only constructed from `key` if the value is not loaded yet.
+	/// Only available if `Map` supports heterogeneous lookup with keys of type `K`.
+	/// @see get
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T& get(const K& key) {
+		return acquire(key, hash_key(key)).second.value;
+	}
+
+	/// Hash of `key`, to be passed to the hashed alternatives like `flyweight_refcounted::get_hashed` instead of hashing the key again.
+	/// @see flyweight::hash_key
+	template<typename K>
+	size_t hash_key(const K& key) const {
+		return detail::hashed_lookup<Map>::hash(map, key);
+	}
+
+	/// Alternative to `flyweight_refcounted::get` that takes the key's hash, as returned by `flyweight_refcounted::hash_key`, instead of hashing the key again.
+	/// The hash must have been computed for a key equal to `key`, otherwise the loaded value may not be found.
+	/// @see get
+	T& get_hashed(const Key& key, size_t hash) {
+		return get_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight_refcounted::get_hashed` that looks up the value without constructing a `Key`.
+	/// @see get_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T& get_hashed(const K& key, size_t hash) {
+		return acquire(key, hash).second.value;
+	}
+
+	/// Alternative to `flyweight_refcounted::get` for `std::tuple` keys that takes the tuple elements as separate arguments, for memoizing functions of several arguments.
+	/// Arguments are hashed and compared against loaded keys directly, and the `Key` tuple is only constructed from them if the value is not loaded yet.
+	/// Only available if `Map` supports heterogeneous lookup with tuples, like the default `flat_map` with `flyweight::hash` and `flyweight::equal_to`.
+	/// @see get
+	template<typename... Args, typename = detail::enable_if_arguments<Args...>, typename = detail::enable_if_lookup_key<Map, Key, detail::argument_key<Args...>>>
+	T& get(const Args&... args) {
+		return get(detail::argument_key<Args...>(args...));
+	}
+
+	/// Gets the values associated to every key in [`first`, `last`), incrementing their reference counts and writing pointers to them to `out`.
+	/// Same as calling `flyweight_refcounted::get` for each key, but keys are hashed before locking the mutex,
+	/// the mutex is locked once per batch of keys and the map slots of a whole batch are prefetched before probing them.
+	/// If the creator functor throws, the references taken for the current batch are released,
+	/// so only values that were written to `out` stay referenced.
+	/// With maps whose values move when inserting, like `flat_map_inline`, pointers are written after every value is loaded.
+	/// @return Output iterator past the last written pointer.
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out) {
+		return get_many(first, last, out, detail::has_stable_references<Map>());
+	}
+
+	/// Creates the values of every key in [`first`, `last`) that are not loaded yet, calling the creator functor on up to `parallelism` threads.
+	/// Preloaded values have a reference count of zero, so they stay loaded until a `flyweight_refcounted::get` is released, or until `flyweight_refcounted::clear`.
+	/// @return Number of inserted values.
+	/// @see flyweight::preload
+	template<typename ForwardIt>
+	size_t preload(ForwardIt first, ForwardIt last, size_t parallelism = std::thread::hardware_concurrency()) {
+		std::vector<Key> keys;
+		{
+			SharedLock lock { mutex };
+			detail::missing_keys(map, first, last, keys);
+		}
+		std::exception_ptr exception;
+		auto created = detail::parallel_create<T>(creator(), keys, parallelism, exception);
+		size_t inserted = 0;
+		{
+			Lock lock { mutex };
+			for (auto& values : created) {
+				for (auto& value : values) {
+					const Key& key = keys[value.first];
+					if (map.find(key) == map.end()) {
+						map.emplace(key, std::move(value.second));
+						inserted++;
+					}
+					else {
+						deleter()(value.second);
+					}
+				}
+			}
+		}
+		if (exception) {
+			std::rethrow_exception(exception);
+		}
+		return inserted;
+	}
+
+	/// Alternative to `flyweight_refcounted::get` that returns a `handle`.
+	/// The handle holds a reference to the value, which is released when the last copy of the handle is destroyed.
+	/// @see get
+	handle get_handle(const Key& key) {
+		return get_handle<Key>(key);
+	}
+
+	/// Alternative to `flyweight_refcounted::get_handle` that looks up the value without constructing a `Key`.
+	/// @see get_handle
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	handle get_handle(const K& key) {
+		return make_handle(acquire(key, hash_key(key)));
+	}
+
+	/// Alternative to `flyweight_refcounted::get` that returns an `autorelease_value`.
+	/// This enables the RAII idiom for automatically releasing values.
+	/// @see get
+	autorelease_value_type get_autorelease(const Key& key) {
+		return {
+			*this,
+			key,
+		};
+	}
+
+	/// Gets the existing value associated to the passed key.
+	/// If the value was not created yet, returns `nullptr`.
+	/// @param key Key that represents a value.
+	/// @return Pointer to the existing value, or `nullptr` if the value is not loaded.
+	T *peek(const Key& key) {
+		return peek<Key>(key);
+	}
+
+	/// Alternative to `flyweight_refcounted::peek` that looks up the value without constructing a `Key`.
+	/// @see peek
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T *peek(const K& key) {
+		return peek_hashed(key, hash_key(key));
+	}
+
+	/// Alternative to `flyweight_refcounted::peek` that takes the key's hash, as returned by `flyweight_refcounted::hash_key`.
+	/// @see get_hashed
+	T *peek_hashed(const Key& key, size_t hash) {
+		return peek_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight_refcounted::peek_hashed` that looks up the value without constructing a `Key`.
+	/// @see peek_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T *peek_hashed(const K& key, size_t hash) {
+		SharedLock lock { mutex };
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		if (it == map.end()) {
+			return nullptr;
+		}
+		else {
+			return &it->second.value;
+		}
+	}
+
+	/// Check whether the value mapped to the passed key is loaded.
+	bool is_loaded(const Key& key) {
+		return is_loaded<Key>(key);
+	}
+
+	/// Alternative to `flyweight_refcounted::is_loaded` that looks up the value without constructing a `Key`.
+	/// @see is_loaded
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool is_loaded(const K& key) {
+		return is_loaded_hashed(key, hash_key(key));
+	}
+
+	/// Alternative to `flyweight_refcounted::is_loaded` that takes the key's hash, as returned by `flyweight_refcounted::hash_key`.
+	/// @see get_hashed
+	bool is_loaded_hashed(const Key& key, size_t hash) {
+		return is_loaded_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight_refcounted::is_loaded_hashed` that looks up the value without constructing a `Key`.
+	/// @see is_loaded_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool is_loaded_hashed(const K& key, size_t hash) {
+		SharedLock lock { mutex };
+		return detail::hashed_lookup<Map>::find(map, key, hash) != map.end();
+	}
+
+	/// Get the current reference count for the value mapped to the passed key.
+	size_t reference_count(const Key& key) {
+		return reference_count<Key>(key);
+	}
+
+	/// Alternative to `flyweight_refcounted::reference_count` that looks up the value without constructing a `Key`.
+	/// @see reference_count
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	size_t reference_count(const K& key) {
+		SharedLock lock { mutex };
+		auto it = map.find(key);
+		if (it != map.end()) {
+			return it->second.refcount;
+		}
+		else {
+			return 0;
+		}
+	}
+
+	/// Decrements the reference count for the value mapped to the passed key.
+	/// The value is only actually released when the reference count reaches zero.
+	/// Trying to release a value that is not loaded is a no-op.
+	/// @return `true` if a loaded value was released, `false` otherwise.
+	bool release(const Key& key) {
+		return release<Key>(key);
+	}
+
+	/// Alternative to `flyweight_refcounted::release` that looks up the value without constructing a `Key`.
+	/// @see release
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool release(const K& key) {
+		return release_hashed(key, hash_key(key));
+	}
+
+	/// Alternative to `flyweight_refcounted::release` that takes the key's hash, as returned by `flyweight_refcounted::hash_key`.
+	/// @see get_hashed
+	bool release_hashed(const Key& key, size_t hash) {
+		return release_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight_refcounted::release_hashed` that looks up the value without constructing a `Key`.
+	/// @see release_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool release_hashed(const K& key, size_t hash) {
+		stats_lock<Lock> lock { mutex, statistics() };
+		return release_one(key, hash);
+	}
+
+	/// Decrements the reference counts of the values mapped to every key in [`first`, `last`).
+	/// Same as calling `flyweight_refcounted::release` for each key, but the mutex is locked once per batch of keys.
+	/// @return Number of values whose reference count reached zero and were released.
+	/// @see get_many
+	template<typename ForwardIt>
+	size_t release_many(ForwardIt first, ForwardIt last) {
+		size_t hashes[detail::batch_size];
+		size_t released = 0;
+		while (first != last) {
+			ForwardIt batch = first;
+			size_t count = detail::hash_batch<Key>(map, first, last, hashes);
+			stats_lock<Lock> lock { mutex, statistics() };
+			detail::prefetch_batch(map, hashes, count);
+			for (size_t i = 0; i < count; ++batch, i++) {
+				released += release_one(*batch, hashes[i]);
+			}
+		}
+		return released;
+	}
+
+	/// Copies the loaded values to a `frozen_flyweight`, whose lookups use a minimal perfect hash without locking any mutex.
+	/// The frozen flyweight hashes and compares keys with `Map`'s functors, when it has them.
+	/// Reference counts are not copied, and later changes to this flyweight are not reflected in the frozen one.
+	frozen_flyweight<Key, T, typename detail::map_hashing<Map, Key>::hasher, typename detail::map_hashing<Map, Key>::key_equal> freeze() {
+		SharedLock lock { mutex };
+		return { map.begin(), map.end() };
+	}
+
+	/// Release all values, calling the deleter functor on them.
+	void clear() {
+		Lock lock { mutex };
+		for (auto& it : map) {
+			delete_value(it.second.value);
+		}
+		map.clear();
+	}
+
+	/// Snapshot of the statistics recorded by the `Stats` policy, with the number of loaded values.
+	/// @see flyweight::stats
+	stats_snapshot stats() {
+		stats_snapshot snapshot = statistics().snapshot();
+		SharedLock lock { mutex };
+		snapshot.size = map.size();
+		return snapshot;
+	}
+
+protected:
+	/// Gets the map entry associated to the passed key and its hash, creating it if necessary, and increments its reference count.
+	template<typename K>
+	entry_type& acquire(const K& key, size_t hash) {
+		if (has_shared_lock) {
+			stats_lock<SharedLock> lock { mutex, statistics() };
+			auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+			if (it != map.end()) {
+				statistics().hit();
+				it->second.reference();
+				return *it;
+			}
+		}
+		stats_lock<Lock> lock { mutex, statistics() };
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		if (it == map.end()) {
+			auto&& new_key = detail::make_key<Key>(key);
+			it = create_entry(new_key);
+		}
+		else {
+			statistics().hit();
+		}
+		it->second.reference();
+		return *it;
+	}
+
+	/// Creates a handle to an entry whose reference count was already incremented.
+	handle make_handle(entry_type& entry) {
+		static_assert(detail::has_stable_references<Map>::value, "Handles point to map entries, so Map must have stable references, like flat_map does and flat_map_inline doesn't");
+		return { this, &entry };
+	}
+
+	/// Increments the reference count of an entry that is already referenced by a `handle`.
+	/// Atomic reference counts are incremented without locking the mutex, since the entry cannot be removed concurrently.
+	void reference_entry(entry_type& entry) {
+		if (detail::is_atomic<decltype(entry.second.refcount)>::value) {
+			entry.second.reference();
+		}
+		else {
+			Lock lock { mutex };
+			entry.second.reference();
+		}
+	}
+
+	/// Decrements the reference count of an entry referenced by a `handle`, removing it if the count reaches zero.
+	bool release_entry(entry_type& entry) {
+		stats_lock<Lock> lock { mutex, statistics() };
+		if (entry.second.dereference()) {
+			delete_value(entry.second.value);
+			map.erase(map.find(entry.first));
+			return true;
+		}
+		else {
+			return false;
+		}
+	}
+
+	/// Creator functor passed when constructing the flyweight, if any.
+	Creator& creator() {
+		return creator_storage::get();
+	}
+	/// Deleter functor passed when constructing the flyweight, if any.
+	Deleter& deleter() {
+		return deleter_storage::get();
+	}
+	/// Statistics policy.
+	Stats& statistics() {
+		return stats_storage::get();
+	}
+
+	/// Lock of type `L` that reports the time spent waiting for the mutex to the statistics policy.
+	template<typename L>
+	using stats_lock = detail::stats_lock<L, Stats>;
+
+	/// Creates the value mapped to `key`, which must not be loaded, recording a miss with the time spent creating it.
+	typename Map::iterator create_entry(const Key& key) {
+		detail::stats_timer<Stats> timer;
+		auto it = detail::emplace_created<T>(map, key, creator());
+		statistics().miss(timer.elapsed());
+		return it;
+	}
+
+	/// Calls the deleter functor on `value`, recording the time spent in it.
+	void delete_value(T& value) {
+		detail::stats_timer<Stats> timer;
+		deleter()(value);
+		statistics().deletion(timer.elapsed());
+	}
+
+	/// Value map.
+	/// Maps the tuple of arguments to an already loaded value of type `T`.
+	Map map;
+	Mutex mutex;
+
+	/// Whether lookups lock the mutex in shared mode before trying to lock it exclusively.
+	static constexpr bool has_shared_lock = !std::is_same<Lock, SharedLock>::value;
+
+private:
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out, std::true_type) {
+		size_t hashes[detail::batch_size];
+		T *values[detail::batch_size];
+		while (first != last) {
+			ForwardIt batch = first;
+			size_t count = detail::hash_batch<Key>(map, first, last, hashes);
+			std::fill(values, values + count, nullptr);
+			size_t missing = count;
+			if (has_shared_lock) {
+				stats_lock<SharedLock> lock { mutex, statistics() };
+				missing = find_batch(batch, count, hashes, values, false);
+			}
+			if (missing) {
+				stats_lock<Lock> lock { mutex, statistics() };
+				try {
+					find_batch(batch, count, hashes, values, true);
+				}
+				catch (...) {
+					ForwardIt it = batch;
+					for (size_t i = 0; i < count; ++it, i++) {
+						if (values[i]) {
+							release_one(*it, hashes[i]);
+						}
+					}
+					throw;
+				}
+			}
+			out = std::copy(values, values + count, out);
+		}
+		return out;
+	}
+
+	/// Creating values may move the values loaded before in maps without stable references,
+	/// so pointers are only taken once the values of every key are loaded and referenced.
+	/// If the creator functor throws, pointers to the values referenced before the failing batch are still written.
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out, std::false_type) {
+		size_t loaded = 0;
+		try {
+			get_many(first, last, detail::counting_iterator(loaded), std::true_type());
+		}
+		catch (...) {
+			write_loaded(first, loaded, out);
+			throw;
+		}
+		return write_loaded(first, loaded, out);
+	}
+
+	/// Writes pointers to the loaded values of the first `count` keys from `first` to `out`, without referencing them again.
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt write_loaded(ForwardIt first, size_t count, OutputIt out) {
+		SharedLock lock { mutex };
+		for (; count > 0; ++first, count--) {
+			*out = &map.find(static_cast<const Key&>(*first))->second.value;
+			++out;
+		}
+		return out;
+	}
+
+	/// Looks up the keys of a batch whose values weren't found yet, prefetching their slots first,
+	/// and increments the reference counts of found values.
+	/// Missing values are created if `create` is `true`.
+	/// @return Number of values that are still missing.
+	template<typename ForwardIt>
+	size_t find_batch(ForwardIt it, size_t count, const size_t *hashes, T **values, bool create) {
+		for (size_t i = 0; i < count; i++) {
+			if (!values[i]) {
+				detail::hashed_lookup<Map>::prefetch(map, hashes[i]);
+			}
+		}
+		size_t missing = 0;
+		for (size_t i = 0; i < count; ++it, i++) {
+			if (!values[i] && !find_one(*it, hashes[i], values[i], create)) {
+				missing++;
+			}
+		}
+		return missing;
+	}
+
+	bool find_one(const Key& key, size_t hash, T *& value, bool create) {
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		if (it == map.end()) {
+			if (!create) {
+				return false;
+			}
+			it = create_entry(key);
+		}
+		else {
+			statistics().hit();
+		}
+		value = &it->second.reference().value;
+		return true;
+	}
+
+	template<typename K>
+	bool release_one(const K& key, size_t hash) {
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		if (it != map.end() && it->second.dereference()) {
+			delete_value(it->second.value);
+			map.erase(it);
+			return true;
+		}
+		return false;
+	}
+};
+
+#ifdef FLYWEIGHT_HAS_CXX17
+/// Deduces `Key` and `T` from the parameter and return types of a non-generic creator functor, storing it without type erasure.
+template<typename Creator>
+flyweight_refcounted(Creator) -> flyweight_refcounted<
+	typename detail::callable_traits<Creator>::argument_type,
+	typename detail::callable_traits<Creator>::result_type,
+	flat_map<typename detail::callable_traits<Creator>::argument_type, detail::refcounted_value<typename detail::callable_traits<Creator>::result_type>>,
+	detail::dummy_mutex, detail::dummy_lock, detail::dummy_lock,
+	Creator, default_deleter<typename detail::callable_traits<Creator>::result_type>
+>;
+template<typename Creator, typename Deleter>
+flyweight_refcounted(Creator, Deleter) -> flyweight_refcounted<
+	typename detail::callable_traits<Creator>::argument_type,
+	typename detail::callable_traits<Creator>::result_type,
+	flat_map<typename detail::callable_traits<Creator>::argument_type, detail::refcounted_value<typename detail::callable_traits<Creator>::result_type>>,
+	detail::dummy_mutex, detail::dummy_lock, detail::dummy_lock,
+	Creator, Deleter
+>;
+#endif
+
+/**
+ * Creates a `flyweight_refcounted` that stores `creator` and `deleter` with their own types, instead of type erasing them with `std::function`.
+ * Before C++17, bind the result to `auto&&` if the flyweight is not movable, for example when `Mutex` is `std::mutex`.
+ * @see make_flyweight
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, detail::refcounted_value<T>>, typename Mutex = detail::dummy_mutex, typename Lock = detail::dummy_lock, typename SharedLock = Lock, typename Creator, typename Deleter = default_deleter<T>>
+flyweight_refcounted<Key, T, Map, Mutex, Lock, SharedLock, typename std::decay<Creator>::type, typename std::decay<Deleter>::type>
+make_flyweight_refcounted(Creator&& creator, Deleter&& deleter = Deleter{}) {
+	return { std::forward<Creator>(creator), std::forward<Deleter>(deleter) };
+}
+
+/**
+ * Alternative to `flyweight_refcounted` that uses `std::mutex` and `std::lock_guard` for thread safety.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, detail::refcounted_value<T>>, typename Stats = no_stats>
+using flyweight_refcounted_threadsafe = flyweight_refcounted<Key, T, Map, std::mutex, std::lock_guard<std::mutex>, std::lock_guard<std::mutex>, std::function<T(const Key&)>, std::function<void(T&)>, Stats>;
+
+#ifdef FLYWEIGHT_HAS_CXX17
+/**
+ * Alternative to `flyweight_refcounted` that uses `std::shared_mutex` for thread safety.
+ * Lookups lock the mutex in shared mode and reference counts are atomic, so that concurrent gets of already loaded values don't block each other.
+ * The mutex is only locked exclusively when creating or releasing values.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, detail::refcounted_value<T, std::atomic<long long>>>, typename Stats = no_stats>
+using flyweight_refcounted_threadsafe_rw = flyweight_refcounted<Key, T, Map, std::shared_mutex, std::unique_lock<std::shared_mutex>, std::shared_lock<std::shared_mutex>, std::function<T(const Key&)>, std::function<void(T&)>, Stats>;
+#endif
+
+template<typename T>
+class weak_handle;
+
+/**
+ * Strong handle to a value of a `flyweight_shared`, the size of a single pointer.
+ *
+ * The value stays alive while any strong handle references it, even after the flyweight was cleared or destroyed.
+ * Copying and destroying handles only touches the value's atomic reference count, never the flyweight.
+ *
+ * @tparam T  Value type.
+ */
+template<typename T>
+class shared_handle {
+public:
+	/// Construct an empty handle.
+	shared_handle() {}
+
+	/// Copy constructor.
+	/// Increments the strong reference count.
+	shared_handle(const shared_handle& other) : node(other.node) {
+		if (node) {
+			node->reference();
+		}
+	}
+
+	/// Move constructor.
+	/// Transfers the reference to this handle, leaving `other` empty.
+	shared_handle(shared_handle&& other) noexcept : node(other.node) {
+		other.node = nullptr;
+	}
+
+	/// Copy and move assignment.
+	/// Releases the previously referenced value.
+	shared_handle& operator=(shared_handle other) noexcept {
+		swap(other);
+		return *this;
+	}
+
+	/// Releases the value, destroying it if this was the last strong handle.
+	~shared_handle() {
+		reset();
+	}
+
+	/// Releases the value, leaving this handle empty.
+	void reset() {
+		if (node) {
+			node->dereference();
+			node = nullptr;
+		}
+	}
+
+	void swap(shared_handle& other) noexcept {
+		std::swap(node, other.node);
+	}
+
+	/// Returns the referenced value.
+	T& operator*() const {
+		return node->value();
+	}
+	/// Returns the referenced value.
+	T *operator->() const {
+		return &node->value();
+	}
+	/// Returns a pointer to the referenced value, or `nullptr` if this handle is empty.
+	T *get() const {
+		return node ? &node->value() : nullptr;
+	}
+
+	/// Number of strong handles referencing the value, which is only a hint if other threads copy or destroy them.
+	size_t use_count() const {
+		return node ? node->strong.load(std::memory_order_relaxed) : 0;
+	}
+
+	/// Whether this handle references a value.
+	explicit operator bool() const {
+		return node != nullptr;
+	}
+
+	friend bool operator==(const shared_handle& a, const shared_handle& b) {
+		return a.node == b.node;
+	}
+	friend bool operator!=(const shared_handle& a, const shared_handle& b) {
+		return a.node != b.node;
+	}
+
+private:
+	template<typename Key, typename U, typename Map, typename Mutex, typename Lock, typename Creator>
+	friend class flyweight_shared;
+	friend class weak_handle<T>;
+
+	/// Adopts a strong reference to `node`.
+	explicit shared_handle(detail::shared_node<T> *node) : node(node) {}
+
+	detail::shared_node<T> *node = nullptr;
+};
+
+/**
+ * Weak handle to a value of a `flyweight_shared`, the size of a single pointer.
+ *
+ * Weak handles don't keep the value alive, but can be locked to get a strong handle to it if it's still alive.
+ * The memory of the value's node is only freed after all weak handles are destroyed.
+ *
+ * @tparam T  Value type.
+ */
+template<typename T>
+class weak_handle {
+public:
+	/// Construct an empty handle.
+	weak_handle() {}
+
+	/// Construct a weak handle to the value referenced by `strong`.
+	weak_handle(const shared_handle<T>& strong) : node(strong.node) {
+		if (node) {
+			node->reference_weak();
+		}
+	}
+
+	weak_handle(const weak_handle& other) : node(other.node) {
+		if (node) {
+			node->reference_weak();
+		}
+	}
+
+	weak_handle(weak_handle&& other) noexcept : node(other.node) {
+		other.node = nullptr;
+	}
+
+	weak_handle& operator=(weak_handle other) noexcept {
+		swap(other);
+		return *this;
+	}
+
+	~weak_handle() {
+		reset();
+	}
+
+	void reset() {
+		if (node) {
+			node->dereference_weak();
+			node = nullptr;
+		}
+	}
+
+	void swap(weak_handle& other) noexcept {
+		std::swap(node, other.node);
+	}
+
+	/// Gets a strong handle to the value, or an empty handle if it was already destroyed.
+	shared_handle<T> lock() const {
+		return shared_handle<T>(node && node->try_reference() ? node : nullptr);
+	}
+
+	/// Whether the value was destroyed, or this handle is empty.
+	bool expired() const {
+		return !node || !node->alive();
+	}
+
+private:
+	detail::shared_node<T> *node = nullptr;
+};
+
+/**
+ * Flyweight whose values are owned by the handles returned by `flyweight_shared::get`, like `std::shared_ptr` created by `std::make_shared`.
+ *
+ * Each value is allocated together with its strong and weak reference counts, and handles are a single pointer to it.
+ * The map only holds a weak reference to values, so a value is destroyed as soon as its last strong handle is dropped,
+ * without locking the flyweight or looking its key up.
+ * Entries of destroyed values are removed from the map by the next get of their key, by `flyweight_shared::purge`,
+ * or automatically when the map doubles in size since the last purge.
+ *
+ * `flyweight_shared::clear` only detaches values from the map: values referenced by handles stay alive
+ * and their memory is reclaimed when their last handle is dropped, so memory can be reclaimed under pressure
+ * without waiting for every user of the values. Getting a detached value's key again creates a new value.
+ * Destroying the flyweight detaches values the same way, so handles may outlive it.
+ *
+ * Values are cleaned up by their destructor, since the last handle may be dropped after the flyweight was destroyed.
+ *
+ * @tparam Key  Key mapped to values.
+ * @tparam T  Value type.
+ * @tparam Map  Internal type used to map keys to value nodes. Defaults to `flat_map`, using `flyweight::hash` and `flyweight::equal_to`.
+ * @tparam Mutex  Internal type used for a mutex. Defaults to `detail::dummy_mutex`.
+ *                Handles may be copied and dropped concurrently regardless of it, since reference counts are atomic.
+ * @tparam Lock  Internal type used for locking the mutex. Defaults to `detail::dummy_lock`.
+ * @tparam Creator  Creator functor type. Defaults to `std::function<T(const Key&)>`, which type erases any creator functor.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, detail::shared_node<T> *>, typename Mutex = detail::dummy_mutex, typename Lock = detail::dummy_lock, typename Creator = std::function<T(const Key&)>>
+class flyweight_shared
+	: protected detail::functor_storage<Creator, detail::creator_tag>
+{
+	using creator_storage = detail::functor_storage<Creator, detail::creator_tag>;
+	using node_type = detail::shared_node<T>;
+
+public:
+	using key_type = Key;
+	using value_type = T;
+	using creator_type = Creator;
+	using map_type = Map;
+	using handle = shared_handle<T>;
+	using weak_handle_type = weak_handle<T>;
+
+	/// Default constructor.
+	/// Uses `default_creator` as the value creator, or default constructs `Creator` if it can't be constructed from it.
+	flyweight_shared()
+		: creator_storage(detail::make_default_functor<Creator, default_creator<T, Key>>())
+	{
+	}
+
+	/// Constructor with custom value creator functor.
+	/// @param creator  Creator functor that will be called when creating a value for the first time, or after it was destroyed.
+	///                 It will be called with a const reference to the key passed to `flyweight_shared::get`.
+	template<typename C, typename = detail::enable_if_not_self<flyweight_shared, C>>
+	flyweight_shared(C&& creator)
+		: creator_storage(std::forward<C>(creator))
+	{
+	}
+
+	flyweight_shared(const flyweight_shared&) = delete;
+	flyweight_shared& operator=(const flyweight_shared&) = delete;
+
+	/// Detaches all values, which stay alive until their last handle is dropped.
+	~flyweight_shared() {
+		clear();
+	}
+
+	/// Gets a strong handle to the value associated to the passed key.
+	/// If the value is alive, a handle to the existing value is returned.
+	/// Otherwise, the value is created using the creator functor passed on the flyweight's constructor.
+	/// @param key Key that represent a value.
+	///            It will be passed to the creator functor if the value is not alive.
+	/// @return Strong handle to the value mapped to the passed key.
+	handle get(const Key& key) {
+		return get<Key>(key);
+	}
+
+	/// Alternative to `flyweight_shared::get` that looks up the value without constructing a `Key`.
+	/// A `Key` is only constructed from `key` if the value is not mapped.
+	/// @see get
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	handle get(const K& key) {
+		size_t hash = detail::hashed_lookup<Map>::hash(map, key);
+		Lock lock { mutex };
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		if (it != map.end()) {
+			if (it->second->try_reference()) {
+				return handle(it->second);
+			}
+			// the value was destroyed after its last handle was dropped, replace it with a new one
+			node_type *node = node_type::create(creator(), it->first);
+			it->second->dereference_weak();
+			it->second = node;
+			return handle(node);
+		}
+		auto&& new_key = detail::make_key<Key>(key);
+		node_type *node = node_type::create(creator(), new_key);
+		try {
+			map.emplace(new_key, node);
+		}
+		catch (...) {
+			node->dereference();
+			node->dereference_weak();
+			throw;
+		}
+		if (map.size() >= purge_size) {
+			purge_locked();
+		}
+		return handle(node);
+	}
+
+	/// Gets a strong handle to the value associated to the passed key, if it's alive, without creating it.
+	/// @return Handle to the value, or an empty handle if it's not alive.
+	handle peek(const Key& key) {
+		return peek<Key>(key);
+	}
+
+	/// Alternative to `flyweight_shared::peek` that looks up the value without constructing a `Key`.
+	/// @see peek
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	handle peek(const K& key) {
+		size_t hash = detail::hashed_lookup<Map>::hash(map, key);
+		Lock lock { mutex };
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		return handle(it != map.end() && it->second->try_reference() ? it->second : nullptr);
+	}
+
+	/// Check whether the value associated to the passed key is alive and attached to the flyweight.
+	bool is_loaded(const Key& key) {
+		return is_loaded<Key>(key);
+	}
+
+	/// Alternative to `flyweight_shared::is_loaded` that looks up the value without constructing a `Key`.
+	/// @see is_loaded
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool is_loaded(const K& key) {
+		size_t hash = detail::hashed_lookup<Map>::hash(map, key);
+		Lock lock { mutex };
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		return it != map.end() && it->second->alive();
+	}
+
+	/// Removes the entries of values that were destroyed from the map.
+	/// @return Number of removed entries.
+	size_t purge() {
+		Lock lock { mutex };
+		return purge_locked();
+	}
+
+	/// Detaches all values from the flyweight, without waiting for their handles to be dropped.
+	/// Values referenced by handles stay alive, and are destroyed when their last handle is dropped.
+	void clear() {
+		Lock lock { mutex };
+		for (auto& it : map) {
+			it.second->dereference_weak();
+		}
+		map.clear();
+		purge_size = min_purge_size;
+	}
+
+protected:
+	static constexpr size_t min_purge_size = 16;
+
+	/// Removes the entries of destroyed values.
+	/// Must be called with the mutex locked.
+	size_t purge_locked() {
+		std::vector<Key> dead;
+		for (auto& it : map) {
+			if (!it.second->alive()) {
+				dead.push_back(it.first);
+			}
+		}
+		for (const Key& key : dead) {
+			auto it = map.find(key);
+			it->second->dereference_weak();
+			map.erase(it);
+		}
+		// purge again once the map doubles in size, so that purging is amortized over inserts
+		purge_size = std::max(min_purge_size, map.size() * 2);
+		return dead.size();
+	}
+
+	/// Creator functor passed when constructing the flyweight, if any.
+	Creator& creator() {
+		return creator_storage::get();
+	}
+
+	/// Value map.
+	/// Maps keys to nodes of values, alive or destroyed but not purged yet.
+	Map map;
+	size_t purge_size = min_purge_size;
+	Mutex mutex;
+};
+
+template<typename Key, typename T, typename Map, typename Mutex, typename Lock, typename Creator>
+constexpr size_t flyweight_shared<Key, T, Map, Mutex, Lock, Creator>::min_purge_size;
+
+/**
+ * Alternative to `flyweight_shared` that uses `std::mutex` and `std::lock_guard` for thread safety.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, detail::shared_node<T> *>>
+using flyweight_shared_threadsafe = flyweight_shared<Key, T, Map, std::mutex, std::lock_guard<std::mutex>>;
+
+/**
+ * Flyweight that hash-partitions keys across `Shards` independently locked flyweights of type `Flyweight`.
+ *
+ * Each key always maps to the same shard, so values are never duplicated across shards.
+ * Since each shard has its own map and mutex, threads getting values from different shards never contend with each other.
+ * Shards are aligned to cache lines to avoid false sharing between their mutexes.
+ *
+ * @tparam Flyweight  Flyweight type used for each shard, usually `flyweight_threadsafe` or `flyweight_refcounted_threadsafe`.
+ * @tparam Shards  Number of shards. Must be a power of two, so that selecting a shard is a simple bit mask.
+ * @tparam Hash  Hash functor used for selecting shards. Defaults to `flyweight::hash<Key>`.
+ */
+template<typename Flyweight, size_t Shards = 16, typename Hash = hash<typename Flyweight::key_type>>
+class sharded {
+	static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0, "Shard count must be a power of two");
+
+	/// Enabled if keys of type `K` can be hashed without constructing a `Key`.
+	template<typename K>
+	using enable_if_lookup_key = typename std::enable_if<
+		!std::is_same<K, typename Flyweight::key_type>::value && detail::is_transparent<Hash>::value
+		&& std::is_same<decltype(std::declval<const Hash&>()(std::declval<const K&>())), size_t>::value
+	>::type;
+
+public:
+	using key_type = typename Flyweight::key_type;
+	using value_type = typename Flyweight::value_type;
+	using flyweight_type = Flyweight;
+	using autorelease_value_type = autorelease_value<key_type, value_type, sharded>;
+
+	/// Number of shards.
+	static constexpr size_t shard_count = Shards;
+
+	/// Default constructor.
+	/// Every shard is default constructed.
+	sharded() {
+		construct_shards([](void *storage) { new (storage) Flyweight(); });
+	}
+
+	/// Constructor with custom value creator functor.
+	/// Every shard receives a copy of `creator`.
+	/// @see flyweight::flyweight(Creator&&)
+	template<typename Creator>
+	sharded(const Creator& creator) {
+		construct_shards([&creator](void *storage) { new (storage) Flyweight(creator); });
+	}
+
+	/// Constructor with custom value creator functor and deleter functor.
+	/// Every shard receives a copy of `creator` and `deleter`.
+	/// @see flyweight::flyweight(Creator&&, Deleter&&)
+	template<typename Creator, typename Deleter>
+	sharded(const Creator& creator, const Deleter& deleter) {
+		construct_shards([&creator, &deleter](void *storage) { new (storage) Flyweight(creator, deleter); });
+	}
+
+	sharded(const sharded&) = delete;
+	sharded& operator=(const sharded&) = delete;
+
+	/// Destroys all shards, which calls the deleter functor on all remaining values.
+	~sharded() {
+		destroy_shards(Shards);
+	}
+
+	/// Gets the value associated to the passed key from its shard.
+	/// @see flyweight::get
+	value_type& get(const key_type& key) {
+		return get_hashed(key, hasher(key));
+	}
+
+	/// Alternative to `sharded::get` that passes `key` to the shard without constructing a `Key`.
+	/// Only available if `Hash` is transparent.
+	/// @see get
+	template<typename K, typename = enable_if_lookup_key<K>>
+	value_type& get(const K& key) {
+		return get_hashed(key, hasher(key));
+	}
+
+	/// Hash of `key`, to be passed to the hashed alternatives like `sharded::get_hashed` instead of hashing the key again.
+	/// This is the hash computed by `Hash`, which selects the shard.
+	/// If shards map keys with `Hash` too, like they do by default, the hash is also passed along to the shard, so keys are hashed only once.
+	template<typename K>
+	size_t hash_key(const K& key) const {
+		return hasher(key);
+	}
+
+	/// Alternative to `sharded::get` that takes the key's hash, as returned by `sharded::hash_key`, instead of hashing the key again.
+	/// @see flyweight::get_hashed
+	value_type& get_hashed(const key_type& key, size_t hash) {
+		Flyweight& key_shard = shard(shard_index_hashed(hash));
+		return key_shard.get_hashed(key, shard_hash(key_shard, key, hash));
+	}
+
+	/// Alternative to `sharded::get_hashed` that passes `key` to the shard without constructing a `Key`.
+	/// @see get_hashed
+	template<typename K, typename = enable_if_lookup_key<K>>
+	value_type& get_hashed(const K& key, size_t hash) {
+		Flyweight& key_shard = shard(shard_index_hashed(hash));
+		return key_shard.get_hashed(key, shard_hash(key_shard, key, hash));
+	}
+
+	/// Alternative to `sharded::get` that returns an `autorelease_value`.
+	/// This enables the RAII idiom for automatically releasing values.
+	/// @see get
+	autorelease_value_type get_autorelease(const key_type& key) {
+		return {
+			*this,
+			key,
+		};
+	}
+
+	/// Gets the existing value associated to the passed key from its shard.
+	/// @see flyweight::peek
+	value_type *peek(const key_type& key) {
+		return peek_hashed(key, hasher(key));
+	}
+
+	/// Alternative to `sharded::peek` that passes `key` to the shard without constructing a `Key`.
+	/// @see peek
+	template<typename K, typename = enable_if_lookup_key<K>>
+	value_type *peek(const K& key) {
+		return peek_hashed(key, hasher(key));
+	}
+
+	/// Alternative to `sharded::peek` that takes the key's hash, as returned by `sharded::hash_key`.
+	/// @see get_hashed
+	value_type *peek_hashed(const key_type& key, size_t hash) {
+		Flyweight& key_shard = shard(shard_index_hashed(hash));
+		return key_shard.peek_hashed(key, shard_hash(key_shard, key, hash));
+	}
+
+	/// Alternative to `sharded::peek_hashed` that passes `key` to the shard without constructing a `Key`.
+	/// @see peek_hashed
+	template<typename K, typename = enable_if_lookup_key<K>>
+	value_type *peek_hashed(const K& key, size_t hash) {
+		Flyweight& key_shard = shard(shard_index_hashed(hash));
+		return key_shard.peek_hashed(key, shard_hash(key_shard, key, hash));
+	}
+
+	/// Check whether the value mapped to the passed key is loaded.
+	bool is_loaded(const key_type& key) {
+		return is_loaded_hashed(key, hasher(key));
+	}
+
+	/// Alternative to `sharded::is_loaded` that passes `key` to the shard without constructing a `Key`.
+	/// @see is_loaded
+	template<typename K, typename = enable_if_lookup_key<K>>
+	bool is_loaded(const K& key) {
+		return is_loaded_hashed(key, hasher(key));
+	}
+
+	/// Alternative to `sharded::is_loaded` that takes the key's hash, as returned by `sharded::hash_key`.
+	/// @see get_hashed
+	bool is_loaded_hashed(const key_type& key, size_t hash) {
+		Flyweight& key_shard = shard(shard_index_hashed(hash));
+		return key_shard.is_loaded_hashed(key, shard_hash(key_shard, key, hash));
+	}
+
+	/// Alternative to `sharded::is_loaded_hashed` that passes `key` to the shard without constructing a `Key`.
+	/// @see is_loaded_hashed
+	template<typename K, typename = enable_if_lookup_key<K>>
+	bool is_loaded_hashed(const K& key, size_t hash) {
+		Flyweight& key_shard = shard(shard_index_hashed(hash));
+		return key_shard.is_loaded_hashed(key, shard_hash(key_shard, key, hash));
+	}
+
+	/// Get the current reference count for the value mapped to the passed key.
+	/// Only available if `Flyweight` employs reference counting.
+	/// @see flyweight_refcounted::reference_count
+	size_t reference_count(const key_type& key) {
+		return shard_for(key).reference_count(key);
+	}
+
+	/// Alternative to `sharded::reference_count` that passes `key` to the shard without constructing a `Key`.
+	/// @see reference_count
+	template<typename K, typename = enable_if_lookup_key<K>>
+	size_t reference_count(const K& key) {
+		return shard_for(key).reference_count(key);
+	}
+
+	/// Release the value mapped to the passed key back to its shard.
+	/// @see flyweight::release
+	bool release(const key_type& key) {
+		return release_hashed(key, hasher(key));
+	}
+
+	/// Alternative to `sharded::release` that passes `key` to the shard without constructing a `Key`.
+	/// @see release
+	template<typename K, typename = enable_if_lookup_key<K>>
+	bool release(const K& key) {
+		return release_hashed(key, hasher(key));
+	}
+
+	/// Alternative to `sharded::release` that takes the key's hash, as returned by `sharded::hash_key`.
+	/// @see get_hashed
+	bool release_hashed(const key_type& key, size_t hash) {
+		Flyweight& key_shard = shard(shard_index_hashed(hash));
+		return key_shard.release_hashed(key, shard_hash(key_shard, key, hash));
+	}
+
+	/// Alternative to `sharded::release_hashed` that passes `key` to the shard without constructing a `Key`.
+	/// @see release_hashed
+	template<typename K, typename = enable_if_lookup_key<K>>
+	bool release_hashed(const K& key, size_t hash) {
+		Flyweight& key_shard = shard(shard_index_hashed(hash));
+		return key_shard.release_hashed(key, shard_hash(key_shard, key, hash));
+	}
+
+	/// Gets the values associated to every key in [`first`, `last`) from their shards, writing pointers to them to `out`.
+	/// Keys of a batch are grouped by shard and passed to the shard's own `get_many`, so that each shard is locked once per batch.
+	/// If the creator functor throws and shards employ reference counting,
+	/// the references taken from other shards for the current batch are released.
+	/// @return Output iterator past the last written pointer.
+	/// @see flyweight::get_many
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out) {
+		static_assert(detail::has_stable_values<Flyweight>::value, "Shards are gotten from one batch at a time, so their Map must have stable references, like flat_map does and flat_map_inline doesn't");
+		ForwardIt keys[batch_size];
+		size_t offsets[Shards + 1];
+		size_t positions[batch_size];
+		value_type *grouped[batch_size];
+		value_type *values[batch_size];
+		while (first != last) {
+			size_t count = group_batch(first, last, keys, offsets, positions);
+			size_t index = 0;
+			try {
+				for (; index < Shards; index++) {
+					if (offsets[index] != offsets[index + 1]) {
+						shard(index).get_many(indirect(keys, offsets[index]), indirect(keys, offsets[index + 1]), grouped + offsets[index]);
+					}
+				}
+			}
+			catch (...) {
+				if (detail::has_reference_count<Flyweight>::value) {
+					for (size_t i = 0; i < index; i++) {
+						shard(i).release_many(indirect(keys, offsets[i]), indirect(keys, offsets[i + 1]));
+					}
+				}
+				throw;
+			}
+			for (size_t i = 0; i < count; i++) {
+				values[positions[i]] = grouped[i];
+			}
+			out = std::copy(values, values + count, out);
+		}
+		return out;
+	}
+
+	/// Releases the values mapped to every key in [`first`, `last`) back to their shards.
+	/// Keys of a batch are grouped by shard, so that each shard is locked once per batch.
+	/// @return Number of released values.
+	/// @see flyweight::release_many
+	template<typename ForwardIt>
+	size_t release_many(ForwardIt first, ForwardIt last) {
+		ForwardIt keys[batch_size];
+		size_t offsets[Shards + 1];
+		size_t positions[batch_size];
+		size_t released = 0;
+		while (first != last) {
+			group_batch(first, last, keys, offsets, positions);
+			for (size_t index = 0; index < Shards; index++) {
+				if (offsets[index] != offsets[index + 1]) {
+					released += shard(index).release_many(indirect(keys, offsets[index]), indirect(keys, offsets[index + 1]));
+				}
+			}
+		}
+		return released;
+	}
+
+	/// Release all values from all shards, calling the deleter functor on them.
+	/// Shards are cleared one at a time, so this is not atomic in regards to other threads.
+	void clear() {
+		for (size_t i = 0; i < Shards; i++) {
+			shard(i).clear();
+		}
+	}
+
+	/// Sum of the statistics of all shards.
+	/// Shards are read one at a time, so this is not atomic in regards to other threads.
+	stats_snapshot stats() {
+		stats_snapshot snapshot;
+		for (size_t i = 0; i < Shards; i++) {
+			snapshot += shard(i).stats();
+		}
+		return snapshot;
+	}
+
+	/// Get the shard at index `index`.
+	Flyweight& shard(size_t index) {
+		return *reinterpret_cast<Flyweight *>(&shards[index].storage);
+	}
+
+	/// Get the shard that contains the value mapped to the passed key.
+	template<typename K>
+	Flyweight& shard_for(const K& key) {
+		return shard(shard_index(key));
+	}
+
+	/// Get the index of the shard that contains the value mapped to the passed key.
+	template<typename K>
+	size_t shard_index(const K& key) const {
+		return shard_index_hashed(hasher(key));
+	}
+
+	/// Get the index of the shard that contains the value mapped to a key with hash `hash`, as returned by `sharded::hash_key`.
+	size_t shard_index_hashed(size_t hash) const {
+		// Mix the hash before masking it, so that all keys in a shard don't share
+		// the same lower bits, which would cluster them in the shard's own map.
+		// Upper bits are used, since `flat_map` probes with the lower bits of the same mixed hash.
+		return static_cast<size_t>(detail::mix_hash(hash) >> 32) & (Shards - 1);
+	}
+
+protected:
+	/// Number of keys grouped by shard by batched operations.
+	static constexpr size_t batch_size = 4 * detail::batch_size;
+
+	/// Takes up to `batch_size` keys from `first` and sorts them by shard into `keys`, advancing `first` past them.
+	/// The keys of shard `i` end up in [`offsets[i]`, `offsets[i + 1]`), and `positions` maps each sorted key to its position in the batch.
+	/// @return Number of keys in the batch.
+	template<typename ForwardIt>
+	size_t group_batch(ForwardIt& first, ForwardIt last, ForwardIt *keys, size_t *offsets, size_t *positions) const {
+		ForwardIt batch[batch_size];
+		size_t indices[batch_size];
+		size_t count = 0;
+		std::fill(offsets, offsets + Shards + 1, 0);
+		for (; count < batch_size && first != last; ++first, count++) {
+			batch[count] = first;
+			indices[count] = shard_index(static_cast<const key_type&>(*first));
+			offsets[indices[count] + 1]++;
+		}
+		for (size_t i = 0; i < Shards; i++) {
+			offsets[i + 1] += offsets[i];
+		}
+		size_t next[Shards];
+		std::copy(offsets, offsets + Shards, next);
+		for (size_t i = 0; i < count; i++) {
+			size_t sorted = next[indices[i]]++;
+			keys[sorted] = batch[i];
+			positions[sorted] = i;
+		}
+		return count;
+	}
+
+	/// Hash of `key` to pass to `key_shard`, which is `hash` itself if the shard maps keys with `Hash` too.
+	template<typename K>
+	static size_t shard_hash(Flyweight& key_shard, const K& key, size_t hash) {
+		return detail::hashes_with<Flyweight, Hash>::value ? hash : key_shard.hash_key(key);
+	}
+
+	template<typename ForwardIt>
+	static detail::indirect_iterator<ForwardIt> indirect(const ForwardIt *keys, size_t offset) {
+		return detail::indirect_iterator<ForwardIt> { keys + offset };
+	}
+
+	/// Storage for a single shard, aligned to a cache line.
+	struct alignas(FLYWEIGHT_CACHE_LINE_SIZE) shard_storage {
+		alignas(Flyweight) unsigned char storage[sizeof(Flyweight)];
+	};
+
+	template<typename Constructor>
+	void construct_shards(Constructor constructor) {
+		size_t i = 0;
+		try {
+			for (; i < Shards; i++) {
+				constructor(&shards[i].storage);
+			}
+		}
+		catch (...) {
+			destroy_shards(i);
+			throw;
+		}
+	}
+
+	void destroy_shards(size_t count) {
+		for (size_t i = 0; i < count; i++) {
+			shard(i).~Flyweight();
+		}
+	}
+
+	/// Shards, constructed in place.
+	shard_storage shards[Shards];
+	/// Hash functor used for selecting shards.
+	Hash hasher;
+};
+
+template<typename Flyweight, size_t Shards, typename Hash>
+constexpr size_t sharded<Flyweight, Shards, Hash>::shard_count;
+template<typename Flyweight, size_t Shards, typename Hash>
+constexpr size_t sharded<Flyweight, Shards, Hash>::batch_size;
+
+namespace detail {
+	/// Values of sharded flyweights are stored by their shards.
+	template<typename F, size_t Shards, typename Hash>
+	struct has_stable_values<sharded<F, Shards, Hash>> : has_stable_values<F> {};
+}
+
+/**
+ * Alternative to `flyweight_threadsafe` that hash-partitions keys across `Shards` independently locked shards.
+ */
+template<typename Key, typename T, size_t Shards = 16, typename Map = flat_map<Key, T>>
+using flyweight_sharded = sharded<flyweight_threadsafe<Key, T, Map>, Shards>;
+
+/**
+ * Alternative to `flyweight_refcounted_threadsafe` that hash-partitions keys across `Shards` independently locked shards.
+ */
+template<typename Key, typename T, size_t Shards = 16, typename Map = flat_map<Key, detail::refcounted_value<T>>>
+using flyweight_refcounted_sharded = sharded<flyweight_refcounted_threadsafe<Key, T, Map>, Shards>;
+
+/**
+ * Alternative to `flyweight_threadsafe` that calls the creator functor without holding the lock.
+ *
+ * When a value is not loaded, the first thread that gets it marks the key as being loaded, unlocks the mutex and creates the value.
+ * Threads getting other keys are not blocked while the value is being created.
+ * Threads getting the same key wait for the value being created instead of creating it again.
+ * If the creator throws, the exception is rethrown by all waiting gets and the key is left unloaded.
+ *
+ * The creator functor may be called concurrently for different keys, so it must be thread-safe.
+ *
+ * @tparam Key  Key mapped to loaded values.
+ * @tparam T  Value type.
+ * @tparam Map  Internal type used to map keys to values. Defaults to `flat_map`, using `flyweight::hash` and `flyweight::equal_to`.
+ * @tparam Mutex  Internal type used for a mutex. Defaults to `std::mutex`.
+ * @tparam SharedLock  Internal type used for locking the mutex in shared mode. Defaults to `std::unique_lock<Mutex>`.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, T>, typename Mutex = std::mutex, typename SharedLock = std::unique_lock<Mutex>>
+class flyweight_singleflight : public flyweight<Key, T, Map, Mutex, std::unique_lock<Mutex>, SharedLock> {
+	using base = flyweight<Key, T, Map, Mutex, std::unique_lock<Mutex>, SharedLock>;
+
+public:
+	using autorelease_value_type = autorelease_value<Key, T, flyweight_singleflight>;
+
+	using base::base;
+
+	/// Gets the value associated to the passed key.
+	/// If the value is already loaded, a reference to the existing value is returned.
+	/// If the value is being created by another thread, waits for it to finish.
+	/// Otherwise, the value is created using the creator functor without holding the lock.
+	/// @param key Key that represent a value.
+	///            It will be passed to the creator functor if the value is not loaded yet.
+	/// @return Reference to the value mapped to the passed key.
+	T& get(const Key& key) {
+		return get_hashed(key, this->hash_key(key));
+	}
+
+	/// Alternative to `flyweight_singleflight::get` that takes the key's hash, as returned by `hash_key`, instead of hashing the key again.
+	/// @see get
+	T& get_hashed(const Key& key, size_t hash) {
+		if (base::has_shared_lock) {
+			SharedLock lock { this->mutex };
+			auto it = detail::hashed_lookup<Map>::find(this->map, key, hash);
+			if (it != this->map.end()) {
+				return it->second;
+			}
+		}
+		std::unique_lock<Mutex> lock { this->mutex };
+		auto it = detail::hashed_lookup<Map>::find(this->map, key, hash);
+		if (it != this->map.end()) {
+			return it->second;
+		}
+		auto pending_it = pending.find(key);
+		if (pending_it != pending.end()) {
+			std::shared_future<T&> future = pending_it->second;
+			lock.unlock();
+			return future.get();
+		}
+
+		std::promise<T&> promise;
+		pending.emplace(key, promise.get_future().share());
+		lock.unlock();
+		return create(key, promise);
+	}
+
+	/// Alternative to `flyweight_singleflight::get` that returns a future instead of blocking while the value is created.
+	/// If the value is already loaded, the returned future is ready, without involving the executor.
+	/// If the value is being created by another thread, the future shared by all threads waiting for it is returned.
+	/// Otherwise, a task that creates the value is passed to `executor` and the returned future is ready when it completes.
+	/// If the creator throws, the exception is stored in the future and the key is left unloaded.
+	/// @param key  Key that represent a value.
+	/// @param executor  Functor that is passed a copyable task taking no arguments, and runs it, for example by enqueuing it to a thread pool.
+	///                  It's called without holding the lock, so it may also run the task right away.
+	///                  Tasks access the flyweight, so it must outlive them.
+	/// @return Future reference to the value mapped to the passed key.
+	template<typename Executor>
+	std::shared_future<T&> get_async(const Key& key, Executor&& executor) {
+		if (base::has_shared_lock) {
+			SharedLock lock { this->mutex };
+			auto it = this->map.find(key);
+			if (it != this->map.end()) {
+				return detail::make_ready_future<T&>(it->second);
+			}
+		}
+		std::unique_lock<Mutex> lock { this->mutex };
+		auto it = this->map.find(key);
+		if (it != this->map.end()) {
+			return detail::make_ready_future<T&>(it->second);
+		}
+		auto pending_it = pending.find(key);
+		if (pending_it != pending.end()) {
+			return pending_it->second;
+		}
+
+		auto promise = std::make_shared<std::promise<T&>>();
+		std::shared_future<T&> future = promise->get_future().share();
+		pending.emplace(key, future);
+		lock.unlock();
+		try {
+			executor([this, key, promise]() {
+				try {
+					create(key, *promise);
+				}
+				catch (...) {
+					// Already stored in the future
+				}
+			});
+		}
+		catch (...) {
+			abandon(key, *promise);
+			throw;
+		}
+		return future;
+	}
+
+	/// Alternative to `flyweight_singleflight::get` that returns an `autorelease_value`.
+	/// This enables the RAII idiom for automatically releasing values.
+	/// @see get
+	autorelease_value_type get_autorelease(const Key& key) {
+		return {
+			*this,
+			key,
+		};
+	}
+
+	/// Gets the values associated to every key in [`first`, `last`), writing pointers to them to `out`.
+	/// Keys are gotten one at a time with `flyweight_singleflight::get`, so that values are still created without holding the lock.
+	/// @return Output iterator past the last written pointer.
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out) {
+		static_assert(detail::has_stable_references<Map>::value, "Values are gotten one at a time, so Map must have stable references, like flat_map does and flat_map_inline doesn't");
+		for (; first != last; ++first) {
+			*out = &get(*first);
+			++out;
+		}
+		return out;
+	}
+
+protected:
+	/// Creates the value of a pending key without holding the lock, and publishes it to the threads waiting for it.
+	T& create(const Key& key, std::promise<T&>& promise) {
+		try {
+			T value = this->creator()(key);
+			std::unique_lock<Mutex> lock { this->mutex };
+			T& result = this->map.emplace(key, std::move(value)).first->second;
+			pending.erase(key);
+			lock.unlock();
+			promise.set_value(result);
+			return result;
+		}
+		catch (...) {
+			abandon(key, promise);
+			throw;
+		}
+	}
+
+	/// Stops waiting for the value of a pending key, passing the current exception to the threads waiting for it.
+	void abandon(const Key& key, std::promise<T&>& promise) {
+		std::unique_lock<Mutex> lock { this->mutex };
+		pending.erase(key);
+		lock.unlock();
+		promise.set_exception(std::current_exception());
+	}
+
+	/// Values being created.
+	/// Maps keys to the future value, shared by all threads waiting for it.
+	std::unordered_map<Key, std::shared_future<T&>, hash<Key>, equal_to<Key>> pending;
+};
+
+/**
+ * Alternative to `flyweight_refcounted_threadsafe` that calls the creator functor without holding the lock.
+ *
+ * Threads waiting for a value being created by another thread also get a reference to it.
+ * @see flyweight_singleflight
+ *
+ * @tparam Key  Key mapped to loaded values.
+ * @tparam T  Value type.
+ * @tparam Map  Internal type used to map keys to values. Defaults to `flat_map`, using `flyweight::hash` and `flyweight::equal_to`.
+ * @tparam Mutex  Internal type used for a mutex. Defaults to `std::mutex`.
+ * @tparam SharedLock  Internal type used for locking the mutex in shared mode. Defaults to `std::unique_lock<Mutex>`.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, detail::refcounted_value<T>>, typename Mutex = std::mutex, typename SharedLock = std::unique_lock<Mutex>>
+class flyweight_refcounted_singleflight : public flyweight_refcounted<Key, T, Map, Mutex, std::unique_lock<Mutex>, SharedLock> {
+	using base = flyweight_refcounted<Key, T, Map, Mutex, std::unique_lock<Mutex>, SharedLock>;
+
+public:
+	using autorelease_value_type = autorelease_value<Key, T, flyweight_refcounted_singleflight>;
+	using typename base::handle;
+
+	using base::base;
+
+	/// Gets the value associated to the passed key, incrementing its reference count.
+	/// If the value is already loaded, a reference to the existing value is returned.
+	/// If the value is being created by another thread, waits for it to finish.
+	/// Otherwise, the value is created using the creator functor without holding the lock.
+	/// @param key Key that represent a value.
+	///            It will be passed to the creator functor if the value is not loaded yet.
+	/// @return Reference to the value mapped to the passed key.
+	T& get(const Key& key) {
+		return get_hashed(key, this->hash_key(key));
+	}
+
+	/// Alternative to `flyweight_refcounted_singleflight::get` that takes the key's hash, as returned by `hash_key`, instead of hashing the key again.
+	/// @see get
+	T& get_hashed(const Key& key, size_t hash) {
+		if (base::has_shared_lock) {
+			SharedLock lock { this->mutex };
+			auto it = detail::hashed_lookup<Map>::find(this->map, key, hash);
+			if (it != this->map.end()) {
+				return it->second.reference();
+			}
+		}
+		std::unique_lock<Mutex> lock { this->mutex };
+		auto it = detail::hashed_lookup<Map>::find(this->map, key, hash);
+		if (it != this->map.end()) {
+			return it->second.reference();
+		}
+		auto pending_it = pending.find(key);
+		if (pending_it != pending.end()) {
+			// The reference is taken on behalf of this waiter when the value is published
+			pending_it->second.waiters++;
+			std::shared_future<T&> future = pending_it->second.future;
+			lock.unlock();
+			return future.get();
+		}
+
+		std::promise<T&> promise;
+		pending.emplace(key, pending_value { promise.get_future().share(), 0 });
+		lock.unlock();
+		return create(key, promise);
+	}
+
+	/// Alternative to `flyweight_refcounted_singleflight::get` that returns a future instead of blocking while the value is created.
+	/// The reference count is incremented right away if the value is loaded, or when the value is created otherwise.
+	/// If the creator throws, no reference is taken.
+	/// @see flyweight_singleflight::get_async
+	template<typename Executor>
+	std::shared_future<T&> get_async(const Key& key, Executor&& executor) {
+		if (base::has_shared_lock) {
+			SharedLock lock { this->mutex };
+			auto it = this->map.find(key);
+			if (it != this->map.end()) {
+				return detail::make_ready_future<T&>(it->second.reference().value);
+			}
+		}
+		std::unique_lock<Mutex> lock { this->mutex };
+		auto it = this->map.find(key);
+		if (it != this->map.end()) {
+			return detail::make_ready_future<T&>(it->second.reference().value);
+		}
+		auto pending_it = pending.find(key);
+		if (pending_it != pending.end()) {
+			pending_it->second.waiters++;
+			return pending_it->second.future;
+		}
+
+		auto promise = std::make_shared<std::promise<T&>>();
+		std::shared_future<T&> future = promise->get_future().share();
+		pending.emplace(key, pending_value { future, 0 });
+		lock.unlock();
+		try {
+			executor([this, key, promise]() {
+				try {
+					create(key, *promise);
+				}
+				catch (...) {
+					// Already stored in the future
+				}
+			});
+		}
+		catch (...) {
+			abandon(key, *promise);
+			throw;
+		}
+		return future;
+	}
+
+	/// Alternative to `flyweight_refcounted_singleflight::get` that returns a `handle`.
+	/// @see get
+	handle get_handle(const Key& key) {
+		get(key);
+		std::unique_lock<Mutex> lock { this->mutex };
+		return this->make_handle(*this->map.find(key));
+	}
+
+	/// Alternative to `flyweight_refcounted_singleflight::get` that returns an `autorelease_value`.
+	/// This enables the RAII idiom for automatically releasing values.
+	/// @see get
+	autorelease_value_type get_autorelease(const Key& key) {
+		return {
+			*this,
+			key,
+		};
+	}
+
+	/// Gets the values associated to every key in [`first`, `last`), incrementing their reference counts, writing pointers to them to `out`.
+	/// Keys are gotten one at a time with `flyweight_refcounted_singleflight::get`, so that values are still created without holding the lock.
+	/// @return Output iterator past the last written pointer.
+	template<typename ForwardIt, typename OutputIt>
+	OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out) {
+		static_assert(detail::has_stable_references<Map>::value, "Values are gotten one at a time, so Map must have stable references, like flat_map does and flat_map_inline doesn't");
+		for (; first != last; ++first) {
+			*out = &get(*first);
+			++out;
+		}
+		return out;
+	}
+
+protected:
+	/// Creates the value of a pending key without holding the lock, and publishes it to the threads waiting for it.
+	/// The value is referenced once for the creating thread and once for each waiting thread.
+	T& create(const Key& key, std::promise<T&>& promise) {
+		try {
+			T value = this->creator()(key);
+			std::unique_lock<Mutex> lock { this->mutex };
+			auto& refcounted = this->map.emplace(key, std::move(value)).first->second;
+			auto pending_it = pending.find(key);
+			refcounted.reference(1 + pending_it->second.waiters);
+			pending.erase(pending_it);
+			lock.unlock();
+			promise.set_value(refcounted.value);
+			return refcounted.value;
+		}
+		catch (...) {
+			abandon(key, promise);
+			throw;
+		}
+	}
+
+	/// Stops waiting for the value of a pending key, passing the current exception to the threads waiting for it.
+	void abandon(const Key& key, std::promise<T&>& promise) {
+		std::unique_lock<Mutex> lock { this->mutex };
+		pending.erase(key);
+		lock.unlock();
+		promise.set_exception(std::current_exception());
+	}
+
+	/// Value being created, shared by all threads waiting for it.
+	struct pending_value {
+		std::shared_future<T&> future;
+		/// Number of threads waiting for the value.
+		long long waiters;
+	};
+	/// Values being created.
+	std::unordered_map<Key, pending_value, hash<Key>, equal_to<Key>> pending;
+};
+
+#ifdef FLYWEIGHT_HAS_COROUTINES
+/**
+ * Lazily started coroutine that results in a value of type `T`, used as the default result type of coroutine flyweight creators.
+ *
+ * The coroutine only starts running when the task is awaited, and the awaiting coroutine is resumed when it finishes.
+ * Creators may return any other awaitable instead, like tasks from another library, by passing their type as the flyweight's `Creator`.
+ *
+ * @tparam T  Value type.
+ */
+template<typename T>
+class task {
+	/// Resumes the awaiting coroutine when the task finishes.
+	struct final_awaiter {
+		bool await_ready() noexcept {
+			return false;
+		}
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> coroutine) noexcept {
+			return coroutine.promise().continuation;
+		}
+		void await_resume() noexcept {}
+	};
+
+public:
+	struct promise_type {
+		task get_return_object() {
+			return task { std::coroutine_handle<promise_type>::from_promise(*this) };
+		}
+		std::suspend_always initial_suspend() noexcept {
+			return {};
+		}
+		final_awaiter final_suspend() noexcept {
+			return {};
+		}
+		template<typename U>
+		void return_value(U&& value) {
+			result.emplace(std::forward<U>(value));
+		}
+		void unhandled_exception() {
+			exception = std::current_exception();
+		}
+
+		std::optional<T> result;
+		std::exception_ptr exception;
+		/// Coroutine awaiting the task, resumed when it finishes.
+		std::coroutine_handle<> continuation;
+	};
+
+	/// Awaitable returned when awaiting a task, which starts it.
+	struct awaiter {
+		bool await_ready() noexcept {
+			return false;
+		}
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+			coroutine.promise().continuation = awaiting;
+			return coroutine;
+		}
+		T await_resume() {
+			if (coroutine.promise().exception) {
+				std::rethrow_exception(coroutine.promise().exception);
+			}
+			return std::move(*coroutine.promise().result);
+		}
+
+		std::coroutine_handle<promise_type> coroutine;
+	};
+
+	explicit task(std::coroutine_handle<promise_type> coroutine) : coroutine(coroutine) {}
+
+	task(task&& other) noexcept : coroutine(other.coroutine) {
+		other.coroutine = nullptr;
+	}
+	task& operator=(task&&) = delete;
+
+	~task() {
+		if (coroutine) {
+			coroutine.destroy();
+		}
+	}
+
+	/// Starts the task, resuming the awaiting coroutine with its result when it finishes.
+	awaiter operator co_await() && noexcept {
+		return { coroutine };
+	}
+
+private:
+	std::coroutine_handle<promise_type> coroutine;
+};
+
+/**
+ * Alternative to `flyweight_singleflight` whose creator is a coroutine, for C++20 coroutines.
+ *
+ * Values are gotten by awaiting `flyweight_coroutine::get` inside a coroutine.
+ * When a value is not loaded, the first coroutine that gets it is suspended and the creator coroutine is started in its place.
+ * Coroutines getting the same key are also suspended, instead of creating the value again or blocking their thread.
+ * When the value is created, all of them are resumed on the thread that finished creating it.
+ * If the creator throws, the exception is rethrown by all waiting coroutines and the key is left unloaded.
+ *
+ * Suspended coroutines are linked in a list stored in their own frames, so waiting for a value doesn't allocate memory.
+ * The flyweight must outlive the values being created.
+ *
+ * @tparam Key  Key mapped to loaded values.
+ * @tparam T  Value type.
+ * @tparam Map  Internal type used to map keys to values. Defaults to `flat_map`, using `flyweight::hash` and `flyweight::equal_to`.
+ * @tparam Mutex  Internal type used for a mutex. Defaults to `std::mutex`.
+ * @tparam SharedLock  Internal type used for locking the mutex in shared mode. Defaults to `std::unique_lock<Mutex>`.
+ * @tparam Creator  Creator functor type, returning an awaitable that results in a `T`.
+ *                  Defaults to `std::function<task<T>(const Key&)>`, which type erases any creator functor returning a `task`.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, T>, typename Mutex = std::mutex, typename SharedLock = std::unique_lock<Mutex>, typename Creator = std::function<task<T>(const Key&)>>
+class flyweight_coroutine : public flyweight<Key, T, Map, Mutex, std::unique_lock<Mutex>, SharedLock, Creator> {
+	using base = flyweight<Key, T, Map, Mutex, std::unique_lock<Mutex>, SharedLock, Creator>;
+
+public:
+	/// Awaitable returned by `flyweight_coroutine::get`.
+	/// While the awaiting coroutine is suspended, it's linked in the list of coroutines waiting for the value.
+	class awaiter {
+	public:
+		awaiter(flyweight_coroutine& owner, const Key& key) : owner(owner), key(key) {}
+
+		bool await_ready() {
+			if (base::has_shared_lock) {
+				SharedLock lock { owner.mutex };
+				auto it = owner.map.find(key);
+				if (it != owner.map.end()) {
+					value = &it->second;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+			std::unique_lock<Mutex> lock { owner.mutex };
+			auto it = owner.map.find(key);
+			if (it != owner.map.end()) {
+				value = &it->second;
+				return awaiting;
+			}
+			continuation = awaiting;
+			auto pending_it = owner.pending.find(key);
+			if (pending_it != owner.pending.end()) {
+				next = pending_it->second;
+				pending_it->second = this;
+				return std::noop_coroutine();
+			}
+
+			owner.pending.emplace(key, this);
+			try {
+				return owner.load(key).handle;
+			}
+			catch (...) {
+				owner.pending.erase(key);
+				throw;
+			}
+		}
+
+		T& await_resume() {
+			if (exception) {
+				std::rethrow_exception(exception);
+			}
+			return *value;
+		}
+
+	private:
+		friend class flyweight_coroutine;
+
+		flyweight_coroutine& owner;
+		const Key& key;
+		T *value = nullptr;
+		std::exception_ptr exception;
+		std::coroutine_handle<> continuation;
+		/// Next coroutine waiting for the same value.
+		awaiter *next = nullptr;
+	};
+
+	using base::base;
+
+	/// Gets the value associated to the passed key, when awaited inside a coroutine: `T& value = co_await flyweight.get(key);`.
+	/// If the value is already loaded, the awaiting coroutine continues without being suspended.
+	/// If the value is being created, the awaiting coroutine is suspended until it is created.
+	/// Otherwise, the awaiting coroutine is suspended while the creator coroutine runs in its place.
+	/// @param key  Key that represent a value.
+	///             It will be passed to the creator functor if the value is not loaded yet.
+	///             The returned awaiter refers to it, so it should be awaited right away.
+	/// @return Awaitable that results in a reference to the value mapped to the passed key.
+	awaiter get(const Key& key) {
+		return { *this, key };
+	}
+
+	/// Values can only be created by awaiting `flyweight_coroutine::get`.
+	template<typename... Args>
+	void get_many(Args&&...) = delete;
+	/// Values can only be created by awaiting `flyweight_coroutine::get`.
+	template<typename... Args>
+	void get_hashed(Args&&...) = delete;
+	/// Values can only be created by awaiting `flyweight_coroutine::get`.
+	template<typename... Args>
+	void get_autorelease(Args&&...) = delete;
+	/// Values can only be created by awaiting `flyweight_coroutine::get`.
+	template<typename... Args>
+	void preload(Args&&...) = delete;
+
+protected:
+	/// Awaits the creator for a pending key, then resumes the coroutines waiting for it.
+	detail::detached_coroutine load(Key key) {
+		T *value = nullptr;
+		std::exception_ptr exception;
+		awaiter *waiters;
+		try {
+			T created = co_await this->creator()(key);
+			std::unique_lock<Mutex> lock { this->mutex };
+			value = &this->map.emplace(key, std::move(created)).first->second;
+			waiters = take_waiters(key);
+		}
+		catch (...) {
+			exception = std::current_exception();
+			std::unique_lock<Mutex> lock { this->mutex };
+			waiters = take_waiters(key);
+		}
+		while (waiters) {
+			awaiter *next = waiters->next;
+			waiters->value = value;
+			waiters->exception = exception;
+			waiters->continuation.resume();
+			waiters = next;
+		}
+	}
+
+	/// Removes a pending key, returning the list of coroutines waiting for it.
+	/// Must be called while holding the lock.
+	awaiter *take_waiters(const Key& key) {
+		auto it = pending.find(key);
+		awaiter *waiters = it->second;
+		pending.erase(it);
+		return waiters;
+	}
+
+	/// Values being created.
+	/// Maps keys to the last coroutine that started waiting for them.
+	std::unordered_map<Key, awaiter *, hash<Key>, equal_to<Key>> pending;
+};
+
+/**
+ * Alternative to `flyweight_refcounted_singleflight` whose creator is a coroutine, for C++20 coroutines.
+ *
+ * Each awaited `flyweight_refcounted_coroutine::get` increments the reference count of the value.
+ * Coroutines waiting for a value being created are referenced all at once when it is created.
+ * @see flyweight_coroutine
+ *
+ * @tparam Key  Key mapped to loaded values.
+ * @tparam T  Value type.
+ * @tparam Map  Internal type used to map keys to values. Defaults to `flat_map`, using `flyweight::hash` and `flyweight::equal_to`.
+ * @tparam Mutex  Internal type used for a mutex. Defaults to `std::mutex`.
+ * @tparam SharedLock  Internal type used for locking the mutex in shared mode. Defaults to `std::unique_lock<Mutex>`.
+ * @tparam Creator  Creator functor type, returning an awaitable that results in a `T`.
+ *                  Defaults to `std::function<task<T>(const Key&)>`, which type erases any creator functor returning a `task`.
+ */
+template<typename Key, typename T, typename Map = flat_map<Key, detail::refcounted_value<T>>, typename Mutex = std::mutex, typename SharedLock = std::unique_lock<Mutex>, typename Creator = std::function<task<T>(const Key&)>>
+class flyweight_refcounted_coroutine : public flyweight_refcounted<Key, T, Map, Mutex, std::unique_lock<Mutex>, SharedLock, Creator> {
+	using base = flyweight_refcounted<Key, T, Map, Mutex, std::unique_lock<Mutex>, SharedLock, Creator>;
+
+public:
+	/// Awaitable returned by `flyweight_refcounted_coroutine::get`.
+	/// @see flyweight_coroutine::awaiter
+	class awaiter {
+	public:
+		awaiter(flyweight_refcounted_coroutine& owner, const Key& key) : owner(owner), key(key) {}
+
+		bool await_ready() {
+			if (base::has_shared_lock) {
+				SharedLock lock { owner.mutex };
+				auto it = owner.map.find(key);
+				if (it != owner.map.end()) {
+					value = &it->second.reference().value;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+			std::unique_lock<Mutex> lock { owner.mutex };
+			auto it = owner.map.find(key);
+			if (it != owner.map.end()) {
+				value = &it->second.reference().value;
+				return awaiting;
+			}
+			continuation = awaiting;
+			auto pending_it = owner.pending.find(key);
+			if (pending_it != owner.pending.end()) {
+				next = pending_it->second;
+				pending_it->second = this;
+				return std::noop_coroutine();
+			}
+
+			owner.pending.emplace(key, this);
+			try {
+				return owner.load(key).handle;
+			}
+			catch (...) {
+				owner.pending.erase(key);
+				throw;
+			}
+		}
+
+		T& await_resume() {
+			if (exception) {
+				std::rethrow_exception(exception);
+			}
+			return *value;
+		}
+
+	private:
+		friend class flyweight_refcounted_coroutine;
+
+		flyweight_refcounted_coroutine& owner;
+		const Key& key;
+		T *value = nullptr;
+		std::exception_ptr exception;
+		std::coroutine_handle<> continuation;
+		/// Next coroutine waiting for the same value.
+		awaiter *next = nullptr;
+	};
+
+	using base::base;
+
+	/// Gets the value associated to the passed key, incrementing its reference count, when awaited inside a coroutine.
+	/// If the creator throws, no reference is taken.
+	/// @see flyweight_coroutine::get
+	awaiter get(const Key& key) {
+		return { *this, key };
+	}
+
+	/// Values can only be created by awaiting `flyweight_refcounted_coroutine::get`.
+	template<typename... Args>
+	void get_many(Args&&...) = delete;
+	/// Values can only be created by awaiting `flyweight_refcounted_coroutine::get`.
+	template<typename... Args>
+	void get_hashed(Args&&...) = delete;
+	/// Values can only be created by awaiting `flyweight_refcounted_coroutine::get`.
+	template<typename... Args>
+	void get_handle(Args&&...) = delete;
+	/// Values can only be created by awaiting `flyweight_refcounted_coroutine::get`.
+	template<typename... Args>
+	void get_autorelease(Args&&...) = delete;
+	/// Values can only be created by awaiting `flyweight_refcounted_coroutine::get`.
+	template<typename... Args>
+	void preload(Args&&...) = delete;
+
+protected:
+	/// Awaits the creator for a pending key, then resumes the coroutines waiting for it.
+	/// The value is referenced once for each waiting coroutine.
+	detail::detached_coroutine load(Key key) {
+		T *value = nullptr;
+		std::exception_ptr exception;
+		awaiter *waiters;
+		try {
+			T created = co_await this->creator()(key);
+			std::unique_lock<Mutex> lock { this->mutex };
+			auto& refcounted = this->map.emplace(key, std::move(created)).first->second;
+			waiters = take_waiters(key);
+			long long count = 0;
+			for (awaiter *waiter = waiters; waiter; waiter = waiter->next) {
+				count++;
+			}
+			refcounted.reference(count);
+			value = &refcounted.value;
+		}
+		catch (...) {
+			exception = std::current_exception();
+			std::unique_lock<Mutex> lock { this->mutex };
+			waiters = take_waiters(key);
+		}
+		while (waiters) {
+			awaiter *next = waiters->next;
+			waiters->value = value;
+			waiters->exception = exception;
+			waiters->continuation.resume();
+			waiters = next;
+		}
+	}
+
+	/// Removes a pending key, returning the list of coroutines waiting for it.
+	/// Must be called while holding the lock.
+	awaiter *take_waiters(const Key& key) {
+		auto it = pending.find(key);
+		awaiter *waiters = it->second;
+		pending.erase(it);
+		return waiters;
+	}
+
+	/// Values being created.
+	/// Maps keys to the last coroutine that started waiting for them.
+	std::unordered_map<Key, awaiter *, hash<Key>, equal_to<Key>> pending;
+};
+#endif
+
+/**
+ * Alternative to `flyweight_refcounted_threadsafe` with a lock-free read path.
+ *
+ * Values are stored in nodes referenced by an open addressing table of atomic pointers.
+ * Reference counts are atomic, so getting or releasing a loaded value only takes a table probe and a single CAS, without locking any mutex.
+ * A mutex is only locked when creating values and when removing them after their reference count reaches zero.
+ *
+ * Removed nodes and tables are reclaimed using hazard pointers, so readers never access freed memory.
+ * A node is only removed if its reference count is still zero, so a concurrent `get` that resurrects it is never lost.
+ *
+ * @tparam Key  Key mapped to loaded values.
+ * @tparam T  Value type.
+ * @tparam Hash  Hash functor for keys. Defaults to `flyweight::hash<Key>`.
+ * @tparam KeyEqual  Equality functor for keys. Defaults to `flyweight::equal_to<Key>`.
+ */
+template<typename Key, typename T, typename Hash = hash<Key>, typename KeyEqual = equal_to<Key>>
+class flyweight_refcounted_lockfree {
+	/// Enabled if keys of type `K` can be used for looking up values without constructing a `Key`.
+	template<typename K>
+	using enable_if_lookup_key = typename std::enable_if<std::is_same<K, Key>::value || detail::is_transparent_lookup<Hash, KeyEqual, K>::value>::type;
+
+public:
+	using key_type = Key;
+	using value_type = T;
+	using autorelease_value_type = autorelease_value<Key, T, flyweight_refcounted_lockfree>;
+
+	/// Default constructor.
+	/// Uses `default_creator` as the value creator and `default_deleter` as the value deleter.
+	flyweight_refcounted_lockfree() : flyweight_refcounted_lockfree(default_creator<T, Key>{}, default_deleter<T>{}) {}
+
+	/// Constructor with custom value creator functor.
+	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
+	///                 It will be called with a const reference to the key passed to `flyweight_refcounted_lockfree::get`.
+	template<typename Creator>
+	flyweight_refcounted_lockfree(Creator&& creator)
+		: flyweight_refcounted_lockfree(std::forward<Creator>(creator), default_deleter<T>{})
+	{
+	}
+
+	/// Constructor with custom value creator functor and deleter functor.
+	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
+	///                 It will be called with a const reference to the key passed to `flyweight_refcounted_lockfree::get`.
+	/// @param deleter  Deleter functor that will be called when releasing a mapped value.
+	///                 It will be called by `flyweight_refcounted_lockfree::release` with a reference to the value.
+	template<typename Creator, typename Deleter>
+	flyweight_refcounted_lockfree(Creator&& creator, Deleter&& deleter)
+		: creator([creator](const Key& key) { return creator(key); })
+		, deleter([deleter](T& value) { deleter(value); })
+		, current(new table(initial_capacity))
+	{
+	}
+
+	flyweight_refcounted_lockfree(const flyweight_refcounted_lockfree&) = delete;
+	flyweight_refcounted_lockfree& operator=(const flyweight_refcounted_lockfree&) = delete;
+
+	/// Calls the deleter functor to all remaining values, to ensure everything is cleaned up properly.
+	/// No other thread may be accessing the flyweight at this point.
+	~flyweight_refcounted_lockfree() {
+		table *t = current.load();
+		for (size_t i = 0; i <= t->mask; i++) {
+			node *n = t->slots[i].load(std::memory_order_relaxed);
+			if (n && n != tombstone()) {
+				deleter(n->value);
+				delete n;
+			}
+		}
+		delete t;
+		for (node *n : retired_nodes) {
+			delete n;
+		}
+		for (table *retired : retired_tables) {
+			delete retired;
+		}
+	}
+
+	/// Gets the value associated to the passed key, incrementing its reference count.
+	/// If the value is loaded, this doesn't lock any mutex.
+	/// Otherwise, the value is created using the creator functor passed on the flyweight's constructor.
+	/// @param key Key that represent a value.
+	///            It will be passed to the creator functor if the value is not loaded yet.
+	/// @return Reference to the value mapped to the passed key.
+	T& get(const Key& key) {
+		return get<Key>(key);
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::get` that looks up the value without constructing a `Key`.
+	/// A `Key` is only constructed from `key` if the value is not loaded yet.
+	/// Only available if `Hash` and `KeyEqual` are transparent.
+	/// @see get
+	template<typename K, typename = enable_if_lookup_key<K>>
+	T& get(const K& key) {
+		return get_hashed(key, hasher(key));
+	}
+
+	/// Hash of `key`, to be passed to the hashed alternatives like `flyweight_refcounted_lockfree::get_hashed` instead of hashing the key again.
+	/// This is the hash computed by `Hash`.
+	template<typename K>
+	size_t hash_key(const K& key) const {
+		return hasher(key);
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::get` that takes the key's hash, as returned by `flyweight_refcounted_lockfree::hash_key`, instead of hashing the key again.
+	/// The hash must have been computed for a key equal to `key`, otherwise the loaded value may not be found and may even be created again.
+	/// @see get
+	T& get_hashed(const Key& key, size_t hash) {
+		return get_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::get_hashed` that looks up the value without constructing a `Key`.
+	/// @see get_hashed
+	template<typename K, typename = enable_if_lookup_key<K>>
+	T& get_hashed(const K& key, size_t hash) {
+		{
+			detail::hazard_guard guard;
+			node *n = find(key, hash, guard);
+			if (n && try_reference(n)) {
+				return n->value;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock { writer_mutex };
+		node *n = find_locked(key, hash);
+		if (n && try_reference(n)) {
+			return n->value;
+		}
+		return insert_locked(key, hash)->value;
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::get` for `std::tuple` keys that takes the tuple elements as separate arguments, for memoizing functions of several arguments.
+	/// Arguments are hashed and compared against loaded keys directly, and the `Key` tuple is only constructed from them if the value is not loaded yet.
+	/// Only available if `Hash` and `KeyEqual` are transparent for tuples, like the default `flyweight::hash` and `flyweight::equal_to`.
+	/// @see get
+	template<typename... Args, typename = detail::enable_if_arguments<Args...>, typename = enable_if_lookup_key<detail::argument_key<Args...>>>
+	T& get(const Args&... args) {
+		return get(detail::argument_key<Args...>(args...));
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::get` that returns an `autorelease_value`.
+	/// This enables the RAII idiom for automatically releasing values.
+	/// @see get
+	autorelease_value_type get_autorelease(const Key& key) {
+		return {
+			*this,
+			key,
+		};
+	}
+
+	/// Gets the existing value associated to the passed key.
+	/// If the value was not created yet, returns `nullptr`.
+	/// @param key Key that represents a value.
+	/// @return Pointer to the existing value, or `nullptr` if the value is not loaded.
+	T *peek(const Key& key) {
+		return peek<Key>(key);
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::peek` that looks up the value without constructing a `Key`.
+	/// @see peek
+	template<typename K, typename = enable_if_lookup_key<K>>
+	T *peek(const K& key) {
+		return peek_hashed(key, hasher(key));
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::peek` that takes the key's hash, as returned by `flyweight_refcounted_lockfree::hash_key`.
+	/// @see get_hashed
+	T *peek_hashed(const Key& key, size_t hash) {
+		return peek_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::peek_hashed` that looks up the value without constructing a `Key`.
+	/// @see peek_hashed
+	template<typename K, typename = enable_if_lookup_key<K>>
+	T *peek_hashed(const K& key, size_t hash) {
+		detail::hazard_guard guard;
+		node *n = find(key, hash, guard);
+		if (n && n->refcount.load() >= 0) {
+			return &n->value;
+		}
+		else {
+			return nullptr;
+		}
+	}
+
+	/// Check whether the value mapped to the passed key is loaded.
+	bool is_loaded(const Key& key) {
+		return peek<Key>(key) != nullptr;
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::is_loaded` that looks up the value without constructing a `Key`.
+	/// @see is_loaded
+	template<typename K, typename = enable_if_lookup_key<K>>
+	bool is_loaded(const K& key) {
+		return peek<K>(key) != nullptr;
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::is_loaded` that takes the key's hash, as returned by `flyweight_refcounted_lockfree::hash_key`.
+	/// @see get_hashed
+	bool is_loaded_hashed(const Key& key, size_t hash) {
+		return peek_hashed<Key>(key, hash) != nullptr;
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::is_loaded_hashed` that looks up the value without constructing a `Key`.
+	/// @see is_loaded_hashed
+	template<typename K, typename = enable_if_lookup_key<K>>
+	bool is_loaded_hashed(const K& key, size_t hash) {
+		return peek_hashed<K>(key, hash) != nullptr;
+	}
+
+	/// Get the current reference count for the value mapped to the passed key.
+	size_t reference_count(const Key& key) {
+		return reference_count<Key>(key);
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::reference_count` that looks up the value without constructing a `Key`.
+	/// @see reference_count
+	template<typename K, typename = enable_if_lookup_key<K>>
+	size_t reference_count(const K& key) {
+		detail::hazard_guard guard;
+		node *n = find(key, hasher(key), guard);
+		long long count = n ? n->refcount.load() : 0;
+		return count > 0 ? static_cast<size_t>(count) : 0;
+	}
+
+	/// Decrements the reference count for the value mapped to the passed key.
+	/// The value is only actually released when the reference count reaches zero.
+	/// Decrementing the reference count doesn't lock any mutex, only removing the value does.
+	/// Trying to release a value that is not loaded is a no-op.
+	/// @return `true` if a loaded value was released, `false` otherwise.
+	bool release(const Key& key) {
+		return release<Key>(key);
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::release` that looks up the value without constructing a `Key`.
+	/// @see release
+	template<typename K, typename = enable_if_lookup_key<K>>
+	bool release(const K& key) {
+		return release_hashed(key, hasher(key));
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::release` that takes the key's hash, as returned by `flyweight_refcounted_lockfree::hash_key`.
+	/// @see get_hashed
+	bool release_hashed(const Key& key, size_t hash) {
+		return release_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight_refcounted_lockfree::release_hashed` that looks up the value without constructing a `Key`.
+	/// @see release_hashed
+	template<typename K, typename = enable_if_lookup_key<K>>
+	bool release_hashed(const K& key, size_t hash) {
+		{
+			detail::hazard_guard guard;
+			node *n = find(key, hash, guard);
+			if (!n) {
+				return false;
+			}
+			long long count = n->refcount.load();
+			while (count > 0 && !n->refcount.compare_exchange_weak(count, count - 1)) {}
+			if (count != 1) {
+				return false;
+			}
+		}
+
+		// Reference count reached zero: remove the node, unless another thread referenced it in the meantime
+		std::lock_guard<std::mutex> lock { writer_mutex };
+		table *t = current.load();
+		size_t index;
+		node *n = find_locked(key, hash, &index);
+		long long unreferenced = 0;
+		if (n && n->refcount.compare_exchange_strong(unreferenced, dead)) {
+			deleter(n->value);
+			t->slots[index].store(tombstone());
+			live_count--;
+			retire(n);
+			return true;
+		}
+		else {
+			return false;
+		}
+	}
+
+	/// Release all values, calling the deleter functor on them.
+	void clear() {
+		std::lock_guard<std::mutex> lock { writer_mutex };
+		table *t = current.load();
+		for (size_t i = 0; i <= t->mask; i++) {
+			node *n = t->slots[i].load();
+			if (n && n != tombstone()) {
+				n->refcount.store(dead);
+				deleter(n->value);
+				retired_nodes.push_back(n);
+			}
+		}
+		current.store(new table(initial_capacity));
+		used_count = 0;
+		live_count = 0;
+		retire(t);
+	}
+
+protected:
+	/// Node containing a loaded value.
+	struct node {
+		template<typename Value>
+		node(const Key& key, size_t hash, Value&& value) : key(key), hash(hash), value(std::forward<Value>(value)) {}
+
+		const Key key;
+		const size_t hash;
+		T value;
+		/// Reference count, or `dead` after the node is removed.
+		std::atomic<long long> refcount { 1 };
+	};
+
+	/// Open addressing table of nodes, with a power of two capacity.
+	struct table {
+		explicit table(size_t capacity) : mask(capacity - 1), slots(new std::atomic<node *>[capacity]) {
+			for (size_t i = 0; i < capacity; i++) {
+				slots[i].store(nullptr, std::memory_order_relaxed);
+			}
+		}
+
+		const size_t mask;
+		std::unique_ptr<std::atomic<node *>[]> slots;
+	};
+
+	static constexpr size_t initial_capacity = 16;
+	static constexpr size_t retire_threshold = 64;
+	static constexpr long long dead = -1;
+
+	/// Marker for slots that contained removed nodes, so that probe sequences are not broken.
+	static node *tombstone() {
+		static char marker;
+		return reinterpret_cast<node *>(&marker);
+	}
+
+	/// Increment the reference count of `n`, unless it was already removed.
+	static bool try_reference(node *n) {
+		long long count = n->refcount.load();
+		while (count >= 0) {
+			if (n->refcount.compare_exchange_weak(count, count + 1)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/// Lock-free lookup.
+	/// The returned node is protected by `guard` until the guard is cleared.
+	template<typename K>
+	node *find(const K& key, size_t hash, detail::hazard_guard& guard) {
+		for (;;) {
+			table *t = guard.protect(0, current);
+			size_t index = hash & t->mask;
+			bool changed = false;
+			for (size_t probe = 0; probe <= t->mask; probe++, index = (index + 1) & t->mask) {
+				node *n = t->slots[index].load();
+				if (n == nullptr) {
+					return nullptr;
+				}
+				else if (n == tombstone()) {
+					continue;
+				}
+				guard.set(1, n);
+				// If the slot or table changed, `n` may have been retired before being protected
+				if (t->slots[index].load() != n || current.load() != t) {
+					changed = true;
+					break;
+				}
+				if (n->hash == hash && key_equal(n->key, key)) {
+					return n;
+				}
+			}
+			if (!changed) {
+				return nullptr;
+			}
+		}
+	}
+
+	/// Lookup, only called while `writer_mutex` is locked, so nodes cannot be retired concurrently.
+	template<typename K>
+	node *find_locked(const K& key, size_t hash, size_t *found_index = nullptr) {
+		table *t = current.load();
+		size_t index = hash & t->mask;
+		for (size_t probe = 0; probe <= t->mask; probe++, index = (index + 1) & t->mask) {
+			node *n = t->slots[index].load();
+			if (n == nullptr) {
+				return nullptr;
+			}
+			else if (n != tombstone() && n->hash == hash && key_equal(n->key, key)) {
+				if (found_index) {
+					*found_index = index;
+				}
+				return n;
+			}
+		}
+		return nullptr;
+	}
+
+	/// Create the value and insert a new node, only called while `writer_mutex` is locked.
+	template<typename K>
+	node *insert_locked(const K& key, size_t hash) {
+		auto&& new_key = detail::make_key<Key>(key);
+		std::unique_ptr<node> created { new node(new_key, hash, detail::deferred_value<T, std::function<T(const Key&)>, Key> { creator, new_key }) };
+		table *t = current.load();
+		if ((used_count + 1) * 2 > t->mask + 1) {
+			t = rebuild_locked();
+		}
+		size_t index = hash & t->mask;
+		while (true) {
+			node *n = t->slots[index].load(std::memory_order_relaxed);
+			if (n == nullptr) {
+				used_count++;
+				break;
+			}
+			else if (n == tombstone()) {
+				break;
+			}
+			index = (index + 1) & t->mask;
+		}
+		t->slots[index].store(created.get());
+		live_count++;
+		return created.release();
+	}
+
+	/// Rebuild the table with enough capacity for live nodes, dropping tombstones.
+	table *rebuild_locked() {
+		size_t capacity = initial_capacity;
+		while (capacity < (live_count + 1) * 4) {
+			capacity *= 2;
+		}
+		table *old_table = current.load();
+		table *new_table = new table(capacity);
+		for (size_t i = 0; i <= old_table->mask; i++) {
+			node *n = old_table->slots[i].load(std::memory_order_relaxed);
+			if (n && n != tombstone()) {
+				size_t index = n->hash & new_table->mask;
+				while (new_table->slots[index].load(std::memory_order_relaxed)) {
+					index = (index + 1) & new_table->mask;
+				}
+				new_table->slots[index].store(n, std::memory_order_relaxed);
+			}
+		}
+		current.store(new_table);
+		used_count = live_count;
+		retire(old_table);
+		return new_table;
+	}
+
+	void retire(node *n) {
+		retired_nodes.push_back(n);
+		if (retired_nodes.size() >= retire_threshold) {
+			reclaim();
+		}
+	}
+
+	void retire(table *t) {
+		retired_tables.push_back(t);
+		reclaim();
+	}
+
+	/// Free retired nodes and tables that are not protected by any hazard pointer.
+	void reclaim() {
+		std::vector<void *> hazards;
+		detail::hazard_domain::instance().collect(hazards);
+		auto is_hazard = [&hazards](void *pointer) {
+			for (void *hazard : hazards) {
+				if (hazard == pointer) {
+					return true;
+				}
+			}
+			return false;
+		};
+
+		size_t kept_nodes = 0;
+		for (node *n : retired_nodes) {
+			if (is_hazard(n)) {
+				retired_nodes[kept_nodes++] = n;
+			}
+			else {
+				delete n;
+			}
+		}
+		retired_nodes.resize(kept_nodes);
+
+		size_t kept_tables = 0;
+		for (table *t : retired_tables) {
+			if (is_hazard(t)) {
+				retired_tables[kept_tables++] = t;
+			}
+			else {
+				delete t;
+			}
+		}
+		retired_tables.resize(kept_tables);
+	}
+
+	/// Creator function.
+	/// Wraps the creator functor passed when constructing the flyweight, if any.
+	std::function<T(const Key&)> creator;
+	/// Deleter function.
+	/// Wraps the deleter functor passed when constructing the flyweight, if any.
+	std::function<void(T&)> deleter;
+	Hash hasher;
+	KeyEqual key_equal;
+
+	/// Current table, read by all threads.
+	std::atomic<table *> current;
+	/// Mutex locked when inserting or removing nodes.
+	std::mutex writer_mutex;
+	/// Number of slots that are not empty, including tombstones.
+	size_t used_count = 0;
+	/// Number of live nodes.
+	size_t live_count = 0;
+	/// Nodes and tables that were removed, but may still be accessed by other threads.
+	std::vector<node *> retired_nodes;
+	std::vector<table *> retired_tables;
+};
+
+template<typename Key, typename T, typename Hash, typename KeyEqual>
+constexpr size_t flyweight_refcounted_lockfree<Key, T, Hash, KeyEqual>::initial_capacity;
+template<typename Key, typename T, typename Hash, typename KeyEqual>
+constexpr size_t flyweight_refcounted_lockfree<Key, T, Hash, KeyEqual>::retire_threshold;
+template<typename Key, typename T, typename Hash, typename KeyEqual>
+constexpr long long flyweight_refcounted_lockfree<Key, T, Hash, KeyEqual>::dead;
+
+/**
+ * Eviction policy for `flyweight_cached` that evicts the least recently released value first.
+ *
+ * Eviction policies define a `hook` template with the data they need in each value and a `queue` template that tracks values.
+ * Values are passed as nodes with `key`, `key_hash`, `refcount` and `hook` members, where `key_hash` was computed with the map's hash functor.
+ * These queue members are called with the flyweight locked:
+ * - `on_insert(node)`: a value was created, with a reference count of one.
+ * - `on_access(node)`: a loaded value is being got, before its reference count is incremented.
+ * - `on_release(node)`: the reference count of a value reached zero.
+ * - `victim()`: returns the next unreferenced value to evict, or `nullptr` if there is none.
+ * - `erase(node)`: an unreferenced value is being evicted.
+ * - `clear()`: all values were deleted.
+ */
+struct lru_eviction {
+	template<typename Node>
+	struct hook {
+		Node *prev = nullptr;
+		Node *next = nullptr;
+	};
+
+	template<typename Node>
+	class queue {
+	public:
+		void on_insert(Node&) {}
+
+		void on_access(Node& node) {
+			if (node.refcount == 0) {
+				unreferenced.erase(node);
+			}
+		}
+
+		void on_release(Node& node) {
+			unreferenced.push_front(node);
+		}
+
+		Node *victim() {
+			return unreferenced.back;
+		}
+
+		void erase(Node& node) {
+			unreferenced.erase(node);
+		}
+
+		void clear() {
+			unreferenced.clear();
+		}
+
+	private:
+		/// Unreferenced values, from most to least recently released.
+		detail::lru_list<Node> unreferenced;
+	};
+};
+
+/**
+ * Eviction policy for `flyweight_cached` that approximates LRU with the CLOCK algorithm.
+ *
+ * All loaded values are kept in a ring, and getting or releasing a value only sets its reference bit, without moving it in the ring.
+ * When evicting, a hand sweeps the ring clearing reference bits, and evicts the first unreferenced value whose bit was already clear.
+ */
+struct clock_eviction {
+	template<typename Node>
+	struct hook {
+		Node *prev = nullptr;
+		Node *next = nullptr;
+		bool referenced = false;
+	};
+
+	template<typename Node>
+	class queue {
+	public:
+		void on_insert(Node& node) {
+			// insert right behind the hand, so that the new value is the last one it visits
+			ring.insert_before(hand, node);
+		}
+
+		void on_access(Node& node) {
+			node.hook.referenced = true;
+		}
+
+		void on_release(Node& node) {
+			node.hook.referenced = true;
+		}
+
+		Node *victim() {
+			// after a whole turn all reference bits are clear, so two turns always find an unreferenced value if there is one
+			for (size_t steps = 2 * ring.size; steps > 0; steps--) {
+				Node *node = hand ? hand : ring.front;
+				hand = node->hook.next;
+				if (node->refcount > 0) {
+					continue;
+				}
+				else if (node->hook.referenced) {
+					node->hook.referenced = false;
+				}
+				else {
+					return node;
+				}
+			}
+			return nullptr;
+		}
+
+		void erase(Node& node) {
+			if (hand == &node) {
+				hand = node.hook.next;
+			}
+			ring.erase(node);
+		}
+
+		void clear() {
+			ring.clear();
+			hand = nullptr;
+		}
+
+	private:
+		detail::lru_list<Node> ring;
+		/// Next value visited when evicting, `nullptr` meaning the front of the ring.
+		Node *hand = nullptr;
+	};
+};
+
+/**
+ * Eviction policy for `flyweight_cached` using S3-FIFO, which resists scans that would flush an LRU cache.
+ *
+ * New values enter a small FIFO queue, and only move to the main FIFO queue if they are got again before reaching its end.
+ * Values evicted from the small queue are remembered by key hash in a ghost queue, so that they enter the main queue directly if created again.
+ * Values in the main queue are reinserted while their access frequency, capped at 3, decrements to zero.
+ * Like CLOCK, getting a value doesn't move it in the queues.
+ */
+struct s3fifo_eviction {
+	template<typename Node>
+	struct hook {
+		Node *prev = nullptr;
+		Node *next = nullptr;
+		uint8_t frequency = 0;
+		bool main = false;
+	};
+
+	template<typename Node>
+	class queue {
+	public:
+		void on_insert(Node& node) {
+			auto it = ghost.find(node.key_hash);
+			if (it != ghost.end()) {
+				ghost.erase(it);
+				node.hook.main = true;
+				main.push_front(node);
+			}
+			else {
+				small.push_front(node);
+			}
+		}
+
+		void on_access(Node& node) {
+			if (node.hook.frequency < 3) {
+				node.hook.frequency++;
+			}
+		}
+
+		void on_release(Node&) {}
+
+		Node *victim() {
+			// referenced values are moved along like frequently used ones, which bounds the number of steps
+			for (size_t steps = small.size + 4 * (small.size + main.size) + 1; steps > 0; steps--) {
+				if (small.back && (!main.back || small.size * 10 > small.size + main.size)) {
+					Node& node = *small.back;
+					if (node.refcount == 0 && node.hook.frequency == 0) {
+						remember(node);
+						return &node;
+					}
+					small.erase(node);
+					node.hook.main = true;
+					node.hook.frequency = 0;
+					main.push_front(node);
+				}
+				else if (main.back) {
+					Node& node = *main.back;
+					if (node.refcount == 0 && node.hook.frequency == 0) {
+						return &node;
+					}
+					main.erase(node);
+					if (node.hook.frequency > 0) {
+						node.hook.frequency--;
+					}
+					main.push_front(node);
+				}
+				else {
+					break;
+				}
+			}
+			return nullptr;
+		}
+
+		void erase(Node& node) {
+			(node.hook.main ? main : small).erase(node);
+		}
+
+		void clear() {
+			small.clear();
+			main.clear();
+			ghost.clear();
+			ghost_order.clear();
+		}
+
+	private:
+		/// Adds the key of a value evicted from the small queue to the ghost queue, which remembers as many keys as there are loaded values.
+		void remember(const Node& node) {
+			size_t hashed_key = node.key_hash;
+			ghost[hashed_key] = ++ghost_sequence;
+			ghost_order.emplace_back(hashed_key, ghost_sequence);
+			while (ghost_order.size() > small.size + main.size) {
+				auto it = ghost.find(ghost_order.front().first);
+				// the key may have been remembered again since, or created again and forgotten
+				if (it != ghost.end() && it->second == ghost_order.front().second) {
+					ghost.erase(it);
+				}
+				ghost_order.pop_front();
+			}
+		}
+
+		detail::lru_list<Node> small;
+		detail::lru_list<Node> main;
+		/// Key hashes of values evicted from the small queue, mapped to when they were remembered.
+		std::unordered_map<size_t, uint64_t> ghost;
+		std::deque<std::pair<size_t, uint64_t>> ghost_order;
+		uint64_t ghost_sequence = 0;
+	};
+};
+
+/**
+ * Eviction policy for `flyweight_cached` with a TinyLFU admission filter in front of an LRU queue.
+ *
+ * A frequency sketch estimates how often each key was got recently.
+ * The most recently released value that was never admitted waits as a candidate, and when something must be evicted
+ * it is only admitted to the LRU queue if it was got more often than the queue's least recently used value, which is evicted instead.
+ * Otherwise the candidate itself is evicted, so that values got only once, like in a scan, don't flush frequently used ones.
+ * @tparam Counters  Number of counters in the frequency sketch. Should be a few times the capacity, and must be a power of two.
+ */
+template<size_t Counters = 4096>
+struct tinylfu_eviction {
+	template<typename Node>
+	struct hook {
+		Node *prev = nullptr;
+		Node *next = nullptr;
+		bool admitted = false;
+	};
+
+	template<typename Node>
+	class queue {
+	public:
+		void on_insert(Node& node) {
+			sketch.increment(node.key_hash);
+		}
+
+		void on_access(Node& node) {
+			sketch.increment(node.key_hash);
+			if (node.refcount == 0) {
+				erase(node);
+			}
+		}
+
+		void on_release(Node& node) {
+			if (node.hook.admitted) {
+				admitted.push_front(node);
+			}
+			else {
+				// without pressure to evict, the previous candidate is admitted for free
+				if (candidate) {
+					admit(*candidate);
+				}
+				candidate = &node;
+			}
+		}
+
+		Node *victim() {
+			if (candidate && admitted.back) {
+				if (sketch.estimate(candidate->key_hash) > sketch.estimate(admitted.back->key_hash)) {
+					admit(*candidate);
+					candidate = nullptr;
+					return admitted.back;
+				}
+				return candidate;
+			}
+			return candidate ? candidate : admitted.back;
+		}
+
+		void erase(Node& node) {
+			if (candidate == &node) {
+				candidate = nullptr;
+			}
+			else {
+				admitted.erase(node);
+			}
+		}
+
+		void clear() {
+			admitted.clear();
+			candidate = nullptr;
+		}
+
+	private:
+		void admit(Node& node) {
+			node.hook.admitted = true;
+			admitted.push_front(node);
+		}
+
+		detail::frequency_sketch<Counters> sketch;
+		/// Unreferenced admitted values, from most to least recently released.
+		detail::lru_list<Node> admitted;
+		Node *candidate = nullptr;
+	};
+};
+
+/**
+ * Alternative to `flyweight_refcounted` that keeps values cached after their reference count reaches zero.
+ *
+ * Unreferenced values are only deleted, calling the deleter functor, when the number of loaded values exceeds the flyweight's capacity.
+ * The `Eviction` policy chooses which unreferenced value is evicted first, by default the least recently released one.
+ * Getting a value that is still cached revives it without calling the creator functor again.
+ * Referenced values are never evicted, so the number of loaded values may exceed the capacity while they are in use.
+ *
+ * The `Sizer` functor measures each value when it's created, and the total is reported by `flyweight_cached::memory_usage`.
+ * Besides the capacity, unreferenced values are also evicted when memory usage exceeds the memory budget,
+ * a callback may be notified when it crosses a high-water mark and `flyweight_cached::shrink_to` evicts values on demand,
+ * for example to answer memory pressure signals from the OS.
+ *
+ * This is useful for resources that are often released and needed again shortly after, like assets shared by consecutive scenes.
+ *
+ * @tparam Key  Key mapped to loaded values.
+ * @tparam T  Value type.
+ * @tparam Eviction  Eviction policy. One of `lru_eviction` (the default), `clock_eviction`, `s3fifo_eviction` or `tinylfu_eviction`.
+ * @tparam Map  Internal type used to map keys to values. Defaults to `flat_map`, using `flyweight::hash` and `flyweight::equal_to`.
+ *              Must have stable references to its entries, since eviction policies link values to each other, so `flat_map_inline` fails to compile.
+ * @tparam Mutex  Internal type used for a mutex. Defaults to `detail::dummy_mutex`.
+ * @tparam Lock  Internal type used for locking the mutex. Defaults to `detail::dummy_lock`.
+ * @tparam Creator  Creator functor type. Defaults to `std::function<T(const Key&)>`, which type erases any creator functor.
+ * @tparam Deleter  Deleter functor type. Defaults to `std::function<void(T&)>`, which type erases any deleter functor.
+ * @tparam Sizer  Functor returning the size in bytes of a value. Defaults to `default_sizer`.
+ * @tparam Stats  Statistics policy, reported by `flyweight_cached::stats`. Defaults to `no_stats`, which records nothing and takes no space.
+ */
+template<typename Key, typename T, typename Eviction = lru_eviction, typename Map = flat_map<Key, detail::cached_value<Key, T, Eviction>>, typename Mutex = detail::dummy_mutex, typename Lock = detail::dummy_lock, typename Creator = std::function<T(const Key&)>, typename Deleter = std::function<void(T&)>, typename Sizer = default_sizer<T>, typename Stats = no_stats>
+class flyweight_cached
+	: protected detail::functor_storage<Creator, detail::creator_tag>
+	, protected detail::functor_storage<Deleter, detail::deleter_tag>
+	, protected detail::functor_storage<Sizer, detail::sizer_tag>
+	, protected detail::functor_storage<Stats, detail::stats_tag>
+{
+	using creator_storage = detail::functor_storage<Creator, detail::creator_tag>;
+	using deleter_storage = detail::functor_storage<Deleter, detail::deleter_tag>;
+	using sizer_storage = detail::functor_storage<Sizer, detail::sizer_tag>;
+	using stats_storage = detail::functor_storage<Stats, detail::stats_tag>;
+	using cached_value = typename Map::mapped_type;
+
+	static_assert(detail::has_stable_references<Map>::value, "Eviction policies link map entries, so Map must have stable references, like flat_map does and flat_map_inline doesn't");
+
+public:
+	using key_type = Key;
+	using value_type = T;
+	using eviction_type = Eviction;
+	using creator_type = Creator;
+	using deleter_type = Deleter;
+	using sizer_type = Sizer;
+	using stats_type = Stats;
+	using map_type = Map;
+	using autorelease_value_type = autorelease_value<Key, T, flyweight_cached>;
+	/// Callback notified with the memory usage when it crosses the high-water mark.
+	using high_water_callback_type = std::function<void(size_t)>;
+
+	/// Constructor with optional capacity.
+	/// Uses `default_creator` as the value creator and `default_deleter` as the value deleter,
+	/// or default constructs `Creator` and `Deleter` if they can't be constructed from those.
+	/// @param capacity  Maximum number of loaded values before unreferenced ones start being evicted.
+	explicit flyweight_cached(size_t capacity = SIZE_MAX)
+		: creator_storage(detail::make_default_functor<Creator, default_creator<T, Key>>())
+		, deleter_storage(detail::make_default_functor<Deleter, default_deleter<T>>())
+		, sizer_storage(detail::make_default_functor<Sizer, default_sizer<T>>())
+		, max_size(capacity)
+	{
+	}
+
+	/// Constructor with capacity and custom value creator functor.
+	/// @param capacity  Maximum number of loaded values before unreferenced ones start being evicted.
+	/// @param creator  Creator functor that will be called when creating a mapped value for the first time, or after it was evicted.
+	///                 It will be called with a const reference to the key passed to `flyweight_cached::get`.
+	template<typename C>
+	flyweight_cached(size_t capacity, C&& creator)
+		: creator_storage(std::forward<C>(creator))
+		, deleter_storage(detail::make_default_functor<Deleter, default_deleter<T>>())
+		, sizer_storage(detail::make_default_functor<Sizer, default_sizer<T>>())
+		, max_size(capacity)
+	{
+	}
+
+	/// Constructor with capacity, custom value creator functor and deleter functor.
+	/// @param capacity  Maximum number of loaded values before unreferenced ones start being evicted.
+	/// @param creator  Creator functor that will be called when creating a mapped value for the first time, or after it was evicted.
+	///                 It will be called with a const reference to the key passed to `flyweight_cached::get`.
+	/// @param deleter  Deleter functor that will be called when evicting or clearing a mapped value.
+	template<typename C, typename D>
+	flyweight_cached(size_t capacity, C&& creator, D&& deleter)
+		: creator_storage(std::forward<C>(creator))
+		, deleter_storage(std::forward<D>(deleter))
+		, sizer_storage(detail::make_default_functor<Sizer, default_sizer<T>>())
+		, max_size(capacity)
+	{
+	}
+
+	/// Constructor with capacity, custom value creator functor, deleter functor and sizer functor.
+	/// @param capacity  Maximum number of loaded values before unreferenced ones start being evicted.
+	/// @param creator  Creator functor that will be called when creating a mapped value for the first time, or after it was evicted.
+	///                 It will be called with a const reference to the key passed to `flyweight_cached::get`.
+	/// @param deleter  Deleter functor that will be called when evicting or clearing a mapped value.
+	/// @param sizer  Sizer functor that will be called with a const reference to each value after creating it, returning its size in bytes.
+	template<typename C, typename D, typename S>
+	flyweight_cached(size_t capacity, C&& creator, D&& deleter, S&& sizer)
+		: creator_storage(std::forward<C>(creator))
+		, deleter_storage(std::forward<D>(deleter))
+		, sizer_storage(std::forward<S>(sizer))
+		, max_size(capacity)
+	{
+	}
+
+	flyweight_cached(const flyweight_cached&) = delete;
+	flyweight_cached& operator=(const flyweight_cached&) = delete;
+
+	/// Calls the deleter functor to all remaining values, to ensure everything is cleaned up properly.
+	~flyweight_cached() {
+		Lock lock { mutex };
+		for (auto& it : map) {
+			deleter()(it.second.value);
+		}
+	}
+
+	/// Gets the value associated to the passed key, incrementing its reference count.
+	/// If the value is loaded, including unreferenced values that are still cached, a reference to the existing value is returned.
+	/// Otherwise, the value is created using the creator functor passed on the flyweight's constructor.
+	/// @param key Key that represent a value.
+	///            It will be passed to the creator functor if the value is not loaded.
+	/// @return Reference to the value mapped to the passed key.
+	T& get(const Key& key) {
+		return get<Key>(key);
+	}
+
+	/// Alternative to `flyweight_cached::get` that looks up the value without constructing a `Key`.
+	/// A `Key` is only constructed from `key` if the value is not loaded.
+	/// Only available if `Map` supports heterogeneous lookup with keys of type `K`.
+	/// @see get
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T& get(const K& key) {
+		return get_hashed(key, hash_key(key));
+	}
+
+	/// Hash of `key`, to be passed to the hashed alternatives like `flyweight_cached::get_hashed` instead of hashing the key again.
+	/// @see flyweight::hash_key
+	template<typename K>
+	size_t hash_key(const K& key) const {
+		return detail::hashed_lookup<Map>::hash(map, key);
+	}
+
+	/// Alternative to `flyweight_cached::get` that takes the key's hash, as returned by `flyweight_cached::hash_key`, instead of hashing the key again.
+	/// The hash must have been computed for a key equal to `key`, otherwise the loaded value may not be found.
+	/// @see get
+	T& get_hashed(const Key& key, size_t hash) {
+		return get_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight_cached::get_hashed` that looks up the value without constructing a `Key`.
+	/// @see get_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T& get_hashed(const K& key, size_t hash) {
+		high_water_callback_type callback;
+		size_t usage;
+		T *value;
+		{
+			stats_lock<Lock> lock { mutex, statistics() };
+			auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+			if (it == map.end()) {
+				auto&& new_key = detail::make_key<Key>(key);
+				detail::stats_timer<Stats> timer;
+				it = detail::emplace_created<T>(map, new_key, creator());
+				statistics().miss(timer.elapsed());
+				it->second.key = &it->first;
+				it->second.key_hash = detail::key_hasher<Map, Key>::hash(map, it->first);
+				it->second.size = sizer()(it->second.value);
+				memory += it->second.size;
+				eviction.on_insert(it->second);
+			}
+			else {
+				statistics().hit();
+				eviction.on_access(it->second);
+				if (it->second.refcount == 0) {
+					unreferenced_count--;
+				}
+			}
+			it->second.refcount++;
+			trim();
+			if (memory > high_water && !above_high_water) {
+				above_high_water = true;
+				callback = high_water_callback;
+			}
+			usage = memory;
+			value = &it->second.value;
+		}
+		// notify without holding the lock, so that the callback may call `shrink_to`
+		if (callback) {
+			callback(usage);
+		}
+		return *value;
+	}
+
+	/// Alternative to `flyweight_cached::get` for `std::tuple` keys that takes the tuple elements as separate arguments, for memoizing functions of several arguments.
+	/// Arguments are hashed and compared against loaded keys directly, and the `Key` tuple is only constructed from them if the value is not loaded yet.
+	/// Only available if `Map` supports heterogeneous lookup with tuples, like the default `flat_map` with `flyweight::hash` and `flyweight::equal_to`.
+	/// @see get
+	template<typename... Args, typename = detail::enable_if_arguments<Args...>, typename = detail::enable_if_lookup_key<Map, Key, detail::argument_key<Args...>>>
+	T& get(const Args&... args) {
+		return get(detail::argument_key<Args...>(args...));
+	}
+
+	/// Creates the values of every key in [`first`, `last`) that are not loaded yet, calling the creator functor on up to `parallelism` threads.
+	/// Preloaded values are unreferenced, as if they were gotten and released right away,
+	/// so they stay cached under the eviction policy and later gets don't create them again.
+	/// @return Number of inserted values, some of which may have been evicted already if they don't fit the capacity or memory budget.
+	/// @see flyweight::preload
+	template<typename ForwardIt>
+	size_t preload(ForwardIt first, ForwardIt last, size_t parallelism = std::thread::hardware_concurrency()) {
+		std::vector<Key> keys;
+		{
+			Lock lock { mutex };
+			detail::missing_keys(map, first, last, keys);
+		}
+		std::exception_ptr exception;
+		auto created = detail::parallel_create<T>(creator(), keys, parallelism, exception);
+		size_t inserted = 0;
+		high_water_callback_type callback;
+		size_t usage;
+		{
+			Lock lock { mutex };
+			for (auto& values : created) {
+				for (auto& value : values) {
+					const Key& key = keys[value.first];
+					if (map.find(key) != map.end()) {
+						deleter()(value.second);
+						continue;
+					}
+					auto it = map.emplace(key, std::move(value.second)).first;
+					it->second.key = &it->first;
+					it->second.key_hash = detail::key_hasher<Map, Key>::hash(map, it->first);
+					it->second.size = sizer()(it->second.value);
+					memory += it->second.size;
+					eviction.on_insert(it->second);
+					unreferenced_count++;
+					eviction.on_release(it->second);
+					inserted++;
+				}
+			}
+			trim();
+			if (memory > high_water && !above_high_water) {
+				above_high_water = true;
+				callback = high_water_callback;
+			}
+			usage = memory;
+		}
+		if (callback) {
+			callback(usage);
+		}
+		if (exception) {
+			std::rethrow_exception(exception);
+		}
+		return inserted;
+	}
+
+	/// Alternative to `flyweight_cached::get` that returns an `autorelease_value`.
+	/// This enables the RAII idiom for automatically releasing values.
+	/// @see get
+	autorelease_value_type get_autorelease(const Key& key) {
+		return {
+			*this,
+			key,
+		};
+	}
+
+	/// Gets the existing value associated to the passed key, without changing its reference count.
+	/// If the value is not loaded, returns `nullptr`.
+	/// @param key Key that represents a value.
+	/// @return Pointer to the existing value, or `nullptr` if the value is not loaded.
+	T *peek(const Key& key) {
+		return peek<Key>(key);
+	}
+
+	/// Alternative to `flyweight_cached::peek` that looks up the value without constructing a `Key`.
+	/// @see peek
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T *peek(const K& key) {
+		return peek_hashed(key, hash_key(key));
+	}
+
+	/// Alternative to `flyweight_cached::peek` that takes the key's hash, as returned by `flyweight_cached::hash_key`.
+	/// @see get_hashed
+	T *peek_hashed(const Key& key, size_t hash) {
+		return peek_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight_cached::peek_hashed` that looks up the value without constructing a `Key`.
+	/// @see peek_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	T *peek_hashed(const K& key, size_t hash) {
+		Lock lock { mutex };
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		if (it == map.end()) {
+			return nullptr;
+		}
+		else {
+			return &it->second.value;
+		}
+	}
+
+	/// Check whether the value mapped to the passed key is loaded, either referenced or cached.
+	bool is_loaded(const Key& key) {
+		return is_loaded<Key>(key);
+	}
+
+	/// Alternative to `flyweight_cached::is_loaded` that looks up the value without constructing a `Key`.
+	/// @see is_loaded
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool is_loaded(const K& key) {
+		return is_loaded_hashed(key, hash_key(key));
+	}
+
+	/// Alternative to `flyweight_cached::is_loaded` that takes the key's hash, as returned by `flyweight_cached::hash_key`.
+	/// @see get_hashed
+	bool is_loaded_hashed(const Key& key, size_t hash) {
+		return is_loaded_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight_cached::is_loaded_hashed` that looks up the value without constructing a `Key`.
+	/// @see is_loaded_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool is_loaded_hashed(const K& key, size_t hash) {
+		Lock lock { mutex };
+		return detail::hashed_lookup<Map>::find(map, key, hash) != map.end();
+	}
+
+	/// Get the current reference count for the value mapped to the passed key.
+	/// Values that are cached but unreferenced have a reference count of zero.
+	size_t reference_count(const Key& key) {
+		return reference_count<Key>(key);
+	}
+
+	/// Alternative to `flyweight_cached::reference_count` that looks up the value without constructing a `Key`.
+	/// @see reference_count
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	size_t reference_count(const K& key) {
+		Lock lock { mutex };
+		auto it = map.find(key);
+		if (it != map.end()) {
+			return it->second.refcount;
+		}
+		else {
+			return 0;
+		}
+	}
+
+	/// Decrements the reference count for the value mapped to the passed key.
+	/// When the reference count reaches zero, the value stays cached until it needs to be evicted to fit the capacity.
+	/// Trying to release a value that is not referenced is a no-op.
+	/// @return `true` if the reference count reached zero, `false` otherwise.
+	bool release(const Key& key) {
+		return release<Key>(key);
+	}
+
+	/// Alternative to `flyweight_cached::release` that looks up the value without constructing a `Key`.
+	/// @see release
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool release(const K& key) {
+		return release_hashed(key, hash_key(key));
+	}
+
+	/// Alternative to `flyweight_cached::release` that takes the key's hash, as returned by `flyweight_cached::hash_key`.
+	/// @see get_hashed
+	bool release_hashed(const Key& key, size_t hash) {
+		return release_hashed<Key>(key, hash);
+	}
+
+	/// Alternative to `flyweight_cached::release_hashed` that looks up the value without constructing a `Key`.
+	/// @see release_hashed
+	template<typename K, typename = detail::enable_if_lookup_key<Map, Key, K>>
+	bool release_hashed(const K& key, size_t hash) {
+		stats_lock<Lock> lock { mutex, statistics() };
+		auto it = detail::hashed_lookup<Map>::find(map, key, hash);
+		if (it != map.end() && it->second.refcount > 0 && --it->second.refcount == 0) {
+			unreferenced_count++;
+			eviction.on_release(it->second);
+			trim();
+			return true;
+		}
+		else {
+			return false;
+		}
+	}
+
+	/// Release all values, referenced or not, calling the deleter functor on them.
+	void clear() {
+		Lock lock { mutex };
+		for (auto& it : map) {
+			delete_value(it.second.value);
+		}
+		map.clear();
+		eviction.clear();
+		unreferenced_count = 0;
+		memory = 0;
+		above_high_water = false;
+	}
+
+	/// Snapshot of the statistics recorded by the `Stats` policy, with the number of loaded values, referenced or not.
+	/// @see flyweight::stats
+	stats_snapshot stats() {
+		stats_snapshot snapshot = statistics().snapshot();
+		Lock lock { mutex };
+		snapshot.size = map.size();
+		return snapshot;
+	}
+
+	/// Maximum number of loaded values before unreferenced ones start being evicted.
+	size_t capacity() {
+		Lock lock { mutex };
+		return max_size;
+	}
+
+	/// Change the capacity, evicting unreferenced values right away if they don't fit anymore.
+	void set_capacity(size_t capacity) {
+		Lock lock { mutex };
+		max_size = capacity;
+		trim();
+	}
+
+	/// Number of loaded values, both referenced and cached.
+	size_t size() {
+		Lock lock { mutex };
+		return map.size();
+	}
+
+	/// Number of loaded values that are not referenced and may be evicted.
+	size_t unreferenced_size() {
+		Lock lock { mutex };
+		return unreferenced_count;
+	}
+
+	/// Total size in bytes of loaded values, both referenced and cached, as measured by the sizer functor.
+	size_t memory_usage() {
+		Lock lock { mutex };
+		return memory;
+	}
+
+	/// Maximum memory usage in bytes before unreferenced values start being evicted.
+	size_t memory_budget() {
+		Lock lock { mutex };
+		return max_memory;
+	}
+
+	/// Change the memory budget, evicting unreferenced values right away if they don't fit anymore.
+	void set_memory_budget(size_t bytes) {
+		Lock lock { mutex };
+		max_memory = bytes;
+		trim();
+	}
+
+	/// Set a callback that is notified when getting a value makes memory usage cross above `bytes`.
+	/// The callback is called with the memory usage, without the flyweight locked, and is notified again only after usage drops back to `bytes` or less.
+	void set_high_water_mark(size_t bytes, high_water_callback_type callback) {
+		Lock lock { mutex };
+		high_water = bytes;
+		high_water_callback = std::move(callback);
+		above_high_water = memory > high_water;
+	}
+
+	/// Evicts unreferenced values, in the eviction policy's order, until memory usage is `bytes` or less.
+	/// Neither the capacity nor the memory budget are changed, so new values may grow memory usage again.
+	/// @return Memory usage after evicting, which may still be more than `bytes` if referenced values use more than that.
+	size_t shrink_to(size_t bytes) {
+		Lock lock { mutex };
+		while (memory > bytes && evict_one()) {}
+		return memory;
+	}
+
+protected:
+	/// Evicts unreferenced values chosen by the eviction policy until the number of loaded values fits the capacity.
+	/// Must be called with the mutex locked.
+	void trim() {
+		while ((map.size() > max_size || memory > max_memory) && evict_one()) {}
+	}
+
+	/// Evicts the unreferenced value chosen by the eviction policy.
+	/// Must be called with the mutex locked.
+	/// @return `false` if there was no value to evict.
+	bool evict_one() {
+		cached_value *victim = unreferenced_count > 0 ? eviction.victim() : nullptr;
+		if (victim) {
+			evict(*victim);
+		}
+		return victim != nullptr;
+	}
+
+	/// Deletes an unreferenced value and removes it from the map.
+	/// Must be called with the mutex locked.
+	void evict(cached_value& value) {
+		eviction.erase(value);
+		unreferenced_count--;
+		memory -= value.size;
+		if (memory <= high_water) {
+			above_high_water = false;
+		}
+		statistics().eviction();
+		delete_value(value.value);
+		map.erase(map.find(*value.key));
+	}
+
+	/// Creator functor passed when constructing the flyweight, if any.
+	Creator& creator() {
+		return creator_storage::get();
+	}
+	/// Deleter functor passed when constructing the flyweight, if any.
+	Deleter& deleter() {
+		return deleter_storage::get();
+	}
+	/// Sizer functor passed when constructing the flyweight, if any.
+	Sizer& sizer() {
+		return sizer_storage::get();
+	}
+	/// Statistics policy.
+	Stats& statistics() {
+		return stats_storage::get();
+	}
+
+	/// Lock of type `L` that reports the time spent waiting for the mutex to the statistics policy.
+	template<typename L>
+	using stats_lock = detail::stats_lock<L, Stats>;
+
+	/// Calls the deleter functor on `value`, recording the time spent in it.
+	void delete_value(T& value) {
+		detail::stats_timer<Stats> timer;
+		deleter()(value);
+		statistics().deletion(timer.elapsed());
+	}
+
+	/// Value map.
+	/// Maps keys to loaded values, referenced or not.
+	Map map;
+	typename Eviction::template queue<cached_value> eviction;
+	size_t unreferenced_count = 0;
+	size_t max_size;
+	/// Memory usage, budget and high-water mark, in bytes.
+	size_t memory = 0;
+	size_t max_memory = SIZE_MAX;
+	size_t high_water = SIZE_MAX;
+	bool above_high_water = false;
+	high_water_callback_type high_water_callback;
+	Mutex mutex;
+};
+
+/**
+ * Alternative to `flyweight_cached` that uses `std::mutex` and `std::lock_guard` for thread safety.
+ */
+template<typename Key, typename T, typename Eviction = lru_eviction, typename Map = flat_map<Key, detail::cached_value<Key, T, Eviction>>, typename Stats = no_stats>
+using flyweight_cached_threadsafe = flyweight_cached<Key, T, Eviction, Map, std::mutex, std::lock_guard<std::mutex>, std::function<T(const Key&)>, std::function<void(T&)>, default_sizer<T>, Stats>;
+
+namespace detail {
+	/// Whether getting values from the flyweight type `F` takes references that must be released.
+	/// Sharded flyweights forward `reference_count` to their shards whether they employ reference counting or not, so their shards are checked instead.
+	template<typename F>
+	struct takes_references : has_reference_count<F> {};
+	template<typename F, size_t Shards, typename Hash>
+	struct takes_references<sharded<F, Shards, Hash>> : has_reference_count<F> {};
+
+	/// Unique identifier of a new object, never reused during the process' lifetime.
+	inline uint64_t next_instance_id() {
+		static std::atomic<uint64_t> next_id { 1 };
+		return next_id.fetch_add(1, std::memory_order_relaxed);
+	}
+}
 
 /**
- * Factory for flyweight objects of type `T`, created with a key of type `Key`.
+ * Thread-local front cache for a thread-safe flyweight.
  *
- * When getting a value, the flyweight first checks for an existing value associated with the passed key, returning a reference to it if found.
- * Otherwise, a new value is created and cached for future requests.
- * When no longer needed, an existing value may be released by calling `flyweight::release`.
+ * Each thread that gets values has its own table of `Slots` recently gotten keys and their values,
+ * so repeated gets of hot keys are resolved without touching the wrapped flyweight's map or locking its mutex.
+ * Tables are 4-way set associative: a key may only be cached in the 4 slots of the set its hash maps to,
+ * and misses get the value from the wrapped flyweight and replace one of them in turn.
  *
- * Flyweights are useful as a way to load heavy objects only once and sharing them whenever necessary, for example images used as icons in an interactive app.
- * Flyweights can also be used to implement string interning and function result memoization.
+ * Every set has a generation counter shared by all threads.
+ * Releasing a key bumps the generation of its set and clearing bumps them all, invalidating the entries cached by every thread,
+ * so that no thread returns a value after it was released.
+ * Releases only invalidate keys in the same set, so workloads that release values now and then keep most of their hits.
  *
- * @tparam Key  Key mapped to loaded values.
- * @tparam T  Value type.
- * @tparam Map  Internal type used to map keys to values. Defaults to `std::unordered_map`.
- * @tparam Mutex  Internal type used for a mutex. Defaults to `detail::dummy_mutex`.
- * @tparam Lock  Internal type used for locking the mutex. Defaults to `detail::dummy_lock`.
+ * Values are returned from the front cache by reference, so the wrapped flyweight's map must have stable references to its values,
+ * like the default `flat_map` does, which is checked at compile time.
+ * Flyweights whose gets take references that must be released, like `flyweight_refcounted`, are not supported:
+ * a hit would need to reference a value that another thread may be deleting,
+ * use `flyweight_refcounted_lockfree` for reference counted values whose hits never lock.
+ *
+ * Per-thread tables are allocated the first time a thread gets a value and are owned by the front cache, until it is destroyed.
+ *
+ * @tparam Flyweight  Wrapped thread-safe flyweight, like `flyweight_threadsafe`, `flyweight_threadsafe_rw` or `flyweight_sharded`.
+ * @tparam Slots  Number of slots of each thread's table. Must be a power of two, at least 4.
+ * @tparam Hash  Hash functor for keys. Defaults to `flyweight::hash`.
+ * @tparam KeyEqual  Equality functor for keys. Defaults to `flyweight::equal_to`.
+ *                   Keys are copied to the slots, so they must be default constructible and copy assignable.
  */
-template<typename Key, typename T, typename Map = std::unordered_map<Key, T>, typename Mutex = detail::dummy_mutex, typename Lock = detail::dummy_lock>
-class flyweight {
+template<typename Flyweight, size_t Slots = 256, typename Hash = hash<typename Flyweight::key_type>, typename KeyEqual = equal_to<typename Flyweight::key_type>>
+class thread_cached
+	: private detail::functor_storage<Hash, detail::hash_tag>
+	, private detail::functor_storage<KeyEqual, detail::key_equal_tag>
+{
+	static_assert(Slots >= 4 && (Slots & (Slots - 1)) == 0, "Slot count must be a power of two, at least 4");
+	static_assert(!detail::takes_references<Flyweight>::value,
+		"Front caches don't support flyweights whose gets take references");
+	static_assert(detail::has_stable_values<Flyweight>::value,
+		"Front caches keep pointers to values, so the wrapped flyweight's Map must have stable references, like flat_map does and flat_map_inline doesn't");
+
+	using hash_storage = detail::functor_storage<Hash, detail::hash_tag>;
+	using key_equal_storage = detail::functor_storage<KeyEqual, detail::key_equal_tag>;
+
 public:
-	using key_type = Key;
-	using value_type = T;
-	using autorelease_value_type = autorelease_value<Key, T, flyweight>;
+	using key_type = typename Flyweight::key_type;
+	using value_type = typename Flyweight::value_type;
+	using flyweight_type = Flyweight;
+	using autorelease_value_type = autorelease_value<key_type, value_type, thread_cached>;
+
+	/// Number of slots of each thread's table.
+	static constexpr size_t slot_count = Slots;
+	/// Number of slots a key may be cached in.
+	static constexpr size_t ways = 4;
 
 	/// Default constructor.
-	/// Uses `default_creator` as the value creator and `default_deleter` as the value deleter.
-	flyweight() : creator(default_creator<T, Key>{}), deleter(default_deleter<T>{}) {}
+	/// The wrapped flyweight is default constructed.
+	thread_cached() {}
 
-	/// Constructor with custom value creator functor.
-	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
-	///                 It will be called with a const reference to the key passed to `flyweight::get`.
-	template<typename Creator>
-	flyweight(Creator&& creator)
-		: creator([creator](const Key& key) { return creator(key); })
-		, deleter(default_deleter<T>{})
-	{
-	}
+	/// Constructor with custom value creator functor, passed to the wrapped flyweight.
+	/// @see flyweight::flyweight(Creator&&)
+	template<typename Creator, typename = detail::enable_if_not_self<thread_cached, Creator>>
+	thread_cached(Creator&& creator) : flyweight(std::forward<Creator>(creator)) {}
 
-	/// Constructor with custom value creator functor and deleter functor.
-	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
-	///                 It will be called with a const reference to the key passed to `flyweight::get`.
-	/// @param deleter  Deleter functor that will be called when releasing a mapped value.
-	///                 It will be called by `flyweight::release` with a reference to the value.
+	/// Constructor with custom value creator functor and deleter functor, passed to the wrapped flyweight.
+	/// @see flyweight::flyweight(Creator&&, Deleter&&)
 	template<typename Creator, typename Deleter>
-	flyweight(Creator&& creator, Deleter&& deleter)
-		: creator([creator](const Key& key) { return creator(key); })
-		, deleter([deleter](T& value) { deleter(value); })
-	{
+	thread_cached(Creator&& creator, Deleter&& deleter) : flyweight(std::forward<Creator>(creator), std::forward<Deleter>(deleter)) {}
+
+	thread_cached(const thread_cached&) = delete;
+	thread_cached& operator=(const thread_cached&) = delete;
+
+	/// Gets the value associated to the passed key, from the calling thread's table if it was cached there.
+	/// @see flyweight::get
+	value_type& get(const key_type& key) {
+		return get<key_type>(key);
 	}
 
-	/// Calls the deleter functor to all remaining values, to ensure everything is cleaned up properly.
-	~flyweight() {
-		Lock lock { mutex };
-		for (auto it : map) {
-			deleter(it.second);
+	/// Alternative to `thread_cached::get` that looks up the calling thread's table without constructing a `key_type`.
+	/// A `key_type` is constructed from `key` when caching the value in the table.
+	/// @see get
+	template<typename K>
+	value_type& get(const K& key) {
+		size_t hash = hasher()(key);
+		size_t index = set_index(hash);
+		uint64_t generation = generations[index].value.load(std::memory_order_acquire);
+		set& local_set = local_table().sets[index];
+		if (slot *s = find_slot(local_set, generation, hash, key)) {
+			return *s->value;
 		}
+		// the generation is read before getting the value, so a concurrent release leaves the slot invalid
+		value_type& value = flyweight.get(key);
+		slot& s = replace_slot(local_set, generation);
+		s.generation = generation;
+		s.hash = hash;
+		s.key = detail::make_key<key_type>(key);
+		s.value = &value;
+		return value;
 	}
 
-	/// Gets the value associated to the passed key.
-	/// If the value was already created, a reference to the existing value is returned.
-	/// Otherwise, the value is created using the creator functor passed on the flyweight's constructor.
-	/// @param key Key that represent a value.
-	///            It will be passed to the creator functor if the value is not loaded yet.
-	/// @return Reference to the value mapped to the passed key.
-	T& get(const Key& key) {
-		Lock lock { mutex };
-		auto it = map.find(key);
-		if (it == map.end()) {
-			it = map.emplace(key, creator(key)).first;
+	/// Gets the value associated to the passed key wrapped in an `autorelease_value`.
+	/// @see flyweight::get_autorelease
+	autorelease_value_type get_autorelease(const key_type& key) {
+		return { *this, key };
+	}
+
+	/// Gets the value associated to the passed key, if it is loaded, without creating it.
+	/// @see flyweight::peek
+	template<typename K>
+	value_type *peek(const K& key) {
+		size_t hash = hasher()(key);
+		size_t index = set_index(hash);
+		if (slot *s = find_slot(local_table().sets[index], generations[index].value.load(std::memory_order_acquire), hash, key)) {
+			return s->value;
 		}
-		return it->second;
+		return flyweight.peek(key);
+	}
+	value_type *peek(const key_type& key) {
+		return peek<key_type>(key);
 	}
 
-	/// Alternative to `flyweight::get` that returns an `autorelease_value`.
-	/// This enables the RAII idiom for automatically releasing values.
-	/// @see get
-	autorelease_value_type get_autorelease(const Key& key) {
-		return {
-			*this,
-			key,
-		};
+	/// Check whether the value associated to the passed key is loaded.
+	/// @see flyweight::is_loaded
+	template<typename K>
+	bool is_loaded(const K& key) {
+		return peek(key) != nullptr;
+	}
+	bool is_loaded(const key_type& key) {
+		return is_loaded<key_type>(key);
 	}
 
-	/// Gets the existing value associated to the passed key.
-	/// If the value was not created yet, returns `nullptr`.
-	/// @param key Key that represents a value.
-	/// @return Pointer to the existing value, or `nullptr` if the value is not loaded.
-	T *peek(const Key& key) {
-		Lock lock { mutex };
-		auto it = map.find(key);
-		if (it == map.end()) {
-			return nullptr;
+	/// Releases the value associated to the passed key from the wrapped flyweight,
+	/// invalidating the entries of every thread's table in the key's set.
+	/// @see flyweight::release
+	template<typename K>
+	bool release(const K& key) {
+		if (flyweight.release(key)) {
+			// bumped after the value is released, so that gets that read the previous generation never cache it again
+			generations[set_index(hasher()(key))].value.fetch_add(1, std::memory_order_release);
+			return true;
 		}
-		else {
-			return &it->second;
+		return false;
+	}
+	bool release(const key_type& key) {
+		return release<key_type>(key);
+	}
+
+	/// Release all values of the wrapped flyweight, invalidating the tables of every thread.
+	void clear() {
+		flyweight.clear();
+		for (auto& generation : generations) {
+			generation.value.fetch_add(1, std::memory_order_release);
 		}
 	}
 
-	/// Check whether the value mapped to the passed key is loaded.
-	bool is_loaded(const Key& key) {
-		Lock lock { mutex };
-		return map.find(key) != map.end();
+	/// Get the wrapped flyweight.
+	/// Values released directly from the wrapped flyweight are not invalidated from the threads' tables.
+	Flyweight& shared_flyweight() {
+		return flyweight;
 	}
 
-	/// Release the value mapped to the passed key.
-	/// Trying to release a value that is not loaded is a no-op.
-	/// @return `true` if a loaded value was released, `false` otherwise.
-	bool release(const Key& key) {
-		Lock lock { mutex };
-		auto it = map.find(key);
-		if (it != map.end()) {
-			deleter(it->second);
-			map.erase(it);
-			return true;
+protected:
+	static constexpr size_t set_count = Slots / ways;
+
+	/// Cached key and value.
+	/// A slot is valid while its generation matches the generation of its set, generations start at 1 so that empty slots are never valid.
+	struct slot {
+		uint64_t generation = 0;
+		size_t hash = 0;
+		key_type key {};
+		value_type *value = nullptr;
+	};
+
+	struct set {
+		slot slots[ways];
+		/// Next slot to replace when all of them are valid.
+		size_t next = 0;
+	};
+
+	struct table {
+		set sets[set_count];
+	};
+
+	/// Generation counter of a set, aligned to its own cache line so that bumping it doesn't invalidate other sets' counters.
+	struct alignas(FLYWEIGHT_CACHE_LINE_SIZE) generation_counter {
+		std::atomic<uint64_t> value { 1 };
+	};
+
+	static size_t set_index(size_t hash) {
+		return static_cast<size_t>(detail::mix_hash(hash)) & (set_count - 1);
+	}
+
+	template<typename K>
+	slot *find_slot(set& s, uint64_t generation, size_t hash, const K& key) {
+		for (slot& candidate : s.slots) {
+			if (candidate.generation == generation && candidate.hash == hash && key_equal()(candidate.key, key)) {
+				return &candidate;
+			}
 		}
-		else {
-			return false;
+		return nullptr;
+	}
+
+	/// Slot to cache a new value in, preferring invalid slots over replacing valid ones.
+	static slot& replace_slot(set& s, uint64_t generation) {
+		for (slot& candidate : s.slots) {
+			if (candidate.generation != generation) {
+				return candidate;
+			}
 		}
+		return s.slots[s.next++ % ways];
 	}
 
-	/// Release all values, calling the deleter functor on them.
-	void clear() {
-		Lock lock { mutex };
-		for (auto it : map) {
-			deleter(it.second);
+	/// Table of the calling thread, allocated on its first use.
+	table& local_table() {
+		// the last used table is kept in trivially constructible thread locals, which are accessed without a guard
+		static thread_local uint64_t last_id = 0;
+		static thread_local table *last = nullptr;
+		if (last_id != id) {
+			last = &find_local_table();
+			last_id = id;
 		}
-		map.clear();
+		return *last;
 	}
 
-protected:
-	/// Value map.
-	/// Maps the tuple of arguments to an already loaded value of type `T`.
-	Map map;
-	/// Creator function.
-	/// Wraps the creator functor passed when constructing the flyweight, if any.
-	std::function<T(const Key&)> creator;
-	/// Deleter function.
-	/// Wraps the deleter functor passed when constructing the flyweight, if any.
-	std::function<void(T&)> deleter;
-	Mutex mutex;
+	/// Table of the calling thread, looked up from every table it used.
+	table& find_local_table() {
+		// tables of destroyed front caches are never looked up again, since identifiers are never reused
+		static thread_local std::unordered_map<uint64_t, table *> local_tables;
+		table *&local = local_tables[id];
+		if (!local) {
+			std::lock_guard<std::mutex> lock { tables_mutex };
+			tables.emplace_back(new table());
+			local = tables.back().get();
+		}
+		return *local;
+	}
+
+	Hash& hasher() {
+		return hash_storage::get();
+	}
+	KeyEqual& key_equal() {
+		return key_equal_storage::get();
+	}
+
+	Flyweight flyweight;
+	generation_counter generations[set_count];
+	const uint64_t id = detail::next_instance_id();
+	/// Tables of every thread that got values, owned by the front cache.
+	std::vector<std::unique_ptr<table>> tables;
+	std::mutex tables_mutex;
 };
 
+template<typename Flyweight, size_t Slots, typename Hash, typename KeyEqual>
+constexpr size_t thread_cached<Flyweight, Slots, Hash, KeyEqual>::slot_count;
+template<typename Flyweight, size_t Slots, typename Hash, typename KeyEqual>
+constexpr size_t thread_cached<Flyweight, Slots, Hash, KeyEqual>::ways;
+template<typename Flyweight, size_t Slots, typename Hash, typename KeyEqual>
+constexpr size_t thread_cached<Flyweight, Slots, Hash, KeyEqual>::set_count;
+
 /**
- * Alternative to `flyweight` that uses `std::mutex` and `std::lock_guard` for thread safety.
+ * Alternative to `flyweight_threadsafe` with a thread-local front cache of `Slots` keys per thread.
+ * @see thread_cached
  */
-template<typename Key, typename T, typename Map = std::unordered_map<Key, T>>
-using flyweight_threadsafe = flyweight<Key, T, Map, std::mutex, std::lock_guard<std::mutex>>;
-
+template<typename Key, typename T, size_t Slots = 256, typename Map = flat_map<Key, T>>
+using flyweight_thread_cached = thread_cached<flyweight_threadsafe<Key, T, Map>, Slots>;
+#ifdef FLYWEIGHT_HAS_CXX17
 /**
- * Factory for flyweight objects of type `T`, created with a key of type `Key`, that employs reference counting.
+ * String interner that maps each distinct string to a compact 32-bit symbol.
  *
- * The reference count increments for each call to `flyweight_refcounted::get` and decrements for each call to `flyweight_refcounted::release` using the same key.
- * When calling `flyweight_refcounted::release`, the value is actually deleted from the cache only when the reference count reaches zero.
+ * Unlike a `flyweight` of string views, strings are copied back to back into chunks owned by the interner,
+ * so interning a new string doesn't allocate it separately, and symbols are numbered consecutively from zero,
+ * which makes them suitable as indices into side tables.
+ * The table of symbols caches each string's hash, so growing it never hashes strings again,
+ * and lookups compare hash bits before touching string bytes.
  *
- * This is specially useful for implementing resource management of heavy objects, like images used as icons in an interactive app.
+ * Strings are never released individually, views of interned strings stay valid until the interner is cleared or destroyed.
+ * Interned strings are null terminated.
  *
- * @tparam Key  Key mapped to loaded values.
- * @tparam T  Value type.
- * @tparam Map  Internal type used to map keys to values. Defaults to `std::unordered_map`.
+ * @tparam CharT  Character type.
+ * @tparam Traits  Character traits.
+ * @tparam Hash  Hash functor for string views. Defaults to `flyweight::hash`.
  * @tparam Mutex  Internal type used for a mutex. Defaults to `detail::dummy_mutex`.
  * @tparam Lock  Internal type used for locking the mutex. Defaults to `detail::dummy_lock`.
+ * @tparam SharedLock  Internal type used for locking the mutex in shared mode, for lookups that don't intern new strings.
+ *                     Defaults to `Lock`, which means lookups also lock the mutex exclusively.
+ * @tparam Allocator  Allocator used for string chunks and the symbol table.
  */
-template<typename Key, typename T, typename Map = std::unordered_map<Key, detail::refcounted_value<T>>, typename Mutex = detail::dummy_mutex, typename Lock = detail::dummy_lock>
-class flyweight_refcounted {
+template<typename CharT = char, typename Traits = std::char_traits<CharT>, typename Hash = hash<std::basic_string_view<CharT, Traits>>, typename Mutex = detail::dummy_mutex, typename Lock = detail::dummy_lock, typename SharedLock = Lock, typename Allocator = std::allocator<CharT>>
+class basic_interner
+	: private detail::functor_storage<Hash, detail::hash_tag>
+{
+	using hash_storage = detail::functor_storage<Hash, detail::hash_tag>;
+
 public:
-	using key_type = Key;
-	using value_type = T;
-	using autorelease_value_type = autorelease_value<Key, T, flyweight_refcounted>;
+	using char_type = CharT;
+	using traits_type = Traits;
+	using string_view_type = std::basic_string_view<CharT, Traits>;
+	using symbol_type = uint32_t;
+	using hasher = Hash;
+	using allocator_type = Allocator;
 
-	/// Default constructor.
-	/// Uses `default_creator` as the value creator and `default_deleter` as the value deleter.
-	flyweight_refcounted() : creator(default_creator<T, Key>{}), deleter(default_deleter<T>{}) {}
+	basic_interner() : basic_interner(Hash()) {}
 
-	/// Constructor with custom value creator functor.
-	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
-	///                 It will be called with a const reference to the key passed to `flyweight_refcounted::get`.
-	template<typename Creator>
-	flyweight_refcounted(Creator&& creator)
-		: creator([creator](const Key& key) { return creator(key); })
-		, deleter(default_deleter<T>{})
+	explicit basic_interner(const Hash& hash, const Allocator& allocator = Allocator())
+		: hash_storage(hash)
+		, arena(allocator)
+		, entries(entry_allocator(allocator))
+		, table(bucket_allocator(allocator))
 	{
 	}
 
-	/// Constructor with custom value creator functor and deleter functor.
-	/// @param creator  Creator functor that will be called when creating a mapped value for the first time.
-	///                 It will be called with a const reference to the key passed to `flyweight_refcounted::get`.
-	/// @param deleter  Deleter functor that will be called when releasing a mapped value.
-	///                 It will be called by `flyweight_refcounted::release` with a reference to the value.
-	template<typename Creator, typename Deleter>
-	flyweight_refcounted(Creator&& creator, Deleter&& deleter)
-		: creator([creator](const Key& key) { return creator(key); })
-		, deleter([deleter](T& value) { deleter(value); })
-	{
-	}
+	basic_interner(const basic_interner&) = delete;
+	basic_interner& operator=(const basic_interner&) = delete;
 
-	/// Calls the deleter functor to all remaining values, to ensure everything is cleaned up properly.
-	~flyweight_refcounted() {
+	/// Interns `str`, returning its symbol.
+	/// If an equal string was already interned, its symbol is returned. Otherwise `str` is copied and gets the next symbol.
+	/// @throws std::length_error  If all 32-bit symbols are taken.
+	symbol_type intern(string_view_type str) {
+		size_t hash = hash_storage::get()(str);
+		if (has_shared_lock) {
+			SharedLock lock { mutex };
+			size_t index = find_index(str, hash);
+			if (index != npos) {
+				return table[index].symbol - 1;
+			}
+		}
 		Lock lock { mutex };
-		for (auto it : map) {
-			deleter(it.second);
+		return intern_hashed(str, hash);
+	}
+
+	/// Interns every string in [`first`, `last`), writing their symbols to `out`.
+	/// Strings are hashed in batches before locking the mutex once per batch, so concurrent lookups are blocked for less time.
+	/// Dereferencing the iterators must yield something convertible to `string_view_type` that stays valid during the call.
+	/// @return Output iterator past the last written symbol.
+	/// @throws std::length_error  If all 32-bit symbols are taken.
+	template<typename InputIt, typename OutputIt>
+	OutputIt intern(InputIt first, InputIt last, OutputIt out) {
+		constexpr size_t batch_size = 64;
+		string_view_type strings[batch_size];
+		size_t hashes[batch_size];
+		while (first != last) {
+			size_t count = 0;
+			for (; count < batch_size && first != last; ++first, count++) {
+				strings[count] = *first;
+				hashes[count] = hash_storage::get()(strings[count]);
+			}
+			Lock lock { mutex };
+			reserve_locked(entries.size() + count);
+			for (size_t i = 0; i < count; i++) {
+				*out = intern_hashed(strings[i], hashes[i]);
+				++out;
+			}
 		}
+		return out;
 	}
 
-	/// Gets the value associated to the passed arguments.
-	/// If the value was already created, a reference to the existing value is returned.
-	/// Otherwise, the value is created using the creator functor passed on the flyweight's constructor.
-	/// @param key Key that represent a value.
-	///            It will be passed to the creator functor if the value is not loaded yet.
-	/// @return Reference to the value mapped to the passed arguments.
-	T& get(const Key& key) {
-		Lock lock { mutex };
-		auto it = map.find(key);
-		if (it == map.end()) {
-			it = map.emplace(key, creator(key)).first;
+	/// Finds the symbol of a string that was already interned, without interning it.
+	/// @return The symbol of `str`, or an empty optional if it was never interned.
+	std::optional<symbol_type> find(string_view_type str) const {
+		size_t hash = hash_storage::get()(str);
+		SharedLock lock { mutex };
+		size_t index = find_index(str, hash);
+		if (index == npos) {
+			return std::nullopt;
 		}
-		return it->second.reference();
+		return table[index].symbol - 1;
 	}
 
-	/// Alternative to `flyweight_refcounted::get` that returns an `autorelease_value`.
-	/// This enables the RAII idiom for automatically releasing values.
-	/// @see get
-	autorelease_value_type get_autorelease(const Key& key) {
-		return {
-			*this,
-			key,
-		};
+	/// Check whether a string equal to `str` was interned.
+	bool contains(string_view_type str) const {
+		return find(str).has_value();
 	}
 
-	/// Gets the existing value associated to the passed key.
-	/// If the value was not created yet, returns `nullptr`.
-	/// @param key Key that represents a value.
-	/// @return Pointer to the existing value, or `nullptr` if the value is not loaded.
-	T *peek(const Key& key) {
-		Lock lock { mutex };
-		auto it = map.find(key);
-		if (it == map.end()) {
-			return nullptr;
-		}
-		else {
-			return &it->second.value;
-		}
+	/// Gets the interned string of a symbol returned by this interner.
+	/// The view stays valid until the interner is cleared or destroyed.
+	string_view_type view(symbol_type symbol) const {
+		SharedLock lock { mutex };
+		const entry& e = entries[symbol];
+		return { e.data, e.size };
+	}
+	/// @see view
+	string_view_type operator[](symbol_type symbol) const {
+		return view(symbol);
 	}
 
-	/// Check whether the value mapped to the passed key is loaded.
-	bool is_loaded(const Key& key) {
+	/// Number of interned strings, which is also the next symbol.
+	size_t size() const {
+		SharedLock lock { mutex };
+		return entries.size();
+	}
+	bool empty() const {
+		return size() == 0;
+	}
+
+	/// Memory allocated for strings and symbols, in bytes.
+	size_t memory_usage() const {
+		SharedLock lock { mutex };
+		return arena.capacity() * sizeof(CharT) + entries.capacity() * sizeof(entry) + table.capacity() * sizeof(bucket);
+	}
+
+	/// Prepare the symbol table for a total of `count` strings, so interning them doesn't grow it again.
+	void reserve(size_t count) {
 		Lock lock { mutex };
-		return map.find(key) != map.end();
+		reserve_locked(count);
 	}
 
-	/// Get the current reference count for the value mapped to the passed key.
-	size_t reference_count(const Key& key) {
+	/// Forget all interned strings, invalidating their symbols and views.
+	void clear() {
 		Lock lock { mutex };
-		auto it = map.find(key);
-		if (it != map.end()) {
-			return it->second.refcount;
+		arena.clear();
+		entries.clear();
+		std::fill(table.begin(), table.end(), bucket {});
+	}
+
+private:
+	/// Interned string, with its cached hash.
+	struct entry {
+		const CharT *data;
+		size_t size;
+		size_t hash;
+	};
+	/// Symbol table bucket, holding the symbol plus one, zero meaning empty, and the low bits of its string's hash.
+	struct bucket {
+		uint32_t symbol = 0;
+		uint32_t hash = 0;
+	};
+	using entry_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<entry>;
+	using bucket_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<bucket>;
+
+	static constexpr size_t npos = SIZE_MAX;
+
+	/// Bucket holding `str`, or `npos` if it wasn't interned.
+	size_t find_index(string_view_type str, size_t hash) const {
+		if (table.empty()) {
+			return npos;
 		}
-		else {
-			return 0;
+		size_t mask = table.size() - 1;
+		for (size_t index = detail::mix_hash(hash) & mask;; index = (index + 1) & mask) {
+			const bucket& b = table[index];
+			if (b.symbol == 0) {
+				return npos;
+			}
+			if (b.hash == static_cast<uint32_t>(hash)) {
+				const entry& e = entries[b.symbol - 1];
+				if (e.size == str.size() && Traits::compare(e.data, str.data(), str.size()) == 0) {
+					return index;
+				}
+			}
 		}
 	}
 
-	/// Decrements the reference count for the value mapped to the passed key.
-	/// The value is only actually released when the reference count reaches zero.
-	/// Trying to release a value that is not loaded is a no-op.
-	/// @return `true` if a loaded value was released, `false` otherwise.
-	bool release(const Key& key) {
-		Lock lock { mutex };
-		auto it = map.find(key);
-		if (it != map.end() && it->second.dereference()) {
-			deleter(it->second);
-			map.erase(it);
-			return true;
+	/// Interns `str` with the mutex locked exclusively.
+	symbol_type intern_hashed(string_view_type str, size_t hash) {
+		size_t index = find_index(str, hash);
+		if (index != npos) {
+			return table[index].symbol - 1;
 		}
-		else {
-			return false;
+		if (entries.size() >= UINT32_MAX) {
+			throw std::length_error("flyweight::basic_interner: too many symbols");
 		}
+		reserve_locked(entries.size() + 1);
+		// grow geometrically, reserving a single entry at a time would copy every entry on each new string
+		if (entries.size() == entries.capacity()) {
+			entries.reserve(std::max<size_t>(16, entries.capacity() * 2));
+		}
+		symbol_type symbol = static_cast<symbol_type>(entries.size());
+		entries.push_back({ arena.store(str.data(), str.size()), str.size(), hash });
+		insert_bucket({ symbol + 1, static_cast<uint32_t>(hash) }, hash);
+		return symbol;
 	}
 
-	/// Release all values, calling the deleter functor on them.
-	void clear() {
-		Lock lock { mutex };
-		for (auto it : map) {
-			deleter(it.second);
+	/// Grow the table to keep its load factor at most 1/2 with `count` strings.
+	void reserve_locked(size_t count) {
+		if (count * 2 > table.size()) {
+			size_t new_size = 16;
+			while (count * 2 > new_size) {
+				new_size *= 2;
+			}
+			std::vector<bucket, bucket_allocator> old_table { new_size, bucket {}, table.get_allocator() };
+			table.swap(old_table);
+			for (const bucket& b : old_table) {
+				if (b.symbol) {
+					insert_bucket(b, entries[b.symbol - 1].hash);
+				}
+			}
 		}
-		map.clear();
 	}
 
-protected:
-	/// Value map.
-	/// Maps the tuple of arguments to an already loaded value of type `T`.
-	Map map;
-	/// Creator function.
-	/// Wraps the creator functor passed when constructing the flyweight, if any.
-	std::function<T(const Key&)> creator;
-	/// Deleter function.
-	/// Wraps the deleter functor passed when constructing the flyweight, if any.
-	std::function<void(T&)> deleter;
-	Mutex mutex;
+	void insert_bucket(bucket b, size_t hash) {
+		size_t mask = table.size() - 1;
+		size_t index = detail::mix_hash(hash) & mask;
+		while (table[index].symbol) {
+			index = (index + 1) & mask;
+		}
+		table[index] = b;
+	}
+
+	detail::string_arena<CharT, Allocator> arena;
+	std::vector<entry, entry_allocator> entries;
+	std::vector<bucket, bucket_allocator> table;
+	mutable Mutex mutex;
+
+	/// Whether interning locks the mutex in shared mode before trying to lock it exclusively.
+	static constexpr bool has_shared_lock = !std::is_same<Lock, SharedLock>::value;
 };
 
+/// String interner for `char` strings. @see basic_interner
+using interner = basic_interner<char>;
+
 /**
- * Alternative to `flyweight_refcounted` that uses `std::mutex` and `std::lock_guard` for thread safety.
+ * Alternative to `interner` that uses `std::shared_mutex` for thread safety.
+ * Interning strings that were already interned, as well as getting their views, only lock the mutex in shared mode.
  */
-template<typename Key, typename T, typename Map = std::unordered_map<Key, detail::refcounted_value<T>>>
-using flyweight_refcounted_threadsafe = flyweight_refcounted<Key, T, Map, std::mutex, std::lock_guard<std::mutex>>;
+using interner_threadsafe = basic_interner<char, std::char_traits<char>, hash<std::string_view>, std::shared_mutex, std::unique_lock<std::shared_mutex>, std::shared_lock<std::shared_mutex>>;
+#endif
 
 }
 
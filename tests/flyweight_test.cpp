@@ -1,11 +1,28 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <cstring>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <tuple>
 #include <vector>
 
+#include <catch2/catch_template_test_macros.hpp>
 #include <catch2/catch_test_macros.hpp>
 #include <flyweight.hpp>
 
+#ifdef FLYWEIGHT_HAS_MMAP
+#include <sys/wait.h>
+#endif
+
 #undef assert
 #define assert(...) REQUIRE(__VA_ARGS__)
 TEST_CASE("README.md examples", "[flyweight][readme]") {
@@ -100,3 +117,2481 @@ TEST_CASE("README.md examples", "[flyweight][readme]") {
 		file_data_cache.clear();
 	}
 }
+
+TEST_CASE("Sharded flyweight", "[flyweight][sharded]") {
+	SECTION("Values are shared across shards") {
+		flyweight::flyweight_sharded<int, std::string, 4> sharded {
+			[](int key) {
+				return std::to_string(key);
+			},
+		};
+
+		std::string& one = sharded.get(1);
+		assert(one == "1");
+		assert(&one == &sharded.get(1));
+		assert(sharded.peek(1) == &one);
+		assert(&sharded.shard_for(1) == &sharded.shard(sharded.shard_index(1)));
+		assert(sharded.shard_for(1).is_loaded(1));
+
+		for (int i = 0; i < 64; i++) {
+			sharded.get(i);
+		}
+		for (int i = 0; i < 64; i++) {
+			assert(sharded.is_loaded(i));
+		}
+		assert(sharded.release(1));
+		assert(!sharded.is_loaded(1));
+		sharded.clear();
+		assert(!sharded.is_loaded(2));
+	}
+
+	SECTION("Reference counting") {
+		flyweight::flyweight_refcounted_sharded<std::string, std::string> sharded;
+
+		sharded.get("file1");
+		sharded.get("file1");
+		assert(sharded.reference_count("file1") == 2);
+		{
+			auto autoreleased = sharded.get_autorelease("file1");
+			assert(sharded.reference_count("file1") == 3);
+		}
+		assert(!sharded.release("file1"));
+		assert(sharded.release("file1"));
+		assert(!sharded.is_loaded("file1"));
+	}
+
+	SECTION("Concurrent gets") {
+		flyweight::flyweight_refcounted_sharded<int, int> sharded;
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++) {
+			threads.emplace_back([&sharded]() {
+				for (int i = 0; i < 1000; i++) {
+					sharded.get(i % 100);
+				}
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		for (int i = 0; i < 100; i++) {
+			assert(sharded.reference_count(i) == 40);
+		}
+	}
+}
+
+TEST_CASE("Thread-local front cache", "[flyweight][thread_cached]") {
+	using counted_flyweight = flyweight::flyweight_threadsafe<int, std::string, flyweight::flat_map<int, std::string>, flyweight::atomic_stats<>>;
+	std::atomic<int> creations { 0 };
+	flyweight::thread_cached<counted_flyweight, 16> values {
+		[&creations](int key) {
+			creations++;
+			return std::to_string(key);
+		},
+	};
+
+	SECTION("Hits don't reach the shared flyweight") {
+		std::string& one = values.get(1);
+		assert(one == "1");
+		for (int i = 0; i < 10; i++) {
+			assert(&values.get(1) == &one);
+		}
+		assert(values.peek(1) == &one);
+		assert(values.is_loaded(1));
+		flyweight::stats_snapshot stats = values.shared_flyweight().stats();
+		assert(stats.misses == 1);
+		assert(stats.hits == 0);
+		assert(creations == 1);
+	}
+
+	SECTION("Colliding keys replace each other") {
+		for (int i = 0; i < 64; i++) {
+			assert(values.get(i) == std::to_string(i));
+		}
+		for (int i = 0; i < 64; i++) {
+			assert(values.get(i) == std::to_string(i));
+		}
+		assert(creations == 64);
+		assert(values.shared_flyweight().stats().hits > 0);
+	}
+
+	SECTION("Releases invalidate every thread's table") {
+		values.get(1);
+		values.get(2);
+		std::thread([&values]() {
+			assert(values.get(1) == "1");
+			assert(values.release(1));
+			assert(!values.release(1));
+		}).join();
+		assert(!values.is_loaded(1));
+		assert(values.peek(1) == nullptr);
+		assert(values.get(1) == "1");
+		assert(creations == 3);
+		values.clear();
+		assert(!values.is_loaded(2));
+		assert(values.get(2) == "2");
+		assert(creations == 4);
+	}
+
+	SECTION("Autorelease") {
+		{
+			auto two = values.get_autorelease(2);
+			assert(*two == "2");
+			assert(values.is_loaded(2));
+		}
+		assert(!values.is_loaded(2));
+	}
+
+	SECTION("Concurrent gets") {
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++) {
+			threads.emplace_back([&values]() {
+				for (int i = 0; i < 1000; i++) {
+					REQUIRE(values.get(i % 8) == std::to_string(i % 8));
+				}
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		assert(creations == 8);
+		assert(values.shared_flyweight().stats().hits < 4 * 1000);
+	}
+
+	SECTION("Sharded flyweights") {
+		flyweight::thread_cached<flyweight::flyweight_sharded<std::string, std::string, 4>> strings;
+		std::string& hello = strings.get(std::string("hello"));
+		assert(&strings.get(std::string("hello")) == &hello);
+		assert(strings.release(std::string("hello")));
+		assert(!strings.is_loaded(std::string("hello")));
+	}
+}
+
+TEST_CASE("Reader/writer flyweight", "[flyweight][rw]") {
+	SECTION("Values") {
+		flyweight::flyweight_threadsafe_rw<int, std::string> rw {
+			[](int key) {
+				return std::to_string(key);
+			},
+		};
+
+		std::string& one = rw.get(1);
+		assert(&one == &rw.get(1));
+		assert(rw.peek(1) == &one);
+		assert(rw.release(1));
+		assert(!rw.is_loaded(1));
+	}
+
+	SECTION("Concurrent reference counting") {
+		flyweight::flyweight_refcounted_threadsafe_rw<int, int> rw;
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++) {
+			threads.emplace_back([&rw]() {
+				for (int i = 0; i < 1000; i++) {
+					rw.get(i % 10);
+				}
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		for (int i = 0; i < 10; i++) {
+			assert(rw.reference_count(i) == 400);
+		}
+		assert(!rw.release(0));
+		assert(rw.reference_count(0) == 399);
+	}
+}
+
+TEST_CASE("Single-flight flyweight", "[flyweight][singleflight]") {
+	SECTION("Concurrent gets create the value once") {
+		std::atomic<int> creations { 0 };
+		flyweight::flyweight_refcounted_singleflight<int, int> singleflight {
+			[&creations](int key) {
+				creations++;
+				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+				return key * 2;
+			},
+		};
+
+		std::vector<int> results(4);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++) {
+			threads.emplace_back([&singleflight, &results, t]() {
+				results[t] = singleflight.get(1);
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		assert(results == std::vector<int> { 2, 2, 2, 2 });
+		assert(creations == 1);
+		assert(singleflight.reference_count(1) == 4);
+	}
+
+	SECTION("Other keys are not blocked by a slow creator") {
+		std::promise<void> unblock;
+		std::shared_future<void> unblocked = unblock.get_future().share();
+		flyweight::flyweight_singleflight<int, int> singleflight {
+			[unblocked](int key) {
+				if (key == 0) {
+					unblocked.wait();
+				}
+				return key;
+			},
+		};
+
+		std::thread slow([&singleflight]() {
+			singleflight.get(0);
+		});
+		assert(singleflight.get(1) == 1);
+		unblock.set_value();
+		slow.join();
+		assert(singleflight.is_loaded(0));
+	}
+
+	SECTION("Creator exceptions leave the key unloaded") {
+		flyweight::flyweight_singleflight<int, int> singleflight {
+			[](int key) -> int {
+				if (key < 0) {
+					throw std::invalid_argument("negative key");
+				}
+				return key;
+			},
+		};
+
+		REQUIRE_THROWS_AS(singleflight.get(-1), std::invalid_argument);
+		assert(!singleflight.is_loaded(-1));
+		assert(singleflight.get(1) == 1);
+	}
+}
+
+TEST_CASE("Asynchronous get", "[flyweight][singleflight][async]") {
+	std::vector<std::function<void()>> tasks;
+	auto deferred = [&tasks](std::function<void()> task) {
+		tasks.push_back(std::move(task));
+	};
+	int creations = 0;
+	auto creator = [&creations](int key) -> int {
+		creations++;
+		if (key < 0) {
+			throw std::invalid_argument("negative key");
+		}
+		return key * 2;
+	};
+
+	SECTION("Misses run the creator on the executor") {
+		flyweight::flyweight_singleflight<int, int> singleflight { creator };
+		std::shared_future<int&> future = singleflight.get_async(1, deferred);
+		std::shared_future<int&> same = singleflight.get_async(1, deferred);
+		assert(tasks.size() == 1);
+		assert(future.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+		assert(!singleflight.is_loaded(1));
+
+		tasks[0]();
+		assert(creations == 1);
+		assert(future.get() == 2);
+		assert(&same.get() == &future.get());
+		assert(&singleflight.get(1) == &future.get());
+	}
+
+	SECTION("Hits are ready without the executor") {
+		flyweight::flyweight_refcounted_singleflight<int, int> singleflight { creator };
+		int& value = singleflight.get(1);
+		std::shared_future<int&> future = singleflight.get_async(1, deferred);
+		assert(tasks.empty());
+		assert(future.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+		assert(&future.get() == &value);
+		assert(singleflight.reference_count(1) == 2);
+	}
+
+	SECTION("Waiters are referenced once the value is created") {
+		flyweight::flyweight_refcounted_singleflight<int, int> singleflight { creator };
+		std::shared_future<int&> future = singleflight.get_async(1, deferred);
+		singleflight.get_async(1, deferred);
+		std::thread waiter([&singleflight]() {
+			singleflight.get(1);
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		tasks[0]();
+		waiter.join();
+		assert(future.get() == 2);
+		assert(creations == 1);
+		assert(singleflight.reference_count(1) == 3);
+	}
+
+	SECTION("Creator exceptions are stored in the future") {
+		flyweight::flyweight_refcounted_singleflight<int, int> singleflight { creator };
+		std::shared_future<int&> future = singleflight.get_async(-1, deferred);
+		tasks[0]();
+		REQUIRE_THROWS_AS(future.get(), std::invalid_argument);
+		assert(!singleflight.is_loaded(-1));
+		assert(singleflight.reference_count(-1) == 0);
+	}
+
+	SECTION("Thread executor") {
+		flyweight::flyweight_singleflight<int, std::string> singleflight {
+			[](int key) {
+				return std::to_string(key);
+			},
+		};
+		std::vector<std::thread> threads;
+		auto spawn = [&threads](std::function<void()> task) {
+			threads.emplace_back(std::move(task));
+		};
+		std::vector<std::shared_future<std::string&>> futures;
+		for (int i = 0; i < 8; i++) {
+			futures.push_back(singleflight.get_async(i % 4, spawn));
+		}
+		for (int i = 0; i < 8; i++) {
+			assert(futures[i].get() == std::to_string(i % 4));
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		assert(threads.size() == 4);
+	}
+}
+
+TEST_CASE("Lock-free refcounted flyweight", "[flyweight][lockfree]") {
+	SECTION("Reference counting") {
+		flyweight::flyweight_refcounted_lockfree<std::string, std::string> lockfree;
+
+		std::string& file1 = lockfree.get("file1");
+		assert(&file1 == &lockfree.get("file1"));
+		assert(lockfree.reference_count("file1") == 2);
+		assert(lockfree.peek("file1") == &file1);
+		{
+			auto autoreleased = lockfree.get_autorelease("file1");
+			assert(lockfree.reference_count("file1") == 3);
+		}
+		assert(!lockfree.release("file1"));
+		assert(lockfree.release("file1"));
+		assert(!lockfree.is_loaded("file1"));
+		assert(!lockfree.release("file1"));
+
+		for (int i = 0; i < 100; i++) {
+			lockfree.get(std::to_string(i));
+		}
+		for (int i = 0; i < 100; i++) {
+			assert(lockfree.reference_count(std::to_string(i)) == 1);
+		}
+		lockfree.clear();
+		assert(!lockfree.is_loaded("1"));
+	}
+
+	SECTION("Concurrent gets and releases") {
+		std::atomic<int> live { 0 };
+		{
+			flyweight::flyweight_refcounted_lockfree<int, int> lockfree {
+				[&live](int key) {
+					live++;
+					return key;
+				},
+				[&live](int&) {
+					live--;
+				},
+			};
+
+			std::vector<std::thread> threads;
+			std::atomic<bool> mismatch { false };
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&lockfree, &mismatch, t]() {
+					for (int i = 0; i < 20000; i++) {
+						int key = (i * 7 + t) % 64;
+						if (lockfree.get(key) != key) {
+							mismatch = true;
+						}
+						lockfree.release(key);
+					}
+				});
+			}
+			for (auto& thread : threads) {
+				thread.join();
+			}
+			assert(!mismatch);
+			for (int i = 0; i < 64; i++) {
+				assert(!lockfree.is_loaded(i));
+			}
+			assert(live == 0);
+
+			lockfree.get(1);
+			assert(live == 1);
+		}
+		assert(live == 0);
+	}
+}
+
+namespace {
+	struct counted_string : std::string {
+		static int constructions;
+		counted_string(const char *str) : std::string(str) {
+			constructions++;
+		}
+	};
+	int counted_string::constructions = 0;
+}
+
+TEST_CASE("Heterogeneous lookup", "[flyweight][heterogeneous]") {
+	counted_string::constructions = 0;
+
+	SECTION("Transparent string hash") {
+		flyweight::hash<std::string> hash;
+		assert(hash("file1") == hash(std::string("file1")));
+		assert(hash(std::string_view("file1")) == hash(std::string("file1")));
+		assert(flyweight::equal_to<std::string>{}(std::string("file1"), "file1"));
+	}
+
+	SECTION("Keys are only constructed on a miss") {
+		flyweight::flyweight_refcounted<counted_string, int, std::map<counted_string, flyweight::detail::refcounted_value<int>, std::less<>>> refcounted {
+			[](const std::string& key) {
+				return int(key.size());
+			},
+		};
+
+		refcounted.get("file1");
+		assert(counted_string::constructions == 1);
+		refcounted.get("file1");
+		assert(refcounted.is_loaded("file1"));
+		assert(refcounted.reference_count("file1") == 2);
+		assert(refcounted.peek("file1") != nullptr);
+		assert(!refcounted.release("file1"));
+		assert(refcounted.release("file1"));
+		assert(counted_string::constructions == 1);
+	}
+
+	SECTION("Flat map") {
+		flyweight::flyweight<counted_string, int, flyweight::flat_map<counted_string, int, flyweight::hash<std::string>, flyweight::equal_to<std::string>>> flat {
+			[](const std::string& key) {
+				return int(key.size());
+			},
+		};
+
+		flat.get("file1");
+		flat.get("file1");
+		assert(flat.is_loaded("file1"));
+		assert(flat.release("file1"));
+		assert(!flat.is_loaded("file1"));
+		assert(counted_string::constructions == 1);
+	}
+
+	SECTION("Lock-free flyweight") {
+		flyweight::flyweight_refcounted_lockfree<counted_string, int, flyweight::hash<std::string>, flyweight::equal_to<std::string>> lockfree {
+			[](const std::string& key) {
+				return int(key.size());
+			},
+		};
+
+		lockfree.get("file1");
+		lockfree.get("file1");
+		assert(lockfree.reference_count("file1") == 2);
+		assert(!lockfree.release("file1"));
+		assert(lockfree.release("file1"));
+		assert(!lockfree.is_loaded("file1"));
+		assert(counted_string::constructions == 1);
+	}
+}
+
+namespace {
+	struct counted_hash : flyweight::hash<std::string> {
+		static int calls;
+		template<typename K>
+		size_t operator()(const K& key) const {
+			calls++;
+			return flyweight::hash<std::string>::operator()(key);
+		}
+	};
+	int counted_hash::calls = 0;
+}
+
+TEST_CASE("Precomputed hashes", "[flyweight][hashed]") {
+	using string_equal = flyweight::equal_to<std::string>;
+	auto size = [](const std::string& key) {
+		return int(key.size());
+	};
+	counted_hash::calls = 0;
+
+	SECTION("Flyweight") {
+		flyweight::flyweight<std::string, int, flyweight::flat_map<std::string, int, counted_hash, string_equal>> values { size };
+		size_t hash = values.hash_key("file1");
+		assert(hash == flyweight::hash<std::string>{}("file1"));
+		counted_hash::calls = 0;
+		int& value = values.get_hashed("file1", hash);
+		assert(value == 5);
+		assert(&values.get_hashed(std::string("file1"), hash) == &value);
+		assert(values.peek_hashed("file1", hash) == &value);
+		assert(values.is_loaded_hashed("file1", hash));
+		// only inserting the new value hashes the key
+		assert(counted_hash::calls == 1);
+		assert(values.release_hashed("file1", hash));
+		assert(!values.is_loaded_hashed("file1", hash));
+		assert(counted_hash::calls == 1);
+	}
+
+	SECTION("Refcounted flyweight") {
+		flyweight::flyweight_refcounted<std::string, int, flyweight::flat_map<std::string, flyweight::detail::refcounted_value<int>, counted_hash, string_equal>> values { size };
+		size_t hash = values.hash_key("file1");
+		values.get_hashed("file1", hash);
+		values.get_hashed("file1", hash);
+		counted_hash::calls = 0;
+		assert(*values.peek_hashed("file1", hash) == 5);
+		assert(!values.release_hashed("file1", hash));
+		assert(values.release_hashed("file1", hash));
+		assert(!values.is_loaded_hashed("file1", hash));
+		assert(counted_hash::calls == 0);
+	}
+
+	SECTION("Cached flyweight") {
+		flyweight::flyweight_cached<std::string, int, flyweight::lru_eviction, flyweight::flat_map<std::string, flyweight::detail::cached_value<std::string, int, flyweight::lru_eviction>, counted_hash, string_equal>> values { 1, size };
+		size_t hash = values.hash_key("file1");
+		values.get_hashed("file1", hash);
+		counted_hash::calls = 0;
+		assert(values.release_hashed("file1", hash));
+		assert(values.is_loaded_hashed("file1", hash));
+		assert(values.get_hashed("file1", hash) == 5);
+		assert(*values.peek_hashed("file1", hash) == 5);
+		assert(counted_hash::calls == 0);
+	}
+
+	SECTION("Lock-free flyweight") {
+		flyweight::flyweight_refcounted_lockfree<std::string, int, counted_hash, string_equal> values { size };
+		size_t hash = values.hash_key("file1");
+		counted_hash::calls = 0;
+		assert(values.get_hashed("file1", hash) == 5);
+		assert(*values.peek_hashed("file1", hash) == 5);
+		assert(values.release_hashed("file1", hash));
+		assert(!values.is_loaded_hashed("file1", hash));
+		assert(counted_hash::calls == 0);
+	}
+
+	SECTION("Sharded flyweight hashes keys once") {
+		flyweight::sharded<flyweight::flyweight_threadsafe<std::string, int, flyweight::flat_map<std::string, int, counted_hash, string_equal>>, 4, counted_hash> values { size };
+		values.get("file1");
+		counted_hash::calls = 0;
+		assert(values.get("file1") == 5);
+		assert(values.is_loaded("file1"));
+		assert(counted_hash::calls == 2);
+		size_t hash = values.hash_key("file1");
+		assert(&values.shard(values.shard_index_hashed(hash)) == &values.shard_for("file1"));
+		counted_hash::calls = 0;
+		assert(values.release_hashed("file1", hash));
+		assert(counted_hash::calls == 0);
+	}
+
+	SECTION("Frozen flyweight") {
+		std::map<std::string, int> entries { { "file1", 5 }, { "file22", 6 } };
+		flyweight::frozen_flyweight<std::string, int> frozen { entries.begin(), entries.end() };
+		size_t hash = flyweight::hash<std::string>{}("file22");
+		assert(frozen.get_hashed("file22", hash) == 6);
+		assert(frozen.peek_hashed("file1", flyweight::hash<std::string>{}("file1")) != nullptr);
+	}
+}
+
+TEST_CASE("Multi-argument keys", "[flyweight][heterogeneous]") {
+	counted_string::constructions = 0;
+	using key = std::tuple<counted_string, int>;
+	using key_hash = flyweight::hash<std::tuple<std::string, int>>;
+	using key_equal = flyweight::equal_to<std::tuple<std::string, int>>;
+	int calls = 0;
+	auto price = flyweight::unpack_creator([&calls](const std::string& symbol, int quantity) {
+		calls++;
+		return double(symbol.size() * quantity);
+	});
+
+	SECTION("Tuple hash and equality") {
+		key_hash hash;
+		int quantity = 100;
+		assert(hash(std::make_tuple(std::string("ACME"), 100)) == hash(std::tuple<const char (&)[5], const int&>("ACME", quantity)));
+		assert(key_equal{}(std::make_tuple(std::string("ACME"), 100), std::make_tuple("ACME", 100)));
+		assert(!key_equal{}(std::make_tuple(std::string("ACME"), 100), std::make_tuple("ACME", 10)));
+		assert(counted_string::constructions == 0);
+	}
+
+	SECTION("Default creator unpacks tuple keys") {
+		flyweight::flyweight<std::tuple<std::string, int>, std::pair<std::string, int>> pairs;
+		assert(pairs.get("abc", 2) == std::make_pair(std::string("abc"), 2));
+		assert(&pairs.get(std::make_tuple(std::string("abc"), 2)) == &pairs.get("abc", 2));
+		flyweight::flyweight<std::tuple<int, int>, std::tuple<int, int>> tuples;
+		assert(tuples.get(1, 2) == std::make_tuple(1, 2));
+	}
+
+	SECTION("Flyweight") {
+		flyweight::flyweight<key, double, flyweight::flat_map<key, double, key_hash, key_equal>> prices { price };
+		double& first = prices.get("ACME", 100);
+		assert(first == 400);
+		assert(&prices.get("ACME", 100) == &first);
+		assert(&prices.get(key("ACME", 100)) == &first);
+		assert(prices.get("ACME", 10) == 40);
+		assert(calls == 2);
+		assert(counted_string::constructions == 3);
+	}
+
+	SECTION("Refcounted flyweight") {
+		flyweight::flyweight_refcounted<key, double, flyweight::flat_map<key, flyweight::detail::refcounted_value<double>, key_hash, key_equal>> prices { price };
+		prices.get("ACME", 100);
+		prices.get("ACME", 100);
+		assert(prices.reference_count(key("ACME", 100)) == 2);
+		assert(calls == 1);
+	}
+
+	SECTION("Lock-free flyweight") {
+		flyweight::flyweight_refcounted_lockfree<key, double, key_hash, key_equal> prices { price };
+		prices.get("ACME", 100);
+		prices.get("ACME", 100);
+		assert(prices.reference_count(key("ACME", 100)) == 2);
+		assert(calls == 1);
+		assert(counted_string::constructions == 2);
+	}
+
+	SECTION("Cached flyweight") {
+		flyweight::flyweight_cached<std::tuple<std::string, int>, double> prices { 1, price };
+		prices.get("ACME", 100);
+		prices.release(std::make_tuple(std::string("ACME"), 100));
+		prices.get("ACME", 100);
+		assert(calls == 1);
+	}
+}
+
+// handles and cached flyweights only compile with maps whose entries don't move
+static_assert(flyweight::detail::has_stable_references<flyweight::flat_map<int, int>>::value, "flat_map entries are stable");
+static_assert(!flyweight::detail::has_stable_references<flyweight::flat_map_inline<int, int>>::value, "flat_map_inline entries move");
+static_assert(flyweight::detail::has_stable_references<std::unordered_map<int, int>>::value, "std::unordered_map entries are stable");
+
+TEST_CASE("Refcounted handles", "[flyweight][handle]") {
+	int deletions = 0;
+	flyweight::flyweight_refcounted<std::string, std::string> refcounted {
+		[](const std::string& key) {
+			return key;
+		},
+		[&deletions](std::string&) {
+			deletions++;
+		},
+	};
+
+	SECTION("Copies and moves") {
+		auto handle = refcounted.get_handle("file1");
+		assert(handle);
+		assert(*handle == "file1");
+		assert(handle.key() == "file1");
+		assert(handle->size() == 5);
+		assert(refcounted.reference_count("file1") == 1);
+		{
+			auto copy = handle;
+			assert(&*copy == &*handle);
+			assert(refcounted.reference_count("file1") == 2);
+			auto moved = std::move(copy);
+			assert(!copy);
+			assert(refcounted.reference_count("file1") == 2);
+		}
+		assert(refcounted.reference_count("file1") == 1);
+
+		decltype(handle) other = refcounted.get_handle("file2");
+		other = handle;
+		assert(!refcounted.is_loaded("file2"));
+		assert(refcounted.reference_count("file1") == 2);
+		other.reset();
+		handle.reset();
+		assert(!refcounted.is_loaded("file1"));
+		assert(deletions == 2);
+	}
+
+	SECTION("Mixing handles and gets") {
+		std::string& value = refcounted.get("file1");
+		{
+			auto handle = refcounted.get_handle("file1");
+			assert(&*handle == &value);
+			assert(refcounted.reference_count("file1") == 2);
+		}
+		assert(refcounted.release("file1"));
+		assert(deletions == 1);
+	}
+}
+
+/// Value that counts how many times values were copied or moved.
+struct counted_copies {
+	static int copies;
+	static int moves;
+
+	int value;
+
+	counted_copies(int value) : value(value) {}
+	counted_copies(const counted_copies& other) : value(other.value) {
+		copies++;
+	}
+	counted_copies(counted_copies&& other) noexcept : value(other.value) {
+		moves++;
+	}
+	counted_copies& operator=(const counted_copies&) = default;
+	counted_copies& operator=(counted_copies&&) = default;
+};
+int counted_copies::copies = 0;
+int counted_copies::moves = 0;
+
+TEST_CASE("Shared flyweight", "[flyweight][shared]") {
+	int creations = 0;
+	int destructions = 0;
+	struct tracked {
+		std::string value;
+		int *destructions;
+
+		tracked(std::string value, int *destructions) : value(std::move(value)), destructions(destructions) {}
+		tracked(tracked&& other) = delete;
+		~tracked() {
+			(*destructions)++;
+		}
+	};
+	flyweight::flyweight_shared<std::string, tracked> shared {
+		[&](const std::string& key) {
+			creations++;
+			return tracked { key, &destructions };
+		},
+	};
+
+	SECTION("Handles own values") {
+		static_assert(sizeof(flyweight::shared_handle<tracked>) == sizeof(void *), "Handles should be a single pointer");
+		static_assert(sizeof(flyweight::weak_handle<tracked>) == sizeof(void *), "Handles should be a single pointer");
+		auto a = shared.get("a");
+		auto also_a = shared.get("a");
+		assert(a == also_a);
+		assert(a->value == "a");
+		assert(a.use_count() == 2);
+		assert(creations == 1);
+		assert(shared.is_loaded("a"));
+		a.reset();
+		assert(destructions == 0);
+		also_a.reset();
+		assert(destructions == 1);
+		assert(!shared.is_loaded("a"));
+		assert(!shared.peek("a"));
+		assert(shared.get("a")->value == "a");
+		assert(creations == 2);
+	}
+
+	SECTION("Values outlive clear") {
+		auto a = shared.get("a");
+		shared.clear();
+		assert(!shared.is_loaded("a"));
+		assert(destructions == 0);
+		assert(a->value == "a");
+		auto new_a = shared.get("a");
+		assert(new_a != a);
+		assert(creations == 2);
+		a.reset();
+		assert(destructions == 1);
+	}
+
+	SECTION("Weak handles") {
+		auto a = shared.get("a");
+		flyweight::flyweight_shared<std::string, tracked>::weak_handle_type weak = a;
+		assert(!weak.expired());
+		assert(weak.lock() == a);
+		a.reset();
+		assert(weak.expired());
+		assert(!weak.lock());
+		shared.clear();
+		assert(!weak.lock());
+	}
+
+	SECTION("Destroyed values are purged") {
+		for (int i = 0; i < 100; i++) {
+			shared.get(std::to_string(i));
+		}
+		assert(destructions == 100);
+		assert(shared.purge() < 100);
+		assert(shared.purge() == 0);
+	}
+
+	SECTION("Handles outlive the flyweight") {
+		flyweight::shared_handle<tracked> a;
+		{
+			flyweight::flyweight_shared<std::string, tracked> scoped {
+				[&](const std::string& key) {
+					return tracked { key, &destructions };
+				},
+			};
+			a = scoped.get("a");
+		}
+		assert(destructions == 0);
+		assert(a->value == "a");
+		a.reset();
+		assert(destructions == 1);
+	}
+
+	SECTION("Concurrent gets and clears") {
+		flyweight::flyweight_shared_threadsafe<int, std::string> threadsafe {
+			[](int key) {
+				return std::to_string(key);
+			},
+		};
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++) {
+			threads.emplace_back([&threadsafe, t]() {
+				std::vector<flyweight::shared_handle<std::string>> handles;
+				for (int i = 0; i < 1000; i++) {
+					handles.push_back(threadsafe.get(i % 64));
+					REQUIRE(*handles.back() == std::to_string(i % 64));
+					if (i % 16 == 0) {
+						handles.clear();
+						if (t == 0) {
+							threadsafe.clear();
+						}
+					}
+				}
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+	}
+}
+
+TEMPLATE_TEST_CASE("Values are constructed in place", "[flyweight][in_place]",
+	(flyweight::flyweight<int, counted_copies>),
+	(flyweight::flyweight<int, counted_copies, flyweight::flat_map<int, counted_copies, flyweight::hash<int>, flyweight::equal_to<int>, false>>),
+	(flyweight::flyweight<int, counted_copies, std::unordered_map<int, counted_copies>>),
+	(flyweight::flyweight_refcounted<int, counted_copies>),
+	(flyweight::flyweight_refcounted_lockfree<int, counted_copies>)
+) {
+	TestType values {
+		[](int key) {
+			return counted_copies { key };
+		},
+	};
+	counted_copies::copies = 0;
+	counted_copies::moves = 0;
+	for (int i = 0; i < 4; i++) {
+		assert(values.get(i).value == i);
+	}
+	std::vector<int> keys { 4, 5, 6 };
+	std::vector<counted_copies *> gotten;
+	for (int key : keys) {
+		gotten.push_back(&values.get(key));
+	}
+	assert(counted_copies::copies == 0);
+	// unstable maps move values into the table after creating them, and when growing
+	if (!std::is_same<TestType, flyweight::flyweight<int, counted_copies, flyweight::flat_map<int, counted_copies, flyweight::hash<int>, flyweight::equal_to<int>, false>>>::value) {
+		assert(counted_copies::moves == 0);
+	}
+	values.clear();
+	assert(counted_copies::copies == 0);
+}
+
+TEST_CASE("Cached values are constructed in place", "[flyweight_cached][in_place]") {
+	flyweight::flyweight_cached<int, counted_copies> values {
+		2,
+		[](int key) {
+			return counted_copies { key };
+		},
+	};
+	counted_copies::copies = 0;
+	counted_copies::moves = 0;
+	for (int i = 0; i < 4; i++) {
+		assert(values.get(i).value == i);
+		values.release(i);
+	}
+	assert(counted_copies::copies == 0);
+	assert(counted_copies::moves == 0);
+}
+
+TEST_CASE("Move-only values", "[flyweight][in_place]") {
+	auto creator = [](int key) {
+		return std::unique_ptr<int>(new int(key));
+	};
+	flyweight::flyweight<int, std::unique_ptr<int>> unique { creator };
+	assert(*unique.get(1) == 1);
+	flyweight::flyweight_refcounted<int, std::unique_ptr<int>> refcounted { creator };
+	assert(**refcounted.get_handle(2) == 2);
+	flyweight::flyweight_cached<int, std::unique_ptr<int>> cached { 1, creator };
+	assert(*cached.get(3) == 3);
+	cached.release(3);
+	assert(*cached.get(4) == 4);
+}
+
+TEMPLATE_TEST_CASE("Recursive creators", "[flyweight][in_place]",
+	(flyweight::flyweight<int, uint64_t>),
+	(flyweight::flyweight<int, uint64_t, flyweight::flat_map_inline<int, uint64_t>>),
+	(flyweight::flyweight<int, uint64_t, std::unordered_map<int, uint64_t>>),
+	(flyweight::flyweight_refcounted<int, uint64_t>)
+) {
+	// memoized fibonacci, whose creator gets other values while its own value is being created
+	TestType *memo = nullptr;
+	int creations = 0;
+	TestType fibonacci {
+		[&memo, &creations](int n) -> uint64_t {
+			creations++;
+			return n < 2 ? n : memo->get(n - 1) + memo->get(n - 2);
+		},
+	};
+	memo = &fibonacci;
+	assert(fibonacci.get(90) == 2880067194370816120ULL);
+	assert(creations == 91);
+	for (int i = 0; i <= 90; i++) {
+		assert(fibonacci.is_loaded(i));
+	}
+	assert(fibonacci.get(10) == 55);
+	assert(creations == 91);
+}
+
+TEST_CASE("Recursive cached creators", "[flyweight_cached][in_place]") {
+	flyweight::flyweight_cached<int, uint64_t> *memo = nullptr;
+	flyweight::flyweight_cached<int, uint64_t> fibonacci {
+		128,
+		[&memo](int n) -> uint64_t {
+			if (n < 2) {
+				return n;
+			}
+			uint64_t value = memo->get(n - 1) + memo->get(n - 2);
+			memo->release(n - 1);
+			memo->release(n - 2);
+			return value;
+		},
+	};
+	memo = &fibonacci;
+	assert(fibonacci.get(90) == 2880067194370816120ULL);
+	assert(fibonacci.is_loaded(45));
+}
+
+TEST_CASE("Creator and deleter policies", "[flyweight][policy]") {
+	SECTION("make_flyweight stores functors without type erasure") {
+		int deletions = 0;
+		auto flyweight = flyweight::make_flyweight<int, std::string>(
+			[](int key) {
+				return std::to_string(key);
+			},
+			[&deletions](std::string&) {
+				deletions++;
+			}
+		);
+		static_assert(!std::is_same<decltype(flyweight)::creator_type, std::function<std::string(const int&)>>::value, "Creator should not be type erased");
+		assert(flyweight.get(42) == "42");
+		assert(flyweight.release(42));
+		assert(deletions == 1);
+	}
+
+	SECTION("Stateless functors take no space") {
+		auto creator = [](int key) { return key * 2; };
+		using stateless = decltype(flyweight::make_flyweight<int, int>(creator));
+		struct same_layout {
+			flyweight::flat_map<int, int> map;
+			flyweight::detail::dummy_mutex mutex;
+		};
+		assert(sizeof(stateless) == sizeof(same_layout));
+		assert(sizeof(stateless) < sizeof(flyweight::flyweight<int, int>));
+	}
+
+	SECTION("Refcounted") {
+		auto&& refcounted = flyweight::make_flyweight_refcounted<std::string, std::string, std::unordered_map<std::string, flyweight::detail::refcounted_value<std::string>>, std::mutex, std::lock_guard<std::mutex>>(
+			[](const std::string& key) {
+				return key + key;
+			}
+		);
+		assert(refcounted.get("a") == "aa");
+		auto handle = refcounted.get_handle("a");
+		assert(refcounted.reference_count("a") == 2);
+		assert(!refcounted.release("a"));
+		handle.reset();
+		assert(!refcounted.is_loaded("a"));
+	}
+
+#ifdef FLYWEIGHT_HAS_CXX17
+	SECTION("Class template argument deduction") {
+		flyweight::flyweight deduced {
+			[](const std::string& key) {
+				return key.size();
+			},
+		};
+		static_assert(std::is_same_v<decltype(deduced)::key_type, std::string>);
+		static_assert(std::is_same_v<decltype(deduced)::value_type, size_t>);
+		assert(deduced.get("four") == 4);
+
+		int deletions = 0;
+		flyweight::flyweight_refcounted deduced_refcounted {
+			[](int key) {
+				return key + 1;
+			},
+			[&deletions](int&) {
+				deletions++;
+			},
+		};
+		assert(deduced_refcounted.get(1) == 2);
+		assert(deduced_refcounted.release(1));
+		assert(deletions == 1);
+	}
+#endif
+}
+
+TEST_CASE("Deletion queue", "[flyweight][deletion_queue]") {
+	std::vector<std::string> deleted;
+	flyweight::deletion_queue<std::string> deletions {
+		[&deleted](std::string& value) {
+			deleted.push_back(value);
+		},
+	};
+
+	SECTION("Releases queue values until collected") {
+		auto values = flyweight::make_flyweight<int, std::string>(
+			[](int key) {
+				return std::to_string(key);
+			},
+			deletions.deleter()
+		);
+		values.get(1);
+		values.get(2);
+		values.get(3);
+		assert(values.release(1));
+		assert(values.release(2));
+		assert(!values.is_loaded(1));
+		assert(deleted.empty());
+		assert(deletions.size() == 2);
+		assert(deletions.collect() == 2);
+		assert(deleted == std::vector<std::string> { "1", "2" });
+		assert(deletions.size() == 0);
+		assert(deletions.collect() == 0);
+		values.clear();
+		assert(deletions.collect() == 1);
+		assert(deleted.back() == "3");
+	}
+
+	SECTION("Refcounted and cached flyweights") {
+		flyweight::flyweight_refcounted<int, std::string> refcounted { [](int key) { return std::to_string(key); }, deletions.deleter() };
+		refcounted.get(1);
+		refcounted.get(1);
+		refcounted.release(1);
+		assert(deletions.size() == 0);
+		refcounted.release(1);
+		assert(deletions.size() == 1);
+
+		flyweight::flyweight_cached<int, std::string> cached { 1, [](int key) { return std::to_string(key); }, deletions.deleter() };
+		cached.get(2);
+		cached.release(2);
+		cached.get(3);
+		assert(deletions.size() == 2);
+		deletions.collect();
+		assert(deleted == std::vector<std::string> { "1", "2" });
+	}
+
+	SECTION("Batch deleters") {
+		std::vector<size_t> batches;
+		flyweight::deletion_queue<int, std::function<void(std::vector<int>&)>> batched {
+			[&batches](std::vector<int>& values) {
+				batches.push_back(values.size());
+			},
+		};
+		flyweight::flyweight<int, int> values { [](int key) { return key; }, batched.deleter() };
+		for (int i = 0; i < 10; i++) {
+			values.get(i);
+		}
+		values.clear();
+		assert(batched.collect() == 10);
+		assert(batches == std::vector<size_t> { 10 });
+	}
+
+	SECTION("Background collection") {
+		std::atomic<int> collected { 0 };
+		flyweight::deletion_queue<int> background {
+			[&collected](int&) {
+				collected++;
+			},
+		};
+		flyweight::flyweight_threadsafe<int, int> values { [](int key) { return key; }, background.deleter() };
+		background.start_background_collection(std::chrono::milliseconds(10), 4);
+		for (int i = 0; i < 8; i++) {
+			values.get(i);
+			values.release(i);
+		}
+		for (int attempt = 0; attempt < 500 && collected < 8; attempt++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		assert(collected == 8);
+		values.get(8);
+		values.release(8);
+		background.stop_background_collection();
+		assert(collected == 9);
+	}
+
+	SECTION("Destroying the queue collects queued values") {
+		{
+			flyweight::deletion_queue<std::string> scoped {
+				[&deleted](std::string& value) {
+					deleted.push_back(value);
+				},
+			};
+			flyweight::flyweight<std::string, std::string> values { [](const std::string& key) { return key; }, scoped.deleter() };
+			values.get("a");
+		}
+		assert(deleted == std::vector<std::string> { "a" });
+	}
+}
+
+namespace {
+	/// Shared tier standing in for a remote cache.
+	struct map_store {
+		std::map<int, std::string> values;
+		std::mutex mutex;
+		int loads = 0;
+		bool fail = false;
+
+		bool load(const int& key, std::string& value) {
+			std::lock_guard<std::mutex> lock { mutex };
+			loads++;
+			if (fail) {
+				throw std::runtime_error("store unreachable");
+			}
+			auto it = values.find(key);
+			if (it == values.end()) {
+				return false;
+			}
+			value = it->second;
+			return true;
+		}
+
+		void store(const int& key, const std::string& value) {
+			std::lock_guard<std::mutex> lock { mutex };
+			values[key] = value;
+		}
+	};
+}
+
+TEST_CASE("Tiered store", "[flyweight][tiered]") {
+	map_store shared;
+	int creations = 0;
+	auto creator = [&creations](int key) {
+		creations++;
+		return std::to_string(key);
+	};
+	flyweight::tiered_store<int, std::string, map_store&> first_tier { shared, creator };
+	flyweight::tiered_store<int, std::string, map_store&> second_tier { shared, creator };
+	flyweight::flyweight<int, std::string> first { first_tier.creator() };
+	flyweight::flyweight<int, std::string> second { second_tier.creator() };
+
+	SECTION("Values created by one flyweight are loaded by the others") {
+		assert(first.get(1) == "1");
+		assert(creations == 1);
+		assert(first_tier.misses() == 1);
+		first_tier.flush();
+		assert(shared.values.at(1) == "1");
+		assert(second.get(1) == "1");
+		assert(creations == 1);
+		assert(second_tier.hits() == 1);
+		// hits in the flyweight itself never reach the store
+		second.get(1);
+		assert(shared.loads == 2);
+	}
+
+	SECTION("Released values are loaded again") {
+		first.get(2);
+		first_tier.flush();
+		first.release(2);
+		assert(first.get(2) == "2");
+		assert(creations == 1);
+		assert(first_tier.hits() == 1);
+	}
+
+	SECTION("Store errors fall back to the creator") {
+		shared.fail = true;
+		assert(first.get(3) == "3");
+		assert(creations == 1);
+		shared.fail = false;
+		first_tier.flush();
+		assert(shared.values.count(3) == 1);
+	}
+
+	SECTION("Destroying the tiered store writes back pending values") {
+		{
+			flyweight::tiered_store<int, std::string, map_store&> scoped { shared, creator };
+			for (int i = 0; i < 100; i++) {
+				scoped.creator()(i);
+			}
+		}
+		assert(shared.values.size() == 100);
+	}
+}
+
+TEST_CASE("Cached flyweight", "[flyweight][cached]") {
+	int creations = 0;
+	int deletions = 0;
+	flyweight::flyweight_cached<int, std::string> cached {
+		2,
+		[&creations](int key) {
+			creations++;
+			return std::to_string(key);
+		},
+		[&deletions](std::string&) {
+			deletions++;
+		},
+	};
+
+	SECTION("Unreferenced values stay cached") {
+		std::string& one = cached.get(1);
+		assert(cached.release(1));
+		assert(cached.is_loaded(1));
+		assert(cached.reference_count(1) == 0);
+		assert(cached.unreferenced_size() == 1);
+		assert(&cached.get(1) == &one);
+		assert(creations == 1);
+		assert(deletions == 0);
+		assert(cached.unreferenced_size() == 0);
+		assert(!cached.release(2));
+	}
+
+	SECTION("Least recently released values are evicted first") {
+		cached.get(1);
+		cached.get(2);
+		cached.release(2);
+		cached.release(1);
+		cached.get(3);
+		assert(!cached.is_loaded(2));
+		assert(cached.is_loaded(1));
+		assert(deletions == 1);
+		cached.release(3);
+		cached.get(1);
+		cached.get(4);
+		assert(!cached.is_loaded(3));
+		assert(cached.is_loaded(1));
+		assert(cached.is_loaded(4));
+		assert(creations == 4);
+	}
+
+	SECTION("Referenced values are never evicted") {
+		cached.get(1);
+		cached.get(2);
+		cached.get(3);
+		assert(cached.size() == 3);
+		assert(deletions == 0);
+		cached.release(1);
+		assert(!cached.is_loaded(1));
+		assert(deletions == 1);
+	}
+
+	SECTION("Changing the capacity") {
+		cached.get(1);
+		cached.get(2);
+		cached.release(1);
+		cached.release(2);
+		cached.set_capacity(0);
+		assert(cached.size() == 0);
+		assert(deletions == 2);
+		{
+			auto autoreleased = cached.get_autorelease(3);
+			assert(cached.reference_count(3) == 1);
+		}
+		assert(!cached.is_loaded(3));
+	}
+}
+
+/// Key without a `std::hash` specialization, hashed and compared only by its `id`.
+struct tagged_key {
+	int id;
+	int tag;
+};
+struct tagged_key_hash {
+	size_t operator()(const tagged_key& key) const {
+		return std::hash<int>()(key.id);
+	}
+};
+struct tagged_key_equal {
+	bool operator()(const tagged_key& a, const tagged_key& b) const {
+		return a.id == b.id;
+	}
+};
+struct tagged_key_less {
+	bool operator()(const tagged_key& a, const tagged_key& b) const {
+		return a.id < b.id;
+	}
+};
+
+TEMPLATE_TEST_CASE("Cached flyweight eviction policies", "[flyweight][cached]", flyweight::lru_eviction, flyweight::clock_eviction, flyweight::s3fifo_eviction, flyweight::tinylfu_eviction<>) {
+	int creations = 0;
+	int deletions = 0;
+	flyweight::flyweight_cached<int, int, TestType> cached {
+		4,
+		[&creations](int key) {
+			creations++;
+			return key;
+		},
+		[&deletions](int&) {
+			deletions++;
+		},
+	};
+
+	SECTION("Capacity") {
+		for (int i = 0; i < 20; i++) {
+			cached.get(i);
+			cached.release(i);
+		}
+		assert(cached.size() == 4);
+		assert(cached.unreferenced_size() == 4);
+		assert(deletions == 16);
+	}
+
+	SECTION("Reviving cached values") {
+		cached.get(1);
+		cached.release(1);
+		cached.get(1);
+		assert(creations == 1);
+		assert(cached.reference_count(1) == 1);
+		assert(cached.unreferenced_size() == 0);
+	}
+
+	SECTION("Referenced values are never evicted") {
+		for (int i = 0; i < 8; i++) {
+			cached.get(i);
+		}
+		assert(cached.size() == 8);
+		for (int i = 0; i < 8; i++) {
+			cached.release(i);
+		}
+		assert(cached.size() == 4);
+		for (int i = 0; i < 4; i++) {
+			cached.get(i);
+		}
+		for (int i = 0; i < 4; i++) {
+			assert(cached.reference_count(i) == 1);
+		}
+		cached.clear();
+		assert(cached.size() == 0);
+		assert(deletions == creations);
+	}
+}
+
+namespace {
+	/// Gets a few hot keys repeatedly, then scans many other keys once.
+	/// @return Number of hot keys that are still loaded after the scan.
+	template<typename Flyweight>
+	int hot_keys_after_scan(Flyweight& cached) {
+		for (int round = 0; round < 4; round++) {
+			for (int key = 0; key < 4; key++) {
+				cached.get(key);
+				cached.release(key);
+			}
+		}
+		for (int key = 100; key < 200; key++) {
+			cached.get(key);
+			cached.release(key);
+		}
+		int loaded = 0;
+		for (int key = 0; key < 4; key++) {
+			loaded += cached.is_loaded(key);
+		}
+		return loaded;
+	}
+}
+
+TEST_CASE("Cached flyweight eviction order", "[flyweight][cached]") {
+	SECTION("A scan flushes LRU") {
+		flyweight::flyweight_cached<int, int, flyweight::lru_eviction> lru { 8 };
+		assert(hot_keys_after_scan(lru) == 0);
+	}
+
+	SECTION("S3-FIFO keeps frequently got values through a scan") {
+		flyweight::flyweight_cached<int, int, flyweight::s3fifo_eviction> s3fifo { 8 };
+		assert(hot_keys_after_scan(s3fifo) == 4);
+	}
+
+	SECTION("TinyLFU doesn't admit values got only once") {
+		flyweight::flyweight_cached<int, int, flyweight::tinylfu_eviction<>> tinylfu { 8 };
+		assert(hot_keys_after_scan(tinylfu) == 4);
+	}
+
+	SECTION("CLOCK gives values got since the last sweep a second chance") {
+		flyweight::flyweight_cached<int, int, flyweight::clock_eviction> clock { 3 };
+		for (int i = 1; i <= 3; i++) {
+			clock.get(i);
+			clock.release(i);
+		}
+		clock.get(4);
+		assert(!clock.is_loaded(1));
+		clock.get(2);
+		clock.release(2);
+		clock.get(5);
+		assert(clock.is_loaded(2));
+		assert(!clock.is_loaded(3));
+	}
+}
+
+TEMPLATE_TEST_CASE("Cached flyweight eviction with the map's hash", "[flyweight][cached]", flyweight::s3fifo_eviction, flyweight::tinylfu_eviction<>) {
+	using eviction = TestType;
+	using map = flyweight::flat_map<tagged_key, flyweight::detail::cached_value<tagged_key, int, eviction>, tagged_key_hash, tagged_key_equal>;
+	flyweight::flyweight_cached<tagged_key, int, eviction, map> cached {
+		8,
+		[](const tagged_key& key) {
+			return key.id;
+		},
+	};
+	// hot keys are got with a different tag each round, which the map considers the same key
+	for (int round = 0; round < 4; round++) {
+		for (int id = 0; id < 4; id++) {
+			cached.get(tagged_key { id, round });
+			cached.release(tagged_key { id, round });
+		}
+	}
+	for (int id = 100; id < 200; id++) {
+		cached.get(tagged_key { id, 0 });
+		cached.release(tagged_key { id, 0 });
+	}
+	for (int id = 0; id < 4; id++) {
+		assert(cached.is_loaded(tagged_key { id, -1 }));
+	}
+}
+
+TEST_CASE("Cached flyweight memory budget", "[flyweight][cached]") {
+	using file_data = std::vector<uint8_t>;
+	int deletions = 0;
+	flyweight::flyweight_cached<size_t, file_data> cached {
+		SIZE_MAX,
+		[](size_t size) {
+			file_data data;
+			data.reserve(size);
+			data.resize(size);
+			return data;
+		},
+		[&deletions](file_data&) {
+			deletions++;
+		},
+	};
+	const size_t overhead = sizeof(file_data);
+
+	SECTION("Default sizer measures container storage") {
+		cached.get(100);
+		cached.get(200);
+		assert(cached.memory_usage() == 300 + 2 * overhead);
+		cached.release(100);
+		assert(cached.memory_usage() == 300 + 2 * overhead);
+		cached.shrink_to(0);
+		assert(cached.memory_usage() == 200 + overhead);
+		assert(deletions == 1);
+		cached.clear();
+		assert(cached.memory_usage() == 0);
+	}
+
+	SECTION("Budget") {
+		cached.set_memory_budget(1000 + 3 * overhead);
+		for (size_t size = 100; size <= 700; size += 100) {
+			cached.get(size);
+			cached.release(size);
+		}
+		assert(cached.memory_usage() <= cached.memory_budget());
+		assert(cached.is_loaded(700));
+		assert(!cached.is_loaded(100));
+		cached.set_memory_budget(0);
+		assert(cached.memory_usage() == 0);
+	}
+
+	SECTION("High-water mark") {
+		std::vector<size_t> notifications;
+		cached.set_high_water_mark(500, [&](size_t usage) {
+			notifications.push_back(usage);
+			cached.shrink_to(usage / 2);
+		});
+		cached.get(300);
+		cached.release(300);
+		assert(notifications.empty());
+		cached.get(400);
+		assert(notifications.size() == 1);
+		assert(notifications[0] == 700 + 2 * overhead);
+		assert(!cached.is_loaded(300));
+		assert(cached.is_loaded(400));
+		// shrinking got usage back under the mark, so crossing it again notifies again
+		cached.get(401);
+		assert(notifications.size() == 2);
+		// referenced values can't be evicted, so usage stays above the mark and isn't notified again
+		cached.get(50);
+		assert(notifications.size() == 2);
+	}
+
+	SECTION("Custom sizer") {
+		flyweight::flyweight_cached<int, int, flyweight::lru_eviction, std::unordered_map<int, flyweight::detail::cached_value<int, int, flyweight::lru_eviction>>, flyweight::detail::dummy_mutex, flyweight::detail::dummy_lock, std::function<int(const int&)>, std::function<void(int&)>, std::function<size_t(const int&)>> sized {
+			SIZE_MAX,
+			[](int key) { return key; },
+			[](int&) {},
+			[](const int& value) { return size_t(value); },
+		};
+		sized.get(10);
+		sized.get(20);
+		assert(sized.memory_usage() == 30);
+	}
+}
+
+TEMPLATE_TEST_CASE("Flat map", "[flyweight][flat_map]", (flyweight::flat_map<int, std::string>), (flyweight::flat_map_inline<int, std::string>)) {
+	TestType map;
+
+	SECTION("Insertion and lookup") {
+		for (int i = 0; i < 1000; i++) {
+			auto inserted = map.emplace(i, std::to_string(i));
+			assert(inserted.second);
+			assert(inserted.first->second == std::to_string(i));
+		}
+		assert(map.size() == 1000);
+		assert(!map.emplace(10, "duplicate").second);
+		for (int i = 0; i < 1000; i++) {
+			auto it = map.find(i);
+			assert(it != map.end());
+			assert(it->second == std::to_string(i));
+		}
+		assert(map.find(1000) == map.end());
+
+		size_t iterated = 0;
+		for (auto& entry : map) {
+			assert(entry.second == std::to_string(entry.first));
+			iterated++;
+		}
+		assert(iterated == map.size());
+	}
+
+	SECTION("Erasing keeps every other entry reachable") {
+		for (int i = 0; i < 1000; i++) {
+			map.emplace(i, std::to_string(i));
+		}
+		for (int i = 0; i < 1000; i += 3) {
+			assert(map.erase(i) == 1);
+		}
+		assert(map.erase(0) == 0);
+		for (int i = 0; i < 1000; i++) {
+			assert((map.find(i) != map.end()) == (i % 3 != 0));
+		}
+		map.erase(map.find(1));
+		assert(map.count(1) == 0);
+		map.clear();
+		assert(map.empty());
+		assert(map.begin() == map.end());
+	}
+
+	SECTION("Copies and moves") {
+		map.emplace(1, "one");
+		TestType copy { map };
+		assert(copy.find(1)->second == "one");
+		TestType moved { std::move(copy) };
+		assert(moved.size() == 1);
+		assert(copy.empty());
+		copy = moved;
+		assert(copy.size() == 1);
+	}
+}
+
+TEST_CASE("Flat map stable references", "[flyweight][flat_map]") {
+	flyweight::flat_map<int, int> map;
+	int *first = &map.emplace(0, 0).first->second;
+	for (int i = 1; i < 1000; i++) {
+		map.emplace(i, i);
+	}
+	for (int i = 1; i < 1000; i += 2) {
+		map.erase(i);
+	}
+	assert(&map.find(0)->second == first);
+}
+
+namespace {
+	size_t allocations = 0;
+
+	template<typename T>
+	struct counting_allocator : std::allocator<T> {
+		template<typename U>
+		struct rebind {
+			using other = counting_allocator<U>;
+		};
+
+		counting_allocator() {}
+		template<typename U>
+		counting_allocator(const counting_allocator<U>&) {}
+
+		T *allocate(size_t n) {
+			allocations++;
+			return std::allocator<T>::allocate(n);
+		}
+	};
+}
+
+TEST_CASE("Flat map slab storage", "[flyweight][flat_map]") {
+	flyweight::flat_map<int, std::string, flyweight::hash<int>, flyweight::equal_to<int>, true, counting_allocator<std::pair<const int, std::string>>> map;
+	map.reserve(1000);
+	allocations = 0;
+	for (int i = 0; i < 1000; i++) {
+		map.emplace(i, std::to_string(i));
+	}
+	size_t slabs = allocations;
+	assert(slabs > 0);
+	assert(slabs < 20);
+
+	SECTION("erased entries are reused") {
+		for (int i = 0; i < 1000; i += 2) {
+			map.erase(i);
+		}
+		for (int i = 0; i < 1000; i += 2) {
+			map.emplace(i, std::to_string(i));
+		}
+		assert(allocations == slabs);
+	}
+
+	SECTION("clear keeps slabs") {
+		map.clear();
+		assert(map.empty());
+		for (int i = 0; i < 1000; i++) {
+			map.emplace(i, std::to_string(-i));
+		}
+		assert(allocations == slabs);
+		assert(map.find(999)->second == "-999");
+	}
+
+	SECTION("moved map owns slabs") {
+		auto moved = std::move(map);
+		assert(moved.size() == 1000);
+		moved.erase(0);
+		moved.emplace(-1, "-1");
+		assert(allocations == slabs);
+		assert(moved.find(-1)->second == "-1");
+	}
+}
+
+TEST_CASE("Interner", "[flyweight][interner]") {
+	SECTION("Symbols") {
+		flyweight::interner interner;
+		std::string key = "some string";
+		auto symbol = interner.intern(key);
+		assert(symbol == 0);
+		assert(interner.intern("some string") == symbol);
+		assert(interner.intern("other string") == 1);
+		assert(interner.size() == 2);
+
+		std::string_view view = interner.view(symbol);
+		assert(view == "some string");
+		assert(view.data() != key.data());
+		assert(view.data()[view.size()] == '\0');
+		assert(interner[symbol].data() == view.data());
+		assert(interner.intern("") == 2);
+		assert(interner[2].empty());
+
+		assert(interner.find("other string") == std::optional<uint32_t>(1));
+		assert(!interner.find("missing"));
+		assert(!interner.contains("missing"));
+		assert(interner.size() == 3);
+
+		interner.clear();
+		assert(interner.empty());
+		assert(!interner.contains("some string"));
+		assert(interner.intern("other string") == 0);
+	}
+
+	SECTION("Views stay valid") {
+		flyweight::interner interner;
+		std::string_view first = interner.view(interner.intern("first"));
+		std::string long_string(100000, 'x');
+		interner.intern(long_string);
+		for (int i = 0; i < 100000; i++) {
+			interner.intern(std::to_string(i));
+		}
+		assert(interner.size() == 100002);
+		assert(interner.view(0).data() == first.data());
+		assert(first == "first");
+		assert(interner.view(1) == long_string);
+		assert(interner.intern("99999") == 100001);
+		assert(interner.memory_usage() > 100000 + 6 * 100000);
+	}
+
+	SECTION("Bulk interning") {
+		flyweight::interner interner;
+		interner.intern("b");
+		std::vector<std::string> strings;
+		for (int i = 0; i < 200; i++) {
+			strings.push_back(std::string(1, static_cast<char>('a' + i % 3)));
+		}
+		std::vector<uint32_t> symbols;
+		interner.intern(strings.begin(), strings.end(), std::back_inserter(symbols));
+		assert(symbols.size() == 200);
+		assert(interner.size() == 3);
+		for (size_t i = 0; i < strings.size(); i++) {
+			assert(interner[symbols[i]] == strings[i]);
+		}
+		assert(symbols[0] == 1);
+		assert(symbols[1] == 0);
+		assert(symbols[2] == 2);
+	}
+
+	SECTION("Concurrent interning") {
+		flyweight::interner_threadsafe interner;
+
+		std::vector<std::thread> threads;
+		std::vector<std::vector<uint32_t>> symbols(4);
+		for (int t = 0; t < 4; t++) {
+			threads.emplace_back([&interner, &symbols, t]() {
+				for (int i = 0; i < 1000; i++) {
+					symbols[t].push_back(interner.intern(std::to_string(i)));
+				}
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		assert(interner.size() == 1000);
+		for (int i = 0; i < 1000; i++) {
+			assert(interner[symbols[0][i]] == std::to_string(i));
+			for (int t = 1; t < 4; t++) {
+				assert(symbols[t][i] == symbols[0][i]);
+			}
+		}
+	}
+}
+
+TEST_CASE("Batched gets", "[flyweight][batch]") {
+	std::vector<int> keys;
+	for (int i = 0; i < 100; i++) {
+		keys.push_back(i % 40);
+	}
+	auto to_string = [](int key) {
+		return std::to_string(key);
+	};
+
+	SECTION("flyweight") {
+		flyweight::flyweight<int, std::string> strings { to_string };
+		std::string& loaded = strings.get(5);
+		std::vector<std::string *> values;
+		strings.get_many(keys.begin(), keys.end(), std::back_inserter(values));
+		assert(values.size() == keys.size());
+		for (size_t i = 0; i < keys.size(); i++) {
+			assert(values[i] == &strings.get(keys[i]));
+			assert(*values[i] == std::to_string(keys[i]));
+		}
+		assert(values[5] == &loaded);
+		assert(strings.release_many(keys.begin(), keys.begin() + 50) == 40);
+		assert(!strings.is_loaded(5));
+	}
+
+	SECTION("std::unordered_map") {
+		flyweight::flyweight<int, std::string, std::unordered_map<int, std::string>> strings { to_string };
+		std::vector<std::string *> values(keys.size());
+		assert(strings.get_many(keys.begin(), keys.end(), values.begin()) == values.end());
+		assert(*values[99] == "19");
+		assert(strings.release_many(keys.begin(), keys.end()) == 40);
+	}
+
+	SECTION("flyweight_refcounted") {
+		flyweight::flyweight_refcounted_threadsafe_rw<int, std::string> strings { to_string };
+		std::vector<std::string *> values;
+		strings.get_many(keys.begin(), keys.end(), std::back_inserter(values));
+		for (int key = 0; key < 40; key++) {
+			assert(strings.reference_count(key) == (key < 20 ? 3 : 2));
+		}
+		strings.get_many(keys.begin(), keys.begin() + 10, std::back_inserter(values));
+		assert(values[100] == values[0]);
+		assert(strings.reference_count(0) == 4);
+		assert(strings.release_many(keys.begin(), keys.end()) == 30);
+		assert(strings.release_many(keys.begin(), keys.begin() + 10) == 10);
+		assert(!strings.is_loaded(0));
+	}
+
+	SECTION("flat_map_inline") {
+		// 40 missing keys grow the table several times while getting them
+		flyweight::flyweight<int, std::string, flyweight::flat_map_inline<int, std::string>> strings { to_string };
+		std::vector<std::string *> values;
+		strings.get_many(keys.begin(), keys.end(), std::back_inserter(values));
+		assert(values.size() == keys.size());
+		for (size_t i = 0; i < keys.size(); i++) {
+			assert(*values[i] == std::to_string(keys[i]));
+			assert(values[i] == strings.peek(keys[i]));
+		}
+
+		flyweight::flyweight_refcounted<int, int, flyweight::flat_map_inline<int, flyweight::detail::refcounted_value<int>>> numbers {
+			[](int key) {
+				if (key == 35) {
+					throw std::runtime_error("thirty five");
+				}
+				return key;
+			},
+		};
+		std::vector<int *> numbers_values;
+		numbers.get_many(keys.begin(), keys.begin() + 30, std::back_inserter(numbers_values));
+		for (int key = 0; key < 30; key++) {
+			assert(*numbers_values[key] == key);
+			assert(numbers_values[key] == numbers.peek(key));
+			assert(numbers.reference_count(key) == 1);
+		}
+		// the batch of keys 32 to 39 throws, after the batch of keys 16 to 31 was referenced
+		numbers_values.clear();
+		REQUIRE_THROWS_AS(numbers.get_many(keys.begin() + 16, keys.begin() + 40, std::back_inserter(numbers_values)), std::runtime_error);
+		assert(numbers_values.size() == 16);
+		for (int key = 16; key < 32; key++) {
+			assert(*numbers_values[key - 16] == key);
+			assert(numbers_values[key - 16] == numbers.peek(key));
+		}
+		assert(numbers.reference_count(29) == 2);
+		assert(numbers.reference_count(31) == 1);
+		assert(!numbers.is_loaded(32));
+	}
+
+	SECTION("Creator exceptions release the batch") {
+		flyweight::flyweight_refcounted<int, int> numbers {
+			[](int key) {
+				if (key == 3) {
+					throw std::runtime_error("three");
+				}
+				return key;
+			},
+		};
+		numbers.get(1);
+		std::vector<int> batch = { 1, 2, 4, 3 };
+		std::vector<int *> values;
+		REQUIRE_THROWS_AS(numbers.get_many(batch.begin(), batch.end(), std::back_inserter(values)), std::runtime_error);
+		assert(values.empty());
+		assert(numbers.reference_count(1) == 1);
+		assert(!numbers.is_loaded(2));
+		assert(!numbers.is_loaded(4));
+	}
+
+	SECTION("sharded") {
+		flyweight::flyweight_refcounted_sharded<int, std::string, 4> strings { to_string };
+		std::vector<std::string *> values;
+		strings.get_many(keys.begin(), keys.end(), std::back_inserter(values));
+		assert(values.size() == keys.size());
+		for (size_t i = 0; i < keys.size(); i++) {
+			assert(*values[i] == std::to_string(keys[i]));
+			assert(values[i] == strings.peek(keys[i]));
+		}
+		assert(strings.reference_count(0) == 3);
+		assert(strings.release_many(keys.begin(), keys.begin() + 40) == 0);
+		assert(strings.release_many(keys.begin() + 40, keys.begin() + 80) == 20);
+		assert(strings.release_many(keys.begin(), keys.begin() + 20) == 20);
+		assert(!strings.is_loaded(0));
+	}
+
+	SECTION("singleflight") {
+		flyweight::flyweight_refcounted_singleflight<int, std::string> strings { to_string };
+		std::vector<std::string *> values;
+		strings.get_many(keys.begin(), keys.end(), std::back_inserter(values));
+		assert(*values[41] == "1");
+		assert(strings.reference_count(1) == 3);
+	}
+}
+
+TEST_CASE("Preload", "[flyweight][preload]") {
+	std::vector<int> keys;
+	for (int i = 0; i < 100; i++) {
+		keys.push_back(i % 40);
+	}
+	std::atomic<int> creations { 0 };
+	auto creator = [&creations](int key) {
+		creations++;
+		if (key < 0) {
+			throw std::invalid_argument("negative key");
+		}
+		return std::to_string(key);
+	};
+
+	SECTION("flyweight") {
+		flyweight::flyweight<int, std::string> strings { creator };
+		std::string& loaded = strings.get(5);
+		assert(strings.preload(keys.begin(), keys.end(), 4) == 39);
+		assert(creations == 40);
+		assert(&strings.get(5) == &loaded);
+		for (int key = 0; key < 40; key++) {
+			assert(*strings.peek(key) == std::to_string(key));
+		}
+		assert(strings.preload(keys.begin(), keys.end(), 4) == 0);
+		assert(creations == 40);
+	}
+
+	SECTION("flyweight_refcounted") {
+		flyweight::flyweight_refcounted_threadsafe<int, std::string> strings { creator };
+		assert(strings.preload(keys.begin(), keys.end()) == 40);
+		for (int key = 0; key < 40; key++) {
+			assert(strings.is_loaded(key));
+			assert(strings.reference_count(key) == 0);
+		}
+		strings.get(1);
+		assert(strings.reference_count(1) == 1);
+		strings.release(1);
+		assert(!strings.is_loaded(1));
+		assert(creations == 40);
+	}
+
+	SECTION("flyweight_cached") {
+		flyweight::flyweight_cached<int, std::string> strings { 30, creator };
+		assert(strings.preload(keys.begin(), keys.end(), 8) == 40);
+		assert(strings.size() == 30);
+		assert(strings.unreferenced_size() == 30);
+		int cached = 0;
+		for (int key = 0; key < 40; key++) {
+			if (strings.is_loaded(key)) {
+				cached++;
+				strings.get(key);
+				strings.release(key);
+			}
+		}
+		assert(cached == 30);
+		assert(creations == 40);
+	}
+
+	SECTION("Keys are deduplicated like the map does") {
+		std::vector<tagged_key> tagged { { 1, 1 }, { 2, 1 }, { 1, 2 }, { 3, 1 }, { 2, 2 } };
+		auto tagged_creator = [&creations](const tagged_key& key) {
+			creations++;
+			return std::to_string(key.id);
+		};
+		flyweight::flyweight<tagged_key, std::string, flyweight::flat_map<tagged_key, std::string, tagged_key_hash, tagged_key_equal>> strings { tagged_creator };
+		assert(strings.preload(tagged.begin(), tagged.end(), 2) == 3);
+		flyweight::flyweight<tagged_key, std::string, std::map<tagged_key, std::string, tagged_key_less>> ordered { tagged_creator };
+		assert(ordered.preload(tagged.begin(), tagged.end(), 2) == 3);
+		flyweight::flyweight_refcounted<tagged_key, std::string, flyweight::flat_map<tagged_key, flyweight::detail::refcounted_value<std::string>, tagged_key_hash, tagged_key_equal>> refcounted { tagged_creator };
+		assert(refcounted.preload(tagged.begin(), tagged.end(), 2) == 3);
+		flyweight::flyweight_cached<tagged_key, std::string, flyweight::lru_eviction, flyweight::flat_map<tagged_key, flyweight::detail::cached_value<tagged_key, std::string, flyweight::lru_eviction>, tagged_key_hash, tagged_key_equal>> cached { 8, tagged_creator };
+		assert(cached.preload(tagged.begin(), tagged.end(), 2) == 3);
+		assert(creations == 12);
+		assert(strings.get({ 2, 5 }) == "2");
+		assert(creations == 12);
+	}
+
+	SECTION("Creator exceptions") {
+		flyweight::flyweight<int, std::string> strings { creator };
+		std::vector<int> failing { 1, -1, 2 };
+		REQUIRE_THROWS_AS(strings.preload(failing.begin(), failing.end(), 1), std::invalid_argument);
+		assert(strings.is_loaded(1));
+		assert(!strings.is_loaded(-1));
+		assert(!strings.is_loaded(2));
+	}
+}
+
+TEST_CASE("Statistics", "[flyweight][stats]") {
+	SECTION("Default policy only reports size") {
+		flyweight::flyweight<int, int> values;
+		assert(sizeof(values) == sizeof(flyweight::flyweight<int, int, flyweight::flat_map<int, int>, flyweight::detail::dummy_mutex, flyweight::detail::dummy_lock, flyweight::detail::dummy_lock, std::function<int(const int&)>, std::function<void(int&)>, flyweight::no_stats>));
+		values.get(1);
+		values.get(1);
+		flyweight::stats_snapshot stats = values.stats();
+		assert(stats.size == 1);
+		assert(stats.hits == 0);
+		assert(stats.misses == 0);
+	}
+
+	SECTION("Flyweight") {
+		flyweight::flyweight_threadsafe<int, int, flyweight::flat_map<int, int>, flyweight::atomic_stats<>> values;
+		values.get(1);
+		values.get(1);
+		values.get(2);
+		values.release(1);
+		values.release(3);
+		std::vector<std::thread> threads;
+		for (int i = 0; i < 4; i++) {
+			threads.emplace_back([&values]() {
+				for (int j = 0; j < 100; j++) {
+					values.get(2);
+				}
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		flyweight::stats_snapshot stats = values.stats();
+		assert(stats.hits == 401);
+		assert(stats.misses == 2);
+		assert(stats.deletions == 1);
+		assert(stats.locks == 405);
+		assert(stats.size == 1);
+		assert(stats.hit_ratio() == 401.0 / 403.0);
+		values.clear();
+		assert(values.stats().deletions == 2);
+		assert(values.stats().size == 0);
+	}
+
+	SECTION("Refcounted flyweight") {
+		flyweight::flyweight_refcounted_threadsafe<int, int, flyweight::flat_map<int, flyweight::detail::refcounted_value<int>>, flyweight::atomic_stats<>> values;
+		values.get(1);
+		values.get(1);
+		values.release(1);
+		assert(values.stats().deletions == 0);
+		values.release(1);
+		flyweight::stats_snapshot stats = values.stats();
+		assert(stats.hits == 1);
+		assert(stats.misses == 1);
+		assert(stats.deletions == 1);
+		assert(stats.size == 0);
+	}
+
+	SECTION("Cached flyweight") {
+		flyweight::flyweight_cached_threadsafe<int, int, flyweight::lru_eviction, flyweight::flat_map<int, flyweight::detail::cached_value<int, int, flyweight::lru_eviction>>, flyweight::atomic_stats<>> values { 2 };
+		for (int i = 0; i < 4; i++) {
+			values.get(i);
+			values.release(i);
+		}
+		values.get(3);
+		flyweight::stats_snapshot stats = values.stats();
+		assert(stats.hits == 1);
+		assert(stats.misses == 4);
+		assert(stats.evictions == 2);
+		assert(stats.deletions == 2);
+		assert(stats.size == 2);
+	}
+
+	SECTION("Sharded flyweight") {
+		flyweight::sharded<flyweight::flyweight_threadsafe<int, int, flyweight::flat_map<int, int>, flyweight::atomic_stats<>>, 4> values;
+		for (int i = 0; i < 16; i++) {
+			values.get(i);
+			values.get(i);
+		}
+		flyweight::stats_snapshot stats = values.stats();
+		assert(stats.hits == 16);
+		assert(stats.misses == 16);
+		assert(stats.size == 16);
+	}
+}
+
+TEST_CASE("Frozen flyweight", "[flyweight][frozen]") {
+	SECTION("Freezing a flyweight") {
+		flyweight::flyweight_threadsafe<int, std::string> strings {
+			[](int key) {
+				return std::to_string(key);
+			},
+		};
+		for (int i = 0; i < 1000; i++) {
+			strings.get(i * 7);
+		}
+		flyweight::frozen_flyweight<int, std::string> frozen = strings.freeze();
+		strings.clear();
+		assert(frozen.size() == 1000);
+		for (int i = 0; i < 1000; i++) {
+			assert(frozen.get(i * 7) == std::to_string(i * 7));
+			assert(!frozen.is_loaded(i * 7 + 1));
+		}
+		REQUIRE_THROWS_AS(frozen.get(1), std::out_of_range);
+	}
+
+	SECTION("Freezing a refcounted flyweight") {
+		flyweight::flyweight_refcounted<std::string, std::string> strings;
+		strings.get("a");
+		strings.get("b");
+		flyweight::frozen_flyweight<std::string, std::string> frozen = strings.freeze();
+		assert(*frozen.peek("a") == "a");
+		assert(*frozen.peek("b") == "b");
+		assert(frozen.peek("c") == nullptr);
+	}
+
+	SECTION("Keys are looked up like the map does") {
+		flyweight::flyweight<tagged_key, int, flyweight::flat_map<tagged_key, int, tagged_key_hash, tagged_key_equal>> tags {
+			[](const tagged_key& key) {
+				return key.tag;
+			},
+		};
+		for (int i = 0; i < 10; i++) {
+			tags.get(tagged_key { i, i * 2 });
+		}
+		flyweight::frozen_flyweight<tagged_key, int, tagged_key_hash, tagged_key_equal> frozen = tags.freeze();
+		assert(frozen.size() == 10);
+		for (int i = 0; i < 10; i++) {
+			assert(frozen.get(tagged_key { i, -1 }) == i * 2);
+		}
+		assert(!frozen.is_loaded(tagged_key { 10, 20 }));
+	}
+
+	SECTION("Empty and repeated keys") {
+		flyweight::frozen_flyweight<int, int> empty;
+		assert(empty.peek(0) == nullptr);
+		std::vector<std::pair<int, int>> repeated { { 1, 1 }, { 2, 2 }, { 1, 3 } };
+		REQUIRE_THROWS_AS((flyweight::frozen_flyweight<int, int>(repeated.begin(), repeated.end())), std::invalid_argument);
+	}
+
+	SECTION("Compile-time keys") {
+		static constexpr auto opcodes = flyweight::make_frozen_flyweight<std::string_view, int>({
+			{ "add", 1 },
+			{ "sub", 2 },
+			{ "mul", 3 },
+			{ "div", 4 },
+			{ "mod", 5 },
+		});
+		static_assert(opcodes.size() == 5);
+		static_assert(opcodes.get("mul") == 3);
+		static_assert(!opcodes.is_loaded("pow"));
+		assert(opcodes.get("mod") == 5);
+		assert(opcodes.peek(std::string("pow")) == nullptr);
+	}
+}
+
+enum class material {
+	stone = 3,
+	wood = 10,
+	metal = 42,
+};
+
+TEST_CASE("Static flyweight", "[flyweight][static]") {
+	std::atomic<int> creations { 0 };
+	int deletions = 0;
+	flyweight::static_flyweight<std::string, material::stone, material::wood, material::metal> materials {
+		[&creations](material key) {
+			creations++;
+			return std::to_string(static_cast<int>(key));
+		},
+		[&deletions](std::string&) {
+			deletions++;
+		},
+	};
+
+	SECTION("Values are created on first get") {
+		assert(!materials.is_loaded(material::wood));
+		std::string& wood = materials.get<material::wood>();
+		assert(wood == "10");
+		assert(&materials.get(material::wood) == &wood);
+		assert(materials.peek(material::wood) == &wood);
+		assert(materials.peek(material::stone) == nullptr);
+		assert(creations == 1);
+
+		assert(materials.release(material::wood));
+		assert(!materials.release(material::wood));
+		assert(deletions == 1);
+		assert(materials.get<material::wood>() == "10");
+		assert(creations == 2);
+	}
+
+	SECTION("Keys outside the set") {
+		REQUIRE_THROWS_AS(materials.get(static_cast<material>(7)), std::out_of_range);
+		assert(materials.peek(static_cast<material>(7)) == nullptr);
+		assert(!materials.release(static_cast<material>(7)));
+	}
+
+	SECTION("Concurrent gets create values once") {
+		std::vector<std::thread> threads;
+		std::vector<std::string *> values(8);
+		for (int i = 0; i < 8; i++) {
+			threads.emplace_back([&materials, &values, i]() {
+				values[i] = &materials.get<material::metal>();
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		assert(creations == 1);
+		for (auto value : values) {
+			assert(value == values[0]);
+		}
+	}
+
+	SECTION("make_static_flyweight stores functors without type erasure") {
+		auto creator = [](material key) { return static_cast<int>(key) * 2; };
+		auto doubled = flyweight::make_static_flyweight<int, material::stone, material::wood>(creator);
+		static_assert(std::is_same<decltype(doubled)::creator_type, decltype(creator)>::value, "Creator should not be type erased");
+		assert(doubled.get<material::wood>() == 20);
+		assert(doubled.release(material::wood));
+		assert(sizeof(doubled) < sizeof(flyweight::static_flyweight<int, material::stone, material::wood>));
+	}
+}
+
+#ifdef FLYWEIGHT_HAS_MMAP
+TEST_CASE("Snapshot", "[flyweight][snapshot]") {
+	struct point {
+		int x;
+		double y;
+	};
+	const std::string path = "flyweight_test.snapshot";
+	int creations = 0;
+	auto creator = [&creations](int key) {
+		creations++;
+		return point { key, key * 0.5 };
+	};
+
+	SECTION("Saved values are served from the mapped file") {
+		{
+			flyweight::flyweight_snapshot<int, point> points { {}, creator };
+			for (int i = 0; i < 100; i++) {
+				points.get(i);
+			}
+			assert(creations == 100);
+			points.save_snapshot(path);
+		}
+
+		flyweight::flyweight_snapshot<int, point> points { flyweight::snapshot<int, point>(path), creator };
+		for (int i = 0; i < 100; i++) {
+			assert(points.is_mapped(i));
+			point& value = points.get(i);
+			assert(value.x == i);
+			assert(value.y == i * 0.5);
+			assert(points.peek(i) == &value);
+		}
+		assert(creations == 100);
+		assert(!points.release(5));
+		assert(points.is_loaded(5));
+
+		assert(!points.is_mapped(100));
+		assert(points.get(100).x == 100);
+		assert(creations == 101);
+		std::vector<int> keys { 1, 100, 101, 102 };
+		assert(points.preload(keys.begin(), keys.end(), 2) == 2);
+		assert(creations == 103);
+
+		points.save_snapshot(path);
+		flyweight::snapshot<int, point> resaved { path };
+		assert(resaved.size() == 103);
+		assert(resaved.find(102)->x == 102);
+		assert(resaved.find(103) == nullptr);
+	}
+
+	SECTION("Empty snapshot") {
+		std::vector<std::pair<int, point>> entries;
+		flyweight::snapshot<int, point>::write(path, entries.begin(), entries.end());
+		flyweight::snapshot<int, point> empty { path };
+		assert(empty.size() == 0);
+		assert(empty.find(0) == nullptr);
+	}
+
+	SECTION("Invalid files") {
+		REQUIRE_THROWS_AS((flyweight::snapshot<int, point>("missing.snapshot")), std::system_error);
+		std::vector<std::pair<int, int>> entries { { 1, 2 } };
+		flyweight::snapshot<int, int>::write(path, entries.begin(), entries.end());
+		assert(flyweight::snapshot<int, int>(path).find(1) != nullptr);
+		REQUIRE_THROWS_AS((flyweight::snapshot<int, point>(path)), std::runtime_error);
+
+		// the index of a snapshot with one <int, int> entry has 2 slots, right after the 64 bytes header and the entry
+		auto write_index = [&path](uint32_t first, uint32_t second) {
+			std::FILE *file = std::fopen(path.c_str(), "r+b");
+			uint32_t slots[] = { first, second };
+			std::fseek(file, 64 + sizeof(std::pair<int, int>), SEEK_SET);
+			std::fwrite(slots, sizeof(slots), 1, file);
+			std::fclose(file);
+		};
+		write_index(0, 2);
+		REQUIRE_THROWS_AS((flyweight::snapshot<int, int>(path)), std::runtime_error);
+		write_index(1, 1);
+		REQUIRE_THROWS_AS((flyweight::snapshot<int, int>(path)), std::runtime_error);
+		write_index(1, 0);
+		assert(flyweight::snapshot<int, int>(path).find(1) != nullptr);
+		REQUIRE(::truncate(path.c_str(), 70) == 0);
+		REQUIRE_THROWS_AS((flyweight::snapshot<int, int>(path)), std::runtime_error);
+
+		// a header without entries, shorter than the offset of entries, claiming a huge index
+		entries.clear();
+		flyweight::snapshot<int, int>::write(path, entries.begin(), entries.end());
+		std::FILE *file = std::fopen(path.c_str(), "r+b");
+		uint64_t capacity = uint64_t(1) << 24;
+		std::fseek(file, 32, SEEK_SET);
+		std::fwrite(&capacity, sizeof(capacity), 1, file);
+		std::fclose(file);
+		REQUIRE(::truncate(path.c_str(), 56) == 0);
+		REQUIRE_THROWS_AS((flyweight::snapshot<int, int>(path)), std::runtime_error);
+	}
+
+	std::remove(path.c_str());
+}
+
+TEST_CASE("Shared memory flyweight", "[flyweight][shared_memory]") {
+	struct point {
+		int x;
+		double y;
+	};
+	const std::string name = "/flyweight_test_" + std::to_string(::getpid());
+	flyweight::shared_memory_flyweight<int, point>::remove(name);
+	int creations = 0;
+	auto creator = [&creations](int key) {
+		creations++;
+		return point { key, key * 0.5 };
+	};
+
+	SECTION("Values are shared by every mapping of the segment") {
+		flyweight::shared_memory_flyweight<int, point> points { name, 64, 0, creator };
+		for (int i = 0; i < 10; i++) {
+			assert(points.get(i).x == i);
+		}
+		assert(creations == 10);
+		assert(points.size() == 10);
+		assert(&points.get(3) == &points.get(3));
+
+		flyweight::shared_memory_flyweight<int, point> other { name, 1, 0, creator };
+		assert(other.capacity() == 64);
+		assert(other.is_loaded(5));
+		assert(&other.get(5) != &points.get(5));
+		assert(other.get(5).y == 2.5);
+		assert(creations == 10);
+		other.get(20);
+		assert(points.is_loaded(20));
+		assert(creations == 11);
+
+		pid_t child = ::fork();
+		if (child == 0) {
+			flyweight::shared_memory_flyweight<int, point> forked { name, 64, 0, creator };
+			bool ok = forked.get(3).x == 3 && creations == 11 && forked.get(30).x == 30 && creations == 12;
+			::_exit(ok ? 0 : 1);
+		}
+		int status = 0;
+		REQUIRE(::waitpid(child, &status, 0) == child);
+		assert(WIFEXITED(status));
+		assert(WEXITSTATUS(status) == 0);
+		assert(points.is_loaded(30));
+		assert(points.get(30).y == 15);
+		assert(creations == 11);
+
+		for (int i = 100; points.size() < points.capacity(); i++) {
+			points.get(i);
+		}
+		assert(points.get(30).x == 30);
+		REQUIRE_THROWS_AS(points.get(-1), std::length_error);
+		assert(!points.is_loaded(-1));
+	}
+
+	SECTION("String views are stored in the segment") {
+		flyweight::shared_memory_flyweight<std::string_view, std::string_view>::remove(name);
+		auto upper = [](std::string_view key) {
+			std::string value { key };
+			for (char& c : value) {
+				c = static_cast<char>(c - 'a' + 'A');
+			}
+			return value;
+		};
+		flyweight::shared_memory_flyweight<std::string_view, std::string_view> strings { name, 16, 32, upper };
+		std::string_view value = strings.get(std::string("hello"));
+		assert(value == "HELLO");
+		assert(value.data()[value.size()] == '\0');
+		assert(strings.get("hello").data() == value.data());
+
+		flyweight::shared_memory_flyweight<std::string_view, std::string_view> other { name, 16, 32, upper };
+		assert(other.is_loaded("hello"));
+		assert(other.get("hello") == "HELLO");
+		assert(other.get("abc") == "ABC");
+		assert(strings.is_loaded("abc"));
+		REQUIRE_THROWS_AS(strings.get("aaaaaaaaaaaaaaaa"), std::length_error);
+	}
+
+	SECTION("Invalid segments") {
+		flyweight::shared_memory_flyweight<int, int> ints { name, 4 };
+		REQUIRE_THROWS_AS((flyweight::shared_memory_flyweight<int, point>(name, 4, 0, creator)), std::runtime_error);
+		REQUIRE_THROWS_AS((flyweight::shared_memory_flyweight<int, int>("", 4)), std::system_error);
+	}
+
+	assert(flyweight::shared_memory_flyweight<int, point>::remove(name));
+}
+#endif
+
+#ifdef FLYWEIGHT_HAS_COROUTINES
+/// Coroutine that starts right away and is never awaited.
+struct detached_test {
+	struct promise_type {
+		detached_test get_return_object() {
+			return {};
+		}
+		std::suspend_never initial_suspend() noexcept {
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+		void return_void() {}
+		void unhandled_exception() {
+			std::terminate();
+		}
+	};
+};
+
+/// Suspends the awaiting coroutine, storing it to be resumed later by the test.
+struct suspend_to {
+	std::vector<std::coroutine_handle<>>& suspended;
+
+	bool await_ready() {
+		return false;
+	}
+	void await_suspend(std::coroutine_handle<> coroutine) {
+		suspended.push_back(coroutine);
+	}
+	void await_resume() {}
+};
+
+TEST_CASE("Coroutine flyweight", "[flyweight][coroutine]") {
+	std::vector<std::coroutine_handle<>> suspended;
+	int creations = 0;
+	auto creator = [&suspended, &creations](int key) -> flyweight::task<int> {
+		creations++;
+		co_await suspend_to { suspended };
+		if (key < 0) {
+			throw std::invalid_argument("negative key");
+		}
+		co_return key * 2;
+	};
+	std::vector<int *> results;
+	int failures = 0;
+	auto getter = [&results, &failures](auto& coroutine_flyweight, int key) -> detached_test {
+		try {
+			results.push_back(&co_await coroutine_flyweight.get(key));
+		}
+		catch (const std::invalid_argument&) {
+			failures++;
+		}
+	};
+
+	SECTION("Waiters share one creation") {
+		flyweight::flyweight_coroutine<int, int> coroutine_flyweight { creator };
+		getter(coroutine_flyweight, 1);
+		getter(coroutine_flyweight, 1);
+		getter(coroutine_flyweight, 2);
+		assert(creations == 2);
+		assert(suspended.size() == 2);
+		assert(results.empty());
+
+		suspended[0].resume();
+		assert(results.size() == 2);
+		assert(*results[0] == 2);
+		assert(results[0] == results[1]);
+		assert(coroutine_flyweight.is_loaded(1));
+		assert(!coroutine_flyweight.is_loaded(2));
+
+		suspended[1].resume();
+		assert(results.size() == 3);
+		assert(*results[2] == 4);
+	}
+
+	SECTION("Hits don't suspend") {
+		flyweight::flyweight_coroutine<int, int> coroutine_flyweight { creator };
+		getter(coroutine_flyweight, 1);
+		suspended[0].resume();
+		getter(coroutine_flyweight, 1);
+		assert(creations == 1);
+		assert(suspended.size() == 1);
+		assert(results.size() == 2);
+		assert(results[0] == results[1]);
+	}
+
+	SECTION("Waiters are referenced once the value is created") {
+		flyweight::flyweight_refcounted_coroutine<int, int> coroutine_flyweight { creator };
+		getter(coroutine_flyweight, 1);
+		getter(coroutine_flyweight, 1);
+		getter(coroutine_flyweight, 1);
+		assert(coroutine_flyweight.reference_count(1) == 0);
+		suspended[0].resume();
+		assert(results.size() == 3);
+		assert(coroutine_flyweight.reference_count(1) == 3);
+		getter(coroutine_flyweight, 1);
+		assert(coroutine_flyweight.reference_count(1) == 4);
+		assert(creations == 1);
+	}
+
+	SECTION("Creator exceptions are rethrown by all waiters") {
+		flyweight::flyweight_refcounted_coroutine<int, int> coroutine_flyweight { creator };
+		getter(coroutine_flyweight, -1);
+		getter(coroutine_flyweight, -1);
+		suspended[0].resume();
+		assert(failures == 2);
+		assert(results.empty());
+		assert(!coroutine_flyweight.is_loaded(-1));
+		assert(coroutine_flyweight.reference_count(-1) == 0);
+	}
+
+	SECTION("Creators resumed on other threads") {
+		flyweight::flyweight_coroutine<int, std::string> coroutine_flyweight {
+			[&suspended](int key) -> flyweight::task<std::string> {
+				co_await suspend_to { suspended };
+				co_return std::to_string(key);
+			},
+		};
+		std::vector<std::string *> strings;
+		auto string_getter = [&strings](auto& coroutine_flyweight, int key) -> detached_test {
+			strings.push_back(&co_await coroutine_flyweight.get(key));
+		};
+		for (int i = 0; i < 8; i++) {
+			string_getter(coroutine_flyweight, i % 4);
+		}
+		assert(suspended.size() == 4);
+		std::vector<std::thread> threads;
+		for (auto coroutine : suspended) {
+			threads.emplace_back([coroutine]() {
+				coroutine.resume();
+			});
+			threads.back().join();
+		}
+		assert(strings.size() == 8);
+		for (int i = 0; i < 4; i++) {
+			assert(*coroutine_flyweight.peek(i) == std::to_string(i));
+		}
+	}
+}
+#endif